@@ -3,14 +3,14 @@
 #include "util.h"
 #include "opcodes.h"
 #include "assert.h"
+#include "context.h"
+#include <string.h>
 
 /*
 Many thanks to cliff biffle for reverse engineering propeller tool binary format.
 http://www.cliff.biffle.org/software/propeller/binary-format.html
 */
 
-u32 clkfreq = 0;
-u8  clkreg = 0x6F;
 
 
 /*****************************************************************\
@@ -42,7 +42,7 @@ u16 count_instructions()
     do
     {
         ops--;
-        if(flags[ops].valid)
+        if(asm_ctx->flags[ops].valid)
             break;
     }
     while(ops);
@@ -57,12 +57,12 @@ u16 count_instructions()
 \*****************************************************************/
 void create_preamble(u8* preamb, u8* prog, u16 num_instr)
 {
-    if(clkfreq)
+    if(asm_ctx->clkfreq)
     {
-        preamb[0] = clkfreq & 0xFF;
-        preamb[1] = (clkfreq >> 8) & 0xFF;
-        preamb[2] = (clkfreq >> 16) & 0xFF;
-        preamb[3] = (clkfreq >> 24) & 0xFF;
+        preamb[0] = asm_ctx->clkfreq & 0xFF;
+        preamb[1] = (asm_ctx->clkfreq >> 8) & 0xFF;
+        preamb[2] = (asm_ctx->clkfreq >> 16) & 0xFF;
+        preamb[3] = (asm_ctx->clkfreq >> 24) & 0xFF;
     }
     else /* 80 Mhz by default */
     {
@@ -72,7 +72,7 @@ void create_preamble(u8* preamb, u8* prog, u16 num_instr)
         preamb[3] = 0x04;
     }
 
-    preamb[4] = clkreg;
+    preamb[4] = asm_ctx->clkreg;
     preamb[5] = 0; /* initial checksum */
     preamb[6] = 0x10;  /* Program base address. Must be 0x0010 (the word following the Initialization Area). */
     preamb[7] = 0x00;
@@ -115,6 +115,58 @@ void create_preamble(u8* preamb, u8* prog, u16 num_instr)
     preamb[5] = compute_checksum(preamb, prog, num_instr);
 }
 
+/*****************************************************************\
+*                                                                 *
+*   Writes the preamble and the @param num instructions of        *
+*   @param prog into @param image, which must hold                *
+*   PREAMBLE_SIZE + num * 4 bytes.                                *
+*   @return size of the image                                     *
+*                                                                 *
+\*****************************************************************/
+size_t create_image_of(u8* image, const instruction_t* prog, u16 num)
+{
+    for(u16 i = 0; i < num; i++)
+    {
+        u32 u = u32tole(prog[i].raw);
+        memcpy(image + PREAMBLE_SIZE + i * 4, &u, 4);
+    }
+
+    create_preamble(image, image + PREAMBLE_SIZE, num);
+    return PREAMBLE_SIZE + num * 4;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Writes the preamble and the program into @param image, which  *
+*   must hold PREAMBLE_SIZE + num_ops * 4 bytes.                  *
+*   @return size of the image                                     *
+*                                                                 *
+\*****************************************************************/
+size_t create_image(u8* image)
+{
+    return create_image_of(image, asm_ctx->program, asm_ctx->num_ops);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Creates the EEPROM_SIZE @param eeprom out of the @param image *
+*   of @param imgsz bytes, the way the ROM leaves the hub RAM:    *
+*   zero padded with the $FFF9FFFF stack frame at dbase - 8.      *
+*                                                                 *
+\*****************************************************************/
+void create_eeprom(u8* eeprom, const u8* image, size_t imgsz)
+{
+    static const u8 stack_frame[8] = { 0xFF, 0xFF, 0xF9, 0xFF, 0xFF, 0xFF, 0xF9, 0xFF };
+
+    assert(imgsz + sizeof(stack_frame) <= EEPROM_SIZE);
+
+    memset(eeprom, 0, EEPROM_SIZE);
+    memcpy(eeprom, image, imgsz);
+
+    u16 dbase = eeprom[0x0A] | eeprom[0x0B] << 8;
+    memcpy(eeprom + dbase - 8, stack_frame, sizeof(stack_frame));
+}
+
 /*****************************************************************\
 *                                                                 *
 *   Assembles a program into a @param file stream                 *
@@ -123,21 +175,21 @@ void create_preamble(u8* preamb, u8* prog, u16 num_instr)
 void assemble(FILE* file)
 {
     if(opt_verbose > 4)
-        fprintf(vfile, "assembling %u instructions\n", num_ops);
+        fprintf(vfile, "assembling %u instructions\n", asm_ctx->num_ops);
 
     if(!opt_raw) /* writing out the propeller tool header */
     {
         u8 preamble[PREAMBLE_SIZE];
-        create_preamble(preamble, (u8*)program, num_ops);
+        create_preamble(preamble, (u8*)asm_ctx->program, asm_ctx->num_ops);
 
         size_t w = fwrite(preamble, 1, PREAMBLE_SIZE, file);
         if(w != PREAMBLE_SIZE)
             sys_error("error writing out preamble");
     }
 
-    for(u16 i = 0; i < num_ops; i++)
+    for(u16 i = 0; i < asm_ctx->num_ops; i++)
     {
-        u32 u = u32tole(program[i].raw);
+        u32 u = u32tole(asm_ctx->program[i].raw);
         size_t w = fwrite(&u, 4, 1, file);
         if(w != 1)
             sys_error("error writing assembled program");
@@ -160,22 +212,49 @@ void generate_listing(FILE* file, size_t num_ops)
 
     for(unsigned i = 0; i < num_ops; i++)
     {
+        if(asm_ctx->flags[i].data) /* a long of a FILE isn't an instruction */
+        {
+            fprintf(file, "%04X %08X data\n", i, asm_ctx->program[i].raw);
+            continue;
+        }
+
         pair_t p;
-        p.value = program[i].data.cond;
+        p.value = asm_ctx->program[i].data.cond;
         size_t j = pair_t_find(&p, if_pairs, NUM_IFS, &pair_t_compare_value);
 
         op_pair_t op;
-        op.value = program[i].data.opcode;
+        op.value = asm_ctx->program[i].data.opcode;
         size_t o = op_pair_t_find(&op, opcodes, NUM_OPCODES, &op_pair_t_compare_value);
 
         assert(j != NUM_IFS);
         assert(o != NUM_OPCODES);
 
-        u16 dest =  ((u16)(program[i].data.desth)) << 8 | program[i].data.dest;
-        u16 src =  ((u16)(program[i].data.srch)) << 8 | program[i].data.src;
+        u16 dest =  ((u16)(asm_ctx->program[i].data.desth)) << 8 | asm_ctx->program[i].data.dest;
+        u16 src =  ((u16)(asm_ctx->program[i].data.srch)) << 8 | asm_ctx->program[i].data.src;
 
-        fprintf(file, "%04X %08X if_%s %s $%x, $%x zcri:%u%u%u%u\n", i, program[i].raw, if_pairs[j].string,
+        fprintf(file, "%04X %08X if_%s %s $%x, $%x zcri:%u%u%u%u\n", i, asm_ctx->program[i].raw, if_pairs[j].string,
                 opcodes[o].string, dest, src,
-                program[i].data.z, program[i].data.c, program[i].data.r, program[i].data.imm);
+                asm_ctx->program[i].data.z, asm_ctx->program[i].data.c, asm_ctx->program[i].data.r, asm_ctx->program[i].data.imm);
     }
 }
+
+/*****************************************************************\
+*                                                                 *
+*   Writes a EEPROM_SIZE eeprom image into a @param file stream.  *
+*                                                                 *
+\*****************************************************************/
+void assemble_eeprom(FILE* file)
+{
+    u8 image[PREAMBLE_SIZE + asm_ctx->num_ops * 4];
+    size_t imgsz = create_image(image);
+
+    u8* eeprom = malloc(EEPROM_SIZE);
+    if(!eeprom)
+        fatal("out of memory");
+    create_eeprom(eeprom, image, imgsz);
+
+    if(fwrite(eeprom, 1, EEPROM_SIZE, file) != EEPROM_SIZE)
+        sys_error("error writing eeprom image");
+
+    free(eeprom);
+}
@@ -5,10 +5,13 @@
 #include <stdio.h>
 
 #define PREAMBLE_SIZE 0x20
+#define EEPROM_SIZE 0x8000
 u16 count_instructions();
 void create_preamble(u8* preamb, u8* prog, u16 num_instr);
+size_t create_image_of(u8* image, const instruction_t* prog, u16 num);
+size_t create_image(u8* image);
+void create_eeprom(u8* eeprom, const u8* image, size_t imgsz);
 void assemble(FILE* file);
+void assemble_eeprom(FILE* file);
 void generate_listing(FILE* file, size_t num_ops);
-extern u32 clkfreq;
-extern u8 clkreg;
 #endif // ASSEMBLE_H_INCLUDED
@@ -0,0 +1,154 @@
+#include "batch.h"
+#include "util.h"
+#include <unistd.h>
+#include <pthread.h>
+
+/*
+Every worker starts with an equal slice of the jobs in a deque of its own. It takes jobs
+from the back of its deque, and once that is empty it steals from the front of the others,
+so a worker stuck on a big source doesn't hold back the jobs behind it. The deques only
+hold ranges of job numbers, a lock each is enough since a job takes far longer than a
+take or a steal.
+*/
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    size_t          head; /* first job left, the thieves' end */
+    size_t          tail; /* one past the last job left, the owner's end */
+} deque_t;
+
+typedef struct
+{
+    deque_t*        deques;
+    unsigned        num_threads;
+    batch_job_t     job;
+    void*           arg;
+} pool_t;
+
+typedef struct
+{
+    pool_t*         pool;
+    unsigned        id;
+} worker_t;
+
+/*****************************************************************\
+*                                                                 *
+*   Takes a job from the back of @param d, the owner's end.       *
+*   @return 1 and the job in @param job or 0 if @param d is empty *
+*                                                                 *
+\*****************************************************************/
+static int deque_take(deque_t* d, size_t* job)
+{
+    pthread_mutex_lock(&d->lock);
+    int taken = d->head < d->tail;
+    if(taken)
+        *job = --d->tail;
+    pthread_mutex_unlock(&d->lock);
+    return taken;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Steals a job from the front of @param d.                      *
+*   @return 1 and the job in @param job or 0 if @param d is empty *
+*                                                                 *
+\*****************************************************************/
+static int deque_steal(deque_t* d, size_t* job)
+{
+    pthread_mutex_lock(&d->lock);
+    int taken = d->head < d->tail;
+    if(taken)
+        *job = d->head++;
+    pthread_mutex_unlock(&d->lock);
+    return taken;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Runs the jobs of its own deque, then steals from the others   *
+*   until all of them are empty.                                  *
+*                                                                 *
+\*****************************************************************/
+static void* batch_worker(void* arg)
+{
+    worker_t* w = arg;
+    pool_t* pool = w->pool;
+    size_t job;
+
+    for(;;)
+    {
+        if(deque_take(&pool->deques[w->id], &job))
+        {
+            pool->job(job, pool->arg);
+            continue;
+        }
+
+        /* nothing left to steal means nothing left at all, jobs are never added */
+        unsigned v = 1;
+        for(; v < pool->num_threads; v++)
+        {
+            if(deque_steal(&pool->deques[(w->id + v) % pool->num_threads], &job))
+                break;
+        }
+        if(v == pool->num_threads)
+            break;
+
+        pool->job(job, pool->arg);
+    }
+    return NULL;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return threads to use when -j doesn't say, one per core.     *
+*                                                                 *
+\*****************************************************************/
+unsigned batch_threads()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (unsigned)cpus : 1;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Runs @param job with @param arg for each of @param num_jobs   *
+*   on @param num_threads threads, returns when all are done.     *
+*                                                                 *
+\*****************************************************************/
+void batch_run(size_t num_jobs, unsigned num_threads, batch_job_t job, void* arg)
+{
+    if(!num_jobs)
+        return;
+    if(!num_threads)
+        num_threads = 1;
+    if(num_threads > num_jobs)
+        num_threads = num_jobs;
+
+    deque_t deques[num_threads];
+    worker_t workers[num_threads];
+    pthread_t threads[num_threads];
+    pool_t pool = { deques, num_threads, job, arg };
+
+    for(unsigned i = 0; i < num_threads; i++)
+    {
+        pthread_mutex_init(&deques[i].lock, NULL);
+        deques[i].head = num_jobs * i / num_threads;
+        deques[i].tail = num_jobs * (i + 1) / num_threads;
+        workers[i].pool = &pool;
+        workers[i].id = i;
+    }
+
+    /* the calling thread is worker 0 */
+    for(unsigned i = 1; i < num_threads; i++)
+    {
+        if(pthread_create(&threads[i], NULL, batch_worker, &workers[i]))
+            fatal("failed to start a batch thread");
+    }
+    batch_worker(&workers[0]);
+
+    for(unsigned i = 1; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    for(unsigned i = 0; i < num_threads; i++)
+        pthread_mutex_destroy(&deques[i].lock);
+}
@@ -0,0 +1,11 @@
+#ifndef BATCH_H_INCLUDED
+#define BATCH_H_INCLUDED
+#include "types.h"
+#include <stdlib.h>
+
+/* runs jobs 0 to num_jobs - 1 on a pool of threads that steal each other's jobs */
+typedef void (*batch_job_t)(size_t job, void* arg);
+
+void batch_run(size_t num_jobs, unsigned num_threads, batch_job_t job, void* arg);
+unsigned batch_threads();
+#endif // BATCH_H_INCLUDED
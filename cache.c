@@ -0,0 +1,299 @@
+#include "cache.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+/*
+--cache <dir> keeps the outputs of every build in dir, named after a hash of everything
+that goes into them: the source without \r, the options that change the outputs, the
+syntax and the ppasm executable itself. A build that was done before is a hash and a copy,
+a reflink where the filesystem can. Entries are written into temporary files and renamed,
+the binary last, so a concurrent build sees a whole entry or none. Nothing is ever evicted,
+remove the directory to clean it.
+*/
+
+#define QUOTE_X(t) #t
+#define QUOTE(t) QUOTE_X(t)
+#define CACHE_VERSION QUOTE(VERSION_MAJOR) "." QUOTE(VERSION_MINOR)
+
+/* the outputs of a build, in the order they are stored, the binary is last */
+static const char* extensions[] = { ".lst", ".map", "" };
+
+/*****************************************************************\
+*                                                                 *
+*   @return the hash of the build of the @param len bytes of the  *
+*   source @param src with the current options.                   *
+*                                                                 *
+\*****************************************************************/
+u64 cache_key(const char* src, size_t len)
+{
+    u64 hash = hash_fnv1a(CACHE_VERSION, sizeof(CACHE_VERSION), FNV_OFFSET);
+
+    /* a rebuilt ppasm may assemble differently, its size and time say it was rebuilt */
+    struct stat st;
+    if(!stat("/proc/self/exe", &st))
+    {
+        hash = hash_fnv1a(&st.st_size, sizeof(st.st_size), hash);
+        hash = hash_fnv1a(&st.st_mtime, sizeof(st.st_mtime), hash);
+    }
+
+    u8 options[] = { opt_raw, opt_eeprom, opt_listing, opt_map };
+    hash = hash_fnv1a(options, sizeof(options), hash);
+    hash = hash_fnv1a(syntax->after_comment, strlen(syntax->after_comment) + 1, hash);
+    hash = hash_fnv1a(syntax->multi_comment_begin, strlen(syntax->multi_comment_begin) + 1, hash);
+    hash = hash_fnv1a(syntax->multi_comment_end, strlen(syntax->multi_comment_end) + 1, hash);
+    hash = hash_fnv1a(&syntax->immediate_prefix, 1, hash);
+    hash = hash_fnv1a(&syntax->local_label_prefix, 1, hash);
+
+    /* read_line() drops \r, a source with dos line ends builds the same */
+    for(size_t i = 0; i < len; i++)
+    {
+        if(src[i] != '\r')
+        {
+            hash ^= (u8)src[i];
+            hash *= 0x100000001B3ULL;
+        }
+    }
+    return hash;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return @param key with the path and the content of the file  *
+*   @param path FILE copies in mixed into it.                     *
+*                                                                 *
+\*****************************************************************/
+u64 cache_key_file(u64 key, const char* path)
+{
+    key = hash_fnv1a(path, strlen(path) + 1, key);
+
+    /* a missing file fails the build, it is never stored */
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0)
+        return key;
+    if(!fstat(fd, &st) && st.st_size)
+    {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data != MAP_FAILED)
+        {
+            key = hash_fnv1a(data, st.st_size, key);
+            munmap(data, st.st_size);
+        }
+    }
+    close(fd);
+    return key;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Copies the file @param from to @param to, sharing the blocks  *
+*   if the filesystem can. @return 0 if it failed                 *
+*                                                                 *
+\*****************************************************************/
+static int copy_file(const char* from, const char* to)
+{
+    int in = open(from, O_RDONLY);
+    if(in < 0)
+        return 0;
+
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out < 0)
+    {
+        close(in);
+        return 0;
+    }
+
+    int ok = 0;
+#ifdef FICLONE
+    ok = !ioctl(out, FICLONE, in);
+#endif
+    if(!ok)
+    {
+        char buf[0x4000];
+        ssize_t n;
+        ok = 1;
+        while((n = read(in, buf, sizeof(buf))) > 0)
+        {
+            if(write(out, buf, n) != n)
+            {
+                ok = 0;
+                break;
+            }
+        }
+        if(n < 0)
+            ok = 0;
+    }
+
+    close(in);
+    if(close(out))
+        ok = 0;
+    return ok;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Writes the name of the output @param ext of the entry         *
+*   @param key in @param dir into @param path.                    *
+*                                                                 *
+\*****************************************************************/
+static void entry_path(char* path, size_t pathsz, const char* dir, u64 key, const char* ext)
+{
+    snprintf(path, pathsz, "%s/%016llx%s", dir, (unsigned long long)key, *ext ? ext : ".binary");
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return non zero if the output @param ext is built now.       *
+*                                                                 *
+\*****************************************************************/
+static int is_built(const char* ext)
+{
+    if(!strcmp(ext, ".lst"))
+        return opt_listing;
+    if(!strcmp(ext, ".map"))
+        return opt_map;
+    return 1;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Counts a hit or a miss in @param dir.                         *
+*                                                                 *
+\*****************************************************************/
+static void count(const char* dir, const char* name)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if(mkdir(dir, 0755) && errno != EEXIST)
+        return;
+
+    /* appends of a byte are atomic, no lock is needed among concurrent builds */
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(fd >= 0)
+    {
+        if(write(fd, "", 1) != 1) {}
+        close(fd);
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Copies the outputs of the build @param key from the cache     *
+*   @param dir to @param outfile.                                 *
+*   @return non zero if it was in the cache                       *
+*                                                                 *
+\*****************************************************************/
+int cache_fetch(const char* dir, u64 key, const char* outfile)
+{
+    char path[PATH_MAX], out[PATH_MAX];
+    entry_path(path, sizeof(path), dir, key, "");
+    int hit = !access(path, R_OK);
+
+    for(unsigned i = 0; hit && i < sizeof(extensions) / sizeof(*extensions); i++)
+    {
+        if(!is_built(extensions[i]))
+            continue;
+
+        entry_path(path, sizeof(path), dir, key, extensions[i]);
+        snprintf(out, sizeof(out), "%s%s", outfile, extensions[i]);
+        hit = copy_file(path, out);
+    }
+
+    count(dir, hit ? CACHE_HITS : CACHE_MISSES);
+    return hit;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Puts the outputs in @param outfile of the build @param key    *
+*   into the cache @param dir.                                    *
+*                                                                 *
+\*****************************************************************/
+void cache_store(const char* dir, u64 key, const char* outfile)
+{
+    if(mkdir(dir, 0755) && errno != EEXIST)
+    {
+        fprintf(stderr, "can't create the cache %s: %s\n", dir, strerror(errno));
+        return;
+    }
+
+    for(unsigned i = 0; i < sizeof(extensions) / sizeof(*extensions); i++)
+    {
+        if(!is_built(extensions[i]))
+            continue;
+
+        char path[PATH_MAX], tmppath[PATH_MAX + 8], out[PATH_MAX];
+        entry_path(path, sizeof(path), dir, key, extensions[i]);
+        snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", path);
+        snprintf(out, sizeof(out), "%s%s", outfile, extensions[i]);
+
+        int fd = mkstemp(tmppath);
+        if(fd < 0)
+            return;
+        close(fd);
+
+        if(!copy_file(out, tmppath) || rename(tmppath, path))
+        {
+            fprintf(stderr, "failed to store %s in the cache\n", out);
+            unlink(tmppath);
+            return;
+        }
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Writes the hit rate and the size of the cache @param dir      *
+*   into @param out.                                              *
+*                                                                 *
+\*****************************************************************/
+void cache_stats(const char* dir, FILE* out)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    ulong hits = 0, misses = 0, entries = 0;
+    unsigned long long bytes = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, CACHE_HITS);
+    if(!stat(path, &st))
+        hits = st.st_size;
+    snprintf(path, sizeof(path), "%s/%s", dir, CACHE_MISSES);
+    if(!stat(path, &st))
+        misses = st.st_size;
+
+    DIR* d = opendir(dir);
+    if(d)
+    {
+        struct dirent* entry;
+        while((entry = readdir(d)))
+        {
+            size_t len = strlen(entry->d_name);
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            if(*entry->d_name == '.' || stat(path, &st) || !S_ISREG(st.st_mode) ||
+               !strcmp(entry->d_name, CACHE_HITS) || !strcmp(entry->d_name, CACHE_MISSES))
+                continue;
+
+            bytes += st.st_size;
+            if(len > 7 && !strcmp(entry->d_name + len - 7, ".binary"))
+                entries++;
+        }
+        closedir(d);
+    }
+
+    fprintf(out, "cache %s: %lu hits, %lu misses", dir, hits, misses);
+    if(hits + misses)
+        fprintf(out, ", %.1f%% hit rate", 100.0 * hits / (hits + misses));
+    fprintf(out, ", %lu entries in %llu bytes\n", entries, bytes);
+}
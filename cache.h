@@ -0,0 +1,14 @@
+#ifndef CACHE_H_INCLUDED
+#define CACHE_H_INCLUDED
+#include "types.h"
+#include <stdio.h>
+
+#define CACHE_HITS "hits" /* one byte is appended for every hit */
+#define CACHE_MISSES "misses"
+
+u64 cache_key(const char* src, size_t len);
+u64 cache_key_file(u64 key, const char* path);
+int cache_fetch(const char* dir, u64 key, const char* outfile);
+void cache_store(const char* dir, u64 key, const char* outfile);
+void cache_stats(const char* dir, FILE* out);
+#endif // CACHE_H_INCLUDED
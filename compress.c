@@ -0,0 +1,190 @@
+#include "compress.h"
+#include <string.h>
+
+/*
+The compressed format is a plain byte oriented RLE, simple enough to be expanded by a
+few dozen PASM instructions while the bits are coming in over the serial line:
+
+    0x00 - 0x7F     literal run, followed by (n + 1) bytes that are copied as they are
+    0x80 - 0xFF     repeat run, followed by one byte that is written (n - 0x80 + 3) times
+
+Hub images are mostly zero padding, RES areas and long aligned constants, that's where
+the runs come from.
+
+The stub doesn't receive while it writes a repeat run, and the host sends without pauses.
+rx returns in the middle of the stop bit, half a bit (347 clocks at 80MHz, 115200 baud)
+before the next start bit can come. Every byte of a run costs the :rep loop up to 43
+clocks (wrbyte up to 23) and getting back into rx about 24 more, so rle_compress() makes
+no run longer than RLE_MAX_RUN: 7 * 43 + 24 = 325. rle_decompress() takes the whole format.
+*/
+
+/*****************************************************************\
+*                                                                 *
+*   Compresses @param srcsz bytes of @param src into @param dest, *
+*   which must hold at least RLE_BOUND(srcsz) bytes.              *
+*   @return the size of the compressed data                       *
+*                                                                 *
+\*****************************************************************/
+size_t rle_compress(const u8* src, size_t srcsz, u8* dest)
+{
+    size_t i = 0, out = 0, lit = 0; /* lit is the start of the pending literal run */
+
+    while(i < srcsz)
+    {
+        size_t run = 1;
+        while(i + run < srcsz && run < RLE_MAX_RUN && src[i + run] == src[i])
+            run++;
+
+        if(run < 3)
+        {
+            i += run;
+            continue;
+        }
+
+        /* flushing the pending literals in chunks of 128 */
+        while(lit < i)
+        {
+            size_t n = i - lit < 128 ? i - lit : 128;
+            dest[out++] = n - 1;
+            memcpy(&dest[out], &src[lit], n);
+            out += n;
+            lit += n;
+        }
+
+        dest[out++] = 0x80 + run - 3;
+        dest[out++] = src[i];
+        i += run;
+        lit = i;
+    }
+
+    while(lit < srcsz)
+    {
+        size_t n = srcsz - lit < 128 ? srcsz - lit : 128;
+        dest[out++] = n - 1;
+        memcpy(&dest[out], &src[lit], n);
+        out += n;
+        lit += n;
+    }
+
+    return out;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Expands @param src into @param dest of @param destsz bytes,   *
+*   this is what the stub does on the propeller.                  *
+*   @return the size of the expanded data or 0 on corrupt input   *
+*                                                                 *
+\*****************************************************************/
+size_t rle_decompress(const u8* src, size_t srcsz, u8* dest, size_t destsz)
+{
+    size_t i = 0, out = 0;
+
+    while(i < srcsz)
+    {
+        u8 ctl = src[i++];
+        if(ctl & 0x80)
+        {
+            size_t n = ctl - 0x80 + 3;
+            if(i >= srcsz || out + n > destsz)
+                return 0;
+
+            memset(&dest[out], src[i++], n);
+            out += n;
+        }
+        else
+        {
+            size_t n = ctl + 1;
+            if(i + n > srcsz || out + n > destsz)
+                return 0;
+
+            memcpy(&dest[out], &src[i], n);
+            i += n;
+            out += n;
+        }
+    }
+
+    return out;
+}
+
+/*
+The decompressor stub, assembled with ppasm -r. It is loaded through the ROM like any
+other program, so it starts in cog 0 from hub $0020. It bit-bangs 8N1 on P31/P30:
+
+    1. sends UNZ_READY
+    2. reads the expanded size as 4 little endian bytes
+    3. expands the RLE stream into hub RAM starting from $0000, overwriting its own hub copy
+    4. sends back the low byte of the sum of all expanded bytes
+    5. restarts cog 0 with the spin interpreter, which boots the expanded image
+
+The variables after bitticks are never sent, they are initialized by the code before use:
+
+length res 1, ptr res 1, sum res 1, count res 1, rxdata res 1, rxcnt res 1, bits res 1,
+txdata res 1, txcnt res 1
+*/
+const u32 unz_stub[UNZ_STUB_SIZE] =
+{
+    0xA0BFE83B, /* 00 entry    mov         outa, txmask */
+    0xA0BFEC3B, /* 01          mov         dira, txmask */
+    0xA0FC8CAC, /* 02          mov         txdata, #$AC */
+    0x5CFC7431, /* 03          jmpret      tx_ret, #tx */
+    0xA0FC8404, /* 04          mov         count, #4 */
+    0x5CFC6024, /* 05 :len     jmpret      rx_ret, #rx */
+    0x28FC7E08, /* 06          shr         length, #8 */
+    0x2CFC8618, /* 07          shl         rxdata, #24 */
+    0x68BC7E43, /* 08          or          length, rxdata */
+    0xE4FC8405, /* 09          djnz        count, #:len */
+    0xA0FC8000, /* 0A          mov         ptr, #0 */
+    0xA0FC8200, /* 0B          mov         sum, #0 */
+    0x5CFC6024, /* 0C loop     jmpret      rx_ret, #rx */
+    0xA0BC8443, /* 0D          mov         count, rxdata */
+    0x627C8480, /* 0E          test        count, #$80 wz */
+    0x5C540015, /* 0F if_nz    jmp         #run */
+    0x80FC8401, /* 10          add         count, #1 */
+    0x5CFC6024, /* 11 :lit     jmpret      rx_ret, #rx */
+    0x5CFC4620, /* 12          jmpret      put_ret, #put */
+    0xE4FC8411, /* 13          djnz        count, #:lit */
+    0x5C7C001A, /* 14          jmp         #check */
+    0x60FC847F, /* 15 run      and         count, #$7F */
+    0x80FC8403, /* 16          add         count, #3 */
+    0x5CFC6024, /* 17          jmpret      rx_ret, #rx */
+    0x5CFC4620, /* 18 :rep     jmpret      put_ret, #put */
+    0xE4FC8418, /* 19          djnz        count, #:rep */
+    0x873C803F, /* 1A check    cmp         ptr, length wz, wc */
+    0x5C70000C, /* 1B if_b     jmp         #loop */
+    0xA0BC8C41, /* 1C          mov         txdata, sum */
+    0x60FC8CFF, /* 1D          and         txdata, #$FF */
+    0x5CFC7431, /* 1E          jmpret      tx_ret, #tx */
+    0x0C7C7A02, /* 1F          coginit     interp */
+    0x003C8640, /* 20 put      wrbyte      rxdata, ptr */
+    0x80BC8243, /* 21          add         sum, rxdata */
+    0x80FC8001, /* 22          add         ptr, #1 */
+    0x5C7C0000, /* 23 put_ret  ret */
+    0xF43C783C, /* 24 rx       waitpne     rxmask, rxmask */
+    0xA0BC883E, /* 25          mov         rxcnt, bitticks */
+    0x28FC8801, /* 26          shr         rxcnt, #1 */
+    0x80BC883E, /* 27          add         rxcnt, bitticks */
+    0x80BC89F1, /* 28          add         rxcnt, cnt */
+    0xA0FC8A08, /* 29          mov         bits, #8 */
+    0xF8BC883E, /* 2A :bit     waitcnt     rxcnt, bitticks */
+    0x613C79F2, /* 2B          test        rxmask, ina wc */
+    0x30FC8601, /* 2C          rcr         rxdata, #1 */
+    0xE4FC8A2A, /* 2D          djnz        bits, #:bit */
+    0xF8FC8800, /* 2E          waitcnt     rxcnt, #0 */
+    0x28FC8618, /* 2F          shr         rxdata, #24 */
+    0x5C7C0000, /* 30 rx_ret   ret */
+    0x68FC8D00, /* 31 tx       or          txdata, #$100 */
+    0x2CFC8C01, /* 32          shl         txdata, #1 */
+    0xA0FC8A0A, /* 33          mov         bits, #10 */
+    0xA0BC8FF1, /* 34          mov         txcnt, cnt */
+    0x80BC8E3E, /* 35          add         txcnt, bitticks */
+    0x29FC8C01, /* 36 :bit     shr         txdata, #1 wc */
+    0x70BFE83B, /* 37          muxc        outa, txmask */
+    0xF8BC8E3E, /* 38          waitcnt     txcnt, bitticks */
+    0xE4FC8A36, /* 39          djnz        bits, #:bit */
+    0x5C7C0000, /* 3A tx_ret   ret */
+    0x40000000, /* 3B txmask   long        $40000000 */
+    0x80000000, /* 3C rxmask   long        $80000000 */
+    0x0007C010, /* 3D interp   long        $0007C010 (PAR $0004, code $F004, cog 0) */
+    0x000002B6, /* 3E bitticks long        694 */
+};
@@ -0,0 +1,17 @@
+#ifndef COMPRESS_H_INCLUDED
+#define COMPRESS_H_INCLUDED
+#include "types.h"
+#include <stdlib.h>
+
+#define UNZ_STUB_SIZE 63 /* longs of the decompressor stub that are sent to the propeller */
+#define UNZ_STUB_BITTICKS 0x3E /* cog address of the bit period long, patched before the upload */
+#define UNZ_READY 0xAC /* byte the stub sends when it waits for the payload */
+#define UNZ_OVERHEAD_MS 10 /* stub boot and the ready/checksum round trips */
+
+#define RLE_MAX_RUN 7 /* longest repeat run the stub expands before the next start bit, see compress.c */
+#define RLE_BOUND(x) ((x) + (x) / 128 + 1) /* worst case size of a compressed buffer */
+
+size_t rle_compress(const u8* src, size_t srcsz, u8* dest);
+size_t rle_decompress(const u8* src, size_t srcsz, u8* dest, size_t destsz);
+extern const u32 unz_stub[UNZ_STUB_SIZE];
+#endif // COMPRESS_H_INCLUDED
@@ -17,7 +17,7 @@ static inline void NAME##_init(NAME* vec, size_t cap)\
     vec->size = 0;\
     vec->capacity = cap;\
     if(cap)\
-        vec->element = malloc(cap * sizeof(NAME));\
+        vec->element = malloc(cap * sizeof(TYPE));\
 }\
 static inline void NAME##_fini(NAME* vec)\
 {\
@@ -30,7 +30,7 @@ static inline void NAME##_push_back(NAME* vec, TYPE el)\
     {\
         assert(vec->capacity);\
         vec->capacity <<= 1;\
-        vec->element = realloc(vec->element, vec->capacity * sizeof(NAME));\
+        vec->element = realloc(vec->element, vec->capacity * sizeof(TYPE));\
         assert(vec->element);\
     }\
     vec->element[vec->size++] = el;\
@@ -54,7 +54,7 @@ static inline void NAME##_clear(NAME* vec)\
 }\
 static inline void NAME##_remove(NAME* vec, size_t idx)\
 {\
-    memmove(&vec->element[idx], &vec->element[idx + 1], sizeof(NAME) * (vec->size - idx - 1));\
+    memmove(&vec->element[idx], &vec->element[idx + 1], sizeof(TYPE) * (vec->size - idx - 1));\
     vec->size--;\
 }
 
@@ -0,0 +1,51 @@
+#include "context.h"
+#include "util.h"
+
+static asm_context_t main_context = { .clkreg = 0x6F, .must_fit_in = MAX_INSTRUCTIONS, .toksz = 82 };
+__thread asm_context_t* asm_ctx = &main_context;
+
+/*****************************************************************\
+*                                                                 *
+*   @return a new context for assembling a source on a thread of  *
+*   its own, it is used once it is set as asm_ctx. NULL if out of *
+*   memory                                                        *
+*                                                                 *
+\*****************************************************************/
+asm_context_t* asm_context_new()
+{
+    asm_context_t* ctx = calloc(1, sizeof(asm_context_t));
+    if(!ctx)
+        return NULL;
+
+    ctx->clkreg = 0x6F;
+    ctx->must_fit_in = MAX_INSTRUCTIONS;
+    ctx->toksz = 82;
+    return ctx;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Frees the context @param ctx and what parse() left in it.     *
+*                                                                 *
+\*****************************************************************/
+void asm_context_free(asm_context_t* ctx)
+{
+    if(ctx->symmap.initialized)
+    {
+        for(size_t i = 0; i < ctx->symmap.symbols.size; i++)
+            free(ctx->symmap.symbols.element[i].name);
+        for(size_t i = 0; i < ctx->symmap.refs.size; i++)
+            free(ctx->symmap.refs.element[i].name);
+        for(size_t i = 0; i < ctx->symmap.constants.size; i++)
+            free(ctx->symmap.constants.element[i].name);
+        vecsymbol_fini(&ctx->symmap.symbols);
+        vecsymref_fini(&ctx->symmap.refs);
+        vecsymbol_fini(&ctx->symmap.constants);
+    }
+
+    free(ctx->symindex);
+    free(ctx->line);
+    free(ctx->tok);
+    free(ctx->file);
+    free(ctx);
+}
@@ -0,0 +1,80 @@
+#ifndef CONTEXT_H_INCLUDED
+#define CONTEXT_H_INCLUDED
+#include "types.h"
+#include "containers.h"
+#include "expression.h"
+#include "symmap.h"
+#include <setjmp.h>
+
+VECTOR_DECLARE(veclable, pair_t);
+
+/* everything that changes while one source is assembled, one per job so several can run at once */
+typedef struct asm_context
+{
+    const char*     source; /* file name for the error messages of a batch */
+    instruction_t   program[MAX_INSTRUCTIONS];
+    flags_t         flags[MAX_INSTRUCTIONS];
+    expression_t*   unresolved_src[MAX_INSTRUCTIONS];
+    expression_t*   unresolved_dest[MAX_INSTRUCTIONS];
+    veclable        symtable;
+    u32*            symindex; /* hash index of symtable, number of the symbol + 1, 0 if free */
+    size_t          symindex_size; /* a power of two, at least twice the symbols */
+    u16             num_ops;
+    u32             clkfreq;
+    u8              clkreg;
+    u16             must_fit_in; /* FIT directive argument */
+
+    /* parser */
+    size_t          curr_op;
+    size_t          line_num;
+    char*           file; /* file of the lines after a #line marker, NULL for the source */
+    const char*     last_label;
+    char*           token;
+    int             directive_seen; /* the line being parsed has a directive */
+    size_t          line_op; /* first instruction of the line being parsed, -1 if none yet */
+
+    /* read_line() */
+    char*           line;
+    size_t          linesz;
+
+    /* read_first() and read_next() */
+    const char*     delim1;
+    const char*     delim2;
+    char*           tmptok;
+    char*           strtok_pos;
+    char*           tok;
+    size_t          toksz;
+
+    symmap_t        symmap;
+    struct snapshot* snapshots; /* symbol snapshots looked up after the symbol table */
+
+    /* fatal() and sys_error() jump here instead of exiting if it is set */
+    jmp_buf*        error_jmp;
+    char            error[MAX_ERROR_STRING_SIZE];
+    size_t          error_line;
+} asm_context_t;
+
+extern __thread asm_context_t* asm_ctx; /* context of the source this thread assembles */
+
+/*
+A function that has to clean up before an error goes on to its caller opens an error frame
+with ERROR_FRAME(cleanup): on an error the frame of the caller is put back, the cleanup
+statements run and fatal() passes the error on. ERROR_FRAME_END() puts the frame of the
+caller back on the way out. Like for any setjmp(), the locals the cleanup reads must not
+change after the frame is opened unless they are volatile.
+*/
+#define ERROR_FRAME(cleanup) \
+    jmp_buf error_frame; \
+    jmp_buf* const outer_frame = asm_ctx->error_jmp; \
+    asm_ctx->error_jmp = &error_frame; \
+    if(setjmp(error_frame)) \
+    { \
+        asm_ctx->error_jmp = outer_frame; \
+        cleanup \
+        fatal("%s", asm_ctx->error); \
+    }
+#define ERROR_FRAME_END() (asm_ctx->error_jmp = outer_frame)
+
+asm_context_t* asm_context_new();
+void asm_context_free(asm_context_t* ctx);
+#endif // CONTEXT_H_INCLUDED
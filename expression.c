@@ -1,12 +1,8 @@
 #include "expression.h"
+#include "symmap.h"
+#include "context.h"
+#include "snapshot.h"
 #include <stdlib.h>
-VECTOR_DECLARE(veclable, pair_t);
-veclable symtable;
-
-expression_t*   unresolved_src[MAX_INSTRUCTIONS];
-expression_t*   unresolved_dest[MAX_INSTRUCTIONS];
-
-DECLARE_FIND(pair_t);
 
 /*****************************************************************\
 *                                                                 *
@@ -15,7 +11,122 @@ DECLARE_FIND(pair_t);
 \*****************************************************************/
 void init_symtable()
 {
-    veclable_init(&symtable, 10);
+    veclable_init(&asm_ctx->symtable, 10);
+    free(asm_ctx->symindex);
+    if(!(asm_ctx->symindex = calloc(SYMINDEX_MIN, sizeof(u32))))
+        fatal("out of memory");
+    asm_ctx->symindex_size = SYMINDEX_MIN;
+}
+
+static size_t symbol_hash(const char* name)
+{
+    return (size_t)hash_fnv1a(name, strlen(name), FNV_OFFSET);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Puts the symbol number @param i into the index.               *
+*                                                                 *
+\*****************************************************************/
+static void index_symbol(size_t i)
+{
+    size_t mask = asm_ctx->symindex_size - 1;
+    size_t b = symbol_hash(asm_ctx->symtable.element[i].string) & mask;
+    while(asm_ctx->symindex[b])
+        b = (b + 1) & mask;
+    asm_ctx->symindex[b] = i + 1;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Builds the index of the symbol table again with room for      *
+*   @param size symbols.                                          *
+*                                                                 *
+\*****************************************************************/
+static void reindex_symtable(size_t size)
+{
+    size_t index_size = SYMINDEX_MIN;
+    while(index_size < size * 2)
+        index_size *= 2;
+
+    u32* index = calloc(index_size, sizeof(u32));
+    if(!index)
+        fatal("out of memory");
+    free(asm_ctx->symindex);
+    asm_ctx->symindex = index;
+    asm_ctx->symindex_size = index_size;
+    for(size_t i = 0; i < asm_ctx->symtable.size; i++)
+        index_symbol(i);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return the number of the symbol @param name, the size of the *
+*   symbol table if there is none                                 *
+*                                                                 *
+\*****************************************************************/
+size_t symtable_find(const char* name)
+{
+    if(!asm_ctx->symindex) /* no symbol table */
+        return asm_ctx->symtable.size;
+
+    size_t mask = asm_ctx->symindex_size - 1;
+    for(size_t b = symbol_hash(name) & mask; asm_ctx->symindex[b]; b = (b + 1) & mask)
+    {
+        size_t i = asm_ctx->symindex[b] - 1;
+        if(!strcmp(asm_ctx->symtable.element[i].string, name))
+            return i;
+    }
+    return asm_ctx->symtable.size;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Looks @param name up in the symbol table, then in the mapped  *
+*   snapshots. @return 1 if it is defined, its value goes to      *
+*   @param value unless that is NULL                              *
+*                                                                 *
+\*****************************************************************/
+int symtable_lookup(const char* name, ulong* value)
+{
+    size_t i = symtable_find(name);
+    if(i != asm_ctx->symtable.size)
+    {
+        if(value)
+            *value = asm_ctx->symtable.element[i].value;
+        return 1;
+    }
+
+    const snapshot_entry_t* e = snapshot_lookup(name);
+    if(e && value)
+        *value = e->value;
+    return e != NULL;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Adds @param label to the end of the symbol table, which owns  *
+*   its name from then on.                                        *
+*                                                                 *
+\*****************************************************************/
+void symtable_add(pair_t label)
+{
+    if((asm_ctx->symtable.size + 1) * 2 > asm_ctx->symindex_size)
+        reindex_symtable(asm_ctx->symtable.size + 1);
+    veclable_push_back(&asm_ctx->symtable, label);
+    index_symbol(asm_ctx->symtable.size - 1);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Removes the symbols added after the first @param size ones.   *
+*                                                                 *
+\*****************************************************************/
+void symtable_truncate(size_t size)
+{
+    while(asm_ctx->symtable.size > size)
+        free((char*)asm_ctx->symtable.element[--asm_ctx->symtable.size].string);
+    reindex_symtable(size);
 }
 
 /*****************************************************************\
@@ -25,10 +136,15 @@ void init_symtable()
 \*****************************************************************/
 void fini_symtable()
 {
-    for(size_t i = 0; i < symtable.size; i++)
-        free((char*)symtable.element[i].string);
-
-    veclable_fini(&symtable);
+    for(size_t i = 0; i < asm_ctx->symtable.size; i++)
+        free((char*)asm_ctx->symtable.element[i].string);
+
+    veclable_fini(&asm_ctx->symtable);
+    asm_ctx->symtable.element = NULL;
+    free(asm_ctx->symindex);
+    asm_ctx->symindex = NULL;
+    asm_ctx->symindex_size = 0;
+    snapshot_unmap();
 }
 
 /*****************************************************************\
@@ -50,6 +166,49 @@ void expression_clear(expression_t* exp)
     exp->type = 0;
 }
 
+/*****************************************************************\
+*                                                                 *
+*   @return a copy of the whole expression @param exp             *
+*                                                                 *
+\*****************************************************************/
+expression_t* expression_copy(const expression_t* exp)
+{
+    expression_t* first = NULL;
+    expression_t** next = &first;
+
+    for(; exp; exp = exp->next)
+    {
+        expression_t* copy = malloc(sizeof(expression_t));
+        if(!copy)
+            fatal("out of memory");
+
+        *copy = *exp;
+        copy->next = NULL;
+        if(exp->type & EXP_LABEL)
+            copy->data.label = strdup(exp->data.label);
+
+        *next = copy;
+        next = &copy->next;
+    }
+    return first;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Frees the whole expression @param exp                         *
+*                                                                 *
+\*****************************************************************/
+void expression_free(expression_t* exp)
+{
+    while(exp)
+    {
+        expression_t* next = exp->next;
+        expression_clear(exp);
+        free(exp);
+        exp = next;
+    }
+}
+
 /*******************************************************************\
 *                                                                   *
 *   Evaluates expression @param **exp and writes into @param result *
@@ -64,10 +223,8 @@ const char* expression_evaluate(expression_t** exp, ulong* result)
     {
         if((*exp)->type & EXP_LABEL)
         {
-            pair_t p;
-            p.string = (*exp)->data.label;
-            size_t lpos = pair_t_find(&p, symtable.element, symtable.size, &pair_t_compare_string);
-            if(lpos == symtable.size)
+            ulong value;
+            if(!symtable_lookup((*exp)->data.label, &value))
                 return "cant' resolve a label";
 
             else /* converting label to its value and putting to the expression */
@@ -75,7 +232,7 @@ const char* expression_evaluate(expression_t** exp, ulong* result)
                 free((*exp)->data.label);
                 (*exp)->type &= ~EXP_LABEL; /* removing the lable type */
                 (*exp)->type |= EXP_NUMBER; /* converting it to number type */
-                (*exp)->data.number = symtable.element[lpos].value;
+                (*exp)->data.number = value;
                 assert((*exp)->type & EXP_NUMBER);
             }
         }
@@ -107,6 +264,101 @@ const char* expression_evaluate(expression_t** exp, ulong* result)
     return 0;
 }
 
+/*******************************************************************\
+*                                                                   *
+*   Evaluates expression @param exp into @param result, leaving it  *
+*   as it is. Labels are looked up with @param lookup, which gets   *
+*   @param ctx and returns 0 for unknown ones.                      *
+*                                                                   *
+\*******************************************************************/
+const char* expression_value(const expression_t* exp, int (*lookup)(void* ctx, const char* label, ulong* value),
+                             void* ctx, ulong* result)
+{
+    *result = 0;
+
+    for(; exp; exp = exp->next)
+    {
+        ulong number = exp->data.number;
+        if(exp->type & EXP_LABEL)
+        {
+            if(!lookup(ctx, exp->data.label, &number))
+                return "cant' resolve a label";
+        }
+
+        switch(exp->type & 0b00111111)
+        {
+            case '+': *result += number;
+                break;
+
+            case '-': *result -= number;
+                break;
+
+            case '/': *result /= number;
+                break;
+
+            case '*': *result *= number;
+                break;
+
+            default:
+                return "unknown operator in an expression";
+        }
+    }
+    return 0;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Writes @param result into @param field of @param op, 1-7 are  *
+*   the raw commands of flags_t, FIELD_DEST and FIELD_SRC the     *
+*   instruction fields.                                           *
+*                                                                 *
+\*****************************************************************/
+void expression_apply(instruction_t* op, u8 field, ulong result)
+{
+    switch(field)
+    {
+        case 1:
+            op->byte[0] = result & 0xFF;
+            break;
+
+        case 2:
+            op->byte[1] = result & 0xFF;
+            break;
+
+        case 3:
+            op->byte[2] = result & 0xFF;
+            break;
+
+        case 4:
+            op->byte[3] = result & 0xFF;
+            break;
+
+        case 5: /* low word */
+            op->byte[1] = (result >> 8) & 0xFF;
+            op->byte[0] = result & 0xFF;
+            break;
+
+        case 6: /* high word */
+            op->byte[3] = (result >> 8) & 0xFF;
+            op->byte[2] = result & 0xFF;
+            break;
+
+        case 7:
+            op->raw = result;
+            break;
+
+        case FIELD_DEST:
+            op->data.dest = LOW_BYTE_16(result);
+            op->data.desth = HIGH_BYTE_16(result);
+            break;
+
+        case FIELD_SRC:
+            op->data.src = LOW_BYTE_16(result);
+            op->data.srch = HIGH_BYTE_16(result);
+            break;
+    }
+}
+
 /*****************************************************************\
 *                                                                 *
 *   Evaluates all unresolved expressions.                         *
@@ -116,77 +368,48 @@ void evaluate_all_unresolved()
 {
     for(unsigned i = 0; i < MAX_INSTRUCTIONS; i++)
     {
-        if(flags[i].valid)
+        if(asm_ctx->flags[i].valid)
         {
             ulong result;
 
             if(opt_verbose > 4)
                 fprintf(vfile, "%s: op: %u\n", __FUNCTION__, i);
 
-            if(flags[i].raw_command)
+            if(asm_ctx->flags[i].raw_command)
             {
-                const char* errmsg = expression_evaluate(&unresolved_src[i], &result);
+                symmap_reference(asm_ctx->unresolved_src[i], i, asm_ctx->flags[i].raw_command);
+                const char* errmsg = expression_evaluate(&asm_ctx->unresolved_src[i], &result);
                 if(errmsg)
                     fatal("error resolving src expression: %s", errmsg);
 
                 if(opt_verbose > 4)
                     fprintf(vfile, "\traw: %lu\n", result);
 
-                switch(flags[i].raw_command)
-                {
-                    case 1:
-                        program[i].byte[0] = result & 0xFF;
-                        break;
-
-                    case 2:
-                        program[i].byte[1] = result & 0xFF;
-                        break;
-
-                    case 3:
-                        program[i].byte[2] = result & 0xFF;
-                        break;
-
-                    case 4:
-                        program[i].byte[3] = result & 0xFF;
-                        break;
-
-                    case 5: /* low word */
-                        program[i].byte[1] = (result >> 8) & 0xFF;
-                        program[i].byte[0] = result & 0xFF;
-                        break;
-
-                    case 6: /* high word */
-                        program[i].byte[3] = (result >> 8) & 0xFF;
-                        program[i].byte[2] = result & 0xFF;
-                        break;
-
-                    case 7:
-                        program[i].raw = result;
-                }
+                expression_apply(&asm_ctx->program[i], asm_ctx->flags[i].raw_command, result);
 
                 continue;
             }
 
-            if(unresolved_dest[i])
+            if(asm_ctx->unresolved_dest[i])
             {
-                const char* errmsg = expression_evaluate(&unresolved_dest[i], &result);
+                symmap_reference(asm_ctx->unresolved_dest[i], i, FIELD_DEST);
+                const char* errmsg = expression_evaluate(&asm_ctx->unresolved_dest[i], &result);
                 if(errmsg)
                     fatal("error resolving dest expression: %s", errmsg);
 
-                program[i].data.dest = LOW_BYTE_16(result);
-                program[i].data.desth = HIGH_BYTE_16(result);
+                expression_apply(&asm_ctx->program[i], FIELD_DEST, result);
 
                 if(opt_verbose > 4)
                     fprintf(vfile, "\t resolved dest: %lu\n", result);
             }
 
-            if(unresolved_src[i])
+            if(asm_ctx->unresolved_src[i])
             {
-                const char* errmsg = expression_evaluate(&unresolved_src[i], &result);
+                symmap_reference(asm_ctx->unresolved_src[i], i, FIELD_SRC);
+                const char* errmsg = expression_evaluate(&asm_ctx->unresolved_src[i], &result);
                 if(errmsg)
                     fatal("error resolving src expression: %s", errmsg);
-                program[i].data.src = LOW_BYTE_16(result);
-                program[i].data.srch = HIGH_BYTE_16(result);
+                expression_apply(&asm_ctx->program[i], FIELD_SRC, result);
 
                 if(opt_verbose > 4)
                     fprintf(vfile, "\t resolved src: %lu\n", result);
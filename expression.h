@@ -9,6 +9,10 @@
 #define EXP_NUMBER (1L<<7)
 /* ascii ops are 0x20 - 0x2F, (1L<<5) == 0x20 */
 
+/* fields of an instruction an expression can go to, 1-7 are the raw commands of flags_t */
+#define FIELD_DEST 8
+#define FIELD_SRC 9
+
 #if (__SIZEOF_POINTER__ == 8)
 #pragma pack(8)
 #else
@@ -29,12 +33,21 @@ struct exp_struct
     u32                 type;
 };
 #pragma pack()
-extern expression_t*   unresolved_src[MAX_INSTRUCTIONS];
-extern expression_t*   unresolved_dest[MAX_INSTRUCTIONS];
+
+#define SYMINDEX_MIN 64 /* slots of the index of an empty symbol table */
 
 void init_symtable();
 void fini_symtable();
+size_t symtable_find(const char* name);
+int symtable_lookup(const char* name, ulong* value);
+void symtable_add(pair_t label);
+void symtable_truncate(size_t size);
 void expression_clear(expression_t* exp);
+expression_t* expression_copy(const expression_t* exp);
+void expression_free(expression_t* exp);
 const char* expression_evaluate(expression_t** exp, ulong* result);
+const char* expression_value(const expression_t* exp, int (*lookup)(void* ctx, const char* label, ulong* value),
+                             void* ctx, ulong* result);
+void expression_apply(instruction_t* op, u8 field, ulong result);
 void evaluate_all_unresolved();
 #endif // EXPRESSION_H_INCLUDED
@@ -0,0 +1,233 @@
+#include "fingerprint.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+The per board state (the deployed image, the reset timing) is kept in text files with one
+"<value> <device id>" line per board, they are rewritten into a temporary file and renamed
+over the old one, so a crashed or a concurrent ppasm never leaves a half written file behind.
+*/
+
+#define BY_ID_DIR "/dev/serial/by-id"
+
+/*****************************************************************\
+*                                                                 *
+*   Writes the ppasm state directory into @param path, creating   *
+*   it if needed. @return path or 0 if there is none.             *
+*                                                                 *
+\*****************************************************************/
+const char* ppasm_home(char* path, size_t pathsz)
+{
+    const char* dir = getenv("PPASM_HOME");
+    if(dir && *dir)
+        snprintf(path, pathsz, "%s", dir);
+    else
+    {
+        const char* home = getenv("HOME");
+        if(!home || !*home)
+            return 0;
+        snprintf(path, pathsz, "%s/%s", home, FINGERPRINT_DIR);
+    }
+
+    if(mkdir(path, 0755) && errno != EEXIST)
+        return 0;
+
+    return path;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Finds a stable identifier of the serial @param device, the    *
+*   /dev/serial/by-id link pointing to it if there is one or its  *
+*   resolved path otherwise. @return @param id                    *
+*                                                                 *
+\*****************************************************************/
+const char* device_id(const char* device, char* id, size_t idsz)
+{
+    char real[PATH_MAX], link[PATH_MAX];
+
+    if(!realpath(device, real))
+    {
+        snprintf(id, idsz, "%s", device);
+        return id;
+    }
+    snprintf(id, idsz, "%s", real);
+
+    DIR* dir = opendir(BY_ID_DIR);
+    if(!dir)
+        return id;
+
+    struct dirent* entry;
+    while((entry = readdir(dir)))
+    {
+        if(*entry->d_name == '.')
+            continue;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", BY_ID_DIR, entry->d_name);
+        if(realpath(path, link) && !strcmp(link, real))
+        {
+            snprintf(id, idsz, "%s", path);
+            break;
+        }
+    }
+    closedir(dir);
+
+    return id;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Opens the state file @param name for @param mode, @param path *
+*   gets its full name. @return the stream or 0.                  *
+*                                                                 *
+\*****************************************************************/
+static FILE* state_open(const char* name, char* path, size_t pathsz, const char* mode)
+{
+    char home[PATH_MAX];
+    if(!ppasm_home(home, sizeof(home)))
+        return 0;
+
+    snprintf(path, pathsz, "%s/%s", home, name);
+    return fopen(path, mode);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Looks up the value stored for the device @param id in the     *
+*   state file @param name.                                       *
+*   @return non zero if there is one, copied to @param value.     *
+*                                                                 *
+\*****************************************************************/
+static int state_lookup(const char* name, const char* id, char* value, size_t valuesz)
+{
+    char path[PATH_MAX];
+    FILE* file = state_open(name, path, sizeof(path), "r");
+    if(!file)
+        return 0;
+
+    int found = 0;
+    char line[PATH_MAX + 64];
+    while(fgets(line, sizeof(line), file))
+    {
+        char* device = strchr(line, ' ');
+        if(!device)
+            continue;
+        *device++ = 0;
+        device[strcspn(device, "\n")] = 0;
+
+        if(!strcmp(device, id))
+        {
+            snprintf(value, valuesz, "%s", line);
+            found = 1;
+        }
+    }
+    fclose(file);
+
+    return found;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Stores @param value (without spaces) for the device @param id *
+*   in the state file @param name.                                *
+*                                                                 *
+\*****************************************************************/
+static void state_store(const char* name, const char* id, const char* value)
+{
+    char path[PATH_MAX], tmppath[PATH_MAX + 16];
+    FILE* file = state_open(name, path, sizeof(path), "r");
+
+    snprintf(tmppath, sizeof(tmppath), "%s.%ld", path, (long)getpid());
+    FILE* tmp = fopen(tmppath, "w");
+    if(!tmp)
+    {
+        fprintf(stderr, "failed to update %s\n", path);
+        if(file)
+            fclose(file);
+        return;
+    }
+
+    /* copying all the other devices over */
+    if(file)
+    {
+        char line[PATH_MAX + 64];
+        while(fgets(line, sizeof(line), file))
+        {
+            char* device = strchr(line, ' ');
+            if(!device || strncmp(device + 1, id, strlen(id)) || device[strlen(id) + 1] != '\n')
+                fputs(line, tmp);
+        }
+        fclose(file);
+    }
+
+    fprintf(tmp, "%s %s\n", value, id);
+
+    if(fclose(tmp) || rename(tmppath, path))
+    {
+        fprintf(stderr, "failed to update %s\n", path);
+        unlink(tmppath);
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Looks up the image hash last deployed to the device @param id *
+*   @return non zero if there is one, stored in @param hash.      *
+*                                                                 *
+\*****************************************************************/
+int fingerprint_lookup(const char* id, u64* hash)
+{
+    char value[32];
+    if(!state_lookup(FINGERPRINT_FILE, id, value, sizeof(value)))
+        return 0;
+
+    *hash = strtoull(value, 0, 16);
+    return 1;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Remembers that the image with @param hash was deployed to     *
+*   the device @param id.                                         *
+*                                                                 *
+\*****************************************************************/
+void fingerprint_store(const char* id, u64 hash)
+{
+    char value[32];
+    snprintf(value, sizeof(value), "%016llx", (unsigned long long)hash);
+    state_store(FINGERPRINT_FILE, id, value);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Looks up the calibrated reset timing of the device @param id. *
+*   @return non zero if there is one.                             *
+*                                                                 *
+\*****************************************************************/
+int timing_lookup(const char* id, ulong* reset_ms, ulong* settle_ms)
+{
+    char value[64];
+    if(!state_lookup(TIMING_FILE, id, value, sizeof(value)))
+        return 0;
+
+    return sscanf(value, "%lu,%lu", reset_ms, settle_ms) == 2;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Stores the calibrated reset timing of the device @param id.   *
+*                                                                 *
+\*****************************************************************/
+void timing_store(const char* id, ulong reset_ms, ulong settle_ms)
+{
+    char value[64];
+    snprintf(value, sizeof(value), "%lu,%lu", reset_ms, settle_ms);
+    state_store(TIMING_FILE, id, value);
+}
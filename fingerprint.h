@@ -0,0 +1,16 @@
+#ifndef FINGERPRINT_H_INCLUDED
+#define FINGERPRINT_H_INCLUDED
+#include "types.h"
+#include <stdlib.h>
+
+#define FINGERPRINT_DIR ".ppasm" /* in $HOME, unless PPASM_HOME is set */
+#define FINGERPRINT_FILE "deployed"
+#define TIMING_FILE "timing"
+
+const char* device_id(const char* device, char* id, size_t idsz);
+int fingerprint_lookup(const char* id, u64* hash);
+void fingerprint_store(const char* id, u64 hash);
+int timing_lookup(const char* id, ulong* reset_ms, ulong* settle_ms);
+void timing_store(const char* id, ulong reset_ms, ulong settle_ms);
+const char* ppasm_home(char* path, size_t pathsz);
+#endif // FINGERPRINT_H_INCLUDED
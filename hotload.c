@@ -0,0 +1,336 @@
+#include "hotload.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+/*
+Hot reload keeps a small stub running in cog 0 after the first load. Later loads don't
+reset the chip, they only send one cog image to the stub, which restarts that cog with
+it while the other cogs go on running:
+
+    host: HOT_SYNC                      stub: HOT_READY
+    host: cog, number of longs as 2 little endian bytes, the longs, low byte of their sum
+                                        stub: HOT_ACK, or HOT_NAK if the sum is wrong
+
+The emulator below speaks the same protocol over a pty, so the host side can be tried
+without a propeller.
+*/
+
+/*
+The resident stub, assembled with ppasm -r. It is loaded through the ROM, so it starts in
+cog 0 from hub $0020. It bit-bangs 8N1 on P31/P30, writes the cog image to the hub at
+buffer, then does cogstop and coginit of the requested cog with it. The variables after
+bitticks are never sent, they are initialized by the code before use:
+
+cog res 1, count res 1, ptr res 1, sum res 1, rxdata res 1, rxcnt res 1, bits res 1,
+txdata res 1, txcnt res 1, launch res 1
+*/
+const u32 hot_stub[HOT_STUB_SIZE] =
+{
+    0xA0BFE83A, /* 00 entry    mov         outa, txmask */
+    0xA0BFEC3A, /* 01          mov         dira, txmask */
+    0x5CFC5E23, /* 02 wait     jmpret      rx_ret, #rx */
+    0x867C84A5, /* 03          cmp         rxdata, #$A5 wz */
+    0x5C540002, /* 04 if_nz    jmp         #wait */
+    0xA0FC8AAD, /* 05          mov         txdata, #$AD */
+    0x5CFC7230, /* 06          jmpret      tx_ret, #tx */
+    0x5CFC5E23, /* 07          jmpret      rx_ret, #rx */
+    0xA0BC7C42, /* 08          mov         cog, rxdata */
+    0x5CFC5E23, /* 09          jmpret      rx_ret, #rx */
+    0xA0BC7E42, /* 0A          mov         count, rxdata */
+    0x5CFC5E23, /* 0B          jmpret      rx_ret, #rx */
+    0x2CFC8408, /* 0C          shl         rxdata, #8 */
+    0x68BC7E42, /* 0D          or          count, rxdata */
+    0x2CFC7E02, /* 0E          shl         count, #2 */
+    0xA0BC803C, /* 0F          mov         ptr, buffer */
+    0xA0FC8200, /* 10          mov         sum, #0 */
+    0x5CFC5E23, /* 11 recv     jmpret      rx_ret, #rx */
+    0x003C8440, /* 12          wrbyte      rxdata, ptr */
+    0x80BC8242, /* 13          add         sum, rxdata */
+    0x80FC8001, /* 14          add         ptr, #1 */
+    0xE4FC7E11, /* 15          djnz        count, #recv */
+    0x5CFC5E23, /* 16          jmpret      rx_ret, #rx */
+    0x60FC82FF, /* 17          and         sum, #$FF */
+    0x863C8242, /* 18          cmp         sum, rxdata wz */
+    0xA0FC8AEE, /* 19          mov         txdata, #$EE */
+    0x5C540021, /* 1A if_nz    jmp         #reply */
+    0x0C7C7C03, /* 1B          cogstop     cog */
+    0xA0BC8E3C, /* 1C          mov         launch, buffer */
+    0x2CFC8E02, /* 1D          shl         launch, #2 */
+    0x68BC8E3E, /* 1E          or          launch, cog */
+    0x0C7C8E02, /* 1F          coginit     launch */
+    0xA0FC8AAC, /* 20          mov         txdata, #$AC */
+    0x5CFC7230, /* 21 reply    jmpret      tx_ret, #tx */
+    0x5C7C0002, /* 22          jmp         #wait */
+    0xF43C763B, /* 23 rx       waitpne     rxmask, rxmask */
+    0xA0BC863D, /* 24          mov         rxcnt, bitticks */
+    0x28FC8601, /* 25          shr         rxcnt, #1 */
+    0x80BC863D, /* 26          add         rxcnt, bitticks */
+    0x80BC87F1, /* 27          add         rxcnt, cnt */
+    0xA0FC8808, /* 28          mov         bits, #8 */
+    0xF8BC863D, /* 29 :bit     waitcnt     rxcnt, bitticks */
+    0x613C77F2, /* 2A          test        rxmask, ina wc */
+    0x30FC8401, /* 2B          rcr         rxdata, #1 */
+    0xE4FC8829, /* 2C          djnz        bits, #:bit */
+    0xF8FC8600, /* 2D          waitcnt     rxcnt, #0 */
+    0x28FC8418, /* 2E          shr         rxdata, #24 */
+    0x5C7C0000, /* 2F rx_ret   ret */
+    0x68FC8B00, /* 30 tx       or          txdata, #$100 */
+    0x2CFC8A01, /* 31          shl         txdata, #1 */
+    0xA0FC880A, /* 32          mov         bits, #10 */
+    0xA0BC8DF1, /* 33          mov         txcnt, cnt */
+    0x80BC8C3D, /* 34          add         txcnt, bitticks */
+    0x29FC8A01, /* 35 :bit     shr         txdata, #1 wc */
+    0x70BFE83A, /* 36          muxc        outa, txmask */
+    0xF8BC8C3D, /* 37          waitcnt     txcnt, bitticks */
+    0xE4FC8835, /* 38          djnz        bits, #:bit */
+    0x5C7C0000, /* 39 tx_ret   ret */
+    0x40000000, /* 3A txmask   long        $40000000 */
+    0x80000000, /* 3B rxmask   long        $80000000 */
+    0x00001000, /* 3C buffer   long        $1000 */
+    0x000002B6 /* 3D bitticks long        694 */
+};
+
+/*****************************************************************\
+*                                                                 *
+*   Reads @param size bytes from @param fd into @param buff,      *
+*   waiting at most @param timeout msec for each chunk.           *
+*   @return number of bytes read, less than size on timeout       *
+*                                                                 *
+\*****************************************************************/
+static size_t read_bytes(int fd, u8* buff, size_t size, int timeout)
+{
+    size_t done = 0;
+    struct pollfd fds = { fd, POLLIN, 0 };
+
+    while(done < size)
+    {
+        int ready = poll(&fds, 1, timeout);
+        if(ready < 0 && errno == EINTR)
+            continue;
+        if(ready < 0)
+            sys_error("poll failed");
+        if(!ready || !(fds.revents & POLLIN))
+            break;
+
+        ssize_t n = read(fd, buff + done, size - done);
+        if(n < 0 && errno != EINTR && errno != EAGAIN)
+            sys_error("serial read failed");
+        if(n > 0)
+            done += n;
+    }
+
+    return done;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Writes @param size bytes of @param buff to @param fd.         *
+*                                                                 *
+\*****************************************************************/
+static void write_bytes(int fd, const u8* buff, size_t size)
+{
+    while(size)
+    {
+        ssize_t n = write(fd, buff, size);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            sys_error("serial write failed");
+        buff += n;
+        size -= n;
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Checks if the stub is running on the other end of @param fd,  *
+*   waiting @param timeout msec for it. @return non zero if so    *
+*                                                                 *
+\*****************************************************************/
+int hot_ping(int fd, int timeout)
+{
+    u8 byte = HOT_SYNC;
+    tcflush(fd, TCIFLUSH);
+    write_bytes(fd, &byte, 1);
+
+    while(read_bytes(fd, &byte, 1, timeout) == 1)
+    {
+        if(byte == HOT_READY)
+            return 1;
+    }
+    return 0;
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Sends a cog image of @param num_longs little endian longs in @param image   *
+*   to the stub, which starts it in @param cog. Must follow a succesful         *
+*   hot_ping(). @return error message or 0 if everything is ok.                 *
+*                                                                               *
+\*******************************************************************************/
+const char* hot_send(int fd, u8 cog, const u8* image, size_t num_longs)
+{
+    if(!cog || cog > 7)
+        return "the stub runs in cog 0, the program can go to cogs 1-7";
+    if(!num_longs || num_longs > COG_LONGS)
+        return "the program doesn't fit into a cog";
+
+    u8 header[3] = { cog, num_longs & 0xFF, num_longs >> 8 };
+    u8 sum = 0;
+    for(size_t i = 0; i < num_longs * 4; i++)
+        sum += image[i];
+
+    write_bytes(fd, header, sizeof(header));
+    write_bytes(fd, image, num_longs * 4);
+    write_bytes(fd, &sum, 1);
+    tcdrain(fd);
+
+    /* the stub only answers after the whole image arrived */
+    u8 byte;
+    if(read_bytes(fd, &byte, 1, HOT_BOOT_TIMEOUT) != 1)
+        return "the stub didn't answer";
+    if(byte == HOT_NAK)
+        return "cog image checksum failed";
+    if(byte != HOT_ACK)
+        return "unexpected answer from the stub";
+
+    return 0;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Opens a pty for the stub emulator @param emu.                 *
+*   @return error message or 0 if everything is ok.               *
+*                                                                 *
+\*****************************************************************/
+const char* hot_emulator_open(hot_emulator_t* emu)
+{
+    memset(emu, 0, sizeof(*emu));
+
+    emu->master = open("/dev/ptmx", O_RDWR | O_NOCTTY);
+    if(emu->master < 0)
+        return "failed to open /dev/ptmx";
+    if(grantpt(emu->master) || unlockpt(emu->master) || !ptsname(emu->master))
+    {
+        close(emu->master);
+        return "failed to set up the pty";
+    }
+    snprintf(emu->name, sizeof(emu->name), "%s", ptsname(emu->master));
+
+    /* the line discipline of the pty must pass the bytes as they are */
+    struct termios tio;
+    emu->slave = open(emu->name, O_RDWR | O_NOCTTY);
+    if(emu->slave < 0 || tcgetattr(emu->slave, &tio))
+    {
+        hot_emulator_close(emu);
+        return "failed to open the pty slave";
+    }
+    tio.c_iflag = 0;
+    tio.c_oflag = 0;
+    tio.c_lflag = 0;
+    tio.c_cflag = B115200 | CS8 | CLOCAL | CREAD;
+    tio.c_cc[VTIME] = 0;
+    tio.c_cc[VMIN] = 1;
+    if(tcsetattr(emu->slave, TCSANOW, &tio))
+    {
+        hot_emulator_close(emu);
+        return "failed to set the pty attributes";
+    }
+
+    return 0;
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Serves one request to the stub emulator @param emu the way the stub does,   *
+*   waiting at most @param timeout msec for each byte.                          *
+*   @return the cog that was started or -1 if none                              *
+*                                                                               *
+\*******************************************************************************/
+int hot_emulate(hot_emulator_t* emu, int timeout)
+{
+    u8 byte;
+    do
+    {
+        if(read_bytes(emu->master, &byte, 1, timeout) != 1)
+            return -1;
+    }
+    while(byte != HOT_SYNC);
+
+    byte = HOT_READY;
+    write_bytes(emu->master, &byte, 1);
+
+    u8 header[3];
+    if(read_bytes(emu->master, header, 3, timeout) != 3)
+        return -1;
+
+    u8 cog = header[0];
+    size_t num_longs = header[1] | header[2] << 8;
+    if(cog > 7 || num_longs > COG_LONGS)
+        return -1;
+
+    u8 image[COG_LONGS * 4], sum = 0, check;
+    if(read_bytes(emu->master, image, num_longs * 4, timeout) != num_longs * 4 ||
+       read_bytes(emu->master, &check, 1, timeout) != 1)
+        return -1;
+
+    for(size_t i = 0; i < num_longs * 4; i++)
+        sum += image[i];
+
+    byte = sum == check ? HOT_ACK : HOT_NAK;
+    if(byte == HOT_ACK)
+    {
+        for(size_t i = 0; i < num_longs; i++)
+            emu->cog[cog][i] = image[i * 4] | image[i * 4 + 1] << 8 |
+                               image[i * 4 + 2] << 16 | (u32)image[i * 4 + 3] << 24;
+        emu->size[cog] = num_longs;
+    }
+    write_bytes(emu->master, &byte, 1);
+
+    return byte == HOT_ACK ? cog : -1;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Closes the pty of the stub emulator @param emu.               *
+*                                                                 *
+\*****************************************************************/
+void hot_emulator_close(hot_emulator_t* emu)
+{
+    if(emu->slave > 0)
+        close(emu->slave);
+    if(emu->master > 0)
+        close(emu->master);
+    emu->slave = emu->master = -1;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Runs the stub emulator until it's killed, reporting what it   *
+*   starts.                                                       *
+*                                                                 *
+\*****************************************************************/
+void hot_emulator_serve()
+{
+    static hot_emulator_t emu;
+    const char* errmsg = hot_emulator_open(&emu);
+    if(errmsg)
+        sys_error(errmsg);
+
+    printf("hot reload stub emulator on %s\n", emu.name);
+    fflush(stdout);
+
+    for(;;)
+    {
+        int cog = hot_emulate(&emu, -1);
+        if(cog >= 0)
+            printf("started %lu longs in cog %d\n", (ulong)emu.size[cog], cog);
+        fflush(stdout);
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef HOTLOAD_H_INCLUDED
+#define HOTLOAD_H_INCLUDED
+#include "types.h"
+#include <stdlib.h>
+
+#define HOT_STUB_SIZE 62 /* longs of the resident stub that are sent to the propeller */
+#define HOT_STUB_BITTICKS 0x3D /* cog address of the bit period long, patched before the upload */
+#define HOT_SYNC 0xA5 /* byte the host sends to get the stub's attention */
+#define HOT_READY 0xAD /* the stub's answer to HOT_SYNC */
+#define HOT_ACK 0xAC /* cog image received and started */
+#define HOT_NAK 0xEE /* checksum of the cog image failed */
+#define HOT_PING_TIMEOUT 50 /* msec to wait for HOT_READY from a resident stub */
+#define HOT_BOOT_TIMEOUT 500 /* msec for a freshly loaded stub to come up */
+#define COG_LONGS 496 /* longs of a cog image */
+
+/* a pty that behaves like a propeller with the resident stub */
+typedef struct
+{
+    int     master; /* the stub's end of the pty */
+    int     slave; /* kept open so the line settings survive */
+    char    name[64]; /* the device to give ppasm -s */
+    u32     cog[8][COG_LONGS]; /* what got started in each cog */
+    size_t  size[8]; /* longs started in each cog */
+} hot_emulator_t;
+
+extern const u32 hot_stub[HOT_STUB_SIZE];
+
+int hot_ping(int fd, int timeout);
+const char* hot_send(int fd, u8 cog, const u8* image, size_t num_longs);
+const char* hot_emulator_open(hot_emulator_t* emu);
+int hot_emulate(hot_emulator_t* emu, int timeout);
+void hot_emulator_close(hot_emulator_t* emu);
+void hot_emulator_serve();
+#endif // HOTLOAD_H_INCLUDED
@@ -0,0 +1,900 @@
+#include "incremental.h"
+#include "parse.h"
+#include "assemble.h"
+#include "expression.h"
+#include "stringext.h"
+#include "context.h"
+#include "snapshot.h"
+#include "util.h"
+#include <string.h>
+#include <stdio.h>
+#include <setjmp.h>
+#include <stdarg.h>
+
+/*
+--watch builds the same source again after every save, and a save usually changes a few
+lines. The parse of every line is kept, keyed by the text of the line and the global label
+its local labels belong to. A build only parses the lines that changed and replays the kept
+ones at the address they land on now, so inserting an instruction moves everything after
+it without parsing it again. Labels of a line are kept relative to its first instruction.
+
+The fixups of an instruction, its expressions, are only evaluated again if the line moved
+to another address or one of the labels it uses changed its value; the other instructions
+get what they resolved to last time. Lines with directives depend on more than their text
+(ORG, RES) or change the state of the whole build (FIT, _CLKFREQ), they are not kept but
+parsed every time, and their fixups are always evaluated.
+
+With keep_going, for --lsp, an error takes back what its line added and the build goes on
+with the next line, so all the errors of a source are found at once. A build also indexes
+the labels every line defines and uses.
+*/
+
+typedef struct
+{
+    char*   name;
+    ulong   value; /* the constant, or the address relative to the line's first instruction */
+    u8      constant;
+} line_label_t;
+
+struct line_record
+{
+    line_record_t*  next; /* in the same bucket */
+    u64             hash;
+    char*           text;
+    char*           scope; /* the last global label before the line */
+    size_t          used; /* last build that had the line */
+    u8              reparse; /* has a directive */
+
+    line_label_t*   labels;
+    size_t          num_labels;
+    size_t          scope_label; /* label that starts a new scope, num_labels if none */
+
+    size_t          first; /* address of the first instruction when it was parsed */
+    size_t          count; /* instructions of the line */
+    instruction_t*  program;
+    flags_t*        flags;
+    expression_t**  src;
+    expression_t**  dest;
+};
+
+/*****************************************************************\
+*                                                                 *
+*   @return a new incremental assembler or NULL                   *
+*                                                                 *
+\*****************************************************************/
+incremental_t* incremental_new()
+{
+    incremental_t* inc = calloc(1, sizeof(incremental_t));
+    if(!inc)
+        return NULL;
+
+    inc->num_buckets = 256;
+    if(!(inc->buckets = calloc(inc->num_buckets, sizeof(line_record_t*))))
+    {
+        free(inc);
+        return NULL;
+    }
+
+    vecincerror_init(&inc->errors, 16);
+    vecincline_init(&inc->source, 256);
+    vecincsymbol_init(&inc->definitions, 64);
+    vecincsymbol_init(&inc->references, 64);
+    return inc;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Frees the line record @param r.                               *
+*                                                                 *
+\*****************************************************************/
+static void free_record(line_record_t* r)
+{
+    for(size_t i = 0; i < r->num_labels; i++)
+        free(r->labels[i].name);
+    for(size_t i = 0; i < r->count; i++)
+    {
+        expression_free(r->src[i]);
+        expression_free(r->dest[i]);
+    }
+    free(r->labels);
+    free(r->program);
+    free(r->flags);
+    free(r->src);
+    free(r->dest);
+    free(r->text);
+    free(r->scope);
+    free(r);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Frees the records of the lines with directives.               *
+*                                                                 *
+\*****************************************************************/
+static void free_retired(incremental_t* inc)
+{
+    while(inc->retired)
+    {
+        line_record_t* r = inc->retired;
+        inc->retired = r->next;
+        free_record(r);
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Frees the symbols the last build left.                        *
+*                                                                 *
+\*****************************************************************/
+static void free_symbols(incremental_t* inc)
+{
+    for(size_t i = 0; i < inc->num_symbols; i++)
+        free((char*)inc->symbols[i].string);
+    free(inc->symbols);
+    inc->symbols = NULL;
+    inc->num_symbols = 0;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Forgets the errors and the index of the last build.           *
+*                                                                 *
+\*****************************************************************/
+static void clear_build(incremental_t* inc)
+{
+    for(size_t i = 0; i < inc->errors.size; i++)
+        free(inc->errors.element[i].message);
+    vecincerror_clear(&inc->errors);
+    vecincline_clear(&inc->source);
+    vecincsymbol_clear(&inc->definitions);
+    vecincsymbol_clear(&inc->references);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Frees the incremental assembler @param inc.                   *
+*                                                                 *
+\*****************************************************************/
+void incremental_free(incremental_t* inc)
+{
+    if(!inc)
+        return;
+
+    for(size_t b = 0; b < inc->num_buckets; b++)
+    {
+        while(inc->buckets[b])
+        {
+            line_record_t* r = inc->buckets[b];
+            inc->buckets[b] = r->next;
+            free_record(r);
+        }
+    }
+    free_retired(inc);
+    free_symbols(inc);
+    clear_build(inc);
+    vecincerror_fini(&inc->errors);
+    vecincline_fini(&inc->source);
+    vecincsymbol_fini(&inc->definitions);
+    vecincsymbol_fini(&inc->references);
+    free(inc->buckets);
+    free(inc);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return the key of the line @param text in the scope of the   *
+*   global label @param scope.                                    *
+*                                                                 *
+\*****************************************************************/
+static u64 line_hash(const char* text, const char* scope)
+{
+    u64 hash = hash_fnv1a(text, strlen(text) + 1, FNV_OFFSET);
+    return hash_fnv1a(scope, strlen(scope), hash);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return the record of the line @param text in @param scope    *
+*   or NULL if it was not parsed before.                          *
+*                                                                 *
+\*****************************************************************/
+static line_record_t* find_record(incremental_t* inc, u64 hash, const char* text, const char* scope)
+{
+    for(line_record_t* r = inc->buckets[hash % inc->num_buckets]; r; r = r->next)
+    {
+        if(r->hash == hash && !strcmp(r->text, text) && !strcmp(r->scope, scope))
+            return r;
+    }
+    return NULL;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Adds the record @param r, the table doubles when it has two   *
+*   records per bucket.                                           *
+*                                                                 *
+\*****************************************************************/
+static void insert_record(incremental_t* inc, line_record_t* r)
+{
+    if(inc->num_records >= inc->num_buckets * 2)
+    {
+        size_t num = inc->num_buckets * 2;
+        line_record_t** buckets = calloc(num, sizeof(line_record_t*));
+        if(!buckets)
+            fatal("out of memory");
+
+        for(size_t b = 0; b < inc->num_buckets; b++)
+        {
+            while(inc->buckets[b])
+            {
+                line_record_t* m = inc->buckets[b];
+                inc->buckets[b] = m->next;
+                m->next = buckets[m->hash % num];
+                buckets[m->hash % num] = m;
+            }
+        }
+        free(inc->buckets);
+        inc->buckets = buckets;
+        inc->num_buckets = num;
+    }
+
+    r->next = inc->buckets[r->hash % inc->num_buckets];
+    inc->buckets[r->hash % inc->num_buckets] = r;
+    inc->num_records++;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Parses @param line and keeps what it added to asm_ctx.        *
+*   @param hash and @param scope are its key.                     *
+*   @return the record of the line                                *
+*                                                                 *
+\*****************************************************************/
+static line_record_t* record_line(char* line, u64 hash, const char* scope)
+{
+    char text[strlen(line) + 1]; /* parse_line() cuts the line into tokens */
+    strcpy(text, line);
+
+    size_t start = asm_ctx->curr_op;
+    size_t num_symbols = asm_ctx->symtable.size;
+    size_t num_constants = asm_ctx->symmap.constants.size;
+    const char* last_label = asm_ctx->last_label;
+
+    parse_line(line);
+
+    size_t first = asm_ctx->line_op == (size_t)-1 ? asm_ctx->curr_op : asm_ctx->line_op;
+    if(asm_ctx->curr_op < first)
+        fatal("line %lu: ORG after an instruction of the same line", asm_ctx->line_num);
+
+    line_record_t* r = calloc(1, sizeof(line_record_t));
+    if(!r || !(r->text = strdup(text)) || !(r->scope = strdup(scope)))
+        fatal("out of memory");
+    r->hash = hash;
+    r->reparse = asm_ctx->directive_seen;
+
+    r->num_labels = r->scope_label = asm_ctx->symtable.size - num_symbols;
+    if(!(r->labels = malloc((r->num_labels + 1) * sizeof(line_label_t))))
+        fatal("out of memory");
+
+    for(size_t i = 0; i < r->num_labels; i++)
+    {
+        const pair_t* s = &asm_ctx->symtable.element[num_symbols + i];
+        line_label_t* l = &r->labels[i];
+        if(!(l->name = strdup(s->string)))
+            fatal("out of memory");
+
+        l->constant = 0;
+        for(size_t c = num_constants; c < asm_ctx->symmap.constants.size; c++)
+            l->constant |= !strcmp(asm_ctx->symmap.constants.element[c].name, s->string);
+
+        l->value = l->constant ? s->value : s->value - start;
+        if(s->string == asm_ctx->last_label && last_label != asm_ctx->last_label)
+            r->scope_label = i;
+    }
+
+    r->first = first;
+    r->count = asm_ctx->curr_op - r->first;
+    r->program = malloc((r->count + 1) * sizeof(instruction_t));
+    r->flags = malloc((r->count + 1) * sizeof(flags_t));
+    r->src = malloc((r->count + 1) * sizeof(expression_t*));
+    r->dest = malloc((r->count + 1) * sizeof(expression_t*));
+    if(!r->program || !r->flags || !r->src || !r->dest)
+        fatal("out of memory");
+
+    /* the record takes the expressions, they stay unresolved */
+    for(size_t i = 0; i < r->count; i++)
+    {
+        size_t a = r->first + i;
+        r->program[i] = asm_ctx->program[a];
+        r->flags[i] = asm_ctx->flags[a];
+        r->src[i] = asm_ctx->unresolved_src[a];
+        r->dest[i] = asm_ctx->unresolved_dest[a];
+        asm_ctx->unresolved_src[a] = asm_ctx->unresolved_dest[a] = NULL;
+    }
+    return r;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Adds the line of the record @param r at the current address.  *
+*                                                                 *
+\*****************************************************************/
+static void replay_line(const line_record_t* r)
+{
+    size_t start = asm_ctx->curr_op;
+
+    for(size_t i = 0; i < r->num_labels; i++)
+    {
+        const line_label_t* l = &r->labels[i];
+        if(symtable_lookup(l->name, NULL))
+            fatal("label %s was already defined!", l->name);
+
+        pair_t label = { strdup(l->name), l->constant ? l->value : start + l->value };
+        if(!label.string)
+            fatal("out of memory");
+        symtable_add(label);
+
+        if(i == r->scope_label)
+            asm_ctx->last_label = label.string;
+        if(l->constant)
+            symmap_constant(l->name);
+    }
+
+    for(size_t i = 0; i < r->count; i++)
+    {
+        if(asm_ctx->curr_op > asm_ctx->must_fit_in || asm_ctx->curr_op >= MAX_INSTRUCTIONS)
+            fatal("program doesn't fit in %u longs", asm_ctx->must_fit_in);
+
+        asm_ctx->program[asm_ctx->curr_op] = r->program[i];
+        asm_ctx->flags[asm_ctx->curr_op] = r->flags[i];
+        asm_ctx->curr_op++;
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Compares symbols @param a and @param b by name for qsort().   *
+*                                                                 *
+\*****************************************************************/
+static int compare_symbols(const void* a, const void* b)
+{
+    return strcmp(((const pair_t*)a)->string, ((const pair_t*)b)->string);
+}
+
+typedef struct
+{
+    const pair_t*   symbols;
+    size_t          num_symbols;
+} symbols_t;
+
+/*****************************************************************\
+*                                                                 *
+*   Looks up @param label in the sorted symbols @param ctx for    *
+*   expression_value().                                           *
+*                                                                 *
+\*****************************************************************/
+static int lookup(void* ctx, const char* label, ulong* value)
+{
+    const symbols_t* s = ctx;
+    pair_t key = { label, 0 };
+    const pair_t* found = bsearch(&key, s->symbols, s->num_symbols, sizeof(pair_t), compare_symbols);
+    if(!found)
+        return 0;
+
+    *value = found->value;
+    return 1;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return 1 if all the labels of @param exp have the same value *
+*   in @param now and @param before.                              *
+*                                                                 *
+\*****************************************************************/
+static int labels_unchanged(const expression_t* exp, symbols_t* now, symbols_t* before)
+{
+    for(; exp; exp = exp->next)
+    {
+        ulong a, b;
+        if((exp->type & EXP_LABEL) &&
+           (!lookup(now, exp->data.label, &a) || !lookup(before, exp->data.label, &b) || a != b))
+            return 0;
+    }
+    return 1;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Resolves @param exp with the symbols @param now into          *
+*   @param field of the instruction at @param addr.               *
+*   @return error message or NULL                                 *
+*                                                                 *
+\*****************************************************************/
+static const char* resolve(const expression_t* exp, symbols_t* now, size_t addr, u8 field)
+{
+    ulong result;
+    const char* errmsg = expression_value(exp, lookup, now, &result);
+    if(errmsg)
+        return errmsg;
+
+    expression_apply(&asm_ctx->program[addr], field, result);
+    return NULL;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return the first label of @param exp that is not in          *
+*   @param now or NULL.                                           *
+*                                                                 *
+\*****************************************************************/
+static const char* unknown_label(const expression_t* exp, symbols_t* now)
+{
+    for(; exp; exp = exp->next)
+    {
+        ulong value;
+        if((exp->type & EXP_LABEL) && !lookup(now, exp->data.label, &value))
+            return exp->data.label;
+    }
+    return NULL;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Adds an error of @param line to the build, formatted like     *
+*   printf().                                                     *
+*                                                                 *
+\*****************************************************************/
+static void add_error(incremental_t* inc, size_t line, const char* format, ...)
+{
+    incremental_error_t e = { line, malloc(MAX_ERROR_STRING_SIZE) };
+    if(!e.message)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(e.message, MAX_ERROR_STRING_SIZE, format, args);
+    va_end(args);
+    vecincerror_push_back(&inc->errors, e);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Adds the line @param line at the current address, by the      *
+*   record of the same line and scope if there is one.            *
+*   @param first gets the address of its first instruction.       *
+*   @return the record of the line                                *
+*                                                                 *
+\*****************************************************************/
+static line_record_t* build_line(incremental_t* inc, char* line, const char* scope, size_t* first)
+{
+    u64 hash = line_hash(line, scope);
+    line_record_t* r = find_record(inc, hash, line, scope);
+    if(r)
+    {
+        replay_line(r);
+        return r;
+    }
+
+    r = record_line(line, hash, scope);
+    if(r->reparse)
+    {
+        r->next = inc->retired;
+        inc->retired = r;
+    }
+    else
+        insert_record(inc, r);
+
+    *first = r->first;
+    inc->parsed++;
+    return r;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   build_line() that adds an error instead of stopping the       *
+*   build and takes back what the line added.                     *
+*   @return the record of the line or NULL                        *
+*                                                                 *
+\*****************************************************************/
+static line_record_t* build_line_or_error(incremental_t* inc, char* line, const char* scope, size_t* first)
+{
+    jmp_buf line_jmp;
+    jmp_buf* build_jmp = asm_ctx->error_jmp;
+    size_t start = asm_ctx->curr_op;
+    size_t num_symbols = asm_ctx->symtable.size;
+    const char* last_label = asm_ctx->last_label;
+
+    asm_ctx->error_jmp = &line_jmp;
+    if(setjmp(line_jmp))
+    {
+        asm_ctx->error_jmp = build_jmp;
+        add_error(inc, asm_ctx->error_line, "%s", asm_ctx->error);
+
+        symtable_truncate(num_symbols);
+        asm_ctx->last_label = last_label;
+
+        /* the kept lines own their expressions, what is left is from this line */
+        for(size_t a = 0; a < MAX_INSTRUCTIONS; a++)
+        {
+            expression_free(asm_ctx->unresolved_src[a]);
+            expression_free(asm_ctx->unresolved_dest[a]);
+            asm_ctx->unresolved_src[a] = asm_ctx->unresolved_dest[a] = NULL;
+        }
+        for(size_t a = start; a <= asm_ctx->curr_op && a < MAX_INSTRUCTIONS; a++)
+        {
+            memset(&asm_ctx->program[a], 0, sizeof(instruction_t));
+            memset(&asm_ctx->flags[a], 0, sizeof(flags_t));
+        }
+        asm_ctx->curr_op = start;
+        return NULL;
+    }
+
+    line_record_t* r = build_line(inc, line, scope, first);
+    asm_ctx->error_jmp = build_jmp;
+    return r;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Compares the labels @param a and @param b by name, then by    *
+*   line, for qsort().                                            *
+*                                                                 *
+\*****************************************************************/
+static int compare_uses(const void* a, const void* b)
+{
+    const incremental_symbol_t* x = a;
+    const incremental_symbol_t* y = b;
+    int c = strcmp(x->name, y->name);
+    if(c)
+        return c;
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Adds the labels of @param exp on @param line to the           *
+*   references.                                                   *
+*                                                                 *
+\*****************************************************************/
+static void index_references(incremental_t* inc, const expression_t* exp, size_t line)
+{
+    for(; exp; exp = exp->next)
+    {
+        if(exp->type & EXP_LABEL)
+        {
+            incremental_symbol_t s = { exp->data.label, line };
+            vecincsymbol_push_back(&inc->references, s);
+        }
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Indexes the labels the lines of the build define and use.     *
+*                                                                 *
+\*****************************************************************/
+static void index_source(incremental_t* inc)
+{
+    for(size_t i = 0; i < inc->source.size; i++)
+    {
+        const incremental_line_t* l = &inc->source.element[i];
+        const line_record_t* r = l->record;
+
+        for(size_t j = 0; j < r->num_labels; j++)
+        {
+            incremental_symbol_t s = { r->labels[j].name, l->line };
+            vecincsymbol_push_back(&inc->definitions, s);
+        }
+
+        for(size_t j = 0; j < r->count; j++)
+        {
+            index_references(inc, r->dest[j], l->line);
+            index_references(inc, r->src[j], l->line);
+        }
+    }
+
+    qsort(inc->definitions.element, inc->definitions.size, sizeof(incremental_symbol_t), compare_uses);
+    qsort(inc->references.element, inc->references.size, sizeof(incremental_symbol_t), compare_uses);
+}
+
+/*****************************************************************************************\
+*                                                                                         *
+*   Assembles the @param len bytes of @param src into asm_ctx, parsing only the lines     *
+*   @param inc did not see before and evaluating only the fixups that changed.            *
+*   @return NULL or the error, asm_ctx->error_line is its line                            *
+*                                                                                         *
+\*****************************************************************************************/
+const char* incremental_build(incremental_t* inc, const char* src, size_t len)
+{
+    jmp_buf error_jmp;
+    jmp_buf* caller = asm_ctx->error_jmp;
+    FILE* volatile file = NULL;
+    pair_t* volatile symbols = NULL;
+    volatile size_t num_symbols = 0;
+
+    asm_ctx->error_jmp = &error_jmp;
+    *asm_ctx->error = 0;
+    if(setjmp(error_jmp))
+    {
+        if(file)
+            fclose(file);
+        for(size_t i = 0; i < num_symbols; i++)
+            free((char*)symbols[i].string);
+        free(symbols);
+        parse_abort();
+
+        vecincline_clear(&inc->source);
+        vecincsymbol_clear(&inc->definitions);
+        vecincsymbol_clear(&inc->references);
+        free_retired(inc);
+        asm_ctx->error_jmp = caller;
+        return asm_ctx->error;
+    }
+
+    clear_build(inc);
+    free_retired(inc);
+    inc->build++;
+    inc->lines = inc->parsed = inc->fixups = inc->evaluated = 0;
+
+    line_record_t* record_at[MAX_INSTRUCTIONS] = { 0 };
+    u16 index_at[MAX_INSTRUCTIONS];
+    size_t line_at[MAX_INSTRUCTIONS];
+
+    if(!(file = fmemopen((void*)src, len, "r")))
+        sys_error("can't read the source");
+
+    parse_begin();
+    asm_ctx->must_fit_in = MAX_INSTRUCTIONS;
+    asm_ctx->clkfreq = 0;
+    asm_ctx->clkreg = 0x6F;
+
+    int     comment_on = 0;
+    size_t  linesz;
+    while(!feof(file))
+    {
+        asm_ctx->line_num++;
+        char* line = read_line(file, &linesz, &comment_on);
+        const char* scope = asm_ctx->last_label ? asm_ctx->last_label : "";
+
+        size_t first = asm_ctx->curr_op;
+        line_record_t* r = inc->keep_going ? build_line_or_error(inc, line, scope, &first)
+                                           : build_line(inc, line, scope, &first);
+        inc->lines++;
+        if(!r)
+            continue;
+
+        r->used = inc->build;
+        incremental_line_t l = { asm_ctx->line_num, r, first };
+        vecincline_push_back(&inc->source, l);
+        for(size_t i = 0; i < r->count && first + i < MAX_INSTRUCTIONS; i++)
+        {
+            record_at[first + i] = r;
+            index_at[first + i] = i;
+            line_at[first + i] = asm_ctx->line_num;
+        }
+    }
+    fclose(file);
+    file = NULL;
+    free(asm_ctx->file); /* the fixups aren't on the line of the last marker */
+    asm_ctx->file = NULL;
+
+    size_t num_mapped = snapshot_count();
+    num_symbols = asm_ctx->symtable.size + num_mapped;
+    if(!(symbols = malloc((num_symbols + 1) * sizeof(pair_t))))
+        fatal("out of memory");
+    for(size_t i = 0; i < asm_ctx->symtable.size; i++)
+    {
+        symbols[i].value = asm_ctx->symtable.element[i].value;
+        if(!(symbols[i].string = strdup(asm_ctx->symtable.element[i].string)))
+            fatal("out of memory");
+    }
+    for(size_t i = 0; i < num_mapped; i++)
+    {
+        const char* name;
+        pair_t* p = &symbols[asm_ctx->symtable.size + i];
+        p->value = snapshot_symbol(i, &name)->value;
+        if(!(p->string = strdup(name)))
+            fatal("out of memory");
+    }
+    qsort(symbols, num_symbols, sizeof(pair_t), compare_symbols);
+
+    symbols_t now = { symbols, num_symbols };
+    symbols_t before = { inc->symbols, inc->num_symbols };
+    for(size_t a = 0; a < MAX_INSTRUCTIONS; a++)
+    {
+        const line_record_t* r = record_at[a];
+        if(!asm_ctx->flags[a].valid || !r)
+            continue;
+
+        const expression_t* src_exp = r->src[index_at[a]];
+        const expression_t* dest_exp = r->dest[index_at[a]];
+        if(!src_exp && !dest_exp)
+            continue;
+
+        inc->fixups++;
+        if(inc->record_at[a] == r && inc->index_at[a] == index_at[a] &&
+           labels_unchanged(src_exp, &now, &before) && labels_unchanged(dest_exp, &now, &before))
+        {
+            asm_ctx->program[a] = inc->resolved[a];
+            continue;
+        }
+
+        inc->evaluated++;
+        const expression_t* failed = NULL;
+        const char* errmsg = NULL;
+        if(asm_ctx->flags[a].raw_command)
+            errmsg = resolve(failed = src_exp, &now, a, asm_ctx->flags[a].raw_command);
+        else
+        {
+            if(dest_exp)
+                errmsg = resolve(failed = dest_exp, &now, a, FIELD_DEST);
+            if(src_exp && !errmsg)
+                errmsg = resolve(failed = src_exp, &now, a, FIELD_SRC);
+        }
+
+        if(errmsg)
+        {
+            const char* label = unknown_label(failed, &now);
+            asm_ctx->line_num = line_at[a];
+            if(!inc->keep_going && label)
+                fatal("line %lu: unknown label %s", line_at[a], label);
+            else if(!inc->keep_going)
+                fatal("line %lu: error resolving an expression: %s", line_at[a], errmsg);
+            else if(label)
+                add_error(inc, line_at[a], "line %lu: unknown label %s", (ulong)line_at[a], label);
+            else
+                add_error(inc, line_at[a], "line %lu: error resolving an expression: %s", (ulong)line_at[a], errmsg);
+        }
+    }
+
+    ulong clkreg;
+    if(lookup(&now, "_CLKREG", &clkreg))
+        asm_ctx->clkreg = clkreg;
+
+    fini_symtable();
+    asm_ctx->num_ops = count_instructions();
+    asm_ctx->line_num = 0;
+
+    for(size_t a = 0; a < MAX_INSTRUCTIONS; a++)
+        inc->record_at[a] = record_at[a] && !record_at[a]->reparse ? record_at[a] : NULL;
+    memcpy(inc->index_at, index_at, sizeof(index_at));
+    memcpy(inc->resolved, asm_ctx->program, sizeof(inc->resolved));
+    free_symbols(inc);
+    inc->symbols = symbols;
+    inc->num_symbols = num_symbols;
+    index_source(inc);
+
+    /* lines that are gone */
+    for(size_t b = 0; b < inc->num_buckets; b++)
+    {
+        for(line_record_t** p = &inc->buckets[b]; *p; )
+        {
+            line_record_t* r = *p;
+            if(r->used == inc->build)
+            {
+                p = &r->next;
+                continue;
+            }
+            *p = r->next;
+            inc->num_records--;
+            free_record(r);
+        }
+    }
+
+    asm_ctx->error_jmp = caller;
+    return NULL;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return the last line of the last build up to @param line     *
+*   or NULL.                                                      *
+*                                                                 *
+\*****************************************************************/
+static const incremental_line_t* find_line(incremental_t* inc, size_t line)
+{
+    size_t lo = 0, hi = inc->source.size;
+    while(lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if(inc->source.element[mid].line <= line)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo ? &inc->source.element[lo - 1] : NULL;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return the first of the labels @param uses sorted by name    *
+*   that is not before @param name.                               *
+*                                                                 *
+\*****************************************************************/
+static size_t lower_bound(const vecincsymbol* uses, const char* name)
+{
+    size_t lo = 0, hi = uses->size;
+    while(lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if(strcmp(uses->element[mid].name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return the global label local labels on @param line of the   *
+*   last build belong to, "" if there is none.                    *
+*                                                                 *
+\*****************************************************************/
+const char* incremental_scope(incremental_t* inc, size_t line)
+{
+    const incremental_line_t* l = find_line(inc, line);
+    if(!l)
+        return "";
+
+    if(l->line == line || l->record->scope_label == l->record->num_labels)
+        return l->record->scope;
+    return l->record->labels[l->record->scope_label].name;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Finds the label @param name of the last build.                *
+*   @param line gets the line defining it, @param value its value *
+*   @return 1 if it was found, 0 otherwise                        *
+*                                                                 *
+\*****************************************************************/
+int incremental_definition(incremental_t* inc, const char* name, size_t* line, ulong* value)
+{
+    size_t i = lower_bound(&inc->definitions, name);
+    if(i == inc->definitions.size || strcmp(inc->definitions.element[i].name, name))
+        return 0;
+
+    symbols_t now = { inc->symbols, inc->num_symbols };
+    *line = inc->definitions.element[i].line;
+    return lookup(&now, name, value);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Finds the lines of the last build that use the label          *
+*   @param name, @param refs gets the first of them.              *
+*   @return number of uses                                        *
+*                                                                 *
+\*****************************************************************/
+size_t incremental_references(incremental_t* inc, const char* name, const incremental_symbol_t** refs)
+{
+    const incremental_symbol_t* r = inc->references.element;
+    size_t lo = lower_bound(&inc->references, name);
+    size_t num = 0;
+    while(lo + num < inc->references.size && !strcmp(r[lo + num].name, name))
+        num++;
+
+    *refs = r + lo;
+    return num;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Finds the first instruction on @param line of the last build. *
+*   @param addr gets its address, @param op what it assembled to  *
+*   and @param flags its flags.                                   *
+*   @return 1 if the line has one, 0 otherwise                    *
+*                                                                 *
+\*****************************************************************/
+int incremental_instruction(incremental_t* inc, size_t line, size_t* addr, instruction_t* op, flags_t* flags)
+{
+    const incremental_line_t* l = find_line(inc, line);
+    if(!l || l->line != line || !l->record->count || l->first >= MAX_INSTRUCTIONS)
+        return 0;
+
+    *addr = l->first;
+    *op = inc->resolved[l->first];
+    *flags = l->record->flags[0];
+    return 1;
+}
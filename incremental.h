@@ -0,0 +1,71 @@
+#ifndef INCREMENTAL_H_INCLUDED
+#define INCREMENTAL_H_INCLUDED
+#include "types.h"
+#include "containers.h"
+#include <stdlib.h>
+
+typedef struct line_record line_record_t;
+
+typedef struct
+{
+    size_t          line;
+    line_record_t*  record;
+    size_t          first; /* address of its first instruction */
+} incremental_line_t;
+
+typedef struct
+{
+    size_t  line;
+    char*   message;
+} incremental_error_t;
+
+/* a label defined or used on a line */
+typedef struct
+{
+    const char* name;
+    size_t      line;
+} incremental_symbol_t;
+
+VECTOR_DECLARE(vecincline, incremental_line_t);
+VECTOR_DECLARE(vecincerror, incremental_error_t);
+VECTOR_DECLARE(vecincsymbol, incremental_symbol_t);
+
+/* keeps the parse of every line between builds of the same source, for --watch */
+typedef struct
+{
+    line_record_t** buckets; /* line records by the hash of their text and scope */
+    size_t          num_buckets;
+    size_t          num_records;
+    line_record_t*  retired; /* records of lines with directives, freed by the next build */
+    size_t          build; /* number of the current build */
+
+    /* what the last build left at every address, to skip fixups that did not change */
+    line_record_t*  record_at[MAX_INSTRUCTIONS];
+    u16             index_at[MAX_INSTRUCTIONS]; /* instruction of the record */
+    instruction_t   resolved[MAX_INSTRUCTIONS];
+    pair_t*         symbols; /* sorted by name */
+    size_t          num_symbols;
+
+    u8              keep_going; /* errors of a line go into errors and the build goes on */
+    vecincerror     errors;
+
+    /* the lines of the last build and the labels they define and use, sorted by name */
+    vecincline      source;
+    vecincsymbol    definitions;
+    vecincsymbol    references;
+
+    /* what the last build did */
+    size_t          lines;
+    size_t          parsed; /* lines that were not parsed before */
+    size_t          fixups;
+    size_t          evaluated; /* fixups whose line or labels changed */
+} incremental_t;
+
+incremental_t* incremental_new();
+void incremental_free(incremental_t* inc);
+const char* incremental_build(incremental_t* inc, const char* src, size_t len);
+const char* incremental_scope(incremental_t* inc, size_t line);
+int incremental_definition(incremental_t* inc, const char* name, size_t* line, ulong* value);
+size_t incremental_references(incremental_t* inc, const char* name, const incremental_symbol_t** refs);
+int incremental_instruction(incremental_t* inc, size_t line, size_t* addr, instruction_t* op, flags_t* flags);
+#endif // INCREMENTAL_H_INCLUDED
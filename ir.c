@@ -0,0 +1,537 @@
+#include "ir.h"
+#include "parse.h"
+#include "opcodes.h"
+#include "expression.h"
+#include "stringext.h"
+#include "symmap.h"
+#include "snapshot.h"
+#include "context.h"
+#include "util.h"
+#include <string.h>
+#include <setjmp.h>
+
+/*
+Code generators can hand ppasm a binary IR instead of PASM text, it is loaded straight into
+the program and only its expressions are resolved and encoded, nothing is tokenized or
+looked up by name. --dump-ir writes the IR of a source, what it loads gives the same image
+as the source.
+
+All numbers are unsigned LEB128 varints unless told otherwise:
+
+    "\177PIR"                           magic, 4 bytes
+    version clkfreq fit                 fit is the FIT argument, 512 if there's none
+    symbols, then one per symbol:
+        flags value length name         IR_SYMBOL_DEFINED, IR_SYMBOL_CONSTANT, the name
+                                        is length bytes, without a 0
+    records, one byte tells which:
+        IR_ORG address                  the next record goes to address
+        IR_OP opcode zcri dest src      opcode is one byte, the index in the opcodes[]
+                                        table, zcri one byte: the condition in the high
+                                        nibble, then z c r i. The default flags and the
+                                        predefined src of the opcode aren't added.
+        IR_LONG command long operand    command is one byte, the raw command 1-7 of
+                                        flags_t, long the value of the other bytes
+        IR_DATA flags count longs...    count longs of 4 bytes, little endian, that are
+                                        used as they are, IR_DATA_FILE if FILE copied them
+        IR_END
+    operands, one byte tells which:
+        IR_CONSTANT value
+        IR_SYMBOL symbol                the number of the symbol in the table, from 0
+        IR_EXPRESSION count terms...    a term is one byte of the operator, + - * /,
+                                        or'ed with IR_TERM_SYMBOL if its value is the
+                                        number of a symbol, then the value
+
+Every record but IR_ORG takes the address after the one before. A symbol that isn't
+IR_SYMBOL_DEFINED is only referenced, using it is an error when the IR is resolved.
+*/
+
+/* names of the IR being written and their numbers */
+typedef struct
+{
+    const char**    names;
+    u8*             flags;
+    size_t          size;
+    u32*            buckets; /* number of the name + 1, 0 if free */
+    size_t          num_buckets;
+} symbols_t;
+
+static u32 name_hash(const char* name)
+{
+    return (u32)hash_fnv1a(name, strlen(name), FNV_OFFSET);
+}
+
+/*****************************************************************\
+*   @return the number of @param name in @param s, -1 if it has   *
+*   none                                                          *
+\*****************************************************************/
+static long symbol_find(const symbols_t* s, const char* name)
+{
+    if(!s->num_buckets)
+        return -1;
+    for(size_t b = name_hash(name) & (s->num_buckets - 1); s->buckets[b]; b = (b + 1) & (s->num_buckets - 1))
+        if(!strcmp(s->names[s->buckets[b] - 1], name))
+            return s->buckets[b] - 1;
+    return -1;
+}
+
+/*****************************************************************\
+*   Adds @param name to @param s if it isn't in it yet            *
+*   @return its number                                            *
+\*****************************************************************/
+static size_t symbol_add(symbols_t* s, const char* name)
+{
+    long i = symbol_find(s, name);
+    if(i >= 0)
+        return i;
+
+    if((s->size + 1) * 2 > s->num_buckets)
+    {
+        size_t num_buckets = s->num_buckets ? s->num_buckets * 2 : 64;
+        const char** names = realloc(s->names, num_buckets / 2 * sizeof(char*));
+        u8* flags = realloc(s->flags, num_buckets / 2);
+        u32* buckets = calloc(num_buckets, sizeof(u32));
+        if(names)
+            s->names = names;
+        if(flags)
+            s->flags = flags;
+        if(!names || !flags || !buckets)
+            fatal("out of memory");
+
+        free(s->buckets);
+        s->buckets = buckets;
+        s->num_buckets = num_buckets;
+        for(size_t n = 0; n < s->size; n++)
+        {
+            size_t b = name_hash(s->names[n]) & (num_buckets - 1);
+            while(buckets[b])
+                b = (b + 1) & (num_buckets - 1);
+            buckets[b] = n + 1;
+        }
+    }
+
+    size_t b = name_hash(name) & (s->num_buckets - 1);
+    while(s->buckets[b])
+        b = (b + 1) & (s->num_buckets - 1);
+    s->buckets[b] = s->size + 1;
+    s->names[s->size] = name;
+    s->flags[s->size] = 0;
+    return s->size++;
+}
+
+static void symbols_free(symbols_t* s)
+{
+    free(s->names);
+    free(s->flags);
+    free(s->buckets);
+    free(s);
+}
+
+static void put_varint(FILE* out, u64 value)
+{
+    for(; value >= 0x80; value >>= 7)
+        putc((value & 0x7F) | 0x80, out);
+    putc(value, out);
+}
+
+/*****************************************************************\
+*   Writes the operand @param exp with the names of @param s,     *
+*   @param constant is the value of a field without one           *
+\*****************************************************************/
+static void put_operand(FILE* out, const symbols_t* s, const expression_t* exp, ulong constant)
+{
+    if(!exp || (!exp->next && (exp->type & EXP_NUMBER) && (exp->type & 0x3F) == '+'))
+    {
+        putc(IR_CONSTANT, out);
+        put_varint(out, exp ? exp->data.number : constant);
+    }
+    else if(!exp->next && (exp->type & EXP_LABEL) && (exp->type & 0x3F) == '+')
+    {
+        putc(IR_SYMBOL, out);
+        put_varint(out, symbol_find(s, exp->data.label));
+    }
+    else
+    {
+        size_t count = 0;
+        for(const expression_t* e = exp; e; e = e->next)
+            count++;
+        putc(IR_EXPRESSION, out);
+        put_varint(out, count);
+        for(; exp; exp = exp->next)
+        {
+            putc((exp->type & 0x3F) | (exp->type & EXP_LABEL ? IR_TERM_SYMBOL : 0), out);
+            put_varint(out, exp->type & EXP_LABEL ? (ulong)symbol_find(s, exp->data.label) : exp->data.number);
+        }
+    }
+}
+
+static void add_labels(symbols_t* s, const expression_t* exp)
+{
+    for(; exp; exp = exp->next)
+        if(exp->type & EXP_LABEL)
+            symbol_add(s, exp->data.label);
+}
+
+/*****************************************************************\
+*   Parses the @param len bytes of the source @param src and      *
+*   writes its IR into @param out                                 *
+\*****************************************************************/
+void ir_write(const char* src, size_t len, FILE* out)
+{
+    FILE* file = fmemopen((void*)src, len, "r");
+    symbols_t* s = calloc(1, sizeof(symbols_t));
+    if(!file || !s)
+        sys_error("can't read the source");
+
+    ERROR_FRAME(fclose(file); symbols_free(s); parse_abort();)
+
+    parse_begin();
+    int     comment_on = 0;
+    size_t  linesz;
+    while(!feof(file))
+    {
+        asm_ctx->line_num++;
+        parse_line(read_line(file, &linesz, &comment_on));
+    }
+    free(asm_ctx->file);
+    asm_ctx->file = NULL;
+    asm_ctx->line_num = 0;
+
+    /* the symbol table keeps its order, the map of -m lists it in it */
+    for(size_t i = 0; i < asm_ctx->symtable.size; i++)
+    {
+        size_t n = symbol_add(s, asm_ctx->symtable.element[i].string);
+        s->flags[n] = IR_SYMBOL_DEFINED;
+    }
+    for(size_t i = 0, num = snapshot_count(); i < num; i++)
+    {
+        const char* name;
+        const snapshot_entry_t* e = snapshot_symbol(i, &name);
+        size_t n = symbol_add(s, name);
+        s->flags[n] = IR_SYMBOL_DEFINED | (e->constant ? IR_SYMBOL_CONSTANT : 0);
+    }
+    size_t num_defined = s->size;
+    for(size_t i = 0; i < asm_ctx->symmap.constants.size; i++)
+    {
+        long n = symbol_find(s, asm_ctx->symmap.constants.element[i].name);
+        if(n >= 0)
+            s->flags[n] |= IR_SYMBOL_CONSTANT;
+    }
+    for(unsigned i = 0; i < MAX_INSTRUCTIONS; i++)
+    {
+        add_labels(s, asm_ctx->unresolved_dest[i]);
+        add_labels(s, asm_ctx->unresolved_src[i]);
+    }
+
+    int opcode_index[64];
+    for(unsigned i = 0; i < 64; i++)
+        opcode_index[i] = -1;
+    for(unsigned i = NUM_OPCODES; i--;)
+        opcode_index[opcodes[i].value] = i; /* the first one of the value */
+
+    fwrite(IR_MAGIC, 1, IR_MAGIC_SIZE, out);
+    put_varint(out, IR_VERSION);
+    put_varint(out, asm_ctx->clkfreq);
+    put_varint(out, asm_ctx->must_fit_in);
+    put_varint(out, s->size);
+    for(size_t i = 0; i < s->size; i++)
+    {
+        ulong value = 0;
+        if(i < num_defined)
+            symtable_lookup(s->names[i], &value);
+        put_varint(out, s->flags[i]);
+        put_varint(out, value);
+        put_varint(out, strlen(s->names[i]));
+        fputs(s->names[i], out);
+    }
+
+    size_t next = 0;
+    for(size_t i = 0; i < MAX_INSTRUCTIONS; i++)
+    {
+        if(!asm_ctx->flags[i].valid)
+            continue;
+        if(i != next)
+        {
+            putc(IR_ORG, out);
+            put_varint(out, i);
+        }
+
+        const instruction_t* op = &asm_ctx->program[i];
+        if(asm_ctx->flags[i].data)
+        {
+            size_t count = 1;
+            while(i + count < MAX_INSTRUCTIONS && asm_ctx->flags[i + count].valid && asm_ctx->flags[i + count].data)
+                count++;
+            putc(IR_DATA, out);
+            put_varint(out, IR_DATA_FILE);
+            put_varint(out, count);
+            for(size_t n = 0; n < count; n++)
+            {
+                u32 value = op[n].raw;
+                u8 bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+                fwrite(bytes, 1, 4, out);
+            }
+            i += count - 1;
+        }
+        else if(asm_ctx->flags[i].raw_command)
+        {
+            putc(IR_LONG, out);
+            putc(asm_ctx->flags[i].raw_command, out);
+            put_varint(out, op->raw);
+            put_operand(out, s, asm_ctx->unresolved_src[i], 0);
+        }
+        else
+        {
+            if(opcode_index[op->data.opcode] < 0)
+                fatal("no opcode has the value %u", op->data.opcode);
+            putc(IR_OP, out);
+            putc(opcode_index[op->data.opcode], out);
+            putc(op->data.cond << 4 | op->data.z << 3 | op->data.c << 2 | op->data.r << 1 | op->data.imm, out);
+            put_operand(out, s, asm_ctx->unresolved_dest[i], op->data.dest | op->data.desth << 8);
+            put_operand(out, s, asm_ctx->unresolved_src[i], op->data.src | op->data.srch << 8);
+        }
+        next = i + 1;
+    }
+    putc(IR_END, out);
+
+    ERROR_FRAME_END();
+    fclose(file);
+    symbols_free(s);
+    parse_abort();
+    if(ferror(out))
+        sys_error("error writing the IR");
+}
+
+/*****************************************************************\
+*   @return 1 if the @param len bytes of @param src are an IR,    *
+*   not a source                                                  *
+\*****************************************************************/
+int ir_detect(const char* src, size_t len)
+{
+    return len >= IR_MAGIC_SIZE && !memcmp(src, IR_MAGIC, IR_MAGIC_SIZE);
+}
+
+/* the IR being loaded */
+typedef struct
+{
+    const u8*   pos;
+    const u8*   end;
+    const u8**  names; /* of the symbols, they aren't 0 terminated */
+    size_t*     lengths;
+    size_t      num_symbols;
+} reader_t;
+
+static u8 get_byte(reader_t* r)
+{
+    if(r->pos == r->end)
+        fatal("the IR is truncated");
+    return *r->pos++;
+}
+
+static u64 get_varint(reader_t* r)
+{
+    u64 value = 0;
+    for(unsigned shift = 0; shift < 64; shift += 7)
+    {
+        u8 b = get_byte(r);
+        value |= (u64)(b & 0x7F) << shift;
+        if(!(b & 0x80))
+            return value;
+    }
+    fatal("the IR has a number of more than 64 bits");
+    return 0;
+}
+
+/*****************************************************************\
+*   @return a new term of the value @param value or the symbol    *
+*   number @param value with the operator @param op               *
+\*****************************************************************/
+static expression_t* get_term(reader_t* r, u8 op, int symbol, u64 value)
+{
+    expression_t* exp = malloc(sizeof(expression_t));
+    if(!exp)
+        fatal("out of memory");
+    exp->next = NULL;
+    exp->type = op;
+    if(!symbol)
+    {
+        exp->type |= EXP_NUMBER;
+        exp->data.number = value;
+        return exp;
+    }
+
+    exp->type |= EXP_LABEL;
+    exp->data.label = value < r->num_symbols ? strndup((const char*)r->names[value], r->lengths[value]) : NULL;
+    if(!exp->data.label)
+    {
+        free(exp);
+        if(value < r->num_symbols)
+            fatal("out of memory");
+        fatal("the IR references symbol %lu, it has %lu", (ulong)value, (ulong)r->num_symbols);
+    }
+    return exp;
+}
+
+/*****************************************************************\
+*   Reads an operand into @param exp, a constant goes into        *
+*   @param field of @param op if @param op isn't NULL             *
+\*****************************************************************/
+static void get_operand(reader_t* r, expression_t** exp, instruction_t* op, u8 field)
+{
+    u8 kind = get_byte(r);
+    if(kind == IR_CONSTANT)
+    {
+        u64 value = get_varint(r);
+        if(op)
+            expression_apply(op, field, value);
+        else
+            *exp = get_term(r, '+', 0, value);
+    }
+    else if(kind == IR_SYMBOL)
+        *exp = get_term(r, '+', 1, get_varint(r));
+    else if(kind == IR_EXPRESSION)
+    {
+        /* every term is in the program as soon as it is read, parse_abort() frees them on errors */
+        for(u64 count = get_varint(r); count; count--)
+        {
+            u8 b = get_byte(r);
+            if(!is_valid_operator(b & ~IR_TERM_SYMBOL))
+                fatal("the IR has an unknown operator %u", b & ~IR_TERM_SYMBOL);
+            *exp = get_term(r, b & ~IR_TERM_SYMBOL, b & IR_TERM_SYMBOL, get_varint(r));
+            exp = &(*exp)->next;
+        }
+    }
+    else
+        fatal("the IR has an unknown operand %u", kind);
+}
+
+/*****************************************************************\
+*   Loads the @param len bytes of the IR @param ir into asm_ctx,  *
+*   resolves it and frees its symbol table like parse()           *
+\*****************************************************************/
+void ir_load(const char* ir, size_t len)
+{
+    reader_t r = { (const u8*)ir + IR_MAGIC_SIZE, (const u8*)ir + len, NULL, NULL, 0 };
+    parse_begin();
+
+    u64 version = get_varint(&r);
+    if(version != IR_VERSION)
+        fatal("the IR is version %lu, this ppasm reads version %u", (ulong)version, IR_VERSION);
+    asm_ctx->clkfreq = get_varint(&r);
+    u64 fit = get_varint(&r);
+    asm_ctx->must_fit_in = fit < MAX_INSTRUCTIONS ? fit : MAX_INSTRUCTIONS;
+
+    /* a symbol has 3 bytes at least, a broken count doesn't allocate the memory */
+    u64 num_symbols = get_varint(&r);
+    if(num_symbols > (u64)(r.end - r.pos) / 3)
+        fatal("the IR is truncated");
+    r.num_symbols = num_symbols;
+    r.names = malloc(num_symbols * sizeof(u8*) + 1);
+    r.lengths = malloc(num_symbols * sizeof(size_t) + 1);
+    if(!r.names || !r.lengths)
+    {
+        free(r.names);
+        free(r.lengths);
+        fatal("out of memory");
+    }
+
+    /* the names point into the IR, only the arrays are freed on errors */
+    ERROR_FRAME(free(r.names); free(r.lengths);)
+
+    for(size_t i = 0; i < r.num_symbols; i++)
+    {
+        u8 flags = get_varint(&r);
+        pair_t label = { NULL, get_varint(&r) };
+        u64 length = get_varint(&r);
+        if(length > (u64)(r.end - r.pos))
+            fatal("the IR is truncated");
+        r.names[i] = r.pos;
+        r.lengths[i] = length;
+        r.pos += length;
+
+        if(flags & IR_SYMBOL_DEFINED)
+        {
+            if(!(label.string = strndup((const char*)r.names[i], length)))
+                fatal("out of memory");
+            if(symtable_find(label.string) != asm_ctx->symtable.size)
+            {
+                free((char*)label.string);
+                fatal("the IR defines symbol %.*s twice", (int)length, (const char*)r.names[i]);
+            }
+            symtable_add(label);
+            if(flags & IR_SYMBOL_CONSTANT)
+                symmap_constant(label.string);
+        }
+    }
+
+    for(;;)
+    {
+        u8 kind = get_byte(&r);
+        if(kind == IR_END)
+            break;
+        if(kind == IR_ORG)
+        {
+            u64 addr = get_varint(&r);
+            if(addr > MAX_INSTRUCTIONS)
+                fatal("the IR has ORG %lu, a cog has %u longs", (ulong)addr, MAX_INSTRUCTIONS);
+            asm_ctx->curr_op = addr;
+            continue;
+        }
+
+        if(asm_ctx->curr_op > asm_ctx->must_fit_in || asm_ctx->curr_op >= MAX_INSTRUCTIONS)
+            fatal("program doesn't fit in %u longs", asm_ctx->must_fit_in);
+
+        size_t i = asm_ctx->curr_op;
+        instruction_t* op = &asm_ctx->program[i];
+        if(kind == IR_OP)
+        {
+            u8 opcode = get_byte(&r);
+            if(opcode >= NUM_OPCODES)
+                fatal("the IR has opcode %u, there are %u", opcode, NUM_OPCODES);
+            u8 zcri = get_byte(&r);
+            op->data.opcode = opcodes[opcode].value;
+            op->data.cond = zcri >> 4;
+            op->data.z = zcri >> 3;
+            op->data.c = zcri >> 2;
+            op->data.r = zcri >> 1;
+            op->data.imm = zcri;
+            get_operand(&r, &asm_ctx->unresolved_dest[i], op, FIELD_DEST);
+            get_operand(&r, &asm_ctx->unresolved_src[i], op, FIELD_SRC);
+            asm_ctx->flags[i].valid = 1;
+            asm_ctx->curr_op++;
+        }
+        else if(kind == IR_LONG)
+        {
+            u8 command = get_byte(&r);
+            if(!command || command > 7)
+                fatal("the IR has raw command %u, they are 1-7", command);
+            op->raw = get_varint(&r);
+            asm_ctx->flags[i].raw_command = command;
+            get_operand(&r, &asm_ctx->unresolved_src[i], NULL, 0);
+            asm_ctx->flags[i].valid = 1;
+            asm_ctx->curr_op++;
+        }
+        else if(kind == IR_DATA)
+        {
+            u64 flags = get_varint(&r);
+            u64 count = get_varint(&r);
+            if(i + count > asm_ctx->must_fit_in || i + count > MAX_INSTRUCTIONS)
+                fatal("program doesn't fit in %u longs", asm_ctx->must_fit_in);
+            if(count * 4 > (u64)(r.end - r.pos))
+                fatal("the IR is truncated");
+            for(size_t n = 0; n < count; n++, r.pos += 4)
+            {
+                op[n].raw = r.pos[0] | r.pos[1] << 8 | r.pos[2] << 16 | (u32)r.pos[3] << 24;
+                asm_ctx->flags[i + n].valid = 1;
+                asm_ctx->flags[i + n].data = flags & IR_DATA_FILE;
+            }
+            asm_ctx->curr_op += count;
+        }
+        else
+            fatal("the IR has an unknown record %u", kind);
+    }
+
+    ERROR_FRAME_END();
+    free(r.names);
+    free(r.lengths);
+    parse_end();
+}
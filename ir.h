@@ -0,0 +1,32 @@
+#ifndef IR_H_INCLUDED
+#define IR_H_INCLUDED
+#include "types.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define IR_MAGIC "\177PIR" /* no source begins with it */
+#define IR_MAGIC_SIZE 4
+#define IR_VERSION 1
+#define IR_EXTENSION ".pir"
+
+/* records, the first byte of each */
+#define IR_END 0 /* after the last record */
+#define IR_ORG 1 /* address: the next record goes there */
+#define IR_OP 2 /* opcode index, condition and zcri, dest and src operands */
+#define IR_LONG 3 /* raw command 1-7, the long it goes into and the operand */
+#define IR_DATA 4 /* flags, number of longs and the longs, little endian */
+
+/* operands, the first byte of each */
+#define IR_CONSTANT 0 /* value */
+#define IR_SYMBOL 1 /* number of the symbol */
+#define IR_EXPRESSION 2 /* number of terms, then operator and value or symbol of each */
+
+#define IR_SYMBOL_DEFINED 1 /* in the symbol table, not only referenced */
+#define IR_SYMBOL_CONSTANT 2 /* defined with equ or =, not a label */
+#define IR_TERM_SYMBOL 0x80 /* the term's value is the number of a symbol */
+#define IR_DATA_FILE 1 /* copied in by FILE */
+
+int ir_detect(const char* src, size_t len);
+void ir_write(const char* src, size_t len, FILE* out);
+void ir_load(const char* ir, size_t len);
+#endif // IR_H_INCLUDED
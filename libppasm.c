@@ -0,0 +1,132 @@
+#include "libppasm.h"
+#include "context.h"
+#include "parse.h"
+#include "assemble.h"
+#include "ir.h"
+#include <string.h>
+
+/* the library code reads these, the ppasm command line sets them */
+u8 opt_verbose = 0;
+u8 opt_raw = 0;
+u8 opt_eeprom = 0;
+const char* opt_variants = NULL;
+FILE* vfile;
+
+const syntax_t parallax_syntax =
+{
+    "'",
+    "{",
+    "}",
+    1,
+    1,
+    1,
+    '#',
+    ':'
+};
+
+const syntax_t c_syntax =
+{
+    "//",
+    "/*",
+    "*/",
+    2,
+    2,
+    2,
+    '$',
+    '.'
+};
+
+const syntax_t* syntax = &parallax_syntax; /* current syntax */
+
+/*****************************************************************\
+*                                                                 *
+*   @return a new assembler, NULL if out of memory                *
+*                                                                 *
+\*****************************************************************/
+ppasm_t* ppasm_new()
+{
+    return asm_context_new();
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Frees the assembler @param ctx                                *
+*                                                                 *
+\*****************************************************************/
+void ppasm_free(ppasm_t* ctx)
+{
+    asm_context_free(ctx);
+}
+
+/*************************************************************************************\
+*                                                                                     *
+*   Assembles the @param len bytes of @param src, a source or an IR, with @param ctx, *
+*   the image goes into @param out of @param outsz bytes and its size into            *
+*   @param imgsz. The program stays in @param ctx till the next call. @param options  *
+*   can be NULL.                                                                      *
+*   @return 0 or -1 on errors, ppasm_error() tells which                              *
+*                                                                                     *
+\*************************************************************************************/
+int ppasm_assemble(ppasm_t* ctx, const char* src, size_t len, const ppasm_options_t* options,
+                   unsigned char* out, size_t outsz, size_t* imgsz)
+{
+    static const ppasm_options_t defaults = { 0, 0 };
+    if(!options)
+        options = &defaults;
+
+    asm_context_t* caller = asm_ctx;
+    jmp_buf error_jmp;
+    asm_ctx = ctx;
+    ctx->error_jmp = &error_jmp;
+    *ctx->error = 0;
+    ctx->line_num = 0;
+
+    if(setjmp(error_jmp))
+    {
+        parse_abort();
+        ctx->error_jmp = NULL;
+        asm_ctx = caller;
+        return -1;
+    }
+
+    /* an IR is only resolved and encoded */
+    if(ir_detect(src, len))
+        ir_load(src, len);
+    else
+        parse_memory(src, len);
+    ctx->num_ops = count_instructions();
+    ctx->line_num = 0;
+
+    size_t size = PREAMBLE_SIZE + ctx->num_ops * 4;
+    if(options->eeprom)
+        size = EEPROM_SIZE;
+    else if(options->raw)
+        size -= PREAMBLE_SIZE;
+    if(options->eeprom && options->raw)
+        fatal("an eeprom image needs the propeller tool header");
+    if(size > outsz)
+        fatal("the image needs %lu bytes, the buffer has %lu", (ulong)size, (ulong)outsz);
+
+    u8 image[PREAMBLE_SIZE + MAX_INSTRUCTIONS * 4];
+    size_t sz = create_image(image);
+    if(options->eeprom)
+        create_eeprom(out, image, sz);
+    else
+        memcpy(out, options->raw ? image + PREAMBLE_SIZE : image, size);
+
+    *imgsz = size;
+    ctx->error_jmp = NULL;
+    asm_ctx = caller;
+    return 0;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return the error of the last ppasm_assemble() of @param ctx  *
+*                                                                 *
+\*****************************************************************/
+ppasm_error_t ppasm_error(const ppasm_t* ctx)
+{
+    ppasm_error_t e = { ctx->error, ctx->error_line };
+    return e;
+}
@@ -0,0 +1,32 @@
+#ifndef LIBPPASM_H_INCLUDED
+#define LIBPPASM_H_INCLUDED
+#include <stddef.h>
+
+/*
+libppasm assembles PASM sources held in memory into propeller images held in memory,
+without temporary files and without exiting on errors. Every ppasm_t can be used on a
+thread of its own at the same time as the others.
+*/
+
+#define PPASM_MAX_IMAGE 0x8000 /* an eeprom image, nothing is bigger */
+
+typedef struct asm_context ppasm_t;
+
+typedef struct
+{
+    int     raw; /* no propeller tool preamble, only the longs of the program */
+    int     eeprom; /* the 32K eeprom image instead of the binary */
+} ppasm_options_t;
+
+typedef struct
+{
+    const char* message;
+    size_t      line; /* line of the source, 0 if the error isn't about one */
+} ppasm_error_t;
+
+ppasm_t* ppasm_new();
+void ppasm_free(ppasm_t* ctx);
+int ppasm_assemble(ppasm_t* ctx, const char* src, size_t len, const ppasm_options_t* options,
+                   unsigned char* out, size_t outsz, size_t* imgsz);
+ppasm_error_t ppasm_error(const ppasm_t* ctx);
+#endif // LIBPPASM_H_INCLUDED
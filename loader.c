@@ -1,6 +1,14 @@
 #include "loader.h"
 #include "util.h"
 #include "assemble.h"
+#include "compress.h"
+#include "fingerprint.h"
+#include "containers.h"
+#include "lowlatency.h"
+#include "hotload.h"
+#include "monitor.h"
+#include "ring.h"
+#include "context.h"
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -15,6 +23,11 @@
 #include <string.h>
 #include <assert.h>
 #include <poll.h>
+#include <limits.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
 
 /*
 Thanks all the folks on parallax forum for documenting the serial protocol
@@ -25,22 +38,142 @@ I used the lfsr algorithm but split the recieve bit function and redid it with p
 efficency. It schould autmatically detect avalible data, so it schould improve the detection rate
 */
 
-static u8 lfsr = 'P'; /* lfsr to communicate with propeller, initialized with 'P' */
-static int fd; /* serial port file descriptor */
+#define PROBE_TIMEOUT 250 /* msec to wait for the answers to the handshake when looking for propellers */
+#define ANSWER_SIZE (HANDSHAKE_RX_SIZE + 8) /* the LFSR and the version bits */
+#define RESET_MS 25 /* safe default dtr pulse */
+#define SETTLE_MS 95 /* safe default wait after the reset */
+#define CALIBRATION_TRIES 5 /* handshakes in a row that have to work with the calibrated timing */
+#define CALIBRATION_MARGIN_MS 5
+#define ROM_IDLE_MS 100 /* the ROM booter gives up waiting for the command after about this */
+#define IMAGE_QUEUE_SIZE 0x4000
+#define EEPROM_PROGRAM_TIMEOUT 5000 /* msec the ROM may take to program all 32K of the EEPROM */
+#define EEPROM_VERIFY_TIMEOUT 2000 /* msec for reading it back */
+
+/* timings of the stages of a load in CLOCK_MONOTONIC nsec, see prop_write_telemetry() */
+typedef struct
+{
+    const char* device;
+    u32         command;
+    u8          version;
+    u8          ok;
+    u64         start;
+    u64         reset_ns; /* dtr pulse */
+    u64         settle_ns; /* wait after the reset */
+    u64         handshake_ns; /* sending the calibration and the lfsr */
+    u64         lfsr_ns; /* recieving the lfsr */
+    u64         version_ns;
+    u64         image_ns; /* streaming the image */
+    u64         checksum_ns; /* waiting for the checksum result */
+    u64         program_ns;
+    u64         verify_ns;
+    u64         image_bytes;
+    u64         serial_bytes; /* everything written to the serial port */
+    unsigned    pings; /* 0xF9 sent while waiting for an answer */
+    unsigned    retries; /* interrupted or partial reads, writes and polls */
+    int         latency_timer; /* msec of the adapter's latency timer during the load, -1 if unknown */
+    unsigned    fallbacks; /* handshakes repeated with the safe reset timing */
+    u64         untuned_ns; /* handshake before --low-latency tuned the tty, 0 if it wasn't timed */
+} load_stats_t;
+
+static load_stats_t stats;
+static int old_latency; /* msec of the adapter's latency timer before the load */
+static u64 image_hash; /* of the EEPROM image that is downloaded */
+
+/* the download runs on a loader thread while the main thread assembles, see prop_begin() */
+static int pipelined = 0;
+static pthread_t loader_thread;
+static ring_t image_queue; /* encoded image from prop_end() to the loader thread */
+static const char* pipeline_device;
+static u32 pipeline_command;
+static char pipeline_error[MAX_ERROR_STRING_SIZE]; /* of the loader thread, prop_end() reports it */
+static tty_tuning_t tuning = { "", -1, -1, -1 }; /* what --low-latency changed */
+static ulong reset_ms = RESET_MS; /* dtr pulse */
+static ulong settle_ms = SETTLE_MS; /* wait after the reset before the handshake */
+static int fd = -1; /* serial port file descriptor */
 static struct termios oldtio; /* saved serial port settings to restore after the use of serial port */
+static int serial_saved; /* oldtio holds the settings of fd */
+static int old_policy = -1; /* scheduling of the process before set_realtime_priority() */
+static struct sched_param old_sched;
 
 /*****************************************************************\
 *                                                                 *
-*   Returns least significant lfsr bit and iterates a step.       *
+*   Returns least significant bit of the lfsr @param state and    *
+*   iterates it a step.                                           *
 *                                                                 *
 \*****************************************************************/
-static unsigned lfsr_step()
+unsigned lfsr_step(u8* state)
 {
-    unsigned result = lfsr & 0x01;
-    lfsr = lfsr << 1 & 0xFE | (lfsr >> 7 ^ lfsr >> 5 ^ lfsr >> 4 ^ lfsr >> 1) & 1;
+    unsigned result = *state & 0x01;
+    *state = *state << 1 & 0xFE | (*state >> 7 ^ *state >> 5 ^ *state >> 4 ^ *state >> 1) & 1;
     return result;
 }
 
+/*******************************************************************************\
+*                                                                               *
+*   The handshake never changes: the LFSR is always seeded with 'P', so what    *
+*   is sent and the answer the propeller gives are constant. They were          *
+*   generated with lfsr_step(), test_lfsr() checks that they still match.       *
+*                                                                               *
+\*******************************************************************************/
+
+/* timing calibration, 250 bytes of LFSR data and 258 timing calibrations for the answer */
+const u8 handshake_tx[HANDSHAKE_TX_SIZE] =
+{
+    0xF9, 0xFE, 0xFF, 0xFE, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFF, 0xFE,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE, 0xFE, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE, 0xFF, 0xFE, 0xFF,
+    0xFE, 0xFE, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE, 0xFE, 0xFE, 0xFF, 0xFE, 0xFE, 0xFF, 0xFE,
+    0xFE, 0xFF, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE, 0xFF, 0xFE, 0xFE, 0xFE, 0xFF, 0xFE, 0xFE,
+    0xFE, 0xFF, 0xFF, 0xFE, 0xFF, 0xFF, 0xFE, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE, 0xFE, 0xFF, 0xFE, 0xFF,
+    0xFF, 0xFE, 0xFE, 0xFF, 0xFF, 0xFE, 0xFE, 0xFF, 0xFE, 0xFF, 0xFF, 0xFE, 0xFF, 0xFF, 0xFE, 0xFE,
+    0xFF, 0xFE, 0xFE, 0xFF, 0xFF, 0xFF, 0xFE, 0xFF, 0xFE, 0xFF, 0xFE, 0xFF, 0xFE, 0xFF, 0xFF, 0xFF,
+    0xFE, 0xFF, 0xFF, 0xFE, 0xFF, 0xFE, 0xFF, 0xFF, 0xFE, 0xFF, 0xFE, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE, 0xFF, 0xFF, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFF, 0xFF,
+    0xFF, 0xFE, 0xFF, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFF, 0xFE, 0xFF, 0xFE, 0xFF, 0xFF,
+    0xFE, 0xFE, 0xFE, 0xFF, 0xFF, 0xFE, 0xFE, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFF, 0xFE, 0xFE, 0xFF, 0xFE, 0xFF, 0xFE, 0xFF, 0xFE, 0xFE,
+    0xFF, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFF, 0xFE, 0xFE, 0xFE, 0xFE, 0xFF, 0xFF, 0xFF, 0xFE, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFF, 0xFF, 0xFE, 0xFE, 0xFE, 0xFE, 0xFF, 0xFF, 0xFE, 0xFE,
+    0xFE, 0xFF, 0xFE, 0xFE, 0xFF, 0xFF, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFF, 0xFF, 0xFE, 0xFF, 0xFE,
+    0xFE, 0xFE, 0xFF, 0xFE, 0xFF, 0xFE, 0xFE, 0xFF, 0xFF, 0xFE, 0xFF, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9,
+    0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9,
+    0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9,
+    0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9,
+    0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9,
+    0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9,
+    0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9,
+    0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9,
+    0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9,
+    0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9,
+    0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9,
+    0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9,
+    0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9,
+    0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9,
+    0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9,
+    0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9,
+    0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9, 0xF9
+};
+
+/* the 250 LFSR bits the propeller answers with, before its version */
+const u8 handshake_rx[HANDSHAKE_RX_SIZE] =
+{
+    0xFE, 0xFF, 0xFE, 0xFE, 0xFE, 0xFE, 0xFF, 0xFE, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFE, 0xFF, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE, 0xFE, 0xFF, 0xFF, 0xFF, 0xFE,
+    0xFE, 0xFF, 0xFE, 0xFF, 0xFE, 0xFE, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE, 0xFE, 0xFE, 0xFF,
+    0xFE, 0xFE, 0xFF, 0xFE, 0xFE, 0xFF, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE, 0xFF, 0xFE, 0xFE,
+    0xFE, 0xFF, 0xFE, 0xFE, 0xFE, 0xFF, 0xFF, 0xFE, 0xFF, 0xFF, 0xFE, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE,
+    0xFE, 0xFF, 0xFE, 0xFF, 0xFF, 0xFE, 0xFE, 0xFF, 0xFF, 0xFE, 0xFE, 0xFF, 0xFE, 0xFF, 0xFF, 0xFE,
+    0xFF, 0xFF, 0xFE, 0xFE, 0xFF, 0xFE, 0xFE, 0xFF, 0xFF, 0xFF, 0xFE, 0xFF, 0xFE, 0xFF, 0xFE, 0xFF,
+    0xFE, 0xFF, 0xFF, 0xFF, 0xFE, 0xFF, 0xFF, 0xFE, 0xFF, 0xFE, 0xFF, 0xFF, 0xFE, 0xFF, 0xFE, 0xFE,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE, 0xFF, 0xFF, 0xFE, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFE, 0xFF, 0xFF, 0xFF, 0xFE, 0xFF, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFF, 0xFE,
+    0xFF, 0xFE, 0xFF, 0xFF, 0xFE, 0xFE, 0xFE, 0xFF, 0xFF, 0xFE, 0xFE, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE,
+    0xFE, 0xFE, 0xFE, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFF, 0xFE, 0xFE, 0xFF, 0xFE, 0xFF,
+    0xFE, 0xFF, 0xFE, 0xFE, 0xFF, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFF, 0xFE, 0xFE, 0xFE, 0xFE, 0xFF,
+    0xFF, 0xFF, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFF, 0xFF, 0xFE, 0xFE, 0xFE, 0xFE,
+    0xFF, 0xFF, 0xFE, 0xFE, 0xFE, 0xFF, 0xFE, 0xFE, 0xFF, 0xFF, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFF,
+    0xFF, 0xFE, 0xFF, 0xFE, 0xFE, 0xFE, 0xFF, 0xFE, 0xFF, 0xFE
+};
+
 /**********************************************************************************\
 *                                                                                  *
 *   Encodes @param data as a series of short/long pulses whith 3 bits/bye in       *
@@ -67,7 +200,7 @@ void encode(u8* buff, u32 data)
 *   Enables the dtr line pointed to @param fd.                    *
 *                                                                 *
 \*****************************************************************/
-void enable_dtr()
+void enable_dtr(int fd)
 {
     #ifdef ALT_SERIAL_IOCTL
     int controlbits, result;
@@ -83,7 +216,7 @@ void enable_dtr()
     int result, controlbits = TIOCM_DTR;
     result = ioctl(fd, TIOCMBIS, &controlbits);
     if(result < 0)
-        sys_error("enable_dtr: error getting serial port options");
+        sys_error("enable_dtr: error setting serial port options");
     #endif
 }
 
@@ -92,23 +225,23 @@ void enable_dtr()
 *   Disables the dtr line pointed to @param fd.                   *
 *                                                                 *
 \*****************************************************************/
-void disable_dtr()
+void disable_dtr(int fd)
 {
-    #ifdef ALT_SERIAL_CTL
+    #ifdef ALT_SERIAL_IOCTL
     int controlbits, result;
     result = ioctl(fd, TIOCMGET, &controlbits);
-    if(!result)
+    if(result == -1)
         sys_error("disable_dtr: error getting serial port options");
 
     controlbits &= ~TIOCM_DTR;
     result = ioctl(fd, TIOCMSET, &controlbits);
-    if(!result)
+    if(result == -1)
         sys_error("disable_dtr: error setting serial port options");
     #else
     int result, controlbits = TIOCM_DTR;
     result = ioctl(fd, TIOCMBIC, &controlbits);
     if(result < 0)
-        sys_error("enable_dtr: error getting serial port options");
+        sys_error("disable_dtr: error setting serial port options");
     #endif
 }
 
@@ -119,9 +252,22 @@ void disable_dtr()
 \*****************************************************************/
 void prop_reset()
 {
-    enable_dtr(fd);
-    sleep_msec(25);
-    disable_dtr(fd);
+    u64 t = get_time_ns();
+    if(opt_hot)
+    {
+        /* the reset comes from the edge when dtr gets enabled, for hot reloads it stays
+           enabled, so opening the port the next time doesn't reset the propeller */
+        disable_dtr(fd);
+        sleep_msec(reset_ms);
+        enable_dtr(fd);
+    }
+    else
+    {
+        enable_dtr(fd);
+        sleep_msec(reset_ms);
+        disable_dtr(fd);
+    }
+    stats.reset_ns += get_time_ns() - t;
 }
 
 /*****************************************************************\
@@ -129,11 +275,25 @@ void prop_reset()
 *   Writes @param buffer of @param size bytes to serial port fd.  *
 *                                                                 *
 \*****************************************************************/
-void serial_write_buffer(u8* buffer, size_t size)
+void serial_write_buffer(const u8* buffer, size_t size)
 {
-    size_t bytes_send = write(fd, buffer, size);
-    if(bytes_send != size)
-        sys_error("failed to write to serial");
+    while(size)
+    {
+        ssize_t bytes_send = write(fd, buffer, size);
+        if(bytes_send < 0)
+        {
+            if(errno != EINTR)
+                sys_error("failed to write to serial");
+            bytes_send = 0;
+        }
+
+        if((size_t)bytes_send != size)
+            stats.retries++;
+
+        stats.serial_bytes += bytes_send;
+        buffer += bytes_send;
+        size -= bytes_send;
+    }
 }
 
 /*****************************************************************\
@@ -148,33 +308,44 @@ void prop_send_u32(u32 data)
     serial_write_buffer(buff, 11);
 }
 
-/*****************************************************************\
-*                                                                 *
-*   Recieves a bit of data from propeller.                        *
-*                                                                 *
-\*****************************************************************/
-u8 recieve(int timeout)
+/*******************************************************************************\
+*                                                                               *
+*   Reads @param size bytes from the propeller into @param buff, waiting at     *
+*   most @param timeout msec for each chunk.                                    *
+*   @return number of bytes read, less than size if it timed out                *
+*                                                                               *
+\*******************************************************************************/
+static size_t serial_read_buffer(u8* buff, size_t size, int timeout)
 {
-    size_t num_bytes;
-    u8 byte;
-
+    size_t done = 0;
     struct pollfd fds = { fd, POLLIN | POLLPRI, 0 };
-    num_bytes = poll(&fds, 1, timeout);
-    if(num_bytes < 0)
-        fatal("poll failed");
 
-    if((fds.revents & POLLIN) || (fds.revents & POLLPRI))
+    while(done < size)
     {
-        num_bytes = read(fd, &byte, 1);
-        if(num_bytes < 1)
-            sys_error("recv1_select() serial read failed");
+        int ready = poll(&fds, 1, timeout);
+        if(ready < 0)
+        {
+            if(errno != EINTR)
+                fatal("poll failed");
+            stats.retries++;
+            continue;
+        }
+
+        if((fds.revents & POLLIN) || (fds.revents & POLLPRI))
+        {
+            ssize_t num_bytes = read(fd, buff + done, size - done);
+            if(num_bytes < 0 && errno != EINTR && errno != EAGAIN)
+                sys_error("serial read failed");
+            if(num_bytes > 0)
+                done += num_bytes;
+        }
+        else if((fds.revents & POLLERR) || (fds.revents & POLLHUP))
+            fatal("error in poll");
+        else
+            break;
     }
-    else if((fds.revents & POLLERR) || (fds.revents & POLLHUP) || (fds.revents & POLLHUP))
-        fatal("error in poll");
-    else
-        fatal("%s: timed out, propeller hardware not found.", __FUNCTION__);
 
-    return byte - 0xFE;
+    return done;
 }
 
 /************************************************************************************\
@@ -191,8 +362,13 @@ u8 recieve_pinging(int timeout)
 
     while(get_time_ms() - t1 < timeout)
     {
-        write(fd, &f9, 1);
-        poll(&fds, 1, 25);
+        serial_write_buffer(&f9, 1);
+        stats.pings++;
+        if(poll(&fds, 1, 25) < 0)
+        {
+            fds.revents = 0;
+            stats.retries++;
+        }
 
         if((fds.revents & POLLIN) || (fds.revents & POLLPRI))
         {
@@ -212,59 +388,160 @@ u8 recieve_pinging(int timeout)
 
 /*******************************************************************************\
 *                                                                               *
-*   Connects to propeller on device @param fd and sends a @param command to it. *
+*   Resets propeller and does the LFSR handshake with the current reset_ms and  *
+*   settle_ms, the propeller @param version is stored.                          *
+*   @return error message or 0 if everything is ok.                             *
+*                                                                               *
+\*******************************************************************************/
+static const char* prop_handshake(u8* version)
+{
+    u8 buff[HANDSHAKE_RX_SIZE];
+    prop_reset();
+
+    u64 t = get_time_ns();
+    sleep_msec(settle_ms);
+    stats.settle_ns += get_time_ns() - t;
+    t = get_time_ns();
+
+    serial_write_buffer(handshake_tx, HANDSHAKE_TX_SIZE);
+    fsync(fd);
+    stats.handshake_ns += get_time_ns() - t;
+    t = get_time_ns();
+
+    size_t num_bytes = serial_read_buffer(buff, HANDSHAKE_RX_SIZE, 100);
+    if(memcmp(buff, handshake_rx, num_bytes))
+        return "recieved wrong LFSR, lost hardware connection?";
+    if(num_bytes < HANDSHAKE_RX_SIZE)
+        return "timed out, propeller hardware not found";
+    stats.lfsr_ns += get_time_ns() - t;
+    t = get_time_ns();
+
+    if(serial_read_buffer(buff, 8, 200) < 8)
+        return "timed out reading the propeller version";
+    *version = 0;
+    for(unsigned i = 0; i < 8; ++i)
+        *version |= (u8)(buff[i] - 0xFE) << i;
+    stats.version_ns += get_time_ns() - t;
+
+    return 0;
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Connects to propeller on device fd, falling back to the safe reset timing   *
+*   if the calibrated one fails.                                                *
 *   @return propeller version                                                   *
 *                                                                               *
-\********************************************************************************/
+\*******************************************************************************/
 u8 prop_connect()
 {
-    u8 buff[258];
-    prop_reset();
-    sleep_msec(95);
+    u8 version;
+    const char* errmsg = prop_handshake(&version);
+
+    if(errmsg && (reset_ms != RESET_MS || settle_ms != SETTLE_MS))
+    {
+        fprintf(stderr, "calibrated reset timing failed (%s), falling back to %u/%u ms\n",
+                errmsg, RESET_MS, SETTLE_MS);
+        reset_ms = RESET_MS;
+        settle_ms = SETTLE_MS;
+        stats.fallbacks++;
+        tcflush(fd, TCIOFLUSH);
+        errmsg = prop_handshake(&version);
+    }
+
+    if(errmsg)
+        fatal("%s", errmsg);
 
-    lfsr = 'P'; /* resetting lfsr */
+    return version;
+}
 
-    *buff = 0xF9; /* Timing calibration */
+/*******************************************************************************\
+*                                                                               *
+*   @return non zero if the handshake works CALIBRATION_TRIES times in a row    *
+*   with @param reset and @param settle msec.                                   *
+*                                                                               *
+\*******************************************************************************/
+static int prop_timing_works(ulong reset, ulong settle)
+{
+    reset_ms = reset;
+    settle_ms = settle;
 
-    /* 250 bytes of lfsr data */
-    for(unsigned i = 1; i < 251; i++)
+    for(unsigned i = 0; i < CALIBRATION_TRIES; i++)
     {
-        buff[i] = (lfsr_step() | 0xFE);
+        u8 version;
+        tcflush(fd, TCIOFLUSH);
+        if(prop_handshake(&version) || version != 1)
+        {
+            if(opt_verbose > 4)
+                fprintf(vfile, "reset %lu ms settle %lu ms: failed\n", reset, settle);
+            return 0;
+        }
     }
-    serial_write_buffer(buff, 251);
 
-    /* Send 258 timing calibrations */
-    for(unsigned i = 0; i < 258; i++)
+    if(opt_verbose > 4)
+        fprintf(vfile, "reset %lu ms settle %lu ms: ok\n", reset, settle);
+    return 1;
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Searches the shortest reset pulse and then the shortest wait after the      *
+*   reset that still work reliably and stores them for the device @param id.    *
+*                                                                               *
+\*******************************************************************************/
+static void prop_calibrate(const char* id)
+{
+    if(!prop_timing_works(RESET_MS, SETTLE_MS))
+        fatal("propeller doesn't answer with the default reset timing, nothing to calibrate");
+
+    /* binary searching for the first value that works, assuming everything longer works too */
+    ulong lo = 1, hi = RESET_MS;
+    while(lo < hi)
     {
-        buff[i] = 0xF9;
+        ulong mid = (lo + hi) / 2;
+        if(prop_timing_works(mid, SETTLE_MS))
+            hi = mid;
+        else
+            lo = mid + 1;
     }
-    serial_write_buffer(buff, 258);
-    fsync(fd);
+    ulong reset = hi;
 
-    /* Recieve 250 bytes of LFSR data */
-    for(unsigned i = 0; i < 250; i++)
+    lo = 0;
+    hi = SETTLE_MS;
+    while(lo < hi)
     {
-        if(recieve(100) != lfsr_step())
-            fatal("recieved wrong LFSR, lost hardware connection?");
+        ulong mid = (lo + hi) / 2;
+        if(prop_timing_works(reset, mid))
+            hi = mid;
+        else
+            lo = mid + 1;
     }
+    ulong settle = hi;
 
-    u8 version = 0;
-    for(unsigned i = 0; i < 8; ++i)
-        version |= (recieve(200) << i);
+    /* leaving some room for a slower day */
+    reset = reset + CALIBRATION_MARGIN_MS < RESET_MS ? reset + CALIBRATION_MARGIN_MS : RESET_MS;
+    settle = settle + CALIBRATION_MARGIN_MS < SETTLE_MS ? settle + CALIBRATION_MARGIN_MS : SETTLE_MS;
 
-    return version;
+    if(!prop_timing_works(reset, settle))
+        fatal("calibration didn't find a reliable reset timing");
+
+    printf("calibrated reset pulse %lu ms, wait after reset %lu ms, saving %lu ms per load\n",
+           reset, settle, RESET_MS + SETTLE_MS - reset - settle);
+    timing_store(id, reset, settle);
 }
 
 /*****************************************************************\
 *                                                                 *
-*   Sets serial port @param fd settings.                          *
+*   Sets serial port @param fd settings, the old ones are saved   *
+*   in @param saved. @return error message or 0 if everything     *
+*   is ok.                                                        *
 *                                                                 *
 \*****************************************************************/
-void set_serial()
+static const char* serial_setup(int fd, struct termios* saved)
 {
-    int result = tcgetattr(fd, &oldtio); /* save current serial port settings */
+    int result = tcgetattr(fd, saved); /* save current serial port settings */
     if(result < 0)
-        sys_error("failed to retrieve serial port attributes");
+        return "failed to retrieve serial port attributes";
 
     struct termios tio;
     memset(&tio, 0, sizeof(tio)); /* clear struct for new port settings */
@@ -279,11 +556,26 @@ void set_serial()
 
     result = tcflush(fd, TCIFLUSH);
     if(result < 0)
-        sys_error("tcflush failed");
+        return "tcflush failed";
 
     result = tcsetattr(fd, TCSANOW, &tio);
     if(result < 0)
-        sys_error("failed to set serial port attributes");
+        return "failed to set serial port attributes";
+
+    return 0;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Sets serial port fd settings.                                 *
+*                                                                 *
+\*****************************************************************/
+void set_serial()
+{
+    const char* errmsg = serial_setup(fd, &oldtio);
+    if(errmsg)
+        sys_error(errmsg);
+    serial_saved = 1;
 }
 
 
@@ -294,8 +586,12 @@ void set_serial()
 \*****************************************************************/
 void restore_serial()
 {
-    if(!tcsetattr(fd,TCSANOW, &oldtio))
-        sys_error("failed to restore serial port attributes");
+    if(opt_hot)
+        oldtio.c_cflag &= ~HUPCL; /* closing the port mustn't drop dtr and reset the stub */
+
+    serial_saved = 0;
+    if(tcsetattr(fd,TCSANOW, &oldtio) < 0)
+        perror("failed to restore serial port attributes");
 }
 
 /*****************************************************************\
@@ -307,67 +603,260 @@ void set_realtime_priority()
 {
     struct sched_param sparam;
     sparam.sched_priority = 10;
+    int policy = sched_getscheduler(0);
+    if(policy < 0 || sched_getparam(0, &old_sched))
+        policy = -1;
     if(sched_setscheduler(0, SCHED_FIFO, &sparam))
         fprintf(stderr, "failed to set realtime priority\n");
+    else
+        old_policy = policy;
+}
+
+VECTOR_DECLARE(vecstr, char*);
+
+/*****************************************************************\
+*                                                                 *
+*   Adds /dev/@param name to @param list unless it's there.       *
+*                                                                 *
+\*****************************************************************/
+static void add_candidate(vecstr* list, const char* name)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/dev/%s", name);
+
+    for(size_t i = 0; i < list->size; i++)
+        if(!strcmp(list->element[i], path))
+            return;
+
+    vecstr_push_back(list, strdup(path));
 }
 
 /*****************************************************************\
 *                                                                 *
-*   TODO write a proper serial port finder                        *
+*   Lists the serial ports that may have a propeller attached:    *
+*   the ttys with a device behind them in /sys/class/tty and      *
+*   everything that is in /dev/serial/by-id.                      *
 *                                                                 *
 \*****************************************************************/
-int find_serial()
+static void serial_candidates(vecstr* list)
 {
-    int fd = -1;
-    char port[] = "/dev/ttyUSB_";
-    for(unsigned i = 0; i < 10; i++)
+    char path[PATH_MAX], real[PATH_MAX], sysfs_tty[PATH_MAX];
+    struct dirent* entry;
+
+    snprintf(sysfs_tty, sizeof(sysfs_tty), "%s/class/tty", opt_sysfs);
+    DIR* dir = opendir(sysfs_tty);
+    if(dir)
+    {
+        while((entry = readdir(dir)))
+        {
+            if(*entry->d_name == '.')
+                continue;
+
+            snprintf(path, sizeof(path), "%s/%s/device", sysfs_tty, entry->d_name);
+            if(access(path, F_OK))
+                continue; /* virtual terminals, ptys and such */
+
+            /* the 8250 driver registers ttyS ports that have no uart, they have type 0 */
+            if(!strncmp(entry->d_name, "ttyS", 4))
+            {
+                snprintf(path, sizeof(path), "%s/%s/type", sysfs_tty, entry->d_name);
+                FILE* file = fopen(path, "r");
+                int type = 0;
+                if(file)
+                {
+                    if(fscanf(file, "%d", &type) != 1)
+                        type = 0;
+                    fclose(file);
+                }
+                if(!type)
+                    continue;
+            }
+
+            add_candidate(list, entry->d_name);
+        }
+        closedir(dir);
+    }
+
+    dir = opendir("/dev/serial/by-id");
+    if(dir)
     {
-        port[11] = i + 0x30;
-        fd = open(port, O_RDWR | O_NOCTTY);
-        if(!fd)
+        while((entry = readdir(dir)))
         {
-            /* TODO try contact prop */
-            return fd;
+            if(*entry->d_name == '.')
+                continue;
+
+            snprintf(path, sizeof(path), "/dev/serial/by-id/%s", entry->d_name);
+            if(realpath(path, real) && !strncmp(real, "/dev/", 5))
+                add_candidate(list, real + 5);
         }
+        closedir(dir);
     }
+}
 
-    /* ok, trying /dev/ttyS0 - 9 */
-    port[8] = 'S';
-    port[10] = 0;
+typedef struct
+{
+    const char*     device;
+    int             fd;
+    struct termios  saved;
+    size_t          sent; /* bytes of the handshake written so far */
+    size_t          recvd; /* bytes of the answer read so far */
+    u8              version;
+    u8              done;
+} probe_t;
 
-    for(unsigned i = 0; i < 10; i++)
+/***********************************************************************************\
+*                                                                                   *
+*   Looks for propellers on all serial ports at once: every candidate is reset,    *
+*   gets the LFSR handshake and is polled for the answer at the same time, so the  *
+*   search takes one handshake no matter how many ports there are.                  *
+*   The devices that answered with version 1 are put into @param found, which can  *
+*   hold @param maxfound of them. @return number of found propellers                *
+*                                                                                   *
+\***********************************************************************************/
+size_t find_serial(char** found, size_t maxfound)
+{
+    vecstr candidates;
+    vecstr_init(&candidates, 8);
+    serial_candidates(&candidates);
+    if(!candidates.size)
     {
-        port[9] = i + 0x30;
-        fd = open(port, O_RDWR | O_NOCTTY);
-        if(!fd)
+        vecstr_fini(&candidates);
+        return 0;
+    }
+
+    probe_t probes[candidates.size];
+    size_t num_probes = 0;
+    for(size_t i = 0; i < candidates.size; i++)
+    {
+        probe_t* p = &probes[num_probes];
+        p->device = candidates.element[i];
+        p->fd = open(p->device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+        p->sent = p->recvd = 0;
+        p->version = p->done = 0;
+
+        int controlbits;
+        if(p->fd < 0)
+            continue;
+        if(serial_setup(p->fd, &p->saved) || ioctl(p->fd, TIOCMGET, &controlbits) < 0)
         {
-            /* TODO try contact prop */
-            break;
+            close(p->fd);
+            continue;
+        }
+
+        if(opt_verbose > 4)
+            fprintf(vfile, "probing %s\n", p->device);
+        num_probes++;
+    }
+
+    if(num_probes)
+    {
+        for(size_t i = 0; i < num_probes; i++)
+            enable_dtr(probes[i].fd);
+        sleep_msec(25);
+        for(size_t i = 0; i < num_probes; i++)
+            disable_dtr(probes[i].fd);
+        sleep_msec(95);
+    }
+
+    struct pollfd fds[num_probes + 1]; /* none of the ports may have opened */
+    size_t active = num_probes;
+    ulong deadline = get_time_ms() + PROBE_TIMEOUT;
+
+    while(active && get_time_ms() < deadline)
+    {
+        for(size_t i = 0; i < num_probes; i++)
+        {
+            fds[i].fd = probes[i].done ? -1 : probes[i].fd;
+            fds[i].events = probes[i].sent < HANDSHAKE_TX_SIZE ? POLLIN | POLLOUT : POLLIN;
+            fds[i].revents = 0;
+        }
+
+        if(poll(fds, num_probes, 10) < 0)
+            sys_error("poll failed");
+
+        for(size_t i = 0; i < num_probes; i++)
+        {
+            probe_t* p = &probes[i];
+            if(p->done)
+                continue;
+
+            if(fds[i].revents & POLLOUT)
+            {
+                ssize_t n = write(p->fd, handshake_tx + p->sent, HANDSHAKE_TX_SIZE - p->sent);
+                if(n > 0)
+                    p->sent += n;
+            }
+
+            if(fds[i].revents & POLLIN)
+            {
+                u8 buff[ANSWER_SIZE];
+                ssize_t n = read(p->fd, buff, ANSWER_SIZE - p->recvd);
+                size_t lfsr_bytes = 0;
+                if(n > 0 && p->recvd < HANDSHAKE_RX_SIZE)
+                {
+                    lfsr_bytes = HANDSHAKE_RX_SIZE - p->recvd < (size_t)n ? HANDSHAKE_RX_SIZE - p->recvd : (size_t)n;
+                    if(memcmp(buff, handshake_rx + p->recvd, lfsr_bytes))
+                        p->done = 1; /* this is not a propeller */
+                }
+                for(ssize_t j = lfsr_bytes; j < n; j++)
+                    p->version |= (u8)(buff[j] - 0xFE) << (p->recvd + j - HANDSHAKE_RX_SIZE);
+                if(n > 0)
+                    p->recvd += n;
+            }
+
+            if(p->recvd == ANSWER_SIZE || (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)))
+                p->done = 1;
+
+            if(p->done)
+                active--;
         }
     }
 
-    return fd;
+    size_t num_found = 0;
+    for(size_t i = 0; i < num_probes; i++)
+    {
+        if(probes[i].recvd == ANSWER_SIZE && probes[i].version == 1 && num_found < maxfound)
+            found[num_found++] = strdup(probes[i].device);
+
+        tcsetattr(probes[i].fd, TCSANOW, &probes[i].saved);
+        close(probes[i].fd);
+    }
+
+    for(size_t i = 0; i < candidates.size; i++)
+        free(candidates.element[i]);
+    vecstr_fini(&candidates);
+
+    return num_found;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Creates the hub image (preamble and program) in a malloc'ed   *
+*   buffer, its size is stored in @param imgsz.                   *
+*                                                                 *
+\*****************************************************************/
+static u8* prop_create_image(size_t* imgsz)
+{
+    u8* image = malloc(asm_ctx->num_ops * 4 + PREAMBLE_SIZE);
+    if(!image)
+        fatal("out of memory");
+
+    *imgsz = create_image(image);
+    return image;
 }
 
 /************************************************************************************\
 *                                                                                    *
-*   Sends a stream of instructions @param prog of length @param progsz to propeller. *
+*   Sends an @param image of @param imgsz bytes to propeller and waits for the       *
+*   checksum result.                                                                 *
 *                                                                                    *
 \************************************************************************************/
-static void prop_send_program(instruction_t* prog, size_t progsz)
+static void prop_send_image(u8* image, size_t imgsz)
 {
-    size_t imgsz = progsz * 4 + PREAMBLE_SIZE;
-    u8* image = malloc(imgsz);
     mlock(image, imgsz);
-    #ifdef PPASM_LITTLE_ENDIAN
-    create_preamble(image, (u8*)prog, progsz);
-    memcpy(image + PREAMBLE_SIZE, (u8*)prog, imgsz - PREAMBLE_SIZE);
-    #else
-    create_preamble(image, &prog[0].byte[3], progsz);
-    memcpy(image + PREAMBLE_SIZE, (u8*)&prog[0].byte[3], imgsz - PREAMBLE_SIZE);
-    #endif
 
     u32 s;
+    u64 t = get_time_ns();
     unsigned num_u32 = (imgsz) / 4;
     prop_send_u32(num_u32); /* transmit the number of u32 in the image */
     printf("sending %lu bytes %lu longs\n", imgsz, imgsz / 4);
@@ -382,23 +871,455 @@ static void prop_send_program(instruction_t* prog, size_t progsz)
         prop_send_u32(s);
 
     }
+    tcdrain(fd);
+    stats.image_ns += get_time_ns() - t;
+    stats.image_bytes += imgsz;
+    t = get_time_ns();
 
     /* Read a bit indicating whether checksum failed */
     if(recieve_pinging(16000))
         fatal("ram checksum failed");
+    stats.checksum_ns += get_time_ns() - t;
 
     munlock(image, imgsz);
+}
+
+/************************************************************************************\
+*                                                                                    *
+*   Sends the encoded image that prop_end() puts into image_queue as it comes and    *
+*   waits for the checksum result.                                                   *
+*                                                                                    *
+\************************************************************************************/
+static void prop_send_queued()
+{
+    u8 buff[11 * 64];
+    u64 t = get_time_ns();
+    size_t sent = 0;
+
+    for(;;)
+    {
+        size_t n = ring_pop(&image_queue, buff, sizeof(buff));
+        if(n)
+        {
+            serial_write_buffer(buff, n);
+            sent += n;
+        }
+        else if(ring_done(&image_queue))
+            break;
+        else
+            sleep_msec(1);
+    }
+
+    tcdrain(fd);
+    printf("sending %lu bytes %lu longs\n", (ulong)(sent / 11 - 1) * 4, (ulong)(sent / 11 - 1));
+    stats.image_ns += get_time_ns() - t;
+    stats.image_bytes += (sent / 11 - 1) * 4;
+    t = get_time_ns();
+
+    if(recieve_pinging(16000))
+        fatal("ram checksum failed");
+    stats.checksum_ns += get_time_ns() - t;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Sends the program to propeller.                               *
+*                                                                 *
+\*****************************************************************/
+static void prop_send_program()
+{
+    ulong t = get_time_ms();
+    if(pipelined)
+        prop_send_queued();
+    else
+    {
+        size_t imgsz;
+        u8* image = prop_create_image(&imgsz);
+        prop_send_image(image, imgsz);
+        free(image);
+    }
+    printf("downloaded to ram in %lu ms\n", get_time_ms() - t);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Reads a raw byte from the serial port waiting at most         *
+*   @param timeout msec. @return the byte or -1 on timeout.       *
+*                                                                 *
+\*****************************************************************/
+static int serial_read_byte(int timeout)
+{
+    u8 byte;
+    struct pollfd fds = { fd, POLLIN | POLLPRI, 0 };
+
+    if(poll(&fds, 1, timeout) < 0)
+        sys_error("poll failed");
+
+    if((fds.revents & POLLIN) || (fds.revents & POLLPRI))
+    {
+        if(read(fd, &byte, 1) < 1)
+            sys_error("serial read failed");
+        return byte;
+    }
+    else if((fds.revents & POLLERR) || (fds.revents & POLLHUP))
+        fatal("error in poll");
+
+    return -1;
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Sends a @param stub of @param size longs through the ROM, the long at       *
+*   @param bitticks is set to the bit period at the clock of the image.         *
+*                                                                               *
+\*******************************************************************************/
+static void prop_send_stub(const u32* stub, size_t size, unsigned bitticks)
+{
+    u32 period = (asm_ctx->clkfreq ? asm_ctx->clkfreq : 80000000) / 115200;
+    u8 image[PREAMBLE_SIZE + size * 4];
+    for(unsigned i = 0; i < size; i++)
+    {
+        u32 l = i == bitticks ? period : stub[i];
+        image[PREAMBLE_SIZE + i * 4 + 0] = l & 0xFF;
+        image[PREAMBLE_SIZE + i * 4 + 1] = (l >> 8) & 0xFF;
+        image[PREAMBLE_SIZE + i * 4 + 2] = (l >> 16) & 0xFF;
+        image[PREAMBLE_SIZE + i * 4 + 3] = (l >> 24) & 0xFF;
+    }
+    create_preamble(image, image + PREAMBLE_SIZE, size);
+
+    if(opt_verbose > 4)
+        fprintf(vfile, "stub bit period %u clocks\n", period);
+
+    prop_send_image(image, sizeof(image));
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return approximate time in msec to send @param bytes bytes   *
+*   over the 115200 baud 8N1 line.                                *
+*                                                                 *
+\*****************************************************************/
+static ulong serial_time_ms(size_t bytes)
+{
+    return bytes * 10 * 1000 / 115200;
+}
+
+/************************************************************************************\
+*                                                                                    *
+*   Sends the program RLE compressed. The ROM loads the decompressor stub first,     *
+*   which then receives the compressed image as plain 8N1 bytes and boots it.        *
+*   Falls back to the plain download whenever the stub would not be faster.          *
+*                                                                                    *
+\************************************************************************************/
+static void prop_send_compressed()
+{
+    size_t imgsz;
+    u8* image = prop_create_image(&imgsz);
+
+    /* the ROM puts two $FFF9FFFF longs at dbase - 8 right after the image, so does the stub */
+    size_t hubsz = imgsz + 8;
+    image = realloc(image, hubsz);
+    if(!image)
+        fatal("out of memory");
+    memcpy(image + imgsz, "\xFF\xFF\xF9\xFF\xFF\xFF\xF9\xFF", 8);
+
+    clock_t c = clock();
+    u8* packed = malloc(RLE_BOUND(hubsz));
+    if(!packed)
+        fatal("out of memory");
+    size_t packedsz = rle_compress(image, hubsz, packed);
+    ulong compress_us = (clock() - c) * 1000000 / CLOCKS_PER_SEC;
+
+    /* every long through the ROM costs 11 bytes */
+    ulong plain_ms = serial_time_ms((imgsz / 4 + 1) * 11);
+    ulong packed_ms = serial_time_ms((UNZ_STUB_SIZE + PREAMBLE_SIZE / 4 + 1) * 11) +
+                      serial_time_ms(4 + packedsz + 2) + UNZ_OVERHEAD_MS + compress_us / 1000;
+
+    printf("compressed %lu bytes to %lu (ratio %.2f) in %lu usec\n", hubsz, packedsz,
+           (double)hubsz / packedsz, compress_us);
+
+    if(packed_ms >= plain_ms)
+    {
+        printf("compressed download would take ~%lu ms instead of ~%lu ms, sending it uncompressed\n",
+               packed_ms, plain_ms);
+        prop_send_image(image, imgsz);
+        free(packed);
+        free(image);
+        return;
+    }
+
+    if(opt_verbose > 4)
+        fprintf(vfile, "sending decompressor stub\n");
+
+    prop_send_stub(unz_stub, UNZ_STUB_SIZE, UNZ_STUB_BITTICKS);
+
+    int byte;
+    do
+    {
+        byte = serial_read_byte(500);
+        if(byte < 0)
+            fatal("decompressor stub didn't answer");
+    }
+    while(byte != UNZ_READY);
+
+    u64 t = get_time_ns();
+    u8 header[4] = { hubsz & 0xFF, (hubsz >> 8) & 0xFF, (hubsz >> 16) & 0xFF, (hubsz >> 24) & 0xFF };
+    serial_write_buffer(header, 4);
+    serial_write_buffer(packed, packedsz);
+    tcdrain(fd);
+    stats.image_ns += get_time_ns() - t;
+    stats.image_bytes += 4 + packedsz;
+
+    u8 sum = 0;
+    for(size_t i = 0; i < hubsz; i++)
+        sum += image[i];
+
+    t = get_time_ns();
+    byte = serial_read_byte(500);
+    if(byte < 0)
+        fatal("decompressor stub timed out");
+    if(byte != sum)
+        fatal("decompressed image checksum failed");
+    stats.checksum_ns += get_time_ns() - t;
+
+    printf("sent ~%lu ms instead of ~%lu ms, saved ~%lu ms\n", packed_ms, plain_ms, plain_ms - packed_ms);
+
+    free(packed);
     free(image);
 }
 
-/**********************************************************************\
-*                                                                      *
-*   Tries to execute a @param command on the propeller, connected to   *
-*   @param device                                                      *
-*                                                                      *
-\**********************************************************************/
-void prop_action(const char* device, u32 command)
+/*****************************************************************\
+*                                                                 *
+*   Waits for the ROM to program and then to verify the EEPROM    *
+*   with the image that was just loaded into RAM.                 *
+*                                                                 *
+\*****************************************************************/
+static void prop_program_eeprom()
+{
+    u64 t = get_time_ns();
+    printf("programming eeprom...\n");
+    if(recieve_pinging(EEPROM_PROGRAM_TIMEOUT))
+        fatal("eeprom programming failed");
+
+    stats.program_ns = get_time_ns() - t;
+    printf("eeprom programmed in %lu ms, verifying...\n", (ulong)(stats.program_ns / 1000000));
+
+    t = get_time_ns();
+    if(recieve_pinging(EEPROM_VERIFY_TIMEOUT))
+        fatal("eeprom verification failed");
+
+    stats.verify_ns = get_time_ns() - t;
+    printf("eeprom verified in %lu ms\n", (ulong)(stats.verify_ns / 1000000));
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Puts back the latency settings on exit.                       *
+*                                                                 *
+\*****************************************************************/
+static void prop_restore_tuning()
+{
+    tty_restore(&tuning);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Writes @param str as a JSON string into @param file.          *
+*                                                                 *
+\*****************************************************************/
+static void json_string(FILE* file, const char* str)
+{
+    fputc('"', file);
+    for(; *str; str++)
+    {
+        if(*str == '"' || *str == '\\')
+            fprintf(file, "\\%c", *str);
+        else if((u8)*str < 0x20)
+            fprintf(file, "\\u%04x", *str);
+        else
+            fputc(*str, file);
+    }
+    fputc('"', file);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Appends the timings of the load as one JSON record to the     *
+*   opt_telemetry file ("-" for stderr), runs at exit so failed   *
+*   loads are recorded too.                                       *
+*                                                                 *
+\*****************************************************************/
+static void prop_write_telemetry()
+{
+    if(!opt_telemetry || !stats.start)
+        return;
+
+    FILE* file = strcmp(opt_telemetry, "-") ? fopen(opt_telemetry, "a") : stderr;
+    if(!file)
+    {
+        perror("failed to open the telemetry file");
+        return;
+    }
+
+    u64 total = get_time_ns() - stats.start;
+    u64 bps = stats.image_ns ? stats.image_bytes * 1000000000ULL / stats.image_ns : 0;
+
+    fprintf(file, "{\"time\":%ld,\"device\":", (long)time(0));
+    json_string(file, stats.device);
+    fprintf(file, ",\"command\":%u,\"ok\":%s,\"version\":%u", stats.command, stats.ok ? "true" : "false", stats.version);
+    fprintf(file, ",\"reset_ns\":%llu,\"settle_ns\":%llu,\"handshake_ns\":%llu,\"lfsr_ns\":%llu,\"version_ns\":%llu",
+            (unsigned long long)stats.reset_ns, (unsigned long long)stats.settle_ns,
+            (unsigned long long)stats.handshake_ns, (unsigned long long)stats.lfsr_ns,
+            (unsigned long long)stats.version_ns);
+    fprintf(file, ",\"image_ns\":%llu,\"checksum_ns\":%llu,\"eeprom_program_ns\":%llu,\"eeprom_verify_ns\":%llu,\"total_ns\":%llu",
+            (unsigned long long)stats.image_ns, (unsigned long long)stats.checksum_ns,
+            (unsigned long long)stats.program_ns, (unsigned long long)stats.verify_ns,
+            (unsigned long long)total);
+    fprintf(file, ",\"reset_ms\":%lu,\"settle_ms\":%lu,\"fallbacks\":%u", reset_ms, settle_ms, stats.fallbacks);
+    fprintf(file, ",\"latency_timer\":%d,\"low_latency\":%s,\"untuned_handshake_ns\":%llu", stats.latency_timer,
+            opt_low_latency ? "true" : "false", (unsigned long long)stats.untuned_ns);
+    fprintf(file, ",\"image_bytes\":%llu,\"serial_bytes\":%llu,\"bytes_per_sec\":%llu,\"pings\":%u,\"retries\":%u}\n",
+            (unsigned long long)stats.image_bytes, (unsigned long long)stats.serial_bytes,
+            (unsigned long long)bps, stats.pings, stats.retries);
+
+    if(file != stderr)
+        fclose(file);
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Starts the program in cog opt_hot through the resident stub, which is       *
+*   loaded first unless it is @param resident already.                          *
+*                                                                               *
+\*******************************************************************************/
+static void prop_hot_load(int resident)
+{
+    size_t imgsz;
+    u8* image = prop_create_image(&imgsz);
+
+    if(!resident)
+    {
+        if(opt_verbose > 4)
+            fprintf(vfile, "loading the resident stub\n");
+
+        prop_send_stub(hot_stub, HOT_STUB_SIZE, HOT_STUB_BITTICKS);
+        if(!hot_ping(fd, HOT_BOOT_TIMEOUT))
+            fatal("the resident stub didn't start");
+    }
+
+    u64 t = get_time_ns();
+    const char* errmsg = hot_send(fd, opt_hot, image + PREAMBLE_SIZE, (imgsz - PREAMBLE_SIZE) / 4);
+    if(errmsg)
+        fatal("%s", errmsg);
+    stats.image_ns += get_time_ns() - t;
+    stats.image_bytes += imgsz - PREAMBLE_SIZE;
+
+    printf("program started in cog %u in %lu ms%s\n", opt_hot,
+           (ulong)((get_time_ns() - stats.start) / 1000000), resident ? " without a reset" : "");
+    free(image);
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Captures what the started program sends into opt_monitor, switching to      *
+*   opt_baud first if it's given.                                               *
+*                                                                               *
+\*******************************************************************************/
+static void prop_monitor()
+{
+    if(opt_baud)
+    {
+        struct termios tio;
+        if(tcgetattr(fd, &tio) < 0)
+            sys_error("failed to retrieve serial port attributes");
+        cfsetispeed(&tio, monitor_speed(opt_baud));
+        cfsetospeed(&tio, monitor_speed(opt_baud));
+        if(tcsetattr(fd, TCSANOW, &tio) < 0)
+            sys_error("failed to set the monitor baud rate");
+    }
+
+    int out = STDOUT_FILENO;
+    if(strcmp(opt_monitor, "-"))
+    {
+        out = open(opt_monitor, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(out < 0)
+            sys_error("failed to open the monitor file");
+    }
+
+    fflush(stdout);
+    fprintf(stderr, "monitoring at %lu baud, ^C to stop\n", opt_baud ? opt_baud : 115200UL);
+
+    u64 t = get_time_ns();
+    u64 bytes = monitor(fd, out, opt_timestamps);
+    t = get_time_ns() - t;
+    fprintf(stderr, "captured %llu bytes in %lu ms\n", (unsigned long long)bytes, (ulong)(t / 1000000));
+
+    if(out != STDOUT_FILENO)
+        close(out);
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   @return the hash of the 32K EEPROM made of the @param image of @param imgsz *
+*   bytes, the deployed image cache compares them.                              *
+*                                                                               *
+\*******************************************************************************/
+static u64 prop_eeprom_hash(const u8* image, size_t imgsz)
+{
+    u8* eeprom = malloc(EEPROM_SIZE);
+    if(!eeprom)
+        fatal("out of memory");
+
+    create_eeprom(eeprom, image, imgsz);
+    u64 hash = hash_fnv1a(eeprom, EEPROM_SIZE, FNV_OFFSET);
+    free(eeprom);
+    return hash;
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   @return the propeller found on the serial ports, so that there's one.       *
+*                                                                               *
+\*******************************************************************************/
+static const char* prop_search()
+{
+    static char* found[MAX_PROPELLERS];
+    size_t num_found = find_serial(found, MAX_PROPELLERS);
+    if(!num_found)
+        fatal("error: no propeller found on any serial port, use -s <device>");
+
+    for(size_t i = 0; i < num_found; i++)
+        printf("found propeller on %s\n", found[i]);
+    if(num_found > 1)
+        printf("using %s\n", found[0]);
+
+    return found[0];
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Opens and sets up the serial port @param device for @param command, the     *
+*   reset timing of the board @param id is loaded or calibrated.                *
+*                                                                               *
+\*******************************************************************************/
+static void prop_open(const char* device, u32 command, const char* id)
 {
+    memset(&stats, 0, sizeof(stats));
+    stats.device = device;
+    stats.command = command;
+    stats.start = get_time_ns();
+
+    /* --watch opens the port for every build, the handlers are registered once */
+    static int exit_handlers = 0;
+    if(!exit_handlers)
+    {
+        if(opt_telemetry)
+            atexit(prop_write_telemetry);
+        if(opt_low_latency)
+            atexit(prop_restore_tuning);
+        exit_handlers = 1;
+    }
+
     fd = open(device, O_RDWR | O_NOCTTY);
     if(fd < 3)
         sys_error("failed to open serial port");
@@ -406,33 +1327,313 @@ void prop_action(const char* device, u32 command)
     if(opt_verbose > 4)
         fprintf(vfile, "opened %s r/w fd: %i command: %u\n", device, fd, command);
 
-    mlock(&program, num_ops * 4);
     set_serial();
 
+    char path[PATH_MAX], real[PATH_MAX];
+    const char* tty = realpath(device, real) ? real : device;
+    stats.latency_timer = sysfs_latency_timer(strrchr(tty, '/') ? strrchr(tty, '/') + 1 : tty, path, sizeof(path));
+    old_latency = stats.latency_timer;
+
+    reset_ms = RESET_MS;
+    settle_ms = SETTLE_MS;
+    if(opt_low_latency)
+    {
+        /* a handshake before the tuning to compare with, a running hot reload stub isn't reset for it */
+        if(!opt_hot)
+        {
+            load_stats_t load = stats;
+            u8 version;
+            if(!prop_handshake(&version))
+                load.untuned_ns = stats.handshake_ns + stats.lfsr_ns + stats.version_ns;
+            stats = load;
+            tcflush(fd, TCIOFLUSH);
+        }
+
+        tty_tune(&tuning, fd, device);
+        if(tuning.old_latency >= 0)
+            stats.latency_timer = LATENCY_TIMER_MS;
+    }
+
     set_realtime_priority();
 
+    if(opt_calibrate)
+        prop_calibrate(id);
+    else if(timing_lookup(id, &reset_ms, &settle_ms) && opt_verbose > 4)
+        fprintf(vfile, "using calibrated reset timing %lu/%lu ms for %s\n", reset_ms, settle_ms, id);
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Resets the propeller and does the handshake, unless the hot reload stub is  *
+*   running and takes @param command. @return non zero if the stub runs         *
+*                                                                               *
+\*******************************************************************************/
+static int prop_start(u32 command)
+{
+    /* a resident stub takes the program without a reset */
+    if(opt_hot && command == CMD_RAM_RUN && hot_ping(fd, HOT_PING_TIMEOUT))
+        return 1;
+
     u8 version = prop_connect();
+    stats.version = version;
+
+    if(opt_low_latency || opt_verbose > 4)
+    {
+        printf("handshake took %lu ms", (ulong)((stats.handshake_ns + stats.lfsr_ns + stats.version_ns) / 1000000));
+        if(stats.untuned_ns)
+            printf(", %lu ms before the tuning", (ulong)(stats.untuned_ns / 1000000));
+        printf(", latency timer %d ms (was %d ms)\n", stats.latency_timer, old_latency);
+    }
 
     if(version != 1)
         fatal("wrong propeller version");
 
-    prop_send_u32(command);
+    return 0;
+}
 
+/*******************************************************************************\
+*                                                                               *
+*   Puts back what prop_open() changed and closes the serial port, also after   *
+*   it failed half way.                                                         *
+*                                                                               *
+\*******************************************************************************/
+static void prop_close()
+{
+    munlockall();
+    if(old_policy >= 0)
+    {
+        sched_setscheduler(0, old_policy, &old_sched);
+        old_policy = -1;
+    }
+    tty_restore(&tuning);
+    if(serial_saved)
+        restore_serial();
+    if(fd >= 0)
+        close(fd);
+    fd = -1;
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Does @param command on the connected propeller of the board @param id,      *
+*   @param resident tells if the hot reload stub is running, and closes the     *
+*   serial port.                                                                *
+*                                                                               *
+\*******************************************************************************/
+static void prop_run(u32 command, int resident, const char* id)
+{
     switch(command)
     {
         case CMD_SHUTDOWN:
-            printf("found propeller version %u\n", version);
+            printf("found propeller version %u\n", stats.version);
             break;
 
         case CMD_RAM_RUN:
-            prop_send_program(program, num_ops);
-            fprintf(stdout, "program downloaded successfuly");
+            if(opt_hot)
+            {
+                prop_hot_load(resident);
+                break;
+            }
+            if(opt_compress)
+                prop_send_compressed();
+            else
+                prop_send_program();
+            fprintf(stdout, "program downloaded successfuly\n");
+            break;
+
+        case CMD_EEPROM:
+        case CMD_EEPROM_RUN:
+            if(opt_compress)
+                fprintf(stderr, "the ROM programs the EEPROM from the RAM, sending uncompressed\n");
+            prop_send_program();
+            prop_program_eeprom();
+            fprintf(stdout, "program written to eeprom successfuly\n");
             break;
 
         default:
-            fatal("FIXME: only show version/load to ram and run is supported for now");
+            fatal("unknown command %u", command);
     }
 
-    munlockall();
-    restore_serial();
+    if(command == CMD_EEPROM || command == CMD_EEPROM_RUN)
+        fingerprint_store(id, image_hash);
+
+    stats.ok = 1;
+
+    if(opt_monitor && (command == CMD_RAM_RUN || command == CMD_EEPROM_RUN))
+        prop_monitor();
+
+    prop_close();
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Does @param command with the assembled program on the propeller at serial   *
+*   port @param device, or on the one that is found if it is NULL.              *
+*                                                                               *
+\*******************************************************************************/
+void prop_action(const char* device, u32 command)
+{
+    char id[PATH_MAX];
+
+    if(!device)
+        device = prop_search();
+    device_id(device, id, sizeof(id));
+
+    /* the EEPROM keeps its content, so there is nothing to do if it already has this image */
+    if(command == CMD_EEPROM || command == CMD_EEPROM_RUN)
+    {
+        size_t imgsz;
+        u8* image = prop_create_image(&imgsz);
+        image_hash = prop_eeprom_hash(image, imgsz);
+        free(image);
+
+        u64 deployed;
+        if(opt_if_changed && fingerprint_lookup(id, &deployed) && deployed == image_hash)
+        {
+            printf("%s already has this image, skipping\n", id);
+            return;
+        }
+    }
+
+    /* --watch goes on after an error, with the port and the scheduling put back */
+    ERROR_FRAME(prop_close();)
+
+    mlock(&asm_ctx->program, asm_ctx->num_ops * 4);
+    prop_open(device, command, id);
+    int resident = prop_start(command);
+    if(!resident)
+        prop_send_u32(command);
+    prop_run(command, resident, id);
+    ERROR_FRAME_END();
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   @return non zero if @param command can be started with prop_begin() before  *
+*   the program is assembled, the options that need the image before the        *
+*   reset can't.                                                                *
+*                                                                               *
+\*******************************************************************************/
+int prop_can_begin(u32 command)
+{
+    return (command == CMD_RAM_RUN || command == CMD_EEPROM || command == CMD_EEPROM_RUN) &&
+           !opt_compress && !opt_hot && !opt_if_changed;
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Loader thread of prop_begin(), connects while the main thread assembles and *
+*   sends the encoded image as it comes through image_queue.                    *
+*                                                                               *
+\*******************************************************************************/
+static void* prop_pipeline(void* arg)
+{
+    const char* device = pipeline_device;
+    u32 command = pipeline_command;
+    char id[PATH_MAX];
+    (void)arg;
+
+    /* the main thread's context is busy assembling, an error here mustn't jump into it */
+    asm_context_t* ctx = asm_context_new();
+    if(!ctx)
+    {
+        snprintf(pipeline_error, sizeof(pipeline_error), "out of memory");
+        return NULL;
+    }
+    asm_ctx = ctx;
+    jmp_buf error_jmp;
+    asm_ctx->error_jmp = &error_jmp;
+    if(setjmp(error_jmp))
+    {
+        snprintf(pipeline_error, sizeof(pipeline_error), "%s", asm_ctx->error);
+        prop_close();
+
+        /* prop_end() may still be pushing the image */
+        u8 drain[0x400];
+        while(ring_pop(&image_queue, drain, sizeof(drain)) || !ring_done(&image_queue))
+            sleep_msec(1);
+        asm_context_free(ctx);
+        return NULL;
+    }
+
+    if(!device)
+        device = prop_search();
+    device_id(device, id, sizeof(id));
+
+    prop_open(device, command, id);
+    prop_start(command);
+    ulong connected = get_time_ms();
+
+    while(!ring_used(&image_queue) && !ring_done(&image_queue))
+        sleep_msec(1);
+
+    /* the ROM gives up when it doesn't get the command for too long, starting over then */
+    if(get_time_ms() - connected > ROM_IDLE_MS)
+    {
+        if(opt_verbose > 4)
+            fprintf(vfile, "assembling took longer than the ROM waits, connecting again\n");
+        tcflush(fd, TCIOFLUSH);
+        prop_start(command);
+    }
+
+    prop_send_u32(command);
+    prop_run(command, 0, id);
+    asm_context_free(ctx);
+    return NULL;
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Starts @param command on the propeller at serial port @param device, or on  *
+*   the one that is found if it is NULL, on a loader thread. The reset and the  *
+*   handshake go on while the program is assembled, prop_end() hands the image  *
+*   over.                                                                       *
+*                                                                               *
+\*******************************************************************************/
+void prop_begin(const char* device, u32 command)
+{
+    if(!ring_init(&image_queue, IMAGE_QUEUE_SIZE))
+        fatal("out of memory");
+
+    pipeline_device = device;
+    pipeline_command = command;
+    pipeline_error[0] = 0;
+    pipelined = 1;
+
+    if(pthread_create(&loader_thread, NULL, prop_pipeline, NULL))
+        fatal("failed to start the loader thread");
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Encodes the assembled program for the loader thread of prop_begin() and     *
+*   waits for the download to finish, an error of the loader thread is fatal    *
+*   here.                                                                       *
+*                                                                               *
+\*******************************************************************************/
+void prop_end()
+{
+    size_t imgsz;
+    u8* image = prop_create_image(&imgsz);
+    mlock(image, imgsz);
+
+    if(pipeline_command == CMD_EEPROM || pipeline_command == CMD_EEPROM_RUN)
+        image_hash = prop_eeprom_hash(image, imgsz); /* published by ring_close() */
+
+    u8 buff[11];
+    encode(buff, imgsz / 4);
+    ring_push_all(&image_queue, buff, 11);
+    for(size_t i = 0; i < imgsz; i += 4)
+    {
+        encode(buff, (u32)image[i] | (u32)image[i + 1] << 8 | (u32)image[i + 2] << 16 | (u32)image[i + 3] << 24);
+        ring_push_all(&image_queue, buff, 11);
+    }
+    ring_close(&image_queue);
+
+    pthread_join(loader_thread, NULL);
+    ring_free(&image_queue);
+    munlock(image, imgsz);
+    free(image);
+    if(pipeline_error[0])
+        fatal("%s", pipeline_error);
 }
@@ -1,13 +1,27 @@
 #ifndef LOADER_H_INCLUDED
 #define LOADER_H_INCLUDED
 #include "types.h"
+#include <stdlib.h>
 
 #define CMD_SHUTDOWN 0
 #define CMD_RAM_RUN 1
 #define CMD_EEPROM 2
 #define CMD_EEPROM_RUN 3
 
+#define MAX_PROPELLERS 16 /* maximum number of propellers find_serial() reports */
+#define HANDSHAKE_TX_SIZE (1 + 250 + 258)
+#define HANDSHAKE_RX_SIZE 250
+
+extern const u8 handshake_tx[HANDSHAKE_TX_SIZE];
+extern const u8 handshake_rx[HANDSHAKE_RX_SIZE];
+
+unsigned lfsr_step(u8* state);
+
 void encode(u8* buff, u32 data);
 void prop_action(const char* device, u32 cmd);
+int prop_can_begin(u32 cmd);
+void prop_begin(const char* device, u32 cmd);
+void prop_end();
+size_t find_serial(char** found, size_t maxfound);
 
 #endif // LOADER_H_INCLUDED
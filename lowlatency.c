@@ -0,0 +1,129 @@
+#include "lowlatency.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+
+/*
+USB serial adapters don't send what they recieved until their buffer is full or their latency
+timer runs out, with FTDI chips that is 16 msec per round trip by default. The kernel may also
+defer the data to a worker unless the port is low latency. Both are changed only for the time
+of the download, and only when the user asked for it with --low-latency.
+*/
+
+/*****************************************************************\
+*                                                                 *
+*   Finds the latency_timer of @param tty (ttyUSB0) below         *
+*   opt_sysfs and writes it to @param path.                       *
+*   @return the current latency in msec or -1 if there is none.   *
+*                                                                 *
+\*****************************************************************/
+int sysfs_latency_timer(const char* tty, char* path, size_t pathsz)
+{
+    snprintf(path, pathsz, "%s/class/tty/%s/device/latency_timer", opt_sysfs, tty);
+
+    FILE* file = fopen(path, "r");
+    if(!file)
+        return -1;
+
+    int latency = -1;
+    if(fscanf(file, "%d", &latency) != 1)
+        latency = -1;
+    fclose(file);
+
+    return latency;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Writes @param latency msec to the sysfs file @param path.     *
+*   @return 0 on success                                          *
+*                                                                 *
+\*****************************************************************/
+static int set_latency_timer(const char* path, int latency)
+{
+    FILE* file = fopen(path, "w");
+    if(!file)
+        return -1;
+
+    int result = fprintf(file, "%d\n", latency) < 0;
+    return fclose(file) || result;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Lowers the latency timer of the adapter behind @param device  *
+*   and asks for ASYNC_LOW_LATENCY on its @param fd. Whatever it  *
+*   can't change is reported and left alone.                      *
+*                                                                 *
+\*****************************************************************/
+void tty_tune(tty_tuning_t* tuning, int fd, const char* device)
+{
+    tuning->old_latency = -1;
+    tuning->old_low_latency = -1;
+    tuning->fd = fd;
+
+    char real[PATH_MAX];
+    const char* tty = realpath(device, real) ? real : device;
+    if(strrchr(tty, '/'))
+        tty = strrchr(tty, '/') + 1;
+
+    int latency = sysfs_latency_timer(tty, tuning->latency_path, sizeof(tuning->latency_path));
+    if(latency > LATENCY_TIMER_MS)
+    {
+        if(set_latency_timer(tuning->latency_path, LATENCY_TIMER_MS))
+            fprintf(stderr, "failed to set %s, no permission?\n", tuning->latency_path);
+        else
+            tuning->old_latency = latency;
+    }
+
+    if(opt_verbose > 4)
+        fprintf(vfile, "%s latency timer %d ms, now %d ms\n", tty, latency,
+                tuning->old_latency < 0 ? latency : LATENCY_TIMER_MS);
+
+    #ifdef ASYNC_LOW_LATENCY
+    struct serial_struct serial;
+    if(ioctl(fd, TIOCGSERIAL, &serial) < 0)
+        return;
+
+    if(!(serial.flags & ASYNC_LOW_LATENCY))
+    {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        if(ioctl(fd, TIOCSSERIAL, &serial) < 0)
+            fprintf(stderr, "failed to set the serial port to low latency\n");
+        else
+            tuning->old_low_latency = 0;
+    }
+    #endif
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Undoes what tty_tune() did.                                   *
+*                                                                 *
+\*****************************************************************/
+void tty_restore(tty_tuning_t* tuning)
+{
+    if(tuning->old_latency >= 0)
+    {
+        if(set_latency_timer(tuning->latency_path, tuning->old_latency))
+            fprintf(stderr, "failed to restore %s\n", tuning->latency_path);
+        tuning->old_latency = -1;
+    }
+
+    #ifdef ASYNC_LOW_LATENCY
+    struct serial_struct serial;
+    if(tuning->old_low_latency == 0 && ioctl(tuning->fd, TIOCGSERIAL, &serial) == 0)
+    {
+        serial.flags &= ~ASYNC_LOW_LATENCY;
+        if(ioctl(tuning->fd, TIOCSSERIAL, &serial) < 0)
+            fprintf(stderr, "failed to restore the serial port latency\n");
+    }
+    tuning->old_low_latency = -1;
+    #endif
+}
@@ -0,0 +1,20 @@
+#ifndef LOWLATENCY_H_INCLUDED
+#define LOWLATENCY_H_INCLUDED
+#include "types.h"
+#include <limits.h>
+
+#define LATENCY_TIMER_MS 1 /* the FTDI default is 16 msec */
+
+/* what tty_tune() changed, so tty_restore() can put it back */
+typedef struct
+{
+    char    latency_path[PATH_MAX]; /* sysfs latency_timer of the adapter */
+    int     old_latency; /* msec, -1 if it was not changed */
+    int     fd;
+    int     old_low_latency; /* ASYNC_LOW_LATENCY before, -1 if it was not changed */
+} tty_tuning_t;
+
+void tty_tune(tty_tuning_t* tuning, int fd, const char* device);
+void tty_restore(tty_tuning_t* tuning);
+int sysfs_latency_timer(const char* tty, char* path, size_t pathsz);
+#endif // LOWLATENCY_H_INCLUDED
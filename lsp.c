@@ -0,0 +1,917 @@
+#include "lsp.h"
+#include "incremental.h"
+#include "context.h"
+#include "opcodes.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+/*
+ppasm --lsp is a language server on stdin and stdout. Every open document has an assembler
+and an incremental_t of its own, so a change parses only the lines that changed, and a
+build goes on after an error to report all of them. Changes come as ranges (incremental
+text sync), definitions, references and hovers are answered from the label index of the
+last build. Positions are counted in bytes, PASM sources are ASCII.
+*/
+
+enum { JSON_NULL, JSON_FALSE, JSON_TRUE, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT };
+
+typedef struct json json_t;
+struct json
+{
+    u8      type;
+    char*   key; /* name of the member of an object */
+    char*   string;
+    double  number;
+    json_t* child; /* first element or member */
+    json_t* next;
+};
+
+typedef struct
+{
+    char*   data;
+    size_t  size;
+    size_t  capacity;
+} buffer_t;
+
+typedef struct document document_t;
+struct document
+{
+    document_t*     next;
+    char*           uri;
+    buffer_t        text;
+    asm_context_t*  ctx;
+    incremental_t*  inc;
+};
+
+typedef struct
+{
+    FILE*       in;
+    FILE*       out;
+    document_t* documents;
+    int         shutdown;
+} lsp_t;
+
+/*****************************************************************\
+*                                                                 *
+*   Frees the json value @param v.                                *
+*                                                                 *
+\*****************************************************************/
+static void json_free(json_t* v)
+{
+    while(v)
+    {
+        json_t* next = v->next;
+        json_free(v->child);
+        free(v->key);
+        free(v->string);
+        free(v);
+        v = next;
+    }
+}
+
+static json_t* json_value(const char** p);
+
+/*****************************************************************\
+*                                                                 *
+*   Parses the json string at @param p.                           *
+*   @return the string or NULL                                    *
+*                                                                 *
+\*****************************************************************/
+static char* json_string(const char** p)
+{
+    const char* s = *p + 1;
+    char* str = malloc(strlen(s) + 1); /* escapes only get shorter */
+    if(!str)
+        return NULL;
+
+    char* d = str;
+    while(*s && *s != '"')
+    {
+        if(*s != '\\')
+        {
+            *d++ = *s++;
+            continue;
+        }
+
+        s++;
+        switch(*s)
+        {
+            case 'b': *d++ = '\b'; break;
+            case 'f': *d++ = '\f'; break;
+            case 'n': *d++ = '\n'; break;
+            case 'r': *d++ = '\r'; break;
+            case 't': *d++ = '\t'; break;
+            case 'u':
+            {
+                unsigned c = 0;
+                for(int i = 1; i <= 4; i++)
+                {
+                    if(!isxdigit((u8)s[i]))
+                    {
+                        free(str);
+                        return NULL;
+                    }
+                    c = c * 16 + (isdigit((u8)s[i]) ? s[i] - '0' : (tolower((u8)s[i]) - 'a' + 10));
+                }
+                s += 4;
+
+                /* utf-8, surrogate pairs come out as two 3 byte sequences */
+                if(c < 0x80)
+                    *d++ = c;
+                else if(c < 0x800)
+                {
+                    *d++ = 0xC0 | (c >> 6);
+                    *d++ = 0x80 | (c & 0x3F);
+                }
+                else
+                {
+                    *d++ = 0xE0 | (c >> 12);
+                    *d++ = 0x80 | ((c >> 6) & 0x3F);
+                    *d++ = 0x80 | (c & 0x3F);
+                }
+                break;
+            }
+            case 0:
+                free(str);
+                return NULL;
+            default: *d++ = *s; break;
+        }
+        s++;
+    }
+
+    if(*s != '"')
+    {
+        free(str);
+        return NULL;
+    }
+    *d = 0;
+    *p = s + 1;
+    return str;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Skips white space at @param p.                                *
+*                                                                 *
+\*****************************************************************/
+static void json_space(const char** p)
+{
+    while(**p == ' ' || **p == '\t' || **p == '\n' || **p == '\r')
+        (*p)++;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Parses the elements of the array or the members of the        *
+*   object at @param p into @param v.                             *
+*   @return 0 on errors                                           *
+*                                                                 *
+\*****************************************************************/
+static int json_children(const char** p, json_t* v, char close)
+{
+    json_t** last = &v->child;
+    (*p)++;
+    json_space(p);
+    if(**p == close)
+    {
+        (*p)++;
+        return 1;
+    }
+
+    for(;;)
+    {
+        char* key = NULL;
+        if(v->type == JSON_OBJECT)
+        {
+            if(**p != '"' || !(key = json_string(p)))
+                return 0;
+            json_space(p);
+            if(**p != ':')
+            {
+                free(key);
+                return 0;
+            }
+            (*p)++;
+        }
+
+        json_t* child = json_value(p);
+        if(!child)
+        {
+            free(key);
+            return 0;
+        }
+        child->key = key;
+        *last = child;
+        last = &child->next;
+
+        json_space(p);
+        if(**p == close)
+        {
+            (*p)++;
+            return 1;
+        }
+        if(**p != ',')
+            return 0;
+        (*p)++;
+        json_space(p);
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Parses the json value at @param p.                            *
+*   @return the value or NULL                                     *
+*                                                                 *
+\*****************************************************************/
+static json_t* json_value(const char** p)
+{
+    json_space(p);
+    json_t* v = calloc(1, sizeof(json_t));
+    if(!v)
+        return NULL;
+
+    int ok = 1;
+    if(**p == '{')
+    {
+        v->type = JSON_OBJECT;
+        ok = json_children(p, v, '}');
+    }
+    else if(**p == '[')
+    {
+        v->type = JSON_ARRAY;
+        ok = json_children(p, v, ']');
+    }
+    else if(**p == '"')
+    {
+        v->type = JSON_STRING;
+        ok = (v->string = json_string(p)) != NULL;
+    }
+    else if(!strncmp(*p, "true", 4))
+    {
+        v->type = JSON_TRUE;
+        *p += 4;
+    }
+    else if(!strncmp(*p, "false", 5))
+    {
+        v->type = JSON_FALSE;
+        *p += 5;
+    }
+    else if(!strncmp(*p, "null", 4))
+    {
+        v->type = JSON_NULL;
+        *p += 4;
+    }
+    else
+    {
+        char* end;
+        v->type = JSON_NUMBER;
+        v->number = strtod(*p, &end);
+        ok = end != *p;
+        *p = end;
+    }
+
+    if(!ok)
+    {
+        json_free(v);
+        return NULL;
+    }
+    return v;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return the member @param path of the object @param v, with   *
+*   the names of nested objects separated by dots, or NULL.       *
+*                                                                 *
+\*****************************************************************/
+static const json_t* json_get(const json_t* v, const char* path)
+{
+    while(v && *path)
+    {
+        size_t len = strcspn(path, ".");
+        const json_t* c = v->type == JSON_OBJECT ? v->child : NULL;
+        while(c && (strlen(c->key) != len || strncmp(c->key, path, len)))
+            c = c->next;
+
+        v = c;
+        path += len;
+        if(*path == '.')
+            path++;
+    }
+    return v;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return the string @param path of @param v or NULL.           *
+*                                                                 *
+\*****************************************************************/
+static const char* json_get_string(const json_t* v, const char* path)
+{
+    v = json_get(v, path);
+    return v && v->type == JSON_STRING ? v->string : NULL;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return the number @param path of @param v or -1.             *
+*                                                                 *
+\*****************************************************************/
+static long json_get_number(const json_t* v, const char* path)
+{
+    v = json_get(v, path);
+    return v && v->type == JSON_NUMBER ? (long)v->number : -1;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Appends @param len bytes of @param data to @param b.          *
+*                                                                 *
+\*****************************************************************/
+static void put_data(buffer_t* b, const char* data, size_t len)
+{
+    if(b->size + len + 1 > b->capacity)
+    {
+        b->capacity = (b->size + len + 1) * 2;
+        if(!(b->data = realloc(b->data, b->capacity)))
+            fatal("out of memory");
+    }
+    memcpy(b->data + b->size, data, len);
+    b->size += len;
+    b->data[b->size] = 0;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Appends to @param b formatted like printf().                  *
+*                                                                 *
+\*****************************************************************/
+static void put(buffer_t* b, const char* format, ...)
+{
+    char tmp[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(tmp, sizeof(tmp), format, args);
+    va_end(args);
+
+    if(len < (int)sizeof(tmp))
+    {
+        put_data(b, tmp, len);
+        return;
+    }
+
+    char big[len + 1];
+    va_start(args, format);
+    vsnprintf(big, len + 1, format, args);
+    va_end(args);
+    put_data(b, big, len);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Appends @param s to @param b as a json string.                *
+*                                                                 *
+\*****************************************************************/
+static void put_string(buffer_t* b, const char* s)
+{
+    put_data(b, "\"", 1);
+    for(; *s; s++)
+    {
+        if(*s == '"' || *s == '\\')
+            put(b, "\\%c", *s);
+        else if(*s == '\n')
+            put_data(b, "\\n", 2);
+        else if((u8)*s < 0x20)
+            put(b, "\\u%04x", (u8)*s);
+        else
+            put_data(b, s, 1);
+    }
+    put_data(b, "\"", 1);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Appends the request id @param id to @param b.                 *
+*                                                                 *
+\*****************************************************************/
+static void put_id(buffer_t* b, const json_t* id)
+{
+    if(id && id->type == JSON_STRING)
+        put_string(b, id->string);
+    else if(id && id->type == JSON_NUMBER)
+        put(b, "%.0f", id->number);
+    else
+        put(b, "null");
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Sends the message in @param b.                                *
+*                                                                 *
+\*****************************************************************/
+static void send_message(lsp_t* lsp, buffer_t* b)
+{
+    fprintf(lsp->out, "Content-Length: %lu\r\n\r\n", (ulong)b->size);
+    fwrite(b->data, 1, b->size, lsp->out);
+    fflush(lsp->out);
+    free(b->data);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Reads a message.                                              *
+*   @return its content or NULL at the end of the input           *
+*                                                                 *
+\*****************************************************************/
+static char* read_message(lsp_t* lsp)
+{
+    char header[256];
+    size_t length = 0;
+    for(;;)
+    {
+        if(!fgets(header, sizeof(header), lsp->in))
+            return NULL;
+        if(!strcmp(header, "\r\n") || !strcmp(header, "\n"))
+            break;
+        if(!strncasecmp(header, "Content-Length:", 15))
+            length = strtoul(header + 15, NULL, 10);
+    }
+
+    char* content = malloc(length + 1);
+    if(!content)
+        fatal("out of memory");
+    if(fread(content, 1, length, lsp->in) != length)
+    {
+        free(content);
+        return NULL;
+    }
+    content[length] = 0;
+    return content;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return the document @param uri or NULL.                      *
+*                                                                 *
+\*****************************************************************/
+static document_t* find_document(lsp_t* lsp, const char* uri)
+{
+    document_t* d = lsp->documents;
+    while(d && uri && strcmp(d->uri, uri))
+        d = d->next;
+    return uri ? d : NULL;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return offset of the 0 based @param line of @param d, or the *
+*   end of the text.                                              *
+*                                                                 *
+\*****************************************************************/
+static size_t line_offset(const document_t* d, long line)
+{
+    size_t o = 0;
+    while(line-- > 0)
+    {
+        const char* nl = memchr(d->text.data + o, '\n', d->text.size - o);
+        if(!nl)
+            return d->text.size;
+        o = nl - d->text.data + 1;
+    }
+    return o;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return length of the line at offset @param o of @param d.    *
+*                                                                 *
+\*****************************************************************/
+static size_t line_length(const document_t* d, size_t o)
+{
+    const char* nl = memchr(d->text.data + o, '\n', d->text.size - o);
+    size_t len = nl ? (size_t)(nl - d->text.data) - o : d->text.size - o;
+    if(len && d->text.data[o + len - 1] == '\r')
+        len--;
+    return len;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return offset of the lsp position @param pos in @param d.    *
+*                                                                 *
+\*****************************************************************/
+static size_t position_offset(const document_t* d, const json_t* pos)
+{
+    size_t o = line_offset(d, json_get_number(pos, "line"));
+    long character = json_get_number(pos, "character");
+    size_t len = line_length(d, o);
+    return o + (character < 0 ? 0 : (size_t)character < len ? (size_t)character : len);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Appends the location of @param word on the 1 based @param     *
+*   line of @param d to @param b.                                 *
+*                                                                 *
+\*****************************************************************/
+static void put_location(buffer_t* b, const document_t* d, size_t line, const char* word)
+{
+    size_t o = line_offset(d, line - 1);
+    size_t len = line_length(d, o);
+    size_t wlen = strlen(word);
+    size_t column = 0;
+    for(size_t c = 0; c + wlen <= len; c++)
+    {
+        if(!memcmp(d->text.data + o + c, word, wlen))
+        {
+            column = c;
+            break;
+        }
+    }
+
+    put(b, "{\"uri\":");
+    put_string(b, d->uri);
+    put(b, ",\"range\":{\"start\":{\"line\":%lu,\"character\":%lu},\"end\":{\"line\":%lu,\"character\":%lu}}}",
+        (ulong)line - 1, (ulong)column, (ulong)line - 1, (ulong)(column + wlen));
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Assembles @param d again and publishes its errors.            *
+*                                                                 *
+\*****************************************************************/
+static void build_document(lsp_t* lsp, document_t* d)
+{
+    asm_context_t* caller = asm_ctx;
+    asm_ctx = d->ctx;
+    const char* errmsg = incremental_build(d->inc, d->text.data, d->text.size);
+    size_t error_line = d->ctx->error_line;
+    asm_ctx = caller;
+
+    buffer_t b = { 0 };
+    put(&b, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":");
+    put_string(&b, d->uri);
+    put(&b, ",\"diagnostics\":[");
+
+    size_t num = errmsg ? 1 : d->inc->errors.size;
+    for(size_t i = 0; i < num; i++)
+    {
+        size_t line = errmsg ? error_line : d->inc->errors.element[i].line;
+        const char* message = errmsg ? errmsg : d->inc->errors.element[i].message;
+        if(!strncmp(message, "line ", 5) && strstr(message, ": "))
+            message = strstr(message, ": ") + 2;
+
+        size_t o = line_offset(d, line ? line - 1 : 0);
+        size_t len = line_length(d, o);
+        size_t start = 0;
+        while(start < len && isspace((u8)d->text.data[o + start]))
+            start++;
+
+        put(&b, "%s{\"range\":{\"start\":{\"line\":%lu,\"character\":%lu},\"end\":{\"line\":%lu,\"character\":%lu}},"
+            "\"severity\":1,\"source\":\"ppasm\",\"message\":", i ? "," : "",
+            (ulong)(line ? line - 1 : 0), (ulong)start, (ulong)(line ? line - 1 : 0), (ulong)len);
+        put_string(&b, message);
+        put(&b, "}");
+    }
+    put(&b, "]}}");
+    send_message(lsp, &b);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Replaces the bytes from @param start to @param end of the     *
+*   text of @param d with @param text.                            *
+*                                                                 *
+\*****************************************************************/
+static void edit_document(document_t* d, size_t start, size_t end, const char* text)
+{
+    size_t len = strlen(text);
+    size_t size = d->text.size - (end - start) + len;
+    if(size + 1 > d->text.capacity)
+    {
+        d->text.capacity = (size + 1) * 2;
+        if(!(d->text.data = realloc(d->text.data, d->text.capacity)))
+            fatal("out of memory");
+    }
+    memmove(d->text.data + start + len, d->text.data + end, d->text.size - end);
+    memcpy(d->text.data + start, text, len);
+    d->text.size = size;
+    d->text.data[size] = 0;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Applies the change @param change to the text of @param d, the *
+*   whole text if it has no range.                                *
+*                                                                 *
+\*****************************************************************/
+static void change_document(document_t* d, const json_t* change)
+{
+    const char* text = json_get_string(change, "text");
+    if(!text)
+        return;
+
+    const json_t* range = json_get(change, "range");
+    size_t start = 0, end = d->text.size;
+    if(range)
+    {
+        start = position_offset(d, json_get(range, "start"));
+        end = position_offset(d, json_get(range, "end"));
+        if(end < start)
+            end = start;
+    }
+    edit_document(d, start, end, text);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Frees the document @param d.                                  *
+*                                                                 *
+\*****************************************************************/
+static void free_document(document_t* d)
+{
+    incremental_free(d->inc);
+    asm_context_free(d->ctx);
+    free(d->text.data);
+    free(d->uri);
+    free(d);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Finds the label at the position @param params points to.      *
+*   @param name gets its full name, @param word how it is written *
+*   @return the document or NULL if there is no label             *
+*                                                                 *
+\*****************************************************************/
+static document_t* label_at(lsp_t* lsp, const json_t* params, char* name, char* word, size_t size, size_t* line)
+{
+    document_t* d = find_document(lsp, json_get_string(params, "textDocument.uri"));
+    if(!d)
+        return NULL;
+
+    const json_t* pos = json_get(params, "position");
+    *line = json_get_number(pos, "line") + 1;
+    size_t o = line_offset(d, *line - 1);
+    size_t len = line_length(d, o);
+    size_t at = position_offset(d, pos) - o;
+
+    const char* text = d->text.data + o;
+    size_t begin = at, end = at;
+    while(begin > 0 && (isalnum((u8)text[begin - 1]) || text[begin - 1] == '_'))
+        begin--;
+    while(end < len && (isalnum((u8)text[end]) || text[end] == '_'))
+        end++;
+    if(begin > 0 && text[begin - 1] == syntax->local_label_prefix)
+        begin--;
+    if(begin == end || end - begin >= size)
+        return NULL;
+
+    memcpy(word, text + begin, end - begin);
+    word[end - begin] = 0;
+    const char* scope = *word == syntax->local_label_prefix ? incremental_scope(d->inc, *line) : "";
+    if(strlen(scope) + strlen(word) >= size)
+        return NULL;
+
+    strcpy(name, scope);
+    strcat(name, word);
+    return d;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return the part of the label @param name that is written in  *
+*   the source, the local part of a local label.                  *
+*                                                                 *
+\*****************************************************************/
+static const char* written(const char* name)
+{
+    const char* local = strchr(name, syntax->local_label_prefix);
+    return local ? local : name;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Answers a go to definition, find references or hover request  *
+*   @param method with @param params into @param b.               *
+*                                                                 *
+\*****************************************************************/
+static void answer_query(lsp_t* lsp, const char* method, const json_t* params, buffer_t* b)
+{
+    char name[MAX_ERROR_STRING_SIZE];
+    char word[MAX_ERROR_STRING_SIZE];
+    size_t line, def_line;
+    ulong value;
+    document_t* d = label_at(lsp, params, name, word, sizeof(name), &line);
+    int defined = d && incremental_definition(d->inc, name, &def_line, &value);
+
+    if(!strcmp(method, "textDocument/definition"))
+    {
+        if(defined)
+            put_location(b, d, def_line, written(name));
+        else
+            put(b, "null");
+        return;
+    }
+
+    if(!strcmp(method, "textDocument/references"))
+    {
+        put(b, "[");
+        int any = 0;
+        if(defined && json_get(params, "context.includeDeclaration") &&
+           json_get(params, "context.includeDeclaration")->type == JSON_TRUE)
+        {
+            put_location(b, d, def_line, written(name));
+            any = 1;
+        }
+
+        const incremental_symbol_t* refs;
+        size_t num = d ? incremental_references(d->inc, name, &refs) : 0;
+        for(size_t i = 0; i < num; i++)
+        {
+            if(i && refs[i].line == refs[i - 1].line)
+                continue;
+            put(b, any ? "," : "");
+            put_location(b, d, refs[i].line, written(name));
+            any = 1;
+        }
+        put(b, "]");
+        return;
+    }
+
+    /* hover */
+    if(!d)
+        d = find_document(lsp, json_get_string(params, "textDocument.uri"));
+    if(!d)
+    {
+        put(b, "null");
+        return;
+    }
+
+    buffer_t text = { 0 };
+    if(defined)
+        put(&text, "`%s` = %lu ($%lX), line %lu", name, value, value, (ulong)def_line);
+
+    size_t addr;
+    instruction_t op;
+    flags_t flags;
+    line = json_get_number(params, "position.line") + 1;
+    if(incremental_instruction(d->inc, line, &addr, &op, &flags))
+    {
+        put(&text, "%s$%03lX: $%08lX, ", text.size ? "\n\n" : "", (ulong)addr, (ulong)op.raw);
+        if(flags.raw_command || flags.data)
+            put(&text, "data");
+        else
+            put(&text, "cycles: %s", opcode_cycles(&op));
+    }
+
+    if(!text.size)
+    {
+        put(b, "null");
+        return;
+    }
+    put(b, "{\"contents\":{\"kind\":\"markdown\",\"value\":");
+    put_string(b, text.data);
+    put(b, "}}");
+    free(text.data);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Handles the message @param msg.                               *
+*   @return 0 or the exit code after an exit notification         *
+*                                                                 *
+\*****************************************************************/
+static int handle_message(lsp_t* lsp, const json_t* msg)
+{
+    const char* method = json_get_string(msg, "method");
+    const json_t* id = json_get(msg, "id");
+    const json_t* params = json_get(msg, "params");
+    if(!method)
+        return -1;
+
+    if(!strcmp(method, "exit"))
+        return lsp->shutdown ? 0 : 1;
+
+    if(!strcmp(method, "textDocument/didOpen"))
+    {
+        const char* uri = json_get_string(params, "textDocument.uri");
+        const char* text = json_get_string(params, "textDocument.text");
+        if(!uri || !text || find_document(lsp, uri))
+            return -1;
+
+        document_t* d = calloc(1, sizeof(document_t));
+        if(!d || !(d->uri = strdup(uri)) || !(d->ctx = asm_context_new()) || !(d->inc = incremental_new()))
+            fatal("out of memory");
+        d->inc->keep_going = 1;
+        edit_document(d, 0, 0, text);
+
+        d->next = lsp->documents;
+        lsp->documents = d;
+        build_document(lsp, d);
+    }
+    else if(!strcmp(method, "textDocument/didChange"))
+    {
+        document_t* d = find_document(lsp, json_get_string(params, "textDocument.uri"));
+        const json_t* changes = json_get(params, "contentChanges");
+        if(!d || !changes)
+            return -1;
+
+        for(const json_t* c = changes->child; c; c = c->next)
+            change_document(d, c);
+        build_document(lsp, d);
+    }
+    else if(!strcmp(method, "textDocument/didClose"))
+    {
+        const char* uri = json_get_string(params, "textDocument.uri");
+        for(document_t** p = &lsp->documents; *p; p = &(*p)->next)
+        {
+            if(!strcmp((*p)->uri, uri ? uri : ""))
+            {
+                document_t* d = *p;
+                *p = d->next;
+                free_document(d);
+                break;
+            }
+        }
+    }
+
+    if(!id)
+        return -1; /* notifications are not answered */
+
+    buffer_t b = { 0 };
+    put(&b, "{\"jsonrpc\":\"2.0\",\"id\":");
+    put_id(&b, id);
+
+    if(!strcmp(method, "initialize"))
+    {
+        put(&b, ",\"result\":{\"capabilities\":{\"textDocumentSync\":{\"openClose\":true,\"change\":2},"
+            "\"definitionProvider\":true,\"referencesProvider\":true,\"hoverProvider\":true},"
+            "\"serverInfo\":{\"name\":\"ppasm\",\"version\":\"%d.%d\"}}}", VERSION_MAJOR, VERSION_MINOR);
+    }
+    else if(!strcmp(method, "shutdown"))
+    {
+        lsp->shutdown = 1;
+        put(&b, ",\"result\":null}");
+    }
+    else if(!strcmp(method, "textDocument/definition") || !strcmp(method, "textDocument/references") ||
+            !strcmp(method, "textDocument/hover"))
+    {
+        put(&b, ",\"result\":");
+        answer_query(lsp, method, params, &b);
+        put(&b, "}");
+    }
+    else
+        put(&b, ",\"error\":{\"code\":-32601,\"message\":\"method not found\"}}");
+
+    send_message(lsp, &b);
+    return -1;
+}
+
+/**************************************************************************\
+*                                                                          *
+*   Serves the language server protocol on @param in and @param out until  *
+*   the exit notification or the end of the input.                         *
+*   @return the exit code                                                  *
+*                                                                          *
+\**************************************************************************/
+int lsp_run(FILE* in, FILE* out)
+{
+    lsp_t lsp = { in, out, NULL, 0 };
+    int code = 1;
+    char* content;
+    while((content = read_message(&lsp)))
+    {
+        const char* p = content;
+        json_t* msg = json_value(&p);
+        if(!msg)
+        {
+            buffer_t b = { 0 };
+            put(&b, "{\"jsonrpc\":\"2.0\",\"id\":null,\"error\":{\"code\":-32700,\"message\":\"parse error\"}}");
+            send_message(&lsp, &b);
+        }
+        else
+        {
+            code = handle_message(&lsp, msg);
+            json_free(msg);
+        }
+        free(content);
+
+        if(code >= 0)
+            break;
+        code = 1;
+    }
+
+    while(lsp.documents)
+    {
+        document_t* d = lsp.documents;
+        lsp.documents = d->next;
+        free_document(d);
+    }
+    return code;
+}
@@ -0,0 +1,7 @@
+#ifndef LSP_H_INCLUDED
+#define LSP_H_INCLUDED
+#include "types.h"
+#include <stdio.h>
+
+int lsp_run(FILE* in, FILE* out);
+#endif // LSP_H_INCLUDED
@@ -4,36 +4,97 @@
 #include "assemble.h"
 #include "expression.h"
 #include "loader.h"
+#include "hotload.h"
+#include "monitor.h"
+#include "symmap.h"
+#include "variants.h"
+#include "context.h"
+#include "batch.h"
+#include "libppasm.h"
+#include "cache.h"
+#include "server.h"
+#include "incremental.h"
+#include "lsp.h"
+#include "preprocess.h"
+#include "snapshot.h"
+#include "ir.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
 #include <assert.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/inotify.h>
 
-u8 opt_verbose = 0;
-u8 opt_raw = 0;
 u8 opt_listing = 0;
+u8 opt_map = 0;
 u8 opt_propcmd = 0xFF;
-u16 num_ops = 0;
-FILE* vfile;
-const char serial_device[] = "/dev/ttyUSB0";
+u8 opt_compress = 0;
+u8 opt_if_changed = 0;
+const char* opt_telemetry = NULL;
+const char* opt_sysfs = "/sys";
+u8 opt_low_latency = 0;
+u8 opt_calibrate = 0;
+u8 opt_hot = 0;
+const char* opt_monitor = NULL;
+ulong opt_baud = 0;
+u8 opt_timestamps = 0;
+unsigned opt_jobs = 0;
+const char* opt_cache = NULL;
+const char* opt_server = NULL;
 
 #define HELPMSG1 "This is a Propeller P8A32 assembler by Konstantin Schlese (c) 2010 nulleight@gmail.com\n\
 version "
 #define HELPMSG2 " compiled at "
 #define HELPMSG3 "\nusage: ppasm [<options>...] <asmfile>\n\
+       ppasm [-j <threads>] [<options>...] <asmfile>...\n\
 options:\n\
         -r: raw output, no propeller tool bootloader\n\
         -l: generate listing file\n\
+        -m: write a symbol map <outfile>.map for --patch\n\
         -d: disassemble to stdout\n\
         -o <outfile>: specify the output file\n\
         -h: this help message\n\
         -v[0-9]: verbose level\n\
-        -u[0-4]: download a program to propeller\n\
+        -u[0-3]: download a program to propeller\n\
                  0 - get version and shutdown\n\
                  1 - download to ram and run\n\
-        -s <device>: serial port, where propeller is located"
+                 2 - download to eeprom and shutdown\n\
+                 3 - download to eeprom and run\n\
+        -e: write a 32K eeprom image instead of the binary\n\
+        -z: compressed download, loads a decompressor stub first if that is faster\n\
+        -j <threads>: assemble all the files at once into <asmfile>.binary each, one thread per core if not given\n\
+        -D <name>[=<value>]: define a macro for the preprocessor, 1 if no value is given\n\
+        -I <dir>: search #include files in dir too\n\
+        -MD: write the files the source includes as a make rule into <outfile>.d\n\
+        -s <device>: serial port, where propeller is located, all of them are searched if not given\n\
+        --if-changed: skip the EEPROM download if the device already has this image\n\
+        --telemetry <file>: append the timings of the download as a JSON record, - for stderr\n\
+        --low-latency: set the usb serial latency timer to 1 ms during the download, shows the handshake\n\
+                 time before and after the tuning\n\
+        --calibrate: find the shortest reliable reset timing of the board and use it for later downloads\n\
+        --hot <cog>: with -u1 start the program in cog 1-7 through a resident stub, without a reset once it runs\n\
+        --patch <image> <symbol>=<value>...: set labeled longs and constants of an image built with -m,\n\
+                 in place or into -o <outfile>\n\
+        --snapshot <header>: build <header>.syms, #include maps its constants instead of parsing the\n\
+                 header while the header doesn't change\n\
+        --dump-ir: write the binary IR of the source into -o <outfile>, out.pir if not given, ppasm\n\
+                 assembles it like the source\n\
+        --hot-emulator: stand in for a propeller with the resident stub on a pty\n\
+        --monitor <file>: after -u1 or -u3 capture what the program sends into the file, - for stdout\n\
+        --baud <rate>: baud rate of the program for --monitor, 115200 by default\n\
+        --timestamps: put the time in front of every line --monitor captures\n\
+        --variants <file>: parse once and write a binary for every \"<outfile> <symbol>=<value>...\" line of the file\n\
+        --cache <dir>: keep the outputs in dir and copy them from there when the same source is built again\n\
+        --cache-stats: show the hit rate of the --cache <dir>\n\
+        --serve <socket>: keep running and assemble for other ppasm processes on the unix socket\n\
+        --server <socket>: let the --serve process on the socket assemble, PPASM_SERVER sets it too\n\
+        --watch: build again every time the file is saved, only parsing the lines that changed,\n\
+                 and download it with -u\n\
+        --lsp: language server on stdin and stdout, for editors\n\
+        --sysfs <dir>: where sysfs is mounted, /sys by default"
 
 #define QUOTE_X(t) #t
 #define QUOTE(t)QUOTE_X(t)
@@ -42,35 +103,217 @@ options:\n\
 static const char helpmsg[] =
     HELPMSG1""QUOTE(VERSION_MAJOR)""DOT""QUOTE(VERSION_MINOR)""HELPMSG2""__DATE__""SPACE""__TIME__""HELPMSG3;
 
-const syntax_t parallax_syntax =
+static const char* infile = NULL;
+static const char** infiles = NULL; /* all the input files, for a batch */
+static size_t num_infiles = 0;
+static const char* outfile = NULL;
+static const char* serve_path = NULL;
+static const char* serial_device = NULL;
+static char** patches = NULL; /* symbol=value arguments of --patch */
+static size_t num_patches = 0;
+static void (*action)();
+static u8 opt_depfile = 0; /* -MD, write <outfile>.d for make */
+
+/*****************************************************************\
+*                                                                 *
+*   Reads the whole source @param filename into memory.           *
+*   @return the source, its size in @param len                    *
+*                                                                 *
+\*****************************************************************/
+static char* read_source(const char* filename, size_t* len)
 {
-    "'",
-    "{",
-    "}",
-    1,
-    1,
-    1,
-    '#',
-    ':'
-};
+    FILE* file = fopen(filename, "rb");
+    if(!file)
+        sys_error("error opening input file!");
+
+    char* src = NULL;
+    size_t size = 0;
+    *len = 0;
+    do
+    {
+        size = size ? size * 2 : 0x4000;
+        if(!(src = realloc(src, size)))
+            fatal("out of memory");
+        *len += fread(src + *len, 1, size - *len, file);
+    }
+    while(*len == size);
+
+    if(ferror(file))
+        sys_error("error reading input file!");
+    fclose(file);
+    return src;
+}
 
-const syntax_t c_syntax =
+/*****************************************************************\
+*                                                                 *
+*   Reads and preprocesses the source @param filename, with -MD   *
+*   writes the files it includes into a depfile for               *
+*   @param target. Sets @param key to its --cache key if it isn't *
+*   NULL.                                                         *
+*   @return the preprocessed source, its size in @param len       *
+*                                                                 *
+\*****************************************************************/
+static char* load_source(const char* filename, size_t* len, const char* target, u64* key)
 {
-    "//",
-    "/*",
-    "*/",
-    2,
-    2,
-    2,
-    '$',
-    '.'
-};
+    char* src = read_source(filename, len);
+    if(ir_detect(src, *len))
+    {
+        /* an IR has nothing to preprocess and nothing FILE copies in */
+        if(key)
+            *key = cache_key(src, *len);
+        return src;
+    }
 
-const syntax_t* syntax = &parallax_syntax; /* current syntax */
+    preprocessed_t pre;
+    preprocess(filename, src, *len, &pre);
+    free(src);
 
-static const char* infile = NULL;
-static const char* outfile = NULL;
-static void (*action)();
+    /* the files FILE copies in aren't in the text */
+    if(key)
+    {
+        *key = cache_key(pre.text, pre.len);
+        for(size_t i = 0; i < pre.num_blobs; i++)
+            *key = cache_key_file(*key, pre.blobs[i]);
+    }
+
+    if(opt_depfile && target)
+    {
+        /* foo.binary gets foo.d, the extension of a directory doesn't count */
+        size_t sz = strlen(target);
+        const char* dot = strrchr(target, '.');
+        if(dot && !strchr(dot, '/'))
+            sz = dot - target;
+        char depfile[sz + 3];
+        memcpy(depfile, target, sz);
+        strcpy(depfile + sz, ".d");
+        write_depfile(depfile, target, &pre);
+    }
+
+    src = pre.text;
+    *len = pre.len;
+    pre.text = NULL;
+    preprocessed_free(&pre);
+    return src;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Assembles the @param len bytes of @param src with the         *
+*   assembler @param ctx into @param image.                       *
+*   @return size of the image                                     *
+*                                                                 *
+\*****************************************************************/
+static size_t assemble_source(ppasm_t* ctx, const char* src, size_t len, u8* image)
+{
+    size_t imgsz;
+    ppasm_options_t options = { opt_raw, opt_eeprom };
+
+    if(ppasm_assemble(ctx, src, len, &options, image, PPASM_MAX_IMAGE, &imgsz))
+        fatal("%s", ppasm_error(ctx).message);
+
+    return imgsz;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Writes the listing of the assembled program as                *
+*   @param outfile.lst                                            *
+*                                                                 *
+\*****************************************************************/
+static void write_listing(const char* outfile)
+{
+    size_t sz = strlen(outfile);
+    char listfile[sz + 5];
+    memcpy(listfile, outfile, sz + 1);
+    strcat(listfile, ".lst");
+
+    FILE* file = fopen(listfile, "wb");
+    if(!file)
+        sys_error("error opening listing file!");
+
+    generate_listing(file, 0);
+    fclose(file);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Writes the @param image of @param imgsz bytes as              *
+*   @param outfile, and its symbol map as @param outfile.map      *
+*   with -m.                                                      *
+*                                                                 *
+\*****************************************************************/
+static void write_binary(const char* outfile, const u8* image, size_t imgsz)
+{
+    FILE* file = fopen(outfile, "wb");
+    if(!file)
+        sys_error("error opening output file!");
+
+    if(fwrite(image, 1, imgsz, file) != imgsz)
+        sys_error("error writing the image");
+
+    fclose(file);
+
+    if(opt_map)
+    {
+        size_t sz = strlen(outfile);
+        char mapfile[sz + 5];
+        memcpy(mapfile, outfile, sz + 1);
+        strcat(mapfile, ".map");
+
+        if(!(file = fopen(mapfile, "wb")))
+            sys_error("error opening symbol map file!");
+
+        symmap_write(file);
+        fclose(file);
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Assembles @param filename with asm_ctx into @param outfile,   *
+*   with its listing and symbol map, or copies them out of the    *
+*   --cache if they were built before. Only the binary can be     *
+*   assembled by a --server.                                      *
+*                                                                 *
+\*****************************************************************/
+static void build_file(const char* filename, const char* outfile)
+{
+    size_t len;
+    u64 key = 0;
+    char* src = load_source(filename, &len, outfile, opt_cache ? &key : NULL);
+
+    if(opt_cache)
+    {
+        if(cache_fetch(opt_cache, key, outfile))
+        {
+            free(src);
+            return;
+        }
+    }
+
+    /* a listing or a symbol map needs the program, only the image comes back from a server */
+    u8 image[PPASM_MAX_IMAGE];
+    size_t imgsz;
+    int served = -1;
+    if(opt_server && !opt_listing && !opt_map)
+    {
+        char error[MAX_ERROR_STRING_SIZE];
+        ppasm_options_t options = { opt_raw, opt_eeprom };
+        served = server_assemble(opt_server, src, len, &options, image, &imgsz, error, sizeof(error));
+        if(served == 1)
+            fatal("%s", error);
+    }
+    if(served)
+        imgsz = assemble_source(asm_ctx, src, len, image);
+    free(src);
+
+    if(opt_listing)
+        write_listing(outfile);
+    write_binary(outfile, image, imgsz);
+
+    if(opt_cache)
+        cache_store(opt_cache, key, outfile);
+}
 
 /*****************************************************************\
 *                                                                 *
@@ -82,47 +325,344 @@ void act_assemble()
     if(infile == NULL)
         fatal("error: input filename was not specified!");
 
-    FILE* file = fopen(infile, "rb");
-    if(!file)
-        sys_error("error opening input file!");
+    if(opt_variants && opt_propcmd != 0xFF)
+        fatal("error: --variants only writes files, it can't be combined with -u");
 
-    parse(file);
-    num_ops = count_instructions();
-
-    fclose(file);
+    if(opt_eeprom && opt_raw)
+        fatal("error: an eeprom image needs the propeller tool header, -e can't be used with -r");
 
     if(outfile == NULL)
         outfile = "out.binary";
 
-    if(opt_listing)
+    if(opt_propcmd == 0xFF && !opt_variants)
     {
-        size_t sz = strlen(outfile);
-        char listfile[sz + 5];
-        memcpy(listfile, outfile, sz + 1);
-        strcat(listfile, ".lst");
+        build_file(infile, outfile);
+        return;
+    }
 
-        if(!(file = fopen(listfile, "wb")))
-            sys_error("error opening listing file!");
+    /* the board is reset and connected while the program is assembled */
+    int pipelined = opt_propcmd != 0xFF && prop_can_begin(opt_propcmd);
+    if(pipelined)
+        prop_begin(serial_device, opt_propcmd);
 
-        generate_listing(file, 0);
-        fclose(file);
+    size_t len;
+    char* src = load_source(infile, &len, outfile, NULL);
+    u8 image[PPASM_MAX_IMAGE];
+    assemble_source(asm_ctx, src, len, image);
+    free(src);
+
+    if(opt_listing)
+        write_listing(outfile);
+
+    if(pipelined)
+        prop_end();
+    else if(opt_variants)
+        variants_build(opt_variants);
+    else
+        prop_action(serial_device, opt_propcmd);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Assembles the input file number @param job of a batch into    *
+*   <input>.binary, in a context of its own.                      *
+*                                                                 *
+\*****************************************************************/
+static void assemble_job(size_t job, void* arg)
+{
+    (void)arg;
+    asm_context_t* caller = asm_ctx;
+    if(!(asm_ctx = ppasm_new()))
+        fatal("out of memory");
+    asm_ctx->source = infiles[job];
+
+    /* foo.spin becomes foo.binary, the extension of a directory doesn't count */
+    size_t sz = strlen(infiles[job]);
+    const char* dot = strrchr(infiles[job], '.');
+    if(dot && !strchr(dot, '/'))
+        sz = dot - infiles[job];
+    char out[sz + 8];
+    memcpy(out, infiles[job], sz);
+    strcpy(out + sz, ".binary");
+
+    build_file(infiles[job], out);
+
+    ppasm_free(asm_ctx);
+    asm_ctx = caller;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   This is the "batch" action, it assembles all the input files  *
+*   at once on -j threads.                                        *
+*                                                                 *
+\*****************************************************************/
+void act_batch()
+{
+    if(opt_propcmd != 0xFF || opt_variants || outfile)
+        fatal("error: a batch writes <input>.binary next to every input, it can't be combined with -u, -o or --variants");
+
+    if(opt_eeprom && opt_raw)
+        fatal("error: an eeprom image needs the propeller tool header, -e can't be used with -r");
+
+    ulong t = get_time_ms();
+    unsigned threads = opt_jobs ? opt_jobs : batch_threads();
+    batch_run(num_infiles, threads, assemble_job, NULL);
+
+    if(opt_verbose)
+        printf("assembled %lu files on %u threads in %lu ms\n", (ulong)num_infiles,
+               threads < num_infiles ? threads : (unsigned)num_infiles, get_time_ms() - t);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   This is the "serve" action, it assembles for other ppasm      *
+*   processes on the --serve socket.                              *
+*                                                                 *
+\*****************************************************************/
+void act_serve()
+{
+    server_run(serve_path);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Builds the input file with @param inc into outfile, and       *
+*   downloads it with -u. Errors are shown, not fatal.            *
+*                                                                 *
+\*****************************************************************/
+static void watch_build(incremental_t* inc)
+{
+    jmp_buf error_jmp;
+    asm_ctx->error_jmp = &error_jmp;
+    if(setjmp(error_jmp))
+    {
+        asm_ctx->error_jmp = NULL;
+        fprintf(stderr, "%s\n", asm_ctx->error);
+        return;
     }
 
-    if(opt_propcmd != 0xFF)
+    u64 start = get_time_ns();
+    size_t len;
+    char* src = load_source(infile, &len, NULL, NULL);
+    if(ir_detect(src, len))
+    {
+        free(src);
+        fatal("error: --watch parses the lines that changed, %s is an IR", infile);
+    }
+    const char* errmsg = incremental_build(inc, src, len);
+    free(src);
+    if(errmsg)
+        fatal("%s", errmsg);
+
+    u8 image[PREAMBLE_SIZE + MAX_INSTRUCTIONS * 4];
+    size_t imgsz = create_image(image);
+    if(opt_eeprom)
     {
+        u8 eeprom[EEPROM_SIZE];
+        create_eeprom(eeprom, image, imgsz);
+        write_binary(outfile, eeprom, EEPROM_SIZE);
+    }
+    else if(opt_raw)
+        write_binary(outfile, image + PREAMBLE_SIZE, imgsz - PREAMBLE_SIZE);
+    else
+        write_binary(outfile, image, imgsz);
+
+    if(opt_listing)
+        write_listing(outfile);
+
+    printf("%s: %lu lines, %lu parsed, %lu of %lu fixups evaluated, %lu usec\n", infile, (ulong)inc->lines,
+           (ulong)inc->parsed, (ulong)inc->evaluated, (ulong)inc->fixups, (ulong)((get_time_ns() - start) / 1000));
+    fflush(stdout);
+
+    if(opt_propcmd != 0xFF)
         prop_action(serial_device, opt_propcmd);
+    asm_ctx->error_jmp = NULL;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   This is the "watch" action, it builds the input file again    *
+*   every time it is saved.                                       *
+*                                                                 *
+\*****************************************************************/
+void act_watch()
+{
+    if(infile == NULL)
+        fatal("error: input filename was not specified!");
+
+    if(opt_variants || opt_map)
+        fatal("error: --watch can't be combined with --variants or -m");
+
+    if(opt_eeprom && opt_raw)
+        fatal("error: an eeprom image needs the propeller tool header, -e can't be used with -r");
+
+    if(outfile == NULL)
+        outfile = "out.binary";
+
+    incremental_t* inc = incremental_new();
+    if(!inc)
+        fatal("out of memory");
+
+    /* editors often save into a new file and rename it over the old one, so the directory is watched */
+    const char* name = strrchr(infile, '/');
+    char dir[strlen(infile) + 2];
+    if(name)
+    {
+        memcpy(dir, infile, name - infile + 1);
+        dir[name - infile + 1] = 0;
+        name++;
     }
     else
     {
-        if(!(file = fopen(outfile, "wb")))
-            sys_error("error opening output file!");
+        strcpy(dir, ".");
+        name = infile;
+    }
 
-        assemble(file);
+    int fd = inotify_init();
+    if(fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        sys_error("can't watch the input file");
 
-        fclose(file);
+    for(;;)
+    {
+        watch_build(inc);
+
+        int saved = 0;
+        while(!saved)
+        {
+            char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t sz = read(fd, events, sizeof(events));
+            if(sz <= 0)
+                sys_error("can't watch the input file");
+
+            for(char* p = events; p < events + sz; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len)
+            {
+                const struct inotify_event* e = (const struct inotify_event*)p;
+                if(e->len && !strcmp(e->name, name))
+                    saved = 1;
+            }
+        }
     }
 }
 
+/*****************************************************************\
+*                                                                 *
+*   This is the "language server" action.                         *
+*                                                                 *
+\*****************************************************************/
+void act_lsp()
+{
+    exit(lsp_run(stdin, stdout));
+}
+
+/*****************************************************************\
+*                                                                 *
+*   This is the "cache stats" action, it tells how well the       *
+*   --cache does.                                                 *
+*                                                                 *
+\*****************************************************************/
+void act_cache_stats()
+{
+    if(!opt_cache)
+        fatal("error: --cache-stats needs the --cache <dir> to look at");
+
+    cache_stats(opt_cache, stdout);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   This is the "snapshot" action, it builds the symbol snapshot  *
+*   <asmfile>.syms #include maps instead of parsing the header.   *
+*                                                                 *
+\*****************************************************************/
+void act_snapshot()
+{
+    if(infile == NULL)
+        fatal("error: --snapshot needs the header to build it of");
+    if(outfile)
+        fatal("error: the snapshot is written next to the header, #include looks for it there, -o can't be used");
+
+    size_t len;
+    char* src = read_source(infile, &len);
+    char path[strlen(infile) + sizeof(SNAPSHOT_EXTENSION)];
+    snprintf(path, sizeof(path), "%s" SNAPSHOT_EXTENSION, infile);
+    snapshot_build(infile, src, len, path);
+    free(src);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   This is the "dump IR" action, it writes the IR of the source  *
+*   for code generators and for ppasm to load instead of it.      *
+*                                                                 *
+\*****************************************************************/
+void act_dump_ir()
+{
+    if(infile == NULL)
+        fatal("error: input filename was not specified!");
+
+    if(outfile == NULL)
+        outfile = "out" IR_EXTENSION;
+
+    size_t len;
+    char* src = load_source(infile, &len, outfile, NULL);
+    if(ir_detect(src, len))
+        fatal("error: %s already is an IR", infile);
+
+    FILE* file = fopen(outfile, "wb");
+    if(!file)
+        sys_error("error opening IR file!");
+    ir_write(src, len, file);
+    if(fclose(file))
+        sys_error("error writing IR file!");
+    free(src);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   This is the "patch" action, it sets symbols of a built image  *
+*   using the symbol map written next to it with -m.              *
+*                                                                 *
+\*****************************************************************/
+void act_patch()
+{
+    if(infile == NULL)
+        fatal("error: no image to patch was specified!");
+    if(!num_patches)
+        fatal("error: nothing to patch, give symbol=value arguments");
+
+    size_t sz = strlen(infile);
+    char mapfile[sz + 5];
+    memcpy(mapfile, infile, sz + 1);
+    strcat(mapfile, ".map");
+
+    /* patching a copy if there's an output file */
+    const char* image = infile;
+    if(outfile)
+    {
+        FILE* in = fopen(infile, "rb");
+        FILE* out = fopen(outfile, "wb");
+        if(!in || !out)
+            sys_error("error copying the image!");
+
+        char buff[4096];
+        size_t n;
+        while((n = fread(buff, 1, sizeof(buff), in)))
+        {
+            if(fwrite(buff, 1, n, out) != n)
+                sys_error("error copying the image!");
+        }
+        fclose(in);
+        if(fclose(out))
+            sys_error("error copying the image!");
+        image = outfile;
+    }
+
+    const char* errmsg = symmap_patch(image, mapfile, patches, num_patches);
+    if(errmsg)
+        fatal("error: %s", errmsg);
+}
+
 /*****************************************************************\
 *                                                                 *
 *   This is a "disassemble" action                                *
@@ -141,7 +681,12 @@ void act_disassemble()
     if(!opt_raw)
         fseek(file, PREAMBLE_SIZE, SEEK_SET); /* 0x20 is the size of propeller tool preamble */
 
-    size_t i = fread(program, 4, MAX_INSTRUCTIONS, file);
+    size_t i = fread(asm_ctx->program, 4, MAX_INSTRUCTIONS, file);
+
+    /* the symbol map of -m tells which longs FILE copied in */
+    char map[strlen(infile) + 8];
+    snprintf(map, sizeof(map), "%s.map", infile);
+    symmap_read_data(map);
     generate_listing(stdout, i);
 }
 
@@ -158,13 +703,23 @@ int main(int argc, char* argv[])
 
     vfile = stdout;
     action = act_assemble;
-    const char* serial_device = 0;
-
+    opt_server = getenv("PPASM_SERVER");
     for(int parmNum = 1; parmNum < argc; parmNum++)
     {
         if(argv[parmNum][0] != '-')
         {
-            infile = argv[parmNum];
+            if(strchr(argv[parmNum], '='))
+            {
+                if(!patches)
+                    patches = malloc(argc * sizeof(char*));
+                patches[num_patches++] = argv[parmNum];
+            }
+            else
+            {
+                if(!infiles)
+                    infiles = malloc(argc * sizeof(char*));
+                infile = infiles[num_infiles++] = argv[parmNum];
+            }
         }
         else
         {
@@ -182,6 +737,18 @@ int main(int argc, char* argv[])
                     opt_listing = 1;
                     break;
 
+                case 'm':
+                    opt_map = 1;
+                    break;
+
+                case 'z':
+                    opt_compress = 1;
+                    break;
+
+                case 'e':
+                    opt_eeprom = 1;
+                    break;
+
                 case 'u':
                     if(isdigit(argv[parmNum][2]) && argv[parmNum][2] - 0x30 < 4)
                         opt_propcmd = argv[parmNum][2] - 0x30;
@@ -207,6 +774,38 @@ int main(int argc, char* argv[])
                         fatal("error: no output specified with -o");
                     break;
 
+                case 'j':
+                    parmNum++;
+                    if(parmNum < argc && isdigit(argv[parmNum][0]))
+                        opt_jobs = strtoul(argv[parmNum], NULL, 10);
+                    if(!opt_jobs)
+                        fatal("error: -j needs the number of threads");
+                    break;
+
+                case 'D':
+                    if(argv[parmNum][2])
+                        preprocess_define(argv[parmNum] + 2);
+                    else if(++parmNum < argc)
+                        preprocess_define(argv[parmNum]);
+                    else
+                        fatal("error: no macro specified with -D");
+                    break;
+
+                case 'I':
+                    if(argv[parmNum][2])
+                        preprocess_include_dir(argv[parmNum] + 2);
+                    else if(++parmNum < argc)
+                        preprocess_include_dir(argv[parmNum]);
+                    else
+                        fatal("error: no directory specified with -I");
+                    break;
+
+                case 'M':
+                    if(strcmp(argv[parmNum], "-MD"))
+                        fatal("error: unknown option %s", argv[parmNum]);
+                    opt_depfile = 1;
+                    break;
+
                 case 's':
                     parmNum++;
                     if(parmNum < argc)
@@ -215,12 +814,116 @@ int main(int argc, char* argv[])
                         fatal("error: no device specified with -s");
                     break;
 
+                case '-':
+                    if(!strcmp(argv[parmNum], "--if-changed"))
+                        opt_if_changed = 1;
+                    else if(!strcmp(argv[parmNum], "--low-latency"))
+                        opt_low_latency = 1;
+                    else if(!strcmp(argv[parmNum], "--calibrate"))
+                        opt_calibrate = 1;
+                    else if(!strcmp(argv[parmNum], "--patch"))
+                        action = act_patch;
+                    else if(!strcmp(argv[parmNum], "--snapshot"))
+                        action = act_snapshot;
+                    else if(!strcmp(argv[parmNum], "--dump-ir"))
+                        action = act_dump_ir;
+                    else if(!strcmp(argv[parmNum], "--timestamps"))
+                        opt_timestamps = 1;
+                    else if(!strcmp(argv[parmNum], "--monitor"))
+                    {
+                        parmNum++;
+                        if(parmNum < argc)
+                            opt_monitor = argv[parmNum];
+                        else
+                            fatal("error: no file specified with --monitor");
+                    }
+                    else if(!strcmp(argv[parmNum], "--serve"))
+                    {
+                        parmNum++;
+                        if(parmNum < argc)
+                            serve_path = argv[parmNum];
+                        else
+                            fatal("error: no socket specified with --serve");
+                        action = act_serve;
+                    }
+                    else if(!strcmp(argv[parmNum], "--server"))
+                    {
+                        parmNum++;
+                        if(parmNum < argc)
+                            opt_server = argv[parmNum];
+                        else
+                            fatal("error: no socket specified with --server");
+                    }
+                    else if(!strcmp(argv[parmNum], "--watch"))
+                        action = act_watch;
+                    else if(!strcmp(argv[parmNum], "--lsp"))
+                        action = act_lsp;
+                    else if(!strcmp(argv[parmNum], "--cache-stats"))
+                        action = act_cache_stats;
+                    else if(!strcmp(argv[parmNum], "--cache"))
+                    {
+                        parmNum++;
+                        if(parmNum < argc)
+                            opt_cache = argv[parmNum];
+                        else
+                            fatal("error: no directory specified with --cache");
+                    }
+                    else if(!strcmp(argv[parmNum], "--variants"))
+                    {
+                        parmNum++;
+                        if(parmNum < argc)
+                            opt_variants = argv[parmNum];
+                        else
+                            fatal("error: no file specified with --variants");
+                    }
+                    else if(!strcmp(argv[parmNum], "--baud"))
+                    {
+                        parmNum++;
+                        if(parmNum < argc)
+                            opt_baud = strtoul(argv[parmNum], NULL, 10);
+                        if(!opt_baud || !monitor_speed(opt_baud))
+                            fatal("error: unsupported baud rate for --baud");
+                    }
+                    else if(!strcmp(argv[parmNum], "--hot-emulator"))
+                        action = hot_emulator_serve;
+                    else if(!strcmp(argv[parmNum], "--hot"))
+                    {
+                        parmNum++;
+                        if(parmNum < argc && isdigit(argv[parmNum][0]) && !argv[parmNum][1] &&
+                           argv[parmNum][0] > '0' && argv[parmNum][0] < '8')
+                            opt_hot = argv[parmNum][0] - 0x30;
+                        else
+                            fatal("error: --hot needs a cog from 1 to 7, the stub runs in cog 0");
+                    }
+                    else if(!strcmp(argv[parmNum], "--sysfs"))
+                    {
+                        parmNum++;
+                        if(parmNum < argc)
+                            opt_sysfs = argv[parmNum];
+                        else
+                            fatal("error: no directory specified with --sysfs");
+                    }
+                    else if(!strcmp(argv[parmNum], "--telemetry"))
+                    {
+                        parmNum++;
+                        if(parmNum < argc)
+                            opt_telemetry = argv[parmNum];
+                        else
+                            fatal("error: no file specified with --telemetry");
+                    }
+                    else
+                        fatal("error: unknown option %s", argv[parmNum]);
+                    break;
+
                 default:
                     fatal("error: unknown option %c", argv[parmNum][1]);
             }
         }
     }
 
+    if(action == act_assemble && (num_infiles > 1 || opt_jobs))
+        action = act_batch;
+
     action();
 
     return 0;
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE /* splice() */
+#include "monitor.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+/*
+The monitor copies whatever the propeller sends to a file until ^C or until the line
+hangs up. Plain captures go tty -> pipe -> file with splice(), the data never gets to
+user space. Timestamped captures need to see the line breaks, so they use big reads and
+put "[sec.usec] " in front of every line, counting from the start of the capture.
+*/
+
+static volatile sig_atomic_t stop = 0;
+
+/*****************************************************************\
+*                                                                 *
+*   Makes monitor() return, can be called from a signal handler.  *
+*                                                                 *
+\*****************************************************************/
+void monitor_stop()
+{
+    stop = 1;
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    monitor_stop();
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return the termios speed of @param baud or 0 if the serial   *
+*   driver has no such speed.                                     *
+*                                                                 *
+\*****************************************************************/
+speed_t monitor_speed(ulong baud)
+{
+    static const struct { ulong baud; speed_t speed; } speeds[] =
+    {
+        { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+        { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+        { 230400, B230400 }, { 460800, B460800 }, { 921600, B921600 },
+        #ifdef B1000000
+        { 1000000, B1000000 }, { 1500000, B1500000 }, { 2000000, B2000000 },
+        { 2500000, B2500000 }, { 3000000, B3000000 }, { 4000000, B4000000 },
+        #endif
+    };
+
+    for(unsigned i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+    {
+        if(speeds[i].baud == baud)
+            return speeds[i].speed;
+    }
+    return 0;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Waits until @param fd has data. @return non zero if it has,   *
+*   0 if the capture is over.                                     *
+*                                                                 *
+\*****************************************************************/
+static int wait_input(int fd)
+{
+    struct pollfd fds = { fd, POLLIN, 0 };
+
+    while(!stop)
+    {
+        if(poll(&fds, 1, -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            sys_error("poll failed");
+        }
+
+        if(fds.revents & POLLIN)
+            return 1;
+        if(fds.revents & (POLLHUP | POLLERR | POLLNVAL))
+            return 0;
+    }
+    return 0;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Writes @param size bytes of @param buff to @param out.        *
+*                                                                 *
+\*****************************************************************/
+static void write_out(int out, const char* buff, size_t size)
+{
+    while(size)
+    {
+        ssize_t n = write(out, buff, size);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            sys_error("failed to write the capture");
+        buff += n;
+        size -= n;
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Moves the data with splice(). @return bytes captured or -1    *
+*   if splice() doesn't work with @param fd or @param out.        *
+*                                                                 *
+\*****************************************************************/
+static ssize_t capture_splice(int fd, int out)
+{
+    int pipefd[2];
+    if(pipe(pipefd))
+        sys_error("failed to create a pipe");
+    fcntl(pipefd[0], F_SETPIPE_SZ, MONITOR_BUFFER_SIZE);
+
+    ssize_t total = 0;
+    int splice_out = !(fcntl(out, F_GETFL) & O_APPEND); /* splice() refuses appending files */
+    while(wait_input(fd))
+    {
+        ssize_t n = splice(fd, NULL, pipefd[1], NULL, MONITOR_BUFFER_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if(n < 0 && !total && (errno == EINVAL || errno == ENOSYS))
+        {
+            total = -1; /* this kernel can't splice from a tty */
+            break;
+        }
+        if(n <= 0)
+            break; /* EIO when the other end of the line is gone */
+
+        for(ssize_t left = n; left; )
+        {
+            ssize_t m = 0;
+            if(splice_out)
+            {
+                m = splice(pipefd[0], NULL, out, NULL, left, SPLICE_F_MOVE);
+                if(m < 0 && errno == EINTR)
+                    continue;
+                if(m < 0 && errno == EINVAL)
+                    splice_out = 0; /* not every output can be spliced to, copying it then */
+            }
+            if(!splice_out)
+            {
+                char buff[4096];
+                m = read(pipefd[0], buff, (size_t)left < sizeof(buff) ? (size_t)left : sizeof(buff));
+                if(m > 0)
+                    write_out(out, buff, m);
+            }
+            if(m <= 0)
+                sys_error("failed to write the capture");
+            left -= m;
+        }
+        total += n;
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return total;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Moves the data with buffered reads, putting a timestamp in    *
+*   front of every line if @param timestamps is set.              *
+*   @return bytes captured                                        *
+*                                                                 *
+\*****************************************************************/
+static u64 capture_read(int fd, int out, int timestamps)
+{
+    static char buff[MONITOR_BUFFER_SIZE];
+    static char stamped[MONITOR_BUFFER_SIZE * 2];
+    u64 total = 0, start = get_time_ns();
+    int line_start = 1;
+
+    while(wait_input(fd))
+    {
+        ssize_t n = read(fd, buff, sizeof(buff));
+        if(n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if(n <= 0)
+            break;
+        total += n;
+
+        if(!timestamps)
+        {
+            write_out(out, buff, n);
+            continue;
+        }
+
+        /* every byte gets the same time, it is when the chunk arrived */
+        u64 t = get_time_ns() - start;
+        char stamp[32];
+        int stampsz = snprintf(stamp, sizeof(stamp), "[%lu.%06lu] ",
+                               (ulong)(t / 1000000000), (ulong)(t / 1000 % 1000000));
+        size_t used = 0;
+        for(ssize_t i = 0; i < n; i++)
+        {
+            if(used + stampsz + 1 > sizeof(stamped))
+            {
+                write_out(out, stamped, used);
+                used = 0;
+            }
+            if(line_start)
+            {
+                memcpy(stamped + used, stamp, stampsz);
+                used += stampsz;
+            }
+            stamped[used++] = buff[i];
+            line_start = buff[i] == '\n';
+        }
+        write_out(out, stamped, used);
+    }
+
+    return total;
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Captures everything coming from @param fd into @param out until ^C or the   *
+*   line hangs up, with a timestamp on every line if @param timestamps is set.  *
+*   @return bytes captured                                                      *
+*                                                                               *
+\*******************************************************************************/
+u64 monitor(int fd, int out, int timestamps)
+{
+    struct sigaction sa, oldint, oldterm;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal; /* no SA_RESTART, poll() has to return */
+    sigaction(SIGINT, &sa, &oldint);
+    sigaction(SIGTERM, &sa, &oldterm);
+    stop = 0;
+
+    u64 total = 0;
+    if(!timestamps)
+    {
+        ssize_t n = capture_splice(fd, out);
+        if(n >= 0)
+            total = n;
+        else
+            timestamps = -1; /* falling back to reads */
+    }
+    if(timestamps)
+        total = capture_read(fd, out, timestamps > 0);
+
+    sigaction(SIGINT, &oldint, NULL);
+    sigaction(SIGTERM, &oldterm, NULL);
+    return total;
+}
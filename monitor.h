@@ -0,0 +1,12 @@
+#ifndef MONITOR_H_INCLUDED
+#define MONITOR_H_INCLUDED
+#include "types.h"
+#include <stdlib.h>
+#include <termios.h>
+
+#define MONITOR_BUFFER_SIZE 0x10000 /* bytes moved per read or splice */
+
+speed_t monitor_speed(ulong baud);
+u64 monitor(int fd, int out, int timestamps);
+void monitor_stop();
+#endif // MONITOR_H_INCLUDED
@@ -137,3 +137,37 @@ pair_t special_regs[] = {
 { "vcfg", 0x1FE },
 { "vcsl", 0x1FF }
 };
+
+/*****************************************************************\
+*                                                                 *
+*   @return the clock cycles instruction @param op takes, as the  *
+*   datasheet gives them.                                         *
+*                                                                 *
+\*****************************************************************/
+const char* opcode_cycles(const instruction_t* op)
+{
+    switch(op->data.opcode)
+    {
+        case OP_RDBYTE:
+        case OP_RDWORD:
+        case OP_RDLONG:
+        case OP_HUBOP:
+            return "8..23, waits for the hub";
+
+        case OP_DJNZ:
+        case OP_TJNZ:
+        case OP_TJZ:
+            return "4 if it jumps, 8 if not";
+
+        case OP_WAITCNT:
+        case OP_WAITPEQ:
+        case OP_WAITPNE:
+            return "6+";
+
+        case OP_WAITVID:
+            return "4+";
+
+        default:
+            return "4";
+    }
+}
@@ -147,4 +147,6 @@ extern op_pair_t opcodes[]; /* table of opcodes */
 extern pair_t if_pairs[];  /* table of if prefixes */
 extern pair_t special_regs[];
 
+const char* opcode_cycles(const instruction_t* op);
+
 #endif // OPCODES_H_INCLUDED
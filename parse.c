@@ -3,23 +3,20 @@
 #include "assemble.h"
 #include "expression.h"
 #include "stringext.h"
+#include "symmap.h"
+#include "variants.h"
+#include "context.h"
+#include "snapshot.h"
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <assert.h>
 #include <strings.h>
-
-VECTOR_DECLARE(veclable, pair_t);
-extern veclable symtable;
-
-instruction_t   program[MAX_INSTRUCTIONS];
-flags_t         flags[MAX_INSTRUCTIONS];
-u16 must_fit_in = MAX_INSTRUCTIONS; /* FIT directive argument */
-
-
-static size_t       curr_op = 0, line_num = 0;
-static const char*  last_label = 0;
-static char*        token = 0;
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 DECLARE_FIND(op_pair_t);
 DECLARE_FIND(pair_t);
@@ -74,11 +71,11 @@ int is_valid_label(const char* str)
 \*****************************************************************/
 static const char* parse_num(expression_t** exp)
 {
-    if(!token)
+    if(!asm_ctx->token)
         return "no number found";
 
     ulong num;
-    const char* errmsg = string_to_number(token, &num);
+    const char* errmsg = string_to_number(asm_ctx->token, &num);
     if(errmsg)
         return errmsg;
 
@@ -89,7 +86,7 @@ static const char* parse_num(expression_t** exp)
     if(opt_verbose > 4)
         fprintf(vfile, "\t\tnumber %lu\n", num);
 
-    token = read_next();
+    asm_ctx->token = read_next();
     return 0;
 }
 
@@ -102,20 +99,20 @@ static const char* parse_num(expression_t** exp)
 \*****************************************************************/
 static const char* parse_ref_label(expression_t** exp)
 {
-    if(!token || *token == 0)
+    if(!asm_ctx->token || *asm_ctx->token == 0)
         return "empty label";
 
-    if(is_valid_label(token))
+    if(is_valid_label(asm_ctx->token))
     {
-        if(is_local_label(token))
+        if(is_local_label(asm_ctx->token))
         {
-            if(!last_label)
+            if(!asm_ctx->last_label)
                 return "trying to reference a local lable without global one";
 
-            size_t labelsz = strlen(last_label) + strlen(token);
+            size_t labelsz = strlen(asm_ctx->last_label) + strlen(asm_ctx->token);
             char tmp_name[labelsz + 1];
-            strcpy(tmp_name, last_label);
-            strcat(tmp_name, token);
+            strcpy(tmp_name, asm_ctx->last_label);
+            strcat(tmp_name, asm_ctx->token);
 
             *exp = malloc(sizeof(expression_t));
             (*exp)->type = EXP_LABEL;
@@ -125,13 +122,13 @@ static const char* parse_ref_label(expression_t** exp)
         {
             *exp = malloc(sizeof(expression_t));
             (*exp)->type = EXP_LABEL;
-            (*exp)->data.label = strdup(token);
+            (*exp)->data.label = strdup(asm_ctx->token);
         }
 
         if(opt_verbose > 4)
             fprintf(vfile, "\t\tref label \"%s\"\n", (*exp)->data.label);
 
-        token = read_next();
+        asm_ctx->token = read_next();
         return 0;
     }
 
@@ -145,9 +142,9 @@ static const char* parse_ref_label(expression_t** exp)
 \************************************************************************/
 static const char* parse_special(expression_t** exp, unsigned bad)
 {
-    size_t tokensz = strlen(token);
+    size_t tokensz = strlen(asm_ctx->token);
     char lcas_token[tokensz + 1];
-    lower_case(token, lcas_token, tokensz);
+    lower_case(asm_ctx->token, lcas_token, tokensz);
 
     pair_t p;
     p.string = lcas_token;
@@ -157,17 +154,17 @@ static const char* parse_special(expression_t** exp, unsigned bad)
         if(i > bad)
         {
             if(opt_verbose > 4)
-                fprintf(vfile, "\t\tspecial dest register\"%s\"\n", token);
+                fprintf(vfile, "\t\tspecial dest register\"%s\"\n", asm_ctx->token);
 
             *exp = malloc(sizeof(expression_t));
             (*exp)->type = EXP_NUMBER;
             (*exp)->data.number = special_regs[i].value;
 
-            token = read_next();
+            asm_ctx->token = read_next();
             return 0;
         }
         else
-            fatal("error: line: %lu, this register is read only(can only be a source)", line_num);
+            fatal("error: line: %lu, this register is read only(can only be a source)", asm_ctx->line_num);
     }
     return "not a special register";
 }
@@ -180,7 +177,7 @@ static const char* parse_special(expression_t** exp, unsigned bad)
 \**************************************************************************************************/
 static const char* parse_expression(expression_t** exp)
 {
-    if(!token || *token == 0)
+    if(!asm_ctx->token || *asm_ctx->token == 0)
         return "error parsing expression";
 
     if(parse_num(exp))
@@ -195,16 +192,17 @@ static const char* parse_expression(expression_t** exp)
     }
 
     (*exp)->type |= '+'; /* default operator */
+    (*exp)->next = NULL;
     expression_t** e = &((*exp)->next);
 
-    while(token && *token != 0 && is_valid_operator(*token))
+    while(asm_ctx->token && *asm_ctx->token != 0 && is_valid_operator(*asm_ctx->token))
     {
-        u8 op = *token;
-        token = read_next();
+        u8 op = *asm_ctx->token;
+        asm_ctx->token = read_next();
 
         if(parse_num(e))
         {
-            if(parse_special(exp, 0))
+            if(parse_special(e, 0))
             {
                 if(parse_ref_label(e))
                 {
@@ -215,6 +213,7 @@ static const char* parse_expression(expression_t** exp)
         }
 
         (*e)->type |= op;
+        (*e)->next = NULL;
         e = &((*e)->next);
     }
 
@@ -227,63 +226,56 @@ static const char* parse_expression(expression_t** exp)
 \*****************************************************************/
 static const char* parse_addr_label()
 {
-    if(is_valid_label(token))
+    if(is_valid_label(asm_ctx->token))
     {
-        size_t lpos = 0;
-
-        if(is_local_label(token))
+        if(is_local_label(asm_ctx->token))
         {
-            if(!last_label)
+            if(!asm_ctx->last_label)
                 return "trying to create local lable without global one";
 
-            size_t labelsz = strlen(last_label) + strlen(token);
+            size_t labelsz = strlen(asm_ctx->last_label) + strlen(asm_ctx->token);
             char tmp_name[labelsz + 1];
-            strcpy(tmp_name, last_label);
-            strcat(tmp_name, token);
+            strcpy(tmp_name, asm_ctx->last_label);
+            strcat(tmp_name, asm_ctx->token);
 
-            pair_t p;
-            p.string = tmp_name;
-            lpos = pair_t_find(&p, symtable.element, symtable.size, &pair_t_compare_string);
-            if(lpos != symtable.size)
+            if(symtable_lookup(tmp_name, NULL))
                 fatal("label %s was already defined!", tmp_name);
 
-            pair_t label = {strdup(tmp_name), curr_op};
-            veclable_push_back(&symtable, label);
+            pair_t label = {strdup(tmp_name), asm_ctx->curr_op};
+            symtable_add(label);
         }
         else
         {
-            pair_t p;
-            p.string = token;
-            lpos = pair_t_find(&p, symtable.element, symtable.size, &pair_t_compare_string);
-            if(lpos != symtable.size)
-                fatal("label %s was already defined!", token);
-
-            pair_t label = {strdup(token), curr_op};
-            last_label = label.string;
-            veclable_push_back(&symtable, label);
+            if(symtable_lookup(asm_ctx->token, NULL))
+                fatal("label %s was already defined!", asm_ctx->token);
+
+            pair_t label = {strdup(asm_ctx->token), asm_ctx->curr_op};
+            asm_ctx->last_label = label.string;
+            symtable_add(label);
         }
 
         if(opt_verbose > 4)
-            fprintf(vfile, "adding label \"%s\" address %lu line %lu to symbol table\n", symtable.element[symtable.size - 1].string, curr_op, line_num);
+            fprintf(vfile, "adding label \"%s\" address %lu line %lu to symbol table\n", asm_ctx->symtable.element[asm_ctx->symtable.size - 1].string, asm_ctx->curr_op, asm_ctx->line_num);
    }
     else
         return "invalid label";
 
-    token = read_next();
+    asm_ctx->token = read_next();
 
-    if(token && (*token == '=' || !strcasecmp(token, "equ")))
+    if(asm_ctx->token && (*asm_ctx->token == '=' || !strcasecmp(asm_ctx->token, "equ")))
     {
-        token = read_next();
-        if(!token)
+        asm_ctx->token = read_next();
+        if(!asm_ctx->token)
             return "no equ/= argument!";
 
         ulong num;
-        if(string_to_number(token, &num))
+        if(string_to_number(asm_ctx->token, &num))
             return "error parsing after equ/=";
 
-        symtable.element[symtable.size - 1].value = num;
+        asm_ctx->symtable.element[asm_ctx->symtable.size - 1].value = num;
+        symmap_constant(asm_ctx->symtable.element[asm_ctx->symtable.size - 1].string);
 
-        token = read_next();
+        asm_ctx->token = read_next();
     }
 
 
@@ -297,31 +289,31 @@ static const char* parse_addr_label()
 \*****************************************************************/
 static const char* parse_flags()
 {
-    if(token && strlen(token) == 2 && !is_comment(token))
+    if(asm_ctx->token && strlen(asm_ctx->token) == 2 && !is_comment(asm_ctx->token))
     {
-        u8 c1 = tolower(token[0]);
-        u8 c2 = tolower(token[1]);
+        u8 c1 = tolower(asm_ctx->token[0]);
+        u8 c2 = tolower(asm_ctx->token[1]);
 
         if(c1 == 'n' && c2 == 'r')
         {
-            program[curr_op].data.z = 0;
-            program[curr_op].data.c = 0;
-            program[curr_op].data.r = 0;
+            asm_ctx->program[asm_ctx->curr_op].data.z = 0;
+            asm_ctx->program[asm_ctx->curr_op].data.c = 0;
+            asm_ctx->program[asm_ctx->curr_op].data.r = 0;
         }
         else if(c1 == 'w')
         {
             switch(c2)
             {
                 case 'z':
-                    program[curr_op].data.z = 1;
+                    asm_ctx->program[asm_ctx->curr_op].data.z = 1;
                     break;
 
                 case 'c':
-                    program[curr_op].data.c = 1;
+                    asm_ctx->program[asm_ctx->curr_op].data.c = 1;
                     break;
 
                 case 'r':
-                    program[curr_op].data.r = 1;
+                    asm_ctx->program[asm_ctx->curr_op].data.r = 1;
                     break;
 
                 default:
@@ -337,7 +329,7 @@ static const char* parse_flags()
     else
         return "invalid flag";
 
-    token = read_next();
+    asm_ctx->token = read_next();
     return 0;
 
 }
@@ -350,9 +342,9 @@ static const char* parse_flags()
 \*****************************************************************/
 static const char* parse_ifs()
 {
-    size_t tokensz = strlen(token);
+    size_t tokensz = strlen(asm_ctx->token);
     char lcas_token[tokensz + 1];
-    lower_case(token, lcas_token, tokensz);
+    lower_case(asm_ctx->token, lcas_token, tokensz);
 
     if(lcas_token[0] == 'i' && lcas_token[1] == 'f' && lcas_token[2] == '_')
     {
@@ -361,19 +353,19 @@ static const char* parse_ifs()
         size_t i = pair_t_find(&p, if_pairs, NUM_IFS, &pair_t_compare_string);
         if(i != NUM_IFS)
         {
-            program[curr_op].data.cond = if_pairs[i].value;
+            asm_ctx->program[asm_ctx->curr_op].data.cond = if_pairs[i].value;
 
             if(opt_verbose > 4)
-                fprintf(vfile, "\tprefix \"%s\"\n", token);
+                fprintf(vfile, "\tprefix \"%s\"\n", asm_ctx->token);
 
-            token = read_next();
+            asm_ctx->token = read_next();
             return 0;
         }
     }
 
     /* default condition, only nop has 0b0000 by default
     which is overwritten by a special case anyway */
-    program[curr_op].data.cond = 0b1111;
+    asm_ctx->program[asm_ctx->curr_op].data.cond = 0b1111;
     return "unknown IF_ predicate";
 }
 
@@ -384,10 +376,10 @@ static const char* parse_ifs()
 \*****************************************************************/
 static const char* parse_dest()
 {
-    if(!token || *token == 0)
+    if(!asm_ctx->token || *asm_ctx->token == 0)
         return "error processing instruction source";
 
-    return parse_expression(&unresolved_dest[curr_op]);
+    return parse_expression(&asm_ctx->unresolved_dest[asm_ctx->curr_op]);
 }
 
 
@@ -397,18 +389,18 @@ static const char* parse_dest()
 \*****************************************************************/
 static const char* parse_src()
 {
-    if(!token || *token == 0)
+    if(!asm_ctx->token || *asm_ctx->token == 0)
         return "error processing instruction source";
 
-    if(*token == syntax->immediate_prefix) /* immediate? */
+    if(*asm_ctx->token == syntax->immediate_prefix) /* immediate? */
     {
-        program[curr_op].data.imm = 1;
-        token++; /* skip syntax->immediate_prefix */
+        asm_ctx->program[asm_ctx->curr_op].data.imm = 1;
+        asm_ctx->token++; /* skip syntax->immediate_prefix */
 
-        if(*token == 0)
+        if(*asm_ctx->token == 0)
         {
-            token = read_next();
-            if(!token || *token == 0)
+            asm_ctx->token = read_next();
+            if(!asm_ctx->token || *asm_ctx->token == 0)
                 return "nothing after immediate symbol";
         }
 
@@ -416,44 +408,160 @@ static const char* parse_src()
             fprintf(vfile, "\t\timmediate\n");
     }
 
-    return parse_expression(&unresolved_src[curr_op]);
+    return parse_expression(&asm_ctx->unresolved_src[asm_ctx->curr_op]);
 }
 
 u8 alignment;
 
+/*****************************************************************\
+*   Parses FILE "path" [offset [length]] [BYTE|WORD|LONG], the    *
+*   file is mapped and copied into the program from curr_op on,   *
+*   a long for every byte, word or long of it, LONG by default.   *
+*   @return error message or 0 if everything is ok.               *
+\*****************************************************************/
+static const char* parse_file()
+{
+    const char* name = read_string();
+    if(!name)
+        return "FILE needs a \"path\"";
+    char path[strlen(name) + 1];
+    strcpy(path, name);
+
+    /* string_to_number() sets its result even if it fails */
+    ulong offset = 0, length = (ulong)-1, num;
+    unsigned unit = 4;
+    asm_ctx->token = read_next();
+    if(asm_ctx->token && !is_comment(asm_ctx->token) && !string_to_number(asm_ctx->token, &num))
+    {
+        offset = num;
+        asm_ctx->token = read_next();
+        if(asm_ctx->token && !is_comment(asm_ctx->token) && !string_to_number(asm_ctx->token, &num))
+        {
+            length = num;
+            asm_ctx->token = read_next();
+        }
+    }
+    if(asm_ctx->token && !is_comment(asm_ctx->token))
+    {
+        if(!strcasecmp(asm_ctx->token, "byte"))
+            unit = 1;
+        else if(!strcasecmp(asm_ctx->token, "word"))
+            unit = 2;
+        else if(strcasecmp(asm_ctx->token, "long"))
+            return "FILE takes an offset, a length and BYTE, WORD or LONG";
+        asm_ctx->token = read_next();
+    }
+
+    /* the errors don't end --serve, --lsp or --watch, fd is closed before each */
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st))
+    {
+        const char* err = strerror(errno);
+        if(fd >= 0)
+            close(fd);
+        fatal("line %lu: can't open FILE \"%s\": %s", asm_ctx->line_num, path, err);
+    }
+    if(offset > (ulong)st.st_size)
+    {
+        close(fd);
+        fatal("line %lu: FILE \"%s\" has only %lu bytes", asm_ctx->line_num, path, (ulong)st.st_size);
+    }
+    if(length > st.st_size - offset)
+        length = st.st_size - offset;
+
+    size_t longs = (length + unit - 1) / unit;
+    if(asm_ctx->curr_op + longs > asm_ctx->must_fit_in || asm_ctx->curr_op + longs > MAX_INSTRUCTIONS)
+    {
+        close(fd);
+        fatal("line %lu: FILE \"%s\" doesn't fit, it needs %lu longs", asm_ctx->line_num, path, (ulong)longs);
+    }
+
+    /* the mapping begins on a page */
+    size_t skip = offset % sysconf(_SC_PAGESIZE);
+    const u8* data = NULL;
+    if(length)
+    {
+        void* map = mmap(NULL, length + skip, PROT_READ, MAP_PRIVATE, fd, offset - skip);
+        if(map == MAP_FAILED)
+        {
+            const char* err = strerror(errno);
+            close(fd);
+            fatal("line %lu: can't map FILE \"%s\": %s", asm_ctx->line_num, path, err);
+        }
+        data = (const u8*)map + skip;
+    }
+    close(fd);
+
+    instruction_t* op = &asm_ctx->program[asm_ctx->curr_op];
+#if defined(PPASM_LITTLE_ENDIAN)
+    if(unit == 4)
+    {
+        memcpy(op, data, length);
+        memset((u8*)op + length, 0, longs * 4 - length);
+    }
+    else
+#endif
+    for(size_t i = 0; i < longs; i++)
+    {
+        u32 l = 0;
+        for(unsigned b = 0; b < unit && i * unit + b < length; b++)
+            l |= (u32)data[i * unit + b] << (b * 8);
+        op[i].raw = l;
+    }
+    if(length)
+        munmap((void*)(data - skip), length + skip);
+
+    for(size_t i = 0; i < longs; i++)
+    {
+        asm_ctx->flags[asm_ctx->curr_op + i].valid = 1;
+        asm_ctx->flags[asm_ctx->curr_op + i].data = 1;
+    }
+    if(longs && asm_ctx->line_op == (size_t)-1)
+        asm_ctx->line_op = asm_ctx->curr_op;
+    asm_ctx->curr_op += longs;
+
+    /* --watch doesn't keep the line, the file can change without it */
+    asm_ctx->directive_seen = 1;
+    return 0;
+}
+
 /*****************************************************************\
 *   Parses opcodes                                                *
 *   @return error message or 0 if everything is ok.               *
 \*****************************************************************/
 static const char* parse_opcode()
 {
-    if(!token || is_comment(token))
+    if(!asm_ctx->token || is_comment(asm_ctx->token))
         return 0;
 
-    if(curr_op > must_fit_in)
-        fatal("program doesn't fit in %u longs", must_fit_in);
+    if(asm_ctx->curr_op > asm_ctx->must_fit_in)
+        fatal("program doesn't fit in %u longs", asm_ctx->must_fit_in);
 
     parse_ifs();
 
-    if(!token)
+    if(!asm_ctx->token)
         return "opcode is missing";
 
-    size_t tokensz = strlen(token);
+    size_t tokensz = strlen(asm_ctx->token);
     char lcas_token[tokensz + 1];
-    lower_case(token, lcas_token, tokensz);
+    lower_case(asm_ctx->token, lcas_token, tokensz);
 
     /* special case NOP handling */
     if(!strcmp(lcas_token, "nop"))
     {
-        program[curr_op].raw = 0;
-        token = read_next();
+        asm_ctx->program[asm_ctx->curr_op].raw = 0;
+        asm_ctx->token = read_next();
     }
+    /* FILE copies a whole file, it can have a label like LONG */
+    else if(!strcmp(lcas_token, "file"))
+        return parse_file();
     /* special case LONG handling */
     else if(!strcmp(lcas_token, "long"))
     {
-        token = read_next();
-        parse_expression(&unresolved_src[curr_op]);
-        flags[curr_op].raw_command = 7;
+        asm_ctx->token = read_next();
+        parse_expression(&asm_ctx->unresolved_src[asm_ctx->curr_op]);
+        asm_ctx->flags[asm_ctx->curr_op].raw_command = 7;
     }
     else
     {
@@ -464,24 +572,24 @@ static const char* parse_opcode()
             return "unknown opcode";
 
         if(opt_verbose > 4)
-            fprintf(vfile, "\topcode \"%s\"\n", token);
+            fprintf(vfile, "\topcode \"%s\"\n", asm_ctx->token);
 
-        program[curr_op].data.opcode = opcodes[i].value;
+        asm_ctx->program[asm_ctx->curr_op].data.opcode = opcodes[i].value;
 
         /* assigning default flags */
-        program[curr_op].data.z = opcodes[i].flags.z;
-        program[curr_op].data.c = opcodes[i].flags.c;
-        program[curr_op].data.r = opcodes[i].flags.r;
-        program[curr_op].data.imm = opcodes[i].flags.imm;
+        asm_ctx->program[asm_ctx->curr_op].data.z = opcodes[i].flags.z;
+        asm_ctx->program[asm_ctx->curr_op].data.c = opcodes[i].flags.c;
+        asm_ctx->program[asm_ctx->curr_op].data.r = opcodes[i].flags.r;
+        asm_ctx->program[asm_ctx->curr_op].data.imm = opcodes[i].flags.imm;
 
         /* check if we need special value in src register */
         if(opcodes[i].flags.predefined_src)
         {
-            program[curr_op].data.src = opcodes[i].src;
-            program[curr_op].data.srch = 0;
+            asm_ctx->program[asm_ctx->curr_op].data.src = opcodes[i].src;
+            asm_ctx->program[asm_ctx->curr_op].data.srch = 0;
         }
 
-        token = read_next();
+        asm_ctx->token = read_next();
 
         /* processing destination */
         if(opcodes[i].flags.need_dest)
@@ -502,8 +610,11 @@ static const char* parse_opcode()
         while(!parse_flags()); /* parse all valid w* flags */
     }
 
-    flags[curr_op].valid = 1; /* marking current instruction as valid */
-    curr_op++;
+    if(asm_ctx->line_op == (size_t)-1)
+        asm_ctx->line_op = asm_ctx->curr_op;
+
+    asm_ctx->flags[asm_ctx->curr_op].valid = 1; /* marking current instruction as valid */
+    asm_ctx->curr_op++;
     return 0;
 }
 
@@ -513,139 +624,355 @@ static const char* parse_opcode()
 \*****************************************************************/
 static const char* parse_directives()
 {
-    size_t tokensz = strlen(token);
+    size_t tokensz = strlen(asm_ctx->token);
     char lcas_token[tokensz + 1];
-    lower_case(token, lcas_token, tokensz);
+    lower_case(asm_ctx->token, lcas_token, tokensz);
 
     if(!strcmp(lcas_token, "fit"))
     {
         if(opt_verbose > 4)
             fprintf(vfile, "\tdirective FIT\n");
 
-        token = read_next();
+        asm_ctx->token = read_next();
 
         ulong num;
-        if(string_to_number(token, &num))
-            fatal("line %lu: error parsing FIT argument", line_num);
+        if(string_to_number(asm_ctx->token, &num))
+            fatal("line %lu: error parsing FIT argument", asm_ctx->line_num);
 
-        token = read_next();
-        must_fit_in = num;
+        asm_ctx->token = read_next();
+        asm_ctx->must_fit_in = num;
     }
     else if(!strcmp(lcas_token, "org"))
     {
         if(opt_verbose > 4)
             fprintf(vfile, "\tdirective ORG\n");
 
-        token = read_next();
+        asm_ctx->token = read_next();
 
         ulong num;
-        if(string_to_number(token, &num))
+        if(string_to_number(asm_ctx->token, &num))
             fatal("error parsing ORG argument");
 
-        curr_op = num;
-        token = read_next();
+        asm_ctx->curr_op = num;
+        asm_ctx->token = read_next();
     }
     else if(!strcmp(lcas_token, "res"))
     {
         if(opt_verbose > 4)
             fprintf(vfile, "\tdirective RES\n");
 
-        token = read_next();
+        asm_ctx->token = read_next();
 
         ulong num;
-        if(string_to_number(token, &num))
+        if(string_to_number(asm_ctx->token, &num))
             fatal("error parsing RES argument");
 
-        curr_op += num;
-        token = read_next();
+        asm_ctx->curr_op += num;
+        asm_ctx->token = read_next();
     }
-    else if(!strcmp(token, "_CLKFREQ"))
+    else if(!strcmp(asm_ctx->token, "_CLKFREQ"))
     {
         if(opt_verbose > 4)
             fprintf(vfile, "\tdirective _CLKFREQ\n");
 
-        token = read_next();
+        asm_ctx->token = read_next();
 
         ulong num;
-        if(string_to_number(token, &num))
+        if(string_to_number(asm_ctx->token, &num))
             fatal("error parsing _CLKFREQ argument");
 
-        clkfreq = num;
-        token = read_next();
+        asm_ctx->clkfreq = num;
+        asm_ctx->token = read_next();
     }
-    else if(!token || is_comment(lcas_token))
+    else if(!asm_ctx->token || is_comment(lcas_token))
     {
-
+        return 0;
     }
     else
         return "unknown directive";
 
+    asm_ctx->directive_seen = 1;
     return 0;
 }
 
 /*****************************************************************\
-*   Parses the file @param filename                               *
+*   Starts parsing a new program into asm_ctx                     *
 \*****************************************************************/
-void parse(FILE* file)
+void parse_begin()
 {
-    memset(program, 0, sizeof(instruction_t) * MAX_INSTRUCTIONS); /* clear program space */
-    memset(unresolved_src, 0, sizeof(expression_t*) * MAX_INSTRUCTIONS);
-    memset(unresolved_dest, 0, sizeof(expression_t*) * MAX_INSTRUCTIONS);
-    memset(flags, 0, sizeof(flags_t) * MAX_INSTRUCTIONS);
+    memset(asm_ctx->program, 0, sizeof(instruction_t) * MAX_INSTRUCTIONS); /* clear program space */
+    memset(asm_ctx->unresolved_src, 0, sizeof(expression_t*) * MAX_INSTRUCTIONS);
+    memset(asm_ctx->unresolved_dest, 0, sizeof(expression_t*) * MAX_INSTRUCTIONS);
+    memset(asm_ctx->flags, 0, sizeof(flags_t) * MAX_INSTRUCTIONS);
 
     init_symtable();
+    symmap_reset();
 
-    curr_op = 0; /* reset current op */
-    line_num = 0; /* reset line counter */
+    asm_ctx->curr_op = 0; /* reset current op */
+    asm_ctx->line_num = 0; /* reset line counter */
+    asm_ctx->last_label = NULL; /* the previous symbol table is gone */
+    free(asm_ctx->file);
+    asm_ctx->file = NULL;
+}
+
+/*****************************************************************\
+*   Takes the file and the line number of the next line out of   *
+*   the #line N "file" or # N "file" marker @param line the       *
+*   preprocessor put around an included file.                     *
+*   @return 1 if @param line is a marker, 0 otherwise             *
+\*****************************************************************/
+int parse_marker(const char* line)
+{
+    while(*line == ' ' || *line == '\t')
+        line++;
+    if(*line != '#')
+        return 0;
+    line++;
+    while(*line == ' ' || *line == '\t')
+        line++;
+    if(!strncmp(line, "symbols", 7))
+    {
+        /* #symbols "snapshot" hash, the symbols of a header the preprocessor skipped */
+        const char* name = strchr(line, '"');
+        const char* name_end = name ? strchr(name + 1, '"') : NULL;
+        if(!name_end)
+            fatal("line %lu: bad symbols marker", asm_ctx->line_num);
+        char path[name_end - name];
+        memcpy(path, name + 1, name_end - name - 1);
+        path[name_end - name - 1] = 0;
+        snapshot_load(path, strtoull(name_end + 1, NULL, 10));
+        asm_ctx->directive_seen = 1;
+        return 1;
+    }
+    if(!strncmp(line, "line", 4))
+        line += 4;
+
+    char* end;
+    ulong num = strtoul(line, &end, 10);
+    if(end == line || !num)
+        fatal("line %lu: bad line marker", asm_ctx->line_num);
+    asm_ctx->line_num = num - 1; /* the next line is number num */
+    asm_ctx->directive_seen = 1; /* --watch doesn't keep it, it changes the state of the build */
+
+    const char* name = strchr(end, '"');
+    const char* name_end = name ? strchr(name + 1, '"') : NULL;
+    if(name_end)
+    {
+        free(asm_ctx->file);
+        if(!(asm_ctx->file = strndup(name + 1, name_end - name - 1)))
+            fatal("out of memory");
+    }
+    return 1;
+}
 
+/*****************************************************************\
+*   Parses the @param line read by read_line()                    *
+\*****************************************************************/
+void parse_line(char* line)
+{
     const char* errmsg; /* error messages, returned by parse_* functions */
+
+    if(opt_verbose > 4)
+        fprintf(vfile, "parsing line %lu: \"%s\" curr_op:%lu\n", asm_ctx->line_num, line, asm_ctx->curr_op);
+
+    asm_ctx->directive_seen = 0;
+    asm_ctx->line_op = (size_t)-1;
+    if(parse_marker(line))
+        return;
+    asm_ctx->token = read_first(line, " ,\t\n\r", "+-/*=");
+
+    while(asm_ctx->token && !is_comment(asm_ctx->token))
+    {
+        if(parse_directives()) /* is this a directory */
+        {
+            if(parse_opcode()) /* if this is not an opcode, it must be a label */
+            {
+                if(errmsg = parse_addr_label())
+                    fatal("line %u: failed to parse label \"%s\": %s", asm_ctx->line_num, asm_ctx->token, errmsg);
+                else
+                {
+                    if(errmsg = parse_opcode())
+                        fatal("line %u: failed to parse \"%s\": %s", asm_ctx->line_num, asm_ctx->token, errmsg);
+                }
+            }
+        }
+    }
+}
+
+/*****************************************************************\
+*   Frees what a parse that failed halfway left in asm_ctx        *
+\*****************************************************************/
+void parse_abort()
+{
+    for(unsigned i = 0; i < MAX_INSTRUCTIONS; i++)
+    {
+        expression_free(asm_ctx->unresolved_src[i]);
+        expression_free(asm_ctx->unresolved_dest[i]);
+        asm_ctx->unresolved_src[i] = asm_ctx->unresolved_dest[i] = NULL;
+    }
+
+    if(asm_ctx->symtable.element)
+        fini_symtable();
+    free(asm_ctx->file); /* the error already names it */
+    asm_ctx->file = NULL;
+}
+
+/*****************************************************************\
+*   Parses the file @param filename                               *
+\*****************************************************************/
+void parse(FILE* file)
+{
+    parse_begin();
+
     int     comment_on = 0; /* 1 if there is a multiline comment, 0 othrewise */
     size_t  linesz; /* size of read line */
 
     while(!feof(file))
     {
-        line_num++;
+        asm_ctx->line_num++;
+        parse_line(read_line(file, &linesz, &comment_on));
+    }
+    parse_end();
+}
 
-        char* line = read_line(file, &linesz, &comment_on);
+/*
+parse_memory() splits a source in memory into lines the way read_line() does for parse(),
+it drops the { } comments and the \r, and lines that are blank or only a ' comment only
+count for the line number of the next one.
+*/
 
+typedef struct
+{
+    const char* s;
+    const char* end;
+    int         comment_on; /* inside a { } comment */
+    int         eof; /* the last line was read */
+} line_reader_t;
 
-        if(opt_verbose > 4)
-            fprintf(vfile, "parsing line %lu: \"%s\" curr_op:%lu\n", line_num, line, curr_op);
+/*****************************************************************\
+*   Skips the new lines before the next line of @param r.         *
+*   @return the line numbers to go up by for it                   *
+\*****************************************************************/
+static u32 line_begin(line_reader_t* r)
+{
+    u32 lines = 1;
+    while(r->s < r->end && *r->s == '\n')
+    {
+        r->s++;
+        lines++;
+    }
+    return lines;
+}
+
+/*****************************************************************\
+*   @return bytes line_read() may need for the next line of       *
+*   @param r, with the 0                                          *
+\*****************************************************************/
+static size_t line_room(const line_reader_t* r)
+{
+    const char* nl = memchr(r->s, '\n', r->end - r->s);
+    return (nl ? nl : r->end) - r->s + 1;
+}
+
+/*****************************************************************\
+*   Reads the next line of @param r into @param line, without the *
+*   { } comments and the \r. @return its length                   *
+\*****************************************************************/
+static u32 line_read(line_reader_t* r, char* line)
+{
+    u32 length = 0;
+    while(r->s < r->end && *r->s != '\n')
+    {
+        char c = *r->s++;
+        if(r->comment_on)
+        {
+            if(c == '}')
+                r->comment_on = 0;
+        }
+        else if(c == '{')
+            r->comment_on = 1;
+        else if(c != '\r')
+            line[length++] = c;
+    }
+    if(r->s < r->end)
+        r->s++;
+    else
+        r->eof = 1;
+    line[length] = 0;
+    return length;
+}
+
+/*****************************************************************\
+*   @return 1 if the line of @param r that line_read() put into   *
+*   @param line of @param len bytes has nothing for parse_line()  *
+*   to do. The last line never is, the parse ends on its number   *
+\*****************************************************************/
+static int line_skipped(const line_reader_t* r, const char* line, size_t len)
+{
+    if(r->eof)
+        return 0;
 
-        token = read_first(line, " ,\t\n\r", "+-/*=");
+    size_t i = 0;
+    while(i < len && (line[i] == ' ' || line[i] == ',' || line[i] == '\t' || line[i] == '\n' || line[i] == '\r'))
+        i++;
+    return i == len || (len - i >= syntax->after_comment_len &&
+                        !strncmp(line + i, syntax->after_comment, syntax->after_comment_len));
+}
 
-        while(token && !is_comment(token))
+/*****************************************************************\
+*   Parses the @param len bytes of @param src like parse(), the   *
+*   lines are split off in memory instead of read from a FILE     *
+\*****************************************************************/
+void parse_memory(const char* src, size_t len)
+{
+    line_reader_t r = { src, src + len, 0, 0 };
+    parse_begin();
+    while(!r.eof)
+    {
+        asm_ctx->line_num += line_begin(&r);
+        size_t need = line_room(&r);
+        if(asm_ctx->linesz < need)
         {
-            if(parse_directives()) /* is this a directory */
-            {
-                if(parse_opcode()) /* if this is not an opcode, it must be a label */
-                {
-                    if(errmsg = parse_addr_label())
-                        fatal("line %u: failed to parse label \"%s\": %s", line_num, token, errmsg);
-                    else
-                    {
-                        if(errmsg = parse_opcode())
-                            fatal("line %u: failed to parse \"%s\": %s", line_num, token, errmsg);
-                    }
-                }
-            }
+            size_t size = asm_ctx->linesz ? asm_ctx->linesz : 256;
+            while(size < need)
+                size *= 2;
+            char* bigger = realloc(asm_ctx->line, size);
+            if(!bigger)
+                fatal("out of memory");
+            asm_ctx->line = bigger;
+            asm_ctx->linesz = size;
         }
+
+        u32 length = line_read(&r, asm_ctx->line);
+        if(!line_skipped(&r, asm_ctx->line, length))
+            parse_line(asm_ctx->line);
     }
+    parse_end();
+}
+
+/*****************************************************************\
+*   Resolves the expressions of the program parsed into asm_ctx   *
+*   and frees its symbol table                                    *
+\*****************************************************************/
+void parse_end()
+{
+    free(asm_ctx->file); /* the fixups aren't on the line of the last marker */
+    asm_ctx->file = NULL;
 
     if(opt_verbose > 4)
-        fprintf(vfile, "last instruction %lu\n", curr_op);
+        fprintf(vfile, "last instruction %lu\n", asm_ctx->curr_op);
 
+    if(opt_variants)
+        variants_capture();
     evaluate_all_unresolved();
 
     /* TODO this is a temporary hack till I add Directive/Value pairs */
-    pair_t p;
-    p.string = "_CLKREG";
-    size_t lpos = pair_t_find(&p, symtable.element, symtable.size, &pair_t_compare_string);
-    if(lpos != symtable.size)
+    ulong clkreg;
+    if(symtable_lookup("_CLKREG", &clkreg))
     {
-        clkreg = symtable.element[lpos].value;
+        asm_ctx->clkreg = clkreg;
     }
 
-
+    symmap_collect();
     fini_symtable();
 }
@@ -3,5 +3,11 @@
 #include "util.h"
 
 void parse(FILE* file);
+void parse_memory(const char* src, size_t len);
+void parse_begin();
+void parse_line(char* line);
+void parse_end();
+int parse_marker(const char* line);
+void parse_abort();
 void dereference_labels();
 #endif // PARSE_H_INCLUDED
@@ -0,0 +1,1299 @@
+#include "preprocess.h"
+#include "context.h"
+#include "util.h"
+#include "snapshot.h"
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/*
+The sources go through a C like preprocessor before they are parsed: #include, #define of
+object and function like macros, #undef, #if, #ifdef, #ifndef, #elif, #else, #endif,
+#error, #warning and #pragma once. The output has a line for every line of the input, the
+directives and the lines of false regions become empty lines, so the line numbers of the
+errors stay the same. The lines of an included file are put between #line markers that
+tell the parser which file and line it is on. A source without directives comes out as it
+went in.
+
+The path of a FILE line is found like the one of an #include "path" and replaced with its
+real path, the build depends on the file, a --serve process in another directory finds it.
+
+The lines of a false region are only checked for a directive, they are never expanded.
+Included files are read once per process and kept, keyed by their real path, with their
+include guard, an #ifndef X / #define X ... #endif around the whole file, or #pragma once.
+A guarded file that was included before is skipped without reading it again. A kept file
+is read again if it changed on disk, so --watch sees the edits of included files. Every
+preprocess() holds the kept files it loads; an old version is freed once a newer one has
+replaced it and the last preprocess() that holds it is done.
+*/
+
+#define PP_BUCKETS 256 /* buckets of the macro table */
+
+typedef struct macro macro_t;
+struct macro
+{
+    macro_t*    next;
+    char*       name;
+    char**      params;
+    int         num_params; /* -1 for an object like macro */
+    char*       body;
+    int         busy; /* it is being expanded, its name isn't expanded again */
+};
+
+/* a file read by #include */
+typedef struct cached_file cached_file_t;
+struct cached_file
+{
+    cached_file_t*  next;
+    unsigned        users; /* preprocess() runs that hold it */
+    u8              replaced; /* a newer version is in the cache, it goes with its last user */
+    char*           path; /* real path */
+    char*           text;
+    size_t          len;
+    struct timespec mtime;
+    off_t           size;
+    ino_t           ino;
+    u64             hash; /* of the text, for its symbol snapshot */
+    u8              once; /* it has #pragma once */
+    char*           guard; /* macro of its include guard, NULL if it has none */
+};
+
+typedef struct
+{
+    char*   data;
+    size_t  size;
+    size_t  capacity;
+} text_t;
+
+typedef struct
+{
+    macro_t*                macros[PP_BUCKETS];
+    size_t                  num_macros;
+    text_t                  out;
+    preprocessed_t*         result;
+    const cached_file_t**   included; /* files that were included, for #pragma once */
+    size_t                  num_included;
+    cached_file_t**         held; /* files load() gave out, pp_free() lets them go */
+    size_t                  num_held;
+    int                     in_comment; /* inside a multiline comment */
+    int                     quiet; /* only the directives count, a snapshot has the rest */
+    const char*             file; /* file and line being preprocessed, for the errors */
+    size_t                  line;
+} pp_t;
+
+static cached_file_t* cache = NULL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* -D and -I, set before the first source is preprocessed */
+static char** definitions = NULL;
+static size_t num_definitions = 0;
+static char** include_dirs = NULL;
+static size_t num_include_dirs = 0;
+
+static void process(pp_t* pp, const char* file, const char* text, size_t len, int depth);
+
+/*****************************************************************\
+*   Adds a -D NAME[=VALUE] @param definition to every source      *
+\*****************************************************************/
+void preprocess_define(const char* definition)
+{
+    if(!(definitions = realloc(definitions, (num_definitions + 1) * sizeof(char*))))
+        fatal("out of memory");
+    definitions[num_definitions++] = (char*)definition;
+}
+
+/*****************************************************************\
+*   Adds @param dir to the directories #include searches          *
+\*****************************************************************/
+void preprocess_include_dir(const char* dir)
+{
+    if(!(include_dirs = realloc(include_dirs, (num_include_dirs + 1) * sizeof(char*))))
+        fatal("out of memory");
+    include_dirs[num_include_dirs++] = (char*)dir;
+}
+
+/*****************************************************************\
+*   Appends @param len bytes of @param data to @param t           *
+\*****************************************************************/
+static void put(text_t* t, const char* data, size_t len)
+{
+    if(t->size + len + 1 > t->capacity)
+    {
+        size_t capacity = t->capacity ? t->capacity : 0x4000;
+        while(t->size + len + 1 > capacity)
+            capacity *= 2;
+        if(!(t->data = realloc(t->data, capacity)))
+            fatal("out of memory");
+        t->capacity = capacity;
+    }
+    memcpy(t->data + t->size, data, len);
+    t->size += len;
+    t->data[t->size] = 0;
+}
+
+static void put_str(text_t* t, const char* s)
+{
+    put(t, s, strlen(s));
+}
+
+static int is_ident_start(char c)
+{
+    return isalpha((unsigned char)c) || c == '_';
+}
+
+static int is_ident(char c)
+{
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+static const char* skip_blanks(const char* s, const char* end)
+{
+    while(s < end && (*s == ' ' || *s == '\t'))
+        s++;
+    return s;
+}
+
+/*****************************************************************\
+*   @return 1 if the @param end bounded @param s begins with      *
+*   @param prefix of @param len chars                             *
+\*****************************************************************/
+static int begins(const char* s, const char* end, const char* prefix, size_t len)
+{
+    return len && (size_t)(end - s) >= len && !memcmp(s, prefix, len);
+}
+
+/*****************************************************************\
+*   @return the macro named by @param len chars of @param name    *
+\*****************************************************************/
+static macro_t** find_macro(pp_t* pp, const char* name, size_t len)
+{
+    macro_t** m = &pp->macros[hash_fnv1a(name, len, FNV_OFFSET) % PP_BUCKETS];
+    while(*m && (strlen((*m)->name) != len || memcmp((*m)->name, name, len)))
+        m = &(*m)->next;
+    return m;
+}
+
+static void free_macro(macro_t* m)
+{
+    for(int i = 0; i < m->num_params; i++)
+        free(m->params[i]);
+    free(m->params);
+    free(m->name);
+    free(m->body);
+    free(m);
+}
+
+/*****************************************************************\
+*   Removes the macro named by @param len chars of @param name    *
+\*****************************************************************/
+static void undefine(pp_t* pp, const char* name, size_t len)
+{
+    macro_t** m = find_macro(pp, name, len);
+    if(*m)
+    {
+        macro_t* next = (*m)->next;
+        free_macro(*m);
+        *m = next;
+        pp->num_macros--;
+    }
+}
+
+/*****************************************************************\
+*   Defines the macro of the #define arguments @param s to        *
+*   @param end: NAME body or NAME(a, b) body                      *
+\*****************************************************************/
+static void define(pp_t* pp, const char* s, const char* end)
+{
+    const char* name = s;
+    while(s < end && is_ident(*s))
+        s++;
+    if(s == name || !is_ident_start(*name))
+        fatal("%s:%lu: #define needs a macro name", pp->file, (ulong)pp->line);
+
+    macro_t* m = calloc(1, sizeof(macro_t));
+    if(!m || !(m->name = strndup(name, s - name)))
+        fatal("out of memory");
+    m->num_params = -1;
+
+    if(s < end && *s == '(') /* a function like macro, the ( follows the name */
+    {
+        m->num_params = 0;
+        s = skip_blanks(s + 1, end);
+        while(s < end && *s != ')')
+        {
+            const char* param = s;
+            while(s < end && is_ident(*s))
+                s++;
+            if(s == param)
+                fatal("%s:%lu: bad parameter list of macro %s", pp->file, (ulong)pp->line, m->name);
+            if(!(m->params = realloc(m->params, (m->num_params + 1) * sizeof(char*))) ||
+               !(m->params[m->num_params++] = strndup(param, s - param)))
+                fatal("out of memory");
+            s = skip_blanks(s, end);
+            if(s < end && *s == ',')
+                s = skip_blanks(s + 1, end);
+        }
+        if(s == end)
+            fatal("%s:%lu: missing ) in macro %s", pp->file, (ulong)pp->line, m->name);
+        s++;
+    }
+
+    s = skip_blanks(s, end);
+    if(!(m->body = strndup(s, end - s)))
+        fatal("out of memory");
+
+    undefine(pp, m->name, strlen(m->name));
+    macro_t** slot = find_macro(pp, m->name, strlen(m->name));
+    *slot = m;
+    pp->num_macros++;
+}
+
+/*****************************************************************\
+*   @return the number of parameter @param len chars of           *
+*   @param name of @param m is, -1 if it isn't one                *
+\*****************************************************************/
+static int find_param(const macro_t* m, const char* name, size_t len)
+{
+    for(int i = 0; i < m->num_params; i++)
+        if(strlen(m->params[i]) == len && !memcmp(m->params[i], name, len))
+            return i;
+    return -1;
+}
+
+/*****************************************************************\
+*   Puts the body of @param m with its parameters replaced by     *
+*   the @param expanded arguments into @param t, the operands of  *
+*   ## are the @param args as written, ## glues them together     *
+\*****************************************************************/
+static void substitute(const macro_t* m, const char** args, const size_t* arglen, const text_t* expanded, text_t* t)
+{
+    const char* s = m->body;
+    while(*s)
+    {
+        if(s[0] == '#' && s[1] == '#')
+        {
+            while(t->size && (t->data[t->size - 1] == ' ' || t->data[t->size - 1] == '\t'))
+                t->size--;
+            s += 2;
+            while(*s == ' ' || *s == '\t')
+                s++;
+        }
+        else if(is_ident_start(*s))
+        {
+            const char* id = s;
+            while(is_ident(*s))
+                s++;
+            int p = find_param(m, id, s - id);
+            const char* before = id;
+            while(before > m->body && (before[-1] == ' ' || before[-1] == '\t'))
+                before--;
+            const char* after = skip_blanks(s, s + strlen(s));
+            if(p < 0)
+                put(t, id, s - id);
+            else if((before - m->body >= 2 && before[-1] == '#' && before[-2] == '#') ||
+                    (after[0] == '#' && after[1] == '#'))
+                put(t, args[p], arglen[p]);
+            else
+                put(t, expanded[p].size ? expanded[p].data : "", expanded[p].size);
+        }
+        else
+            put(t, s++, 1);
+    }
+    if(!t->size)
+        put(t, "", 0); /* an empty body still needs the terminating 0 */
+}
+
+/*****************************************************************\
+*   Puts @param s to @param end into @param out with the macros   *
+*   expanded, comments and numbers as they are                    *
+\*****************************************************************/
+static void expand(pp_t* pp, const char* s, const char* end, text_t* out, int depth)
+{
+    while(s < end)
+    {
+        if(pp->in_comment)
+        {
+            const char* e = s;
+            while(e < end && !begins(e, end, syntax->multi_comment_end, syntax->multi_comment_end_len))
+                e++;
+            if(e < end)
+            {
+                e += syntax->multi_comment_end_len;
+                pp->in_comment = 0;
+            }
+            put(out, s, e - s);
+            s = e;
+        }
+        else if(begins(s, end, syntax->multi_comment_begin, syntax->multi_comment_begin_len))
+        {
+            put(out, s, syntax->multi_comment_begin_len);
+            s += syntax->multi_comment_begin_len;
+            pp->in_comment = 1;
+        }
+        else if(begins(s, end, syntax->after_comment, syntax->after_comment_len))
+        {
+            /* read_line() opens a multiline comment even after a comment */
+            for(const char* c = s; c < end; c++)
+            {
+                if(!pp->in_comment && begins(c, end, syntax->multi_comment_begin, syntax->multi_comment_begin_len))
+                    pp->in_comment = 1;
+                else if(pp->in_comment && begins(c, end, syntax->multi_comment_end, syntax->multi_comment_end_len))
+                    pp->in_comment = 0;
+            }
+            put(out, s, end - s);
+            return;
+        }
+        else if(isdigit((unsigned char)*s) || (*s == '$' && s + 1 < end && isxdigit((unsigned char)s[1])))
+        {
+            const char* n = s++;
+            while(s < end && is_ident(*s))
+                s++;
+            put(out, n, s - n);
+        }
+        else if(is_ident_start(*s))
+        {
+            const char* id = s;
+            while(s < end && is_ident(*s))
+                s++;
+            macro_t* m = pp->num_macros ? *find_macro(pp, id, s - id) : NULL;
+            if(!m || m->busy)
+            {
+                put(out, id, s - id);
+                continue;
+            }
+            if(depth >= PP_MAX_EXPANSION)
+                fatal("%s:%lu: macro %s expands too deep", pp->file, (ulong)pp->line, m->name);
+
+            text_t body = { 0 };
+            if(m->num_params < 0)
+                put_str(&body, m->body);
+            else
+            {
+                /* a function like macro without arguments is just a name */
+                const char* a = skip_blanks(s, end);
+                if(a == end || *a != '(')
+                {
+                    put(out, id, s - id);
+                    continue;
+                }
+
+                const char* args[m->num_params + 1];
+                size_t arglen[m->num_params + 1];
+                int num_args = 0, level = 1;
+                const char* arg = ++a;
+                for(; a < end && level; a++)
+                {
+                    if(*a == '(')
+                        level++;
+                    else if(*a == ')')
+                        level--;
+                    if((*a == ',' && level == 1) || !level)
+                    {
+                        const char* b = skip_blanks(arg, a);
+                        const char* e = a;
+                        while(e > b && (e[-1] == ' ' || e[-1] == '\t'))
+                            e--;
+                        if(num_args < m->num_params)
+                        {
+                            args[num_args] = b;
+                            arglen[num_args] = e - b;
+                        }
+                        if(num_args || e > b || m->num_params) /* m() has no arguments */
+                            num_args++;
+                        arg = a + 1;
+                    }
+                }
+                if(level)
+                    fatal("%s:%lu: missing ) after the arguments of macro %s", pp->file, (ulong)pp->line, m->name);
+                if(num_args != m->num_params)
+                    fatal("%s:%lu: macro %s takes %d arguments, not %d", pp->file, (ulong)pp->line,
+                          m->name, m->num_params, num_args);
+                /* the arguments are expanded on their own first, so F(F(1)) works with F busy */
+                text_t expanded[m->num_params + 1];
+                int in_comment = pp->in_comment;
+                for(int i = 0; i < m->num_params; i++)
+                {
+                    expanded[i] = (text_t){ 0 };
+                    expand(pp, args[i], args[i] + arglen[i], &expanded[i], depth + 1);
+                    pp->in_comment = in_comment;
+                }
+                substitute(m, args, arglen, expanded, &body);
+                for(int i = 0; i < m->num_params; i++)
+                    free(expanded[i].data);
+                s = a;
+            }
+
+            m->busy = 1;
+            expand(pp, body.data, body.data + body.size, out, depth + 1);
+            m->busy = 0;
+            free(body.data);
+        }
+        else
+            put(out, s++, 1);
+    }
+}
+
+/*
+#if expressions, evaluated by recursive descent over long long after defined() and the
+macros are replaced, with the precedence of C. Names that are left are 0.
+*/
+typedef struct
+{
+    pp_t*       pp;
+    const char* s;
+} cond_t;
+
+static long long cond_or(cond_t* c);
+
+static void cond_blanks(cond_t* c)
+{
+    while(*c->s == ' ' || *c->s == '\t')
+        c->s++;
+}
+
+static int cond_op(cond_t* c, const char* op)
+{
+    static const char* longer[] = { "&&", "||", "<<", "<=", ">>", ">=", "!=" };
+
+    cond_blanks(c);
+    size_t len = strlen(op);
+    if(strncmp(c->s, op, len))
+        return 0;
+    /* & isn't the start of &&, < isn't the start of << or <= */
+    for(size_t i = 0; len == 1 && i < sizeof(longer) / sizeof(longer[0]); i++)
+        if(longer[i][0] == op[0] && c->s[1] == longer[i][1])
+            return 0;
+    c->s += len;
+    return 1;
+}
+
+static void cond_error(cond_t* c)
+{
+    fatal("%s:%lu: bad #if expression near \"%s\"", c->pp->file, (ulong)c->pp->line, c->s);
+}
+
+static long long cond_unary(cond_t* c)
+{
+    cond_blanks(c);
+    if(cond_op(c, "!"))
+        return !cond_unary(c);
+    if(cond_op(c, "~"))
+        return ~cond_unary(c);
+    if(cond_op(c, "-"))
+        return -cond_unary(c);
+    if(cond_op(c, "+"))
+        return cond_unary(c);
+    if(cond_op(c, "("))
+    {
+        long long v = cond_or(c);
+        if(!cond_op(c, ")"))
+            cond_error(c);
+        return v;
+    }
+
+    int base = 10;
+    if(*c->s == '$')
+        base = 16, c->s++;
+    else if(*c->s == '%')
+        base = 2, c->s++;
+    else if(c->s[0] == '0' && (c->s[1] == 'x' || c->s[1] == 'X'))
+        base = 16, c->s += 2;
+    if(isxdigit((unsigned char)*c->s) && (base == 16 || isdigit((unsigned char)*c->s)))
+    {
+        long long v = 0;
+        for(;; c->s++)
+        {
+            int d;
+            if(*c->s == '_')
+                continue;
+            else if(isdigit((unsigned char)*c->s))
+                d = *c->s - '0';
+            else if(isxdigit((unsigned char)*c->s))
+                d = tolower((unsigned char)*c->s) - 'a' + 10;
+            else
+                break;
+            if(d >= base)
+                break;
+            v = v * base + d;
+        }
+        return v;
+    }
+    if(is_ident_start(*c->s))
+    {
+        while(is_ident(*c->s))
+            c->s++;
+        return 0;
+    }
+    cond_error(c);
+    return 0;
+}
+
+static long long cond_mul(cond_t* c)
+{
+    long long v = cond_unary(c);
+    for(;;)
+    {
+        if(cond_op(c, "*"))
+            v *= cond_unary(c);
+        else if(cond_op(c, "/") || cond_op(c, "%"))
+        {
+            int mod = c->s[-1] == '%';
+            long long d = cond_unary(c);
+            if(!d)
+                fatal("%s:%lu: division by zero in #if", c->pp->file, (ulong)c->pp->line);
+            v = mod ? v % d : v / d;
+        }
+        else
+            return v;
+    }
+}
+
+static long long cond_add(cond_t* c)
+{
+    long long v = cond_mul(c);
+    for(;;)
+    {
+        if(cond_op(c, "+"))
+            v += cond_mul(c);
+        else if(cond_op(c, "-"))
+            v -= cond_mul(c);
+        else
+            return v;
+    }
+}
+
+static long long cond_shift(cond_t* c)
+{
+    long long v = cond_add(c);
+    for(;;)
+    {
+        if(cond_op(c, "<<"))
+            v <<= cond_add(c);
+        else if(cond_op(c, ">>"))
+            v >>= cond_add(c);
+        else
+            return v;
+    }
+}
+
+static long long cond_compare(cond_t* c)
+{
+    long long v = cond_shift(c);
+    for(;;)
+    {
+        if(cond_op(c, "<="))
+            v = v <= cond_shift(c);
+        else if(cond_op(c, ">="))
+            v = v >= cond_shift(c);
+        else if(cond_op(c, "<"))
+            v = v < cond_shift(c);
+        else if(cond_op(c, ">"))
+            v = v > cond_shift(c);
+        else
+            return v;
+    }
+}
+
+static long long cond_equal(cond_t* c)
+{
+    long long v = cond_compare(c);
+    for(;;)
+    {
+        if(cond_op(c, "=="))
+            v = v == cond_compare(c);
+        else if(cond_op(c, "!="))
+            v = v != cond_compare(c);
+        else
+            return v;
+    }
+}
+
+static long long cond_bit_and(cond_t* c)
+{
+    long long v = cond_equal(c);
+    while(cond_op(c, "&"))
+        v &= cond_equal(c);
+    return v;
+}
+
+static long long cond_bit_xor(cond_t* c)
+{
+    long long v = cond_bit_and(c);
+    while(cond_op(c, "^"))
+        v ^= cond_bit_and(c);
+    return v;
+}
+
+static long long cond_bit_or(cond_t* c)
+{
+    long long v = cond_bit_xor(c);
+    while(cond_op(c, "|"))
+        v |= cond_bit_xor(c);
+    return v;
+}
+
+static long long cond_and(cond_t* c)
+{
+    long long v = cond_bit_or(c);
+    while(cond_op(c, "&&"))
+    {
+        long long r = cond_bit_or(c);
+        v = v && r;
+    }
+    return v;
+}
+
+static long long cond_or(cond_t* c)
+{
+    long long v = cond_and(c);
+    while(cond_op(c, "||"))
+    {
+        long long r = cond_and(c);
+        v = v || r;
+    }
+    return v;
+}
+
+/*****************************************************************\
+*   @return the value of the #if expression @param s to @param end*
+\*****************************************************************/
+static long long evaluate(pp_t* pp, const char* s, const char* end)
+{
+    /* defined X and defined(X) are replaced before the macros are expanded */
+    text_t defs = { 0 };
+    put(&defs, "", 0);
+    while(s < end)
+    {
+        if(is_ident_start(*s))
+        {
+            const char* id = s;
+            while(s < end && is_ident(*s))
+                s++;
+            if(s - id != 7 || memcmp(id, "defined", 7))
+            {
+                put(&defs, id, s - id);
+                continue;
+            }
+
+            s = skip_blanks(s, end);
+            int paren = s < end && *s == '(';
+            if(paren)
+                s = skip_blanks(s + 1, end);
+            const char* name = s;
+            while(s < end && is_ident(*s))
+                s++;
+            if(s == name)
+                fatal("%s:%lu: defined needs a macro name", pp->file, (ulong)pp->line);
+            put_str(&defs, *find_macro(pp, name, s - name) ? "1" : "0");
+            if(paren)
+            {
+                s = skip_blanks(s, end);
+                if(s == end || *s != ')')
+                    fatal("%s:%lu: missing ) after defined", pp->file, (ulong)pp->line);
+                s++;
+            }
+        }
+        else
+            put(&defs, s++, 1);
+    }
+
+    text_t expr = { 0 };
+    put(&expr, "", 0);
+    int in_comment = pp->in_comment;
+    pp->in_comment = 0;
+    expand(pp, defs.data, defs.data + defs.size, &expr, 0);
+    pp->in_comment = in_comment;
+    free(defs.data);
+
+    cond_t c = { pp, expr.data };
+    long long v = cond_or(&c);
+    cond_blanks(&c);
+    if(*c.s)
+        cond_error(&c);
+    free(expr.data);
+    return v;
+}
+
+/*****************************************************************\
+*   @return the directive @param s begins with, its name in       *
+*   @param name and its arguments from @param args to @param end, *
+*   without the comment after them                                *
+\*****************************************************************/
+static size_t directive(const char* s, const char* end, const char** args, const char** args_end)
+{
+    const char* name = s;
+    while(s < end && is_ident(*s))
+        s++;
+    size_t len = s - name;
+
+    s = skip_blanks(s, end);
+    const char* e = s;
+    while(e < end && !begins(e, end, syntax->after_comment, syntax->after_comment_len))
+        e++;
+    while(e > s && isspace((unsigned char)e[-1]))
+        e--;
+    *args = s;
+    *args_end = e;
+    return len;
+}
+
+static int is_directive(const char* name, size_t len, const char* directive)
+{
+    return strlen(directive) == len && !memcmp(name, directive, len);
+}
+
+/*****************************************************************\
+*   @return the include guard of the file @param text of         *
+*   @param len bytes, NULL if it has none, and sets @param once   *
+*   if it has #pragma once                                        *
+\*****************************************************************/
+static char* find_guard(const char* text, size_t len, u8* once)
+{
+    const char* end = text + len;
+    const char* guard = NULL;
+    size_t guard_len = 0;
+    int level = 0, state = 0; /* 0 before #ifndef, 1 before #define, 2 inside, 3 after #endif */
+    *once = 0;
+
+    for(const char* p = text; p < end;)
+    {
+        const char* nl = memchr(p, '\n', end - p);
+        const char* eol = nl ? nl : end;
+        const char* s = skip_blanks(p, eol);
+        p = nl ? nl + 1 : end;
+
+        while(s < eol && isspace((unsigned char)*s))
+            s++;
+        if(s == eol || begins(s, eol, syntax->after_comment, syntax->after_comment_len))
+            continue;
+        if(*s != '#')
+        {
+            if(state != 2)
+                state = -1;
+            continue;
+        }
+
+        const char *args, *args_end;
+        const char* name = skip_blanks(s + 1, eol);
+        size_t n = directive(name, eol, &args, &args_end);
+        if(is_directive(name, n, "pragma") && args_end - args == 4 && !memcmp(args, "once", 4))
+            *once = 1;
+
+        if(state == 0 && is_directive(name, n, "ifndef"))
+        {
+            guard = args;
+            guard_len = args_end - args;
+            state = 1;
+            level = 1;
+        }
+        else if(state == 1)
+            state = is_directive(name, n, "define") && args_end - args >= (long)guard_len &&
+                    !memcmp(args, guard, guard_len) && (args_end - args == (long)guard_len ||
+                    !is_ident(args[guard_len])) ? 2 : -1;
+        else if(state == 2)
+        {
+            if(is_directive(name, n, "if") || is_directive(name, n, "ifdef") || is_directive(name, n, "ifndef"))
+                level++;
+            else if(is_directive(name, n, "endif") && !--level)
+                state = 3;
+        }
+        else
+            state = -1;
+    }
+
+    char* g = NULL;
+    if(state == 3 && guard_len && !(g = strndup(guard, guard_len)))
+        fatal("out of memory");
+    return g;
+}
+
+/*****************************************************************\
+*   Frees the kept file @param f                                  *
+\*****************************************************************/
+static void free_cached(cached_file_t* f)
+{
+    free(f->path);
+    free(f->text);
+    free(f->guard);
+    free(f);
+}
+
+/*****************************************************************\
+*   @return the kept file at @param path, read again if it is     *
+*   new or changed on disk, NULL if it can't be opened. @param pp *
+*   holds it till pp_free()                                       *
+\*****************************************************************/
+static const cached_file_t* load(pp_t* pp, const char* path)
+{
+    char real[PATH_MAX];
+    struct stat st;
+    if(!realpath(path, real) || stat(real, &st) || !S_ISREG(st.st_mode))
+        return NULL;
+    if(!(pp->held = realloc(pp->held, (pp->num_held + 1) * sizeof(cached_file_t*))))
+        fatal("out of memory");
+
+    pthread_mutex_lock(&cache_lock);
+    cached_file_t* f = cache;
+    while(f && strcmp(f->path, real))
+        f = f->next;
+    if(f && f->size == st.st_size && f->ino == st.st_ino && f->mtime.tv_sec == st.st_mtim.tv_sec &&
+       f->mtime.tv_nsec == st.st_mtim.tv_nsec)
+    {
+        f->users++;
+        pthread_mutex_unlock(&cache_lock);
+        return pp->held[pp->num_held++] = f;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    FILE* file = fopen(real, "rb");
+    if(!file)
+        return NULL;
+    if(!(f = calloc(1, sizeof(cached_file_t))) || !(f->path = strdup(real)) || !(f->text = malloc(st.st_size + 1)))
+        fatal("out of memory");
+    f->len = fread(f->text, 1, st.st_size, file);
+    if(ferror(file))
+        sys_error("error reading an included file");
+    fclose(file);
+    f->text[f->len] = 0;
+    f->mtime = st.st_mtim;
+    f->size = st.st_size;
+    f->ino = st.st_ino;
+    f->guard = find_guard(f->text, f->len, &f->once);
+    f->hash = snapshot_hash(f->text, f->len);
+    f->users = 1;
+
+    /* the older version leaves the cache, another thread may still be reading it */
+    pthread_mutex_lock(&cache_lock);
+    cached_file_t** old = &cache;
+    while(*old && strcmp((*old)->path, real))
+        old = &(*old)->next;
+    if(*old)
+    {
+        cached_file_t* o = *old;
+        *old = o->next;
+        o->replaced = 1;
+        if(!o->users)
+            free_cached(o);
+    }
+    f->next = cache;
+    cache = f;
+    pthread_mutex_unlock(&cache_lock);
+    return pp->held[pp->num_held++] = f;
+}
+
+/*****************************************************************\
+*   Finds the @param len chars of @param name used by the file    *
+*   @param from, next to it if @param quoted, then in the -I      *
+*   directories. @return 1 if it was found, the path it was found *
+*   as in @param found                                            *
+\*****************************************************************/
+static int find_file(const char* from, const char* name, size_t len, int quoted, char* found)
+{
+    struct stat st;
+    if(quoted || (len && name[0] == '/'))
+    {
+        const char* slash = name[0] == '/' ? NULL : strrchr(from, '/');
+        int dirlen = slash ? (int)(slash - from + 1) : 0;
+        snprintf(found, PATH_MAX, "%.*s%.*s", dirlen, from, (int)len, name);
+        if(!stat(found, &st) && S_ISREG(st.st_mode))
+            return 1;
+        if(name[0] == '/')
+            return 0;
+    }
+    for(size_t i = 0; i < num_include_dirs; i++)
+    {
+        snprintf(found, PATH_MAX, "%s/%.*s", include_dirs[i], (int)len, name);
+        if(!stat(found, &st) && S_ISREG(st.st_mode))
+            return 1;
+    }
+    return 0;
+}
+
+/*****************************************************************\
+*   @return the @param len chars of @param name included by       *
+*   @param from, see find_file(), held by @param pp. NULL if it   *
+*   can't be read                                                 *
+\*****************************************************************/
+static const cached_file_t* find_include(pp_t* pp, const char* from, const char* name, size_t len, int quoted,
+                                         char* found)
+{
+    return find_file(from, name, len, quoted, found) ? load(pp, found) : NULL;
+}
+
+/*****************************************************************\
+*   Adds @param path to the @param num paths of @param paths if   *
+*   it isn't there. @return its number                            *
+\*****************************************************************/
+static size_t add_path(char*** paths, size_t* num, const char* path)
+{
+    size_t i = 0;
+    while(i < *num && strcmp((*paths)[i], path))
+        i++;
+    if(i == *num)
+    {
+        if(!(*paths = realloc(*paths, (*num + 1) * sizeof(char*))) || !((*paths)[(*num)++] = strdup(path)))
+            fatal("out of memory");
+    }
+    return i;
+}
+
+/*****************************************************************\
+*   Puts the real path in the FILE "path" of the line that begins *
+*   at @param start of the output, the file is found like an      *
+*   #include "path" and the build depends on it                   *
+\*****************************************************************/
+static void embed(pp_t* pp, size_t start)
+{
+    const char* s = pp->out.data + start;
+    const char* end = pp->out.data + pp->out.size;
+    for(;;)
+    {
+        while(s < end && (isspace((unsigned char)*s) || *s == ','))
+            s++;
+        if(s == end || begins(s, end, syntax->after_comment, syntax->after_comment_len) ||
+           begins(s, end, syntax->multi_comment_begin, syntax->multi_comment_begin_len))
+            return;
+
+        const char* token = s;
+        while(s < end && !isspace((unsigned char)*s) && *s != ',' && *s != '"')
+            s++;
+        if(s == token)
+            s++;
+        if(s - token != 4 || strncasecmp(token, "file", 4))
+            continue;
+
+        const char* q = skip_blanks(s, end);
+        const char* e = q < end && *q == '"' ? memchr(q + 1, '"', end - q - 1) : NULL;
+        char found[PATH_MAX], real[PATH_MAX];
+        if(!e || !find_file(pp->file, q + 1, e - q - 1, 1, found) || !realpath(found, real))
+            return; /* the parser tells what is wrong */
+        add_path(&pp->result->blobs, &pp->result->num_blobs, real);
+
+        size_t name_at = q + 1 - pp->out.data;
+        size_t rest_len = end - e;
+        char rest[rest_len];
+        memcpy(rest, e, rest_len);
+        pp->out.size = name_at;
+        put_str(&pp->out, real);
+        put(&pp->out, rest, rest_len);
+        return;
+    }
+}
+
+/*****************************************************************\
+*   Includes the file of the #include arguments @param s to       *
+*   @param end at @param depth                                    *
+\*****************************************************************/
+static void include(pp_t* pp, const char* s, const char* end, int depth)
+{
+    text_t name = { 0 };
+    if(s < end && *s != '"' && *s != '<')
+    {
+        /* #include NAME with a macro NAME that is "file" or <file> */
+        put(&name, "", 0);
+        expand(pp, s, end, &name, 0);
+        s = name.data;
+        end = name.data + name.size;
+    }
+
+    char close = s < end && *s == '<' ? '>' : '"';
+    const char* e = s < end ? memchr(s + 1, close, end - s - 1) : NULL;
+    if(s == end || (*s != '"' && *s != '<') || !e)
+        fatal("%s:%lu: #include needs \"file\" or <file>", pp->file, (ulong)pp->line);
+    if(depth >= PP_MAX_INCLUDE_DEPTH)
+        fatal("%s:%lu: #include nested too deep", pp->file, (ulong)pp->line);
+
+    char found[PATH_MAX];
+    const cached_file_t* f = find_include(pp, pp->file, s + 1, e - s - 1, close == '"', found);
+    if(!f)
+        fatal("%s:%lu: can't find included file %.*s", pp->file, (ulong)pp->line, (int)(e - s - 1), s + 1);
+    free(name.data);
+
+    /* a guarded file whose guard is defined and a #pragma once file are only included once */
+    if(f->guard && *find_macro(pp, f->guard, strlen(f->guard)))
+        return;
+    size_t i = 0;
+    while(i < pp->num_included && pp->included[i] != f)
+        i++;
+    if(i < pp->num_included && f->once)
+        return;
+    if(i == pp->num_included)
+    {
+        if(!(pp->included = realloc(pp->included, (pp->num_included + 1) * sizeof(cached_file_t*))))
+            fatal("out of memory");
+        pp->included[pp->num_included++] = f;
+    }
+
+    preprocessed_t* r = pp->result;
+    i = add_path(&r->files, &r->num_files, found);
+
+    const char* file = pp->file;
+    size_t line = pp->line;
+    int in_comment = pp->in_comment;
+    char marker[2 * PATH_MAX + 64];
+    snprintf(marker, sizeof(marker), "#line 1 \"%s\"\n", r->files[i]);
+    put_str(&pp->out, marker);
+
+    /* the parser maps the symbols of a header with a snapshot, its lines are skipped */
+    char snapshot[PATH_MAX + sizeof(SNAPSHOT_EXTENSION)];
+    snprintf(snapshot, sizeof(snapshot), "%s" SNAPSHOT_EXTENSION, f->path);
+    int quiet = snapshot_valid(snapshot, f->hash);
+    if(quiet)
+    {
+        snprintf(marker, sizeof(marker), "#symbols \"%s\" %llu\n", snapshot, (unsigned long long)f->hash);
+        put_str(&pp->out, marker);
+    }
+
+    pp->in_comment = 0;
+    pp->quiet += quiet;
+    process(pp, r->files[i], f->text, f->len, depth + 1);
+    pp->quiet -= quiet;
+    if(pp->out.data[pp->out.size - 1] != '\n')
+        put(&pp->out, "\n", 1); /* the last line of the file has no new line */
+
+    pp->file = file;
+    pp->line = line;
+    pp->in_comment = in_comment;
+    snprintf(marker, sizeof(marker), "#line %lu \"%s\"", (ulong)line + 1, file);
+    put_str(&pp->out, marker);
+}
+
+/*****************************************************************\
+*   Preprocesses the @param len bytes of @param text of           *
+*   @param file, included at @param depth, into pp->out           *
+\*****************************************************************/
+static void process(pp_t* pp, const char* file, const char* text, size_t len, int depth)
+{
+    struct
+    {
+        u8 active; /* the lines are kept */
+        u8 taken; /* a branch of this #if was kept */
+        u8 seen_else;
+    } cond[PP_MAX_CONDITIONS];
+    int num_cond = 0;
+    const char* end = text + len;
+
+    pp->file = file;
+    pp->line = 0;
+    for(const char* p = text; p < end;)
+    {
+        const char* nl = memchr(p, '\n', end - p);
+        const char* eol = nl ? nl : end;
+        const char* s = skip_blanks(p, eol);
+        int active = !num_cond || cond[num_cond - 1].active;
+        pp->line++;
+
+        if(s == eol || *s != '#' || pp->in_comment)
+        {
+            if(active && !pp->quiet)
+            {
+                size_t start = pp->out.size;
+                int in_comment = pp->in_comment;
+                expand(pp, p, eol, &pp->out, 0);
+                if(!in_comment)
+                    embed(pp, start);
+            }
+        }
+        else
+        {
+            const char *args, *args_end;
+            const char* name = skip_blanks(s + 1, eol);
+            size_t n = directive(name, eol, &args, &args_end);
+
+            if(is_directive(name, n, "if") || is_directive(name, n, "ifdef") || is_directive(name, n, "ifndef"))
+            {
+                if(num_cond == PP_MAX_CONDITIONS)
+                    fatal("%s:%lu: #if nested too deep", file, (ulong)pp->line);
+                int value = 0;
+                if(active && name[2] == 'd')
+                    value = *find_macro(pp, args, args_end - args) != NULL;
+                else if(active && name[2] == 'n')
+                    value = *find_macro(pp, args, args_end - args) == NULL;
+                else if(active)
+                    value = evaluate(pp, args, args_end) != 0;
+                /* the branches of an #if inside a false region are all false */
+                cond[num_cond].active = value;
+                cond[num_cond].taken = value || !active;
+                cond[num_cond].seen_else = 0;
+                num_cond++;
+            }
+            else if(is_directive(name, n, "elif") || is_directive(name, n, "else"))
+            {
+                if(!num_cond || cond[num_cond - 1].seen_else)
+                    fatal("%s:%lu: #%.*s without #if", file, (ulong)pp->line, (int)n, name);
+                if(cond[num_cond - 1].taken)
+                    cond[num_cond - 1].active = 0;
+                else
+                {
+                    cond[num_cond - 1].active = name[2] == 's' || evaluate(pp, args, args_end) != 0;
+                    cond[num_cond - 1].taken = cond[num_cond - 1].active;
+                }
+                cond[num_cond - 1].seen_else = name[2] == 's';
+            }
+            else if(is_directive(name, n, "endif"))
+            {
+                if(!num_cond)
+                    fatal("%s:%lu: #endif without #if", file, (ulong)pp->line);
+                num_cond--;
+            }
+            else if(!active || name == eol) {} /* a # alone does nothing */
+            else if(isdigit((unsigned char)*name) || is_directive(name, n, "line"))
+            {
+                if(!pp->quiet)
+                    put(&pp->out, p, eol - p); /* #line 12 "file" or the # 12 "file" of cpp */
+            }
+            else if(is_directive(name, n, "define"))
+                define(pp, args, args_end);
+            else if(is_directive(name, n, "undef"))
+                undefine(pp, args, args_end - args);
+            else if(is_directive(name, n, "include"))
+                include(pp, args, args_end, depth);
+            else if(is_directive(name, n, "error"))
+                fatal("%s:%lu: #error %.*s", file, (ulong)pp->line, (int)(args_end - args), args);
+            else if(is_directive(name, n, "warning"))
+                fprintf(stderr, "%s:%lu: warning: %.*s\n", file, (ulong)pp->line, (int)(args_end - args), args);
+            else if(is_directive(name, n, "pragma")) {} /* once is found when the file is read */
+            else
+                fatal("%s:%lu: unknown directive #%.*s", file, (ulong)pp->line, (int)n, name);
+        }
+
+        if(nl && !pp->quiet)
+            put(&pp->out, "\n", 1);
+        p = nl ? nl + 1 : end;
+    }
+
+    if(num_cond)
+        fatal("%s: #if without #endif", file);
+}
+
+static void pp_free(pp_t* pp)
+{
+    for(size_t i = 0; i < PP_BUCKETS; i++)
+    {
+        while(pp->macros[i])
+        {
+            macro_t* next = pp->macros[i]->next;
+            free_macro(pp->macros[i]);
+            pp->macros[i] = next;
+        }
+    }
+    free(pp->included);
+
+    pthread_mutex_lock(&cache_lock);
+    for(size_t i = 0; i < pp->num_held; i++)
+    {
+        if(!--pp->held[i]->users && pp->held[i]->replaced)
+            free_cached(pp->held[i]);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(pp->held);
+
+    free(pp->out.data);
+    free(pp);
+}
+
+/*****************************************************************\
+*   Preprocesses the @param len bytes of @param src of the file   *
+*   @param filename into @param out, with the -D macros defined   *
+\*****************************************************************/
+void preprocess(const char* filename, const char* src, size_t len, preprocessed_t* out)
+{
+    memset(out, 0, sizeof(preprocessed_t));
+    if(!(out->files = malloc(sizeof(char*))) || !(out->files[0] = strdup(filename)))
+        fatal("out of memory");
+    out->num_files = 1;
+
+    pp_t* pp = calloc(1, sizeof(pp_t));
+    if(!pp)
+        fatal("out of memory");
+    pp->result = out;
+    put(&pp->out, "", 0);
+
+    /* the caller gets nothing half made */
+    ERROR_FRAME(pp_free(pp); preprocessed_free(out);)
+
+    pp->file = "-D";
+    for(size_t i = 0; i < num_definitions; i++)
+    {
+        /* NAME=VALUE is #define NAME VALUE, NAME alone is 1 */
+        const char* d = definitions[i];
+        const char* eq = strchr(d, '=');
+        char def[strlen(d) + 3];
+        if(eq)
+            snprintf(def, sizeof(def), "%.*s %s", (int)(eq - d), d, eq + 1);
+        else
+            snprintf(def, sizeof(def), "%s 1", d);
+        define(pp, def, def + strlen(def));
+    }
+
+    process(pp, filename, src, len, 0);
+    ERROR_FRAME_END();
+
+    out->text = pp->out.data;
+    out->len = pp->out.size;
+    pp->out.data = NULL;
+    pp_free(pp);
+}
+
+void preprocessed_free(preprocessed_t* p)
+{
+    for(size_t i = 0; i < p->num_files; i++)
+        free(p->files[i]);
+    free(p->files);
+    for(size_t i = 0; i < p->num_blobs; i++)
+        free(p->blobs[i]);
+    free(p->blobs);
+    free(p->text);
+    memset(p, 0, sizeof(preprocessed_t));
+}
+
+/*****************************************************************\
+*   Writes @param name into the make rule in @param file          *
+\*****************************************************************/
+static void put_make_name(FILE* file, const char* name)
+{
+    for(const char* c = name; *c; c++)
+    {
+        if(*c == ' ' || *c == '#')
+            fputc('\\', file);
+        else if(*c == '$')
+            fputc('$', file);
+        fputc(*c, file);
+    }
+}
+
+/*****************************************************************\
+*   Writes a make rule for @param target that depends on the      *
+*   files of @param p into @param depfile                         *
+\*****************************************************************/
+void write_depfile(const char* depfile, const char* target, const preprocessed_t* p)
+{
+    FILE* file = fopen(depfile, "w");
+    if(!file)
+        sys_error("error opening dependency file!");
+
+    put_make_name(file, target);
+    fputc(':', file);
+    for(size_t i = 0; i < p->num_files + p->num_blobs; i++)
+    {
+        fputs(i ? " \\\n  " : " ", file);
+        put_make_name(file, i < p->num_files ? p->files[i] : p->blobs[i - p->num_files]);
+    }
+    fputc('\n', file);
+
+    /* an empty rule for every included file, make doesn't fail when one is removed */
+    for(size_t i = 1; i < p->num_files + p->num_blobs; i++)
+    {
+        fputc('\n', file);
+        put_make_name(file, i < p->num_files ? p->files[i] : p->blobs[i - p->num_files]);
+        fputs(":\n", file);
+    }
+
+    if(fclose(file))
+        sys_error("error writing dependency file!");
+}
@@ -0,0 +1,26 @@
+#ifndef PREPROCESS_H_INCLUDED
+#define PREPROCESS_H_INCLUDED
+#include "types.h"
+#include <stdlib.h>
+
+#define PP_MAX_INCLUDE_DEPTH 64
+#define PP_MAX_CONDITIONS 64 /* nested #if in one file */
+#define PP_MAX_EXPANSION 64 /* nested macro expansions */
+
+/* a source with its directives carried out */
+typedef struct
+{
+    char*   text;
+    size_t  len;
+    char**  files; /* the source and every file it included, for the depfile */
+    size_t  num_files;
+    char**  blobs; /* real paths of the files FILE copies in */
+    size_t  num_blobs;
+} preprocessed_t;
+
+void preprocess_define(const char* definition);
+void preprocess_include_dir(const char* dir);
+void preprocess(const char* filename, const char* src, size_t len, preprocessed_t* out);
+void preprocessed_free(preprocessed_t* p);
+void write_depfile(const char* depfile, const char* target, const preprocessed_t* p);
+#endif // PREPROCESS_H_INCLUDED
@@ -0,0 +1,159 @@
+#include "ring.h"
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+#define RING_SPINS 64 /* times a waiting side yields before it sleeps */
+#define RING_SLEEP_NS 50000 /* short enough not to hold the other side up */
+
+/*
+head and tail only grow, the position in data is their value modulo size. The producer
+publishes bytes by storing head with release order after copying them, the consumer
+frees space the same way with tail, so each side sees the other's data complete.
+
+A side that has to wait yields a few times, the other one is usually about to be done,
+then sleeps in short steps, so a stage that waits for a slower one doesn't keep a core busy.
+*/
+
+/*****************************************************************\
+*                                                                 *
+*   Waits a bit for the other side, @param idle counts the waits  *
+*   in a row.                                                     *
+*                                                                 *
+\*****************************************************************/
+static void ring_wait(unsigned* idle)
+{
+    if((*idle)++ < RING_SPINS)
+        sched_yield();
+    else
+    {
+        struct timespec req = { 0, RING_SLEEP_NS };
+        nanosleep(&req, NULL);
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Initializes @param ring to hold @param size bytes, which must *
+*   be a power of two. @return 0 if out of memory                 *
+*                                                                 *
+\*****************************************************************/
+int ring_init(ring_t* ring, size_t size)
+{
+    ring->data = malloc(size);
+    ring->size = size;
+    ring->head = ring->tail = 0;
+    ring->closed = 0;
+    return ring->data != NULL;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Frees @param ring, both threads must be done with it.         *
+*                                                                 *
+\*****************************************************************/
+void ring_free(ring_t* ring)
+{
+    free(ring->data);
+    ring->data = NULL;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Producer: copies up to @param size bytes of @param data into  *
+*   @param ring. @return bytes copied, 0 if it is full            *
+*                                                                 *
+\*****************************************************************/
+size_t ring_push(ring_t* ring, const void* data, size_t size)
+{
+    size_t head = ring->head;
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t space = ring->size - (head - tail);
+    if(size > space)
+        size = space;
+
+    size_t pos = head & (ring->size - 1);
+    size_t first = ring->size - pos < size ? ring->size - pos : size;
+    memcpy(ring->data + pos, data, first);
+    memcpy(ring->data, (const u8*)data + first, size - first);
+
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+    return size;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Producer: copies all @param size bytes of @param data into    *
+*   @param ring, waiting for the consumer if it is full.          *
+*                                                                 *
+\*****************************************************************/
+void ring_push_all(ring_t* ring, const void* data, size_t size)
+{
+    const u8* bytes = data;
+    unsigned idle = 0;
+    while(size)
+    {
+        size_t n = ring_push(ring, bytes, size);
+        if(!n)
+            ring_wait(&idle);
+        else
+            idle = 0;
+        bytes += n;
+        size -= n;
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Consumer: copies up to @param size bytes from @param ring     *
+*   into @param data. @return bytes copied, 0 if it is empty      *
+*                                                                 *
+\*****************************************************************/
+size_t ring_pop(ring_t* ring, void* data, size_t size)
+{
+    size_t tail = ring->tail;
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if(size > head - tail)
+        size = head - tail;
+
+    size_t pos = tail & (ring->size - 1);
+    size_t first = ring->size - pos < size ? ring->size - pos : size;
+    memcpy(data, ring->data + pos, first);
+    memcpy((u8*)data + first, ring->data, size - first);
+
+    __atomic_store_n(&ring->tail, tail + size, __ATOMIC_RELEASE);
+    return size;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Consumer: @return bytes in @param ring ready to be popped.    *
+*                                                                 *
+\*****************************************************************/
+size_t ring_used(ring_t* ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Producer: tells the consumer there's nothing more to come.    *
+*                                                                 *
+\*****************************************************************/
+void ring_close(ring_t* ring)
+{
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Consumer: @return non zero if @param ring is closed and all   *
+*   of it was popped.                                             *
+*                                                                 *
+\*****************************************************************/
+int ring_done(ring_t* ring)
+{
+    /* closed first, a push before the close is visible then */
+    return __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) &&
+           __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail;
+}
@@ -0,0 +1,24 @@
+#ifndef RING_H_INCLUDED
+#define RING_H_INCLUDED
+#include "types.h"
+#include <stdlib.h>
+
+/* a byte queue between exactly one producer thread and one consumer thread, without locks */
+typedef struct
+{
+    u8*     data;
+    size_t  size; /* power of two */
+    size_t  head; /* bytes pushed so far, only the producer writes it */
+    size_t  tail; /* bytes popped so far, only the consumer writes it */
+    int     closed; /* the producer is done */
+} ring_t;
+
+int ring_init(ring_t* ring, size_t size);
+void ring_free(ring_t* ring);
+size_t ring_push(ring_t* ring, const void* data, size_t size);
+void ring_push_all(ring_t* ring, const void* data, size_t size);
+size_t ring_pop(ring_t* ring, void* data, size_t size);
+size_t ring_used(ring_t* ring);
+void ring_close(ring_t* ring);
+int ring_done(ring_t* ring);
+#endif // RING_H_INCLUDED
@@ -0,0 +1,412 @@
+#include "server.h"
+#include "context.h"
+#include "preprocess.h"
+#include "ir.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+/*
+ppasm --serve keeps one assembler per connection, so its buffers stay allocated and warm in
+the cache between the requests, and the opcode tables are shared by all of them. A client
+keeps its connection for as long as it has sources to assemble.
+
+ppasm sends its sources preprocessed. The source of a path request is preprocessed by the
+server, with the -D and -I it was started with, so it comes out the same as the one ppasm
+would send. The included files stay in the cache of the server between the requests.
+*/
+
+/*****************************************************************\
+*                                                                 *
+*   Reads exactly @param size bytes from @param fd.               *
+*   @return 0 on errors or at the end of the stream               *
+*                                                                 *
+\*****************************************************************/
+static int read_all(int fd, void* data, size_t size)
+{
+    u8* p = data;
+    while(size)
+    {
+        ssize_t n = read(fd, p, size);
+        if(n <= 0)
+        {
+            if(n < 0 && errno == EINTR)
+                continue;
+            return 0;
+        }
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Writes exactly @param size bytes into the socket @param fd,   *
+*   without a SIGPIPE if the other end is gone.                   *
+*   @return 0 on errors                                           *
+*                                                                 *
+\*****************************************************************/
+static int write_all(int fd, const void* data, size_t size)
+{
+    const u8* p = data;
+    while(size)
+    {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return 0;
+        }
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Sends the answer @param status with @param length bytes of    *
+*   @param data. @return 0 on errors                              *
+*                                                                 *
+\*****************************************************************/
+static int answer(int fd, u32 status, u32 line, const void* data, size_t length)
+{
+    server_answer_t a = { status, line, length };
+    return write_all(fd, &a, sizeof(a)) && write_all(fd, data, length);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Reads the whole file @param path into @param src.             *
+*   @return 0 if it can't, with errno set                         *
+*                                                                 *
+\*****************************************************************/
+static int read_path(const char* path, char** src, size_t* len)
+{
+    FILE* file = fopen(path, "rb");
+    if(!file)
+        return 0;
+
+    size_t size = 0;
+    *len = 0;
+    do
+    {
+        size = size ? size * 2 : 0x4000;
+        char* p = realloc(*src, size);
+        if(!p)
+        {
+            fclose(file);
+            return 0;
+        }
+        *src = p;
+        *len += fread(*src + *len, 1, size - *len, file);
+    }
+    while(*len == size);
+
+    int ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Preprocesses the source @param path of @param len bytes of    *
+*   @param text in the context @param ctx. @return the text and   *
+*   its size in @param len, NULL with the message in ctx->error   *
+*   if the preprocessor failed                                    *
+*                                                                 *
+\*****************************************************************/
+static char* preprocess_path(ppasm_t* ctx, const char* path, const char* text, size_t* len)
+{
+    preprocessed_t pre;
+    asm_context_t* caller = asm_ctx;
+    asm_ctx = ctx;
+    jmp_buf error_jmp;
+    ctx->error_jmp = &error_jmp;
+    if(setjmp(error_jmp))
+    {
+        ctx->error_jmp = NULL;
+        asm_ctx = caller;
+        return NULL;
+    }
+    preprocess(path, text, *len, &pre);
+    ctx->error_jmp = NULL;
+    asm_ctx = caller;
+
+    char* out = pre.text;
+    *len = pre.len;
+    pre.text = NULL;
+    preprocessed_free(&pre);
+    return out;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Serves the requests of the connection @param arg till the     *
+*   client closes it.                                             *
+*                                                                 *
+\*****************************************************************/
+static void* serve_connection(void* arg)
+{
+    int fd = (int)(intptr_t)arg;
+    ppasm_t* ctx = ppasm_new();
+    u8* image = malloc(PPASM_MAX_IMAGE);
+    char* src = NULL;
+    size_t srcsz = 0;
+
+    server_request_t r;
+    while(ctx && image && read_all(fd, &r, sizeof(r)))
+    {
+        if(r.magic != SERVER_MAGIC || r.length > SERVER_MAX_SOURCE)
+            break;
+
+        if(r.length + 1 > srcsz)
+        {
+            srcsz = r.length + 1;
+            char* p = realloc(src, srcsz);
+            if(!p)
+                break;
+            src = p;
+        }
+        if(!read_all(fd, src, r.length))
+            break;
+
+        const char* source = src;
+        size_t len = r.length;
+        char* file = NULL;
+        char* text = NULL;
+        if(r.kind == SERVER_PATH)
+        {
+            src[len] = 0;
+            if(!read_path(src, &file, &len))
+            {
+                const char* msg = strerror(errno);
+                free(file);
+                if(!answer(fd, 1, 0, msg, strlen(msg)))
+                    break;
+                continue;
+            }
+            source = file;
+
+            /* an IR has nothing to preprocess */
+            if(!ir_detect(file, len))
+            {
+                if(!(text = preprocess_path(ctx, src, file, &len)))
+                {
+                    free(file);
+                    if(!answer(fd, 1, 0, ctx->error, strlen(ctx->error)))
+                        break;
+                    continue;
+                }
+                source = text;
+            }
+        }
+
+        ppasm_options_t options = { r.options & SERVER_RAW, (r.options & SERVER_EEPROM) != 0 };
+        size_t imgsz;
+        int ok;
+        int failed = ppasm_assemble(ctx, source, len, &options, image, PPASM_MAX_IMAGE, &imgsz);
+        free(text);
+        free(file);
+        if(!failed)
+            ok = answer(fd, 0, 0, image, imgsz);
+        else
+        {
+            ppasm_error_t e = ppasm_error(ctx);
+            ok = answer(fd, 1, e.line, e.message, strlen(e.message));
+        }
+        if(!ok)
+            break;
+    }
+
+    free(src);
+    free(image);
+    if(ctx)
+        ppasm_free(ctx);
+    close(fd);
+    return NULL;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Creates the listening unix socket @param path, replacing a    *
+*   stale one. Only its user can connect, a request makes the     *
+*   server read any file the user can. @return the socket         *
+*                                                                 *
+\*****************************************************************/
+int server_open(const char* path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if(strlen(path) >= sizeof(addr.sun_path))
+        fatal("error: the socket path %s is too long", path);
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0)
+        sys_error("can't create the server socket");
+
+    /* a socket left behind is replaced, anything else at path is kept */
+    struct stat st;
+    if(!lstat(path, &st))
+    {
+        if(!S_ISSOCK(st.st_mode))
+        {
+            close(sock);
+            fatal("error: %s exists and isn't a socket", path);
+        }
+        if(!connect(sock, (struct sockaddr*)&addr, sizeof(addr)))
+        {
+            close(sock);
+            fatal("error: a server is already running on %s", path);
+        }
+        if(errno != ECONNREFUSED)
+            sys_error("can't check the old server socket");
+        close(sock);
+        if((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            sys_error("can't create the server socket");
+        if(unlink(path))
+            sys_error("can't remove the old server socket");
+    }
+
+    mode_t mask = umask(0177); /* 0600 */
+    int failed = bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+    if(failed || listen(sock, 64))
+        sys_error("can't listen on the server socket");
+
+    return sock;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Accepts connections on @param sock, each one gets a thread,   *
+*   till the socket is shut down.                                 *
+*                                                                 *
+\*****************************************************************/
+void server_loop(int sock)
+{
+    for(;;)
+    {
+        int fd = accept(sock, NULL, NULL);
+        if(fd < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if(pthread_create(&thread, &attr, serve_connection, (void*)(intptr_t)fd))
+            close(fd);
+        pthread_attr_destroy(&attr);
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Serves assemble requests on the unix socket @param path,      *
+*   doesn't return.                                               *
+*                                                                 *
+\*****************************************************************/
+void server_run(const char* path)
+{
+    int sock = server_open(path);
+    printf("serving on %s\n", path);
+    fflush(stdout);
+    server_loop(sock);
+    sys_error("the server socket failed");
+}
+
+/*************************************************************************************\
+*                                                                                     *
+*   Assembles the @param len bytes of @param src with @param options on the server   *
+*   at @param path, the image goes to @param out of PPASM_MAX_IMAGE bytes.           *
+*   @return 0, 1 with the message in @param error if the source has errors or -1 if  *
+*   there is no server to ask                                                         *
+*                                                                                     *
+\*************************************************************************************/
+int server_assemble(const char* path, const char* src, size_t len, const ppasm_options_t* options,
+                    u8* out, size_t* imgsz, char* error, size_t errorsz)
+{
+    /* one connection for all the requests of this thread */
+    static __thread int sock = -1;
+    static __thread struct sockaddr_un addr;
+
+    if(sock >= 0 && strcmp(addr.sun_path, path))
+    {
+        close(sock);
+        sock = -1;
+    }
+
+    if(len > SERVER_MAX_SOURCE)
+        return -1;
+
+    if(sock < 0)
+    {
+        if(strlen(path) >= sizeof(addr.sun_path))
+            return -1;
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(sock < 0)
+            return -1;
+        if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)))
+        {
+            close(sock);
+            sock = -1;
+            return -1;
+        }
+    }
+
+    server_request_t r = { SERVER_MAGIC, SERVER_INLINE, 0, len };
+    if(options->raw)
+        r.options |= SERVER_RAW;
+    if(options->eeprom)
+        r.options |= SERVER_EEPROM;
+
+    server_answer_t a;
+    if(!write_all(sock, &r, sizeof(r)) || !write_all(sock, src, len) || !read_all(sock, &a, sizeof(a)) ||
+       (!a.status && a.length > PPASM_MAX_IMAGE))
+    {
+        close(sock);
+        sock = -1;
+        return -1;
+    }
+
+    if(!a.status)
+    {
+        *imgsz = a.length;
+        if(read_all(sock, out, a.length))
+            return 0;
+    }
+    else
+    {
+        /* the message is cut to fit into error, the rest is read and dropped */
+        size_t n = a.length < errorsz ? a.length : errorsz - 1, rest = a.length - n;
+        char c;
+        int ok = read_all(sock, error, n);
+        error[n] = 0;
+        while(ok && rest--)
+            ok = read_all(sock, &c, 1);
+        if(ok)
+            return 1;
+    }
+
+    close(sock);
+    sock = -1;
+    return -1;
+}
@@ -0,0 +1,40 @@
+#ifndef SERVER_H_INCLUDED
+#define SERVER_H_INCLUDED
+#include "types.h"
+#include "libppasm.h"
+
+/*
+Requests and answers on the --serve socket, in the byte order of the machine since both
+ends are on it. A request is a server_request_t followed by length bytes of the source, or
+of the path of the source, which the server reads and preprocesses, an answer a
+server_answer_t followed by length bytes of the image or of the error message. A connection
+can carry any number of requests.
+*/
+#define SERVER_MAGIC 0x50504153 /* "PPAS" */
+#define SERVER_INLINE 0 /* the request carries the source */
+#define SERVER_PATH 1 /* the request carries the path of the source */
+#define SERVER_RAW 1 /* option bits */
+#define SERVER_EEPROM 2
+#define SERVER_MAX_SOURCE 0x1000000 /* bigger requests are refused */
+
+typedef struct
+{
+    u32 magic;
+    u32 kind;
+    u32 options;
+    u32 length;
+} server_request_t;
+
+typedef struct
+{
+    u32 status; /* 0 or 1 if the source has errors */
+    u32 line; /* of the error, 0 if it isn't about one */
+    u32 length;
+} server_answer_t;
+
+int server_open(const char* path);
+void server_loop(int sock);
+void server_run(const char* path);
+int server_assemble(const char* path, const char* src, size_t len, const ppasm_options_t* options,
+                    u8* out, size_t* imgsz, char* error, size_t errorsz);
+#endif // SERVER_H_INCLUDED
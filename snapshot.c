@@ -0,0 +1,289 @@
+#include "snapshot.h"
+#include "preprocess.h"
+#include "parse.h"
+#include "stringext.h"
+#include "expression.h"
+#include "symmap.h"
+#include "context.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+A header that only defines constants, the pin map every source of a product includes, can
+be built once into a symbol snapshot with --snapshot <header>, it is written next to it as
+<header>.syms. The snapshot is the symbol table of the header laid out to be used where it
+is mapped: a hash table of entries with their values and the names they point to. It holds
+the hash of the header's text, #include uses the snapshot instead of the text while they
+match and the header's text again once it changed.
+
+The header still goes through the preprocessor for its #define and its include guard, its
+other lines are skipped. In their place the parser gets a #symbols "<snapshot>" <hash> line
+and maps the snapshot till fini_symtable(). Its symbols aren't copied into the symbol table,
+a name the symbol table doesn't have is looked up in the buckets of the mapped snapshots.
+*/
+
+/*****************************************************************\
+*   @return the hash of the header @param text of @param len      *
+*   bytes a snapshot is checked against                           *
+\*****************************************************************/
+u64 snapshot_hash(const char* text, size_t len)
+{
+    return hash_fnv1a(text, len, FNV_OFFSET);
+}
+
+static u32 name_hash(const char* name)
+{
+    return (u32)hash_fnv1a(name, strlen(name), FNV_OFFSET);
+}
+
+/*****************************************************************\
+*   @return the line @param line to @param end ends at            *
+\*****************************************************************/
+static const char* line_end(const char* line, const char* end)
+{
+    const char* nl = memchr(line, '\n', end - line);
+    return nl ? nl : end;
+}
+
+/*****************************************************************\
+*   Builds the snapshot @param path of the @param len bytes of    *
+*   @param text of the file @param header. Only constants can be  *
+*   in it, the preprocessor can only add #define to them.         *
+\*****************************************************************/
+void snapshot_build(const char* header, const char* text, size_t len, const char* path)
+{
+    /* a line the preprocessor changed uses a macro, a condition or an #include */
+    preprocessed_t pre;
+    preprocess(header, text, len, &pre);
+    const char* in = text;
+    const char* out = pre.text;
+    for(size_t line = 1; in < text + len || out < pre.text + pre.len; line++)
+    {
+        const char* in_end = in < text + len ? line_end(in, text + len) : in;
+        const char* out_end = out < pre.text + pre.len ? line_end(out, pre.text + pre.len) : out;
+        const char* s = in;
+        while(s < in_end && (*s == ' ' || *s == '\t'))
+            s++;
+        int same = in_end - in == out_end - out && !memcmp(in, out, in_end - in);
+        if(in >= text + len || out >= pre.text + pre.len || (!same && (s == in_end || *s != '#' || out_end != out)))
+            fatal("%s:%lu: a snapshot can only have constants, without macros, conditions or #include", header, (ulong)line);
+        in = in_end + 1;
+        out = out_end + 1;
+    }
+
+    FILE* file = fmemopen(pre.text, pre.len, "r");
+    if(!file)
+        sys_error("can't read the header");
+    parse_begin();
+    int     comment_on = 0;
+    size_t  linesz;
+    while(!feof(file))
+    {
+        asm_ctx->line_num++;
+        parse_line(read_line(file, &linesz, &comment_on));
+        if(asm_ctx->directive_seen || asm_ctx->curr_op)
+            fatal("%s:%lu: a snapshot can only have constants, no instructions or directives", header, (ulong)asm_ctx->line_num);
+    }
+    fclose(file);
+    preprocessed_free(&pre);
+
+    u32 n = asm_ctx->symtable.size;
+    if(asm_ctx->symmap.constants.size != n)
+        fatal("%s: a snapshot can only have constants, the labels need equ or =", header);
+
+    u32 num_buckets = 2; /* the entries after the buckets are 8 byte aligned */
+    while(num_buckets < n * 2)
+        num_buckets *= 2;
+
+    size_t names_size = 0;
+    for(u32 i = 0; i < n; i++)
+        names_size += strlen(asm_ctx->symtable.element[i].string) + 1;
+
+    snapshot_header_t h = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, snapshot_hash(text, len), n, num_buckets, 0, 0 };
+    h.names = sizeof(h) + num_buckets * sizeof(u32) + n * sizeof(snapshot_entry_t);
+    h.size = h.names + names_size;
+
+    char* image = calloc(1, h.size);
+    if(!image)
+        fatal("out of memory");
+    u32* buckets = (u32*)(image + sizeof(h));
+    snapshot_entry_t* entries = (snapshot_entry_t*)(buckets + num_buckets);
+    char* names = image + h.names;
+
+    /* the entries stay in the order of the header, they are added to the symbol table in it */
+    u32 name = 0;
+    for(u32 i = 0; i < n; i++)
+    {
+        const pair_t* p = &asm_ctx->symtable.element[i];
+        u32 b = name_hash(p->string) & (num_buckets - 1);
+        entries[i].value = p->value;
+        entries[i].name = name;
+        entries[i].constant = 1;
+        entries[i].next = buckets[b];
+        buckets[b] = i + 1;
+        strcpy(names + name, p->string);
+        name += strlen(p->string) + 1;
+    }
+    memcpy(image, &h, sizeof(h));
+    fini_symtable();
+
+    /* written next to it and renamed, a build never maps half a snapshot */
+    char tmp[strlen(path) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if(!(file = fopen(tmp, "wb")))
+        sys_error("error opening snapshot file!");
+    if(fwrite(image, 1, h.size, file) != h.size || fclose(file))
+        sys_error("error writing snapshot file!");
+    if(rename(tmp, path))
+        sys_error("error renaming snapshot file!");
+    free(image);
+}
+
+/*****************************************************************\
+*   @return 1 if the snapshot @param path was built from the      *
+*   header with the hash @param hash, 0 if it is missing or old   *
+\*****************************************************************/
+int snapshot_valid(const char* path, u64 hash)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return 0;
+
+    snapshot_header_t h;
+    int valid = read(fd, &h, sizeof(h)) == sizeof(h) && h.magic == SNAPSHOT_MAGIC &&
+                h.version == SNAPSHOT_VERSION && h.source_hash == hash;
+    close(fd);
+    return valid;
+}
+
+/*****************************************************************\
+*   @return the entry of @param name in the snapshot @param s,    *
+*   NULL if it has none                                           *
+\*****************************************************************/
+const snapshot_entry_t* snapshot_find(const snapshot_header_t* s, const char* name)
+{
+    const u32* buckets = (const u32*)(s + 1);
+    const snapshot_entry_t* entries = (const snapshot_entry_t*)(buckets + s->num_buckets);
+    const char* names = (const char*)s + s->names;
+
+    for(u32 i = buckets[name_hash(name) & (s->num_buckets - 1)]; i; i = entries[i - 1].next)
+        if(!strcmp(names + entries[i - 1].name, name))
+            return &entries[i - 1];
+    return NULL;
+}
+
+/*****************************************************************\
+*   Maps the snapshot @param path of the header with the hash     *
+*   @param hash, its symbols are looked up where it is mapped     *
+\*****************************************************************/
+void snapshot_load(const char* path, u64 hash)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st))
+        sys_error("can't open symbol snapshot");
+    void* map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(map == MAP_FAILED)
+        fatal("line %lu: symbol snapshot %s is empty", asm_ctx->line_num, path);
+
+    /* it was checked by the preprocessor, but it can have been built again since */
+    const snapshot_header_t* h = map;
+    const u32* buckets = (const u32*)(h + 1);
+    const snapshot_entry_t* entries = (const snapshot_entry_t*)(buckets + h->num_buckets);
+    const char* names = (const char*)map + h->names;
+    int valid = (size_t)st.st_size >= sizeof(*h) && h->magic == SNAPSHOT_MAGIC && h->version == SNAPSHOT_VERSION &&
+                h->source_hash == hash && h->size == st.st_size && h->num_buckets &&
+                !(h->num_buckets & (h->num_buckets - 1)) && h->num_symbols <= h->size &&
+                h->names >= sizeof(*h) + h->num_buckets * sizeof(u32) + h->num_symbols * sizeof(snapshot_entry_t) &&
+                h->names <= h->size && (h->names == h->size || !((const char*)map)[h->size - 1]);
+    for(u32 i = 0; valid && i < h->num_symbols; i++)
+        valid = entries[i].name < h->size - h->names && entries[i].next <= i; /* no loops */
+    for(u32 i = 0; valid && i < h->num_buckets; i++)
+        valid = buckets[i] <= h->num_symbols;
+    if(!valid)
+    {
+        munmap(map, st.st_size);
+        fatal("line %lu: symbol snapshot %s doesn't match its header, build it again", asm_ctx->line_num, path);
+    }
+
+    snapshot_t* s = malloc(sizeof(snapshot_t));
+    if(!s)
+        fatal("out of memory");
+    s->map = h;
+    s->next = asm_ctx->snapshots;
+    asm_ctx->snapshots = s;
+
+    /* the symbols defined before are few, they are looked up in the snapshot */
+    for(size_t i = 0; i < asm_ctx->symtable.size; i++)
+        if(snapshot_find(h, asm_ctx->symtable.element[i].string))
+            fatal("label %s was already defined!", asm_ctx->symtable.element[i].string);
+    for(const snapshot_t* o = s->next; o; o = o->next)
+        for(u32 i = 0; i < h->num_symbols; i++)
+            if(snapshot_find(o->map, names + entries[i].name))
+                fatal("label %s was already defined!", names + entries[i].name);
+
+    if(h->num_symbols)
+        asm_ctx->last_label = names + entries[h->num_symbols - 1].name;
+}
+
+/*****************************************************************\
+*   @return the entry of @param name in the mapped snapshots,     *
+*   NULL if none of them has it                                   *
+\*****************************************************************/
+const snapshot_entry_t* snapshot_lookup(const char* name)
+{
+    for(const snapshot_t* s = asm_ctx->snapshots; s; s = s->next)
+    {
+        const snapshot_entry_t* e = snapshot_find(s->map, name);
+        if(e)
+            return e;
+    }
+    return NULL;
+}
+
+/*****************************************************************\
+*   @return the number of symbols in the mapped snapshots         *
+\*****************************************************************/
+size_t snapshot_count()
+{
+    size_t n = 0;
+    for(const snapshot_t* s = asm_ctx->snapshots; s; s = s->next)
+        n += s->map->num_symbols;
+    return n;
+}
+
+/*****************************************************************\
+*   @return the entry of symbol number @param n of the mapped     *
+*   snapshots, its name goes to @param name                       *
+\*****************************************************************/
+const snapshot_entry_t* snapshot_symbol(size_t n, const char** name)
+{
+    const snapshot_t* s = asm_ctx->snapshots;
+    for(; n >= s->map->num_symbols; s = s->next)
+        n -= s->map->num_symbols;
+
+    const u32* buckets = (const u32*)(s->map + 1);
+    const snapshot_entry_t* entries = (const snapshot_entry_t*)(buckets + s->map->num_buckets);
+    *name = (const char*)s->map + s->map->names + entries[n].name;
+    return &entries[n];
+}
+
+/*****************************************************************\
+*   Unmaps the snapshots of the symbol table                      *
+\*****************************************************************/
+void snapshot_unmap()
+{
+    while(asm_ctx->snapshots)
+    {
+        snapshot_t* next = asm_ctx->snapshots->next;
+        munmap((void*)asm_ctx->snapshots->map, asm_ctx->snapshots->map->size);
+        free(asm_ctx->snapshots);
+        asm_ctx->snapshots = next;
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef SNAPSHOT_H_INCLUDED
+#define SNAPSHOT_H_INCLUDED
+#include "types.h"
+#include <stdlib.h>
+
+#define SNAPSHOT_MAGIC 0x59535050 /* "PPSY", a file of the other byte order doesn't match */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_EXTENSION ".syms"
+
+/* a snapshot file begins with this, then come the buckets, the entries and the names */
+typedef struct
+{
+    u32 magic;
+    u32 version;
+    u64 source_hash; /* snapshot_hash() of the header it was built from */
+    u32 num_symbols;
+    u32 num_buckets; /* a power of two */
+    u32 names; /* offset of the names, 0 terminated */
+    u32 size; /* of the whole file */
+} snapshot_header_t;
+
+typedef struct
+{
+    u64 value;
+    u32 name; /* offset from the names */
+    u32 next; /* number of the next entry of the bucket + 1, 0 if it is the last one */
+    u32 constant; /* defined with equ, not a label */
+    u32 reserved;
+} snapshot_entry_t;
+
+/* a snapshot mapped into a context till fini_symtable() */
+typedef struct snapshot snapshot_t;
+struct snapshot
+{
+    snapshot_t*                 next;
+    const snapshot_header_t*    map;
+};
+
+u64 snapshot_hash(const char* text, size_t len);
+void snapshot_build(const char* header, const char* text, size_t len, const char* path);
+int snapshot_valid(const char* path, u64 hash);
+void snapshot_load(const char* path, u64 hash);
+const snapshot_entry_t* snapshot_find(const snapshot_header_t* s, const char* name);
+const snapshot_entry_t* snapshot_lookup(const char* name);
+size_t snapshot_count();
+const snapshot_entry_t* snapshot_symbol(size_t n, const char** name);
+void snapshot_unmap();
+#endif // SNAPSHOT_H_INCLUDED
@@ -1,36 +1,48 @@
 #include "stringext.h"
 #include "util.h"
+#include "context.h"
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
 
-static char*   tmpline = 0;
-static size_t tmplinesz = 0;
-
 /***********************************************************************************************\
 *   Reads @param file and returns a line.                                                       *
 *   @param line_len is the address where to store the length of the line                        *
 *   @param comment_on is a boolean flag that is non zero if the line contains multiline comment *
-*   @return line or 0 if this was an empty file or contained only \n                            *
+*   @return line, "" if the rest of the file is empty or only \n                                *
 *
 *   TODO: add syntax_t support
 \***********************************************************************************************/
 char* read_line(FILE* file, size_t* line_len, int* comment_on)
 {
     size_t numchars = 0;
+    char* tmpline = asm_ctx->line;
+    size_t tmplinesz = asm_ctx->linesz;
+
+    /* an empty file still gets a line to return */
+    if(!tmpline)
+    {
+        tmplinesz = 256;
+        if(!(tmpline = malloc(tmplinesz)))
+            fatal("out of memory");
+    }
 
     int c;
-    /* skip new lines in the beginning */
-    while((c = fgetc(file)) == '\n');
+    /* skip new lines in the beginning, they still count for the line numbers */
+    while((c = fgetc(file)) == '\n')
+        asm_ctx->line_num++;
 
     while(!feof(file))
     {
         /* do we have enough space? */
-        if(tmplinesz <= numchars + 1) /* +1 to compensate for the last 0, <= ist for the first case where tmplinesz = 0*/
+        if(tmplinesz <= numchars + 1) /* +1 to compensate for the last 0 */
         {
-            tmplinesz += 256;
+            /* doubled, a long line is copied a few times and not once every 256 bytes */
+            tmplinesz *= 2;
             tmpline = realloc(tmpline, tmplinesz);
+            if(!tmpline)
+                fatal("out of memory");
         }
 
         if(c == '\n')
@@ -59,6 +71,8 @@ char* read_line(FILE* file, size_t* line_len, int* comment_on)
     }
     tmpline[numchars] = 0; /* terminate the line */
     *line_len = numchars;
+    asm_ctx->line = tmpline;
+    asm_ctx->linesz = tmplinesz;
 
     return tmpline;
 }
@@ -169,25 +183,19 @@ const char* char_in_str(const char ch, const char* str)
     return 0;
 }
 
-static const char*  delim1;
-static const char*  delim2;
-static char*        tmptok;
-static char*        token = 0;
-static size_t       tokensz = 82;
-
 /*****************************************************************\
 *   Read first                        *
 \*****************************************************************/
 char* read_first(char* str, const char* d1, const char* d2)
 {
-    token = malloc(tokensz);
-    if(!token)
+    asm_context_t* c = asm_ctx;
+    if(!c->tok && !(c->tok = malloc(c->toksz))) /* kept for the next line, freed with the context */
         fatal("out of memory");
 
-    *token = 0;
-    delim1 = d1;
-    delim2 = d2;
-    tmptok = strtok(str, delim1); /* read first */
+    *c->tok = 0;
+    c->delim1 = d1;
+    c->delim2 = d2;
+    c->tmptok = strtok_r(str, c->delim1, &c->strtok_pos); /* read first */
     return read_next();
 }
 
@@ -197,46 +205,81 @@ char* read_first(char* str, const char* d1, const char* d2)
 \*****************************************************************/
 char* read_next()
 {
-    if(!tmptok || *tmptok == 0)
-        tmptok = strtok(NULL, delim1);
+    asm_context_t* c = asm_ctx;
+    if(!c->tmptok || *c->tmptok == 0)
+        c->tmptok = strtok_r(NULL, c->delim1, &c->strtok_pos);
 
-    static size_t toksz;
+    size_t toksz;
 
-    if(tmptok && *tmptok)
+    if(c->tmptok && *c->tmptok)
     {
         /* if first char is one of delim2 */
-        if(char_in_str(*tmptok, delim2))
+        if(char_in_str(*c->tmptok, c->delim2))
         {
-            toksz = strspn(tmptok, delim2);
+            toksz = strspn(c->tmptok, c->delim2);
         }
         else
         {
-            toksz = strcspn(tmptok, delim2);
+            toksz = strcspn(c->tmptok, c->delim2);
         }
 
         if(toksz != 0)
         {
-            if(tokensz < toksz + 1)
+            if(c->toksz < toksz + 1)
             {
-                tokensz = toksz + 1;
-                token = realloc(token, tokensz);
-                if(!token)
+                c->toksz = toksz + 1;
+                c->tok = realloc(c->tok, c->toksz);
+                if(!c->tok)
                     fatal("out of memory");
             }
 
-            memcpy(token, tmptok, toksz);
-            token[toksz] = 0;
-            tmptok += toksz;
+            memcpy(c->tok, c->tmptok, toksz);
+            c->tok[toksz] = 0;
+            c->tmptok += toksz;
         }
         else
         {
-            *tmptok = *token = 0;
+            *c->tmptok = *c->tok = 0;
         }
     }
     else
         return 0;
 
-    return token;
+    return c->tok;
+}
+
+/*****************************************************************\
+*   Reads the next token as a "quoted" string, it can have        *
+*   blanks and delimiters. @return the string without the quotes, *
+*   0 if the next token isn't one                                 *
+\*****************************************************************/
+char* read_string()
+{
+    asm_context_t* c = asm_ctx;
+    char* s = c->tmptok && *c->tmptok ? c->tmptok : c->strtok_pos;
+    if(!s)
+        return 0;
+    s += strspn(s, c->delim1);
+
+    char* end = *s == '"' ? strchr(s + 1, '"') : NULL;
+    if(!end)
+        return 0;
+
+    size_t toksz = end - s - 1;
+    if(c->toksz < toksz + 1)
+    {
+        c->toksz = toksz + 1;
+        c->tok = realloc(c->tok, c->toksz);
+        if(!c->tok)
+            fatal("out of memory");
+    }
+    memcpy(c->tok, s + 1, toksz);
+    c->tok[toksz] = 0;
+
+    /* the next read_next() goes on after the string */
+    c->tmptok = NULL;
+    c->strtok_pos = end + 1;
+    return c->tok;
 }
 
 /*****************************************************************\
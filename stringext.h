@@ -9,5 +9,6 @@ u32	decode_utf8(const char* msg, unsigned* i);
 void strrm(char* dest, const char* src, char ch);
 char* read_first(char* str, const char* d1, const char* d2);
 char* read_next();
+char* read_string();
 const char* string_to_number(const char* str, ulong* dest);
 #endif // STRINGEXT_H_INCLUDED
@@ -0,0 +1,439 @@
+#include "symmap.h"
+#include "context.h"
+#include "assemble.h"
+#include "stringext.h"
+#include "containers.h"
+#include "snapshot.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+The symbol map is written next to the binary with -m, it tells where every symbol ended
+up in the image, so --patch can change values without assembling again:
+
+    ' ppasm symbol map
+    image <offset of the program> <offset of the checksum, -1 for none> <longs>
+    label <name> <cog address>
+    const <name> <value>
+    ref <name> <cog address> <field>
+    use <name> <cog address>
+    data <cog address> <longs>
+
+A label is patched by rewriting the long it points to, a constant by rewriting every
+field that uses it. Only fields whose expression is the bare symbol are references, a
+symbol inside a longer expression like "#BASE+1" is a use line, the value of the field
+can't be worked out without the expression so --patch refuses constants that have one.
+The data lines are the longs FILE copied in, -d doesn't show them as instructions.
+*/
+
+static const char* field_names[] = { "", "byte0", "byte1", "byte2", "byte3", "word0", "word1", "long", "dest", "src" };
+
+/*****************************************************************\
+*                                                                 *
+*   Frees the symbol lists and starts new ones.                   *
+*                                                                 *
+\*****************************************************************/
+void symmap_reset()
+{
+    symmap_t* m = &asm_ctx->symmap;
+    if(m->initialized)
+    {
+        for(size_t i = 0; i < m->symbols.size; i++)
+            free(m->symbols.element[i].name);
+        for(size_t i = 0; i < m->refs.size; i++)
+            free(m->refs.element[i].name);
+        for(size_t i = 0; i < m->constants.size; i++)
+            free(m->constants.element[i].name);
+        vecsymbol_fini(&m->symbols);
+        vecsymref_fini(&m->refs);
+        vecsymbol_fini(&m->constants);
+    }
+
+    vecsymbol_init(&m->symbols, 16);
+    vecsymref_init(&m->refs, 16);
+    vecsymbol_init(&m->constants, 16);
+    m->initialized = 1;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Marks the symbol @param name as a constant.                   *
+*                                                                 *
+\*****************************************************************/
+void symmap_constant(const char* name)
+{
+    symbol_t s = { strdup(name), 0, 1 };
+    vecsymbol_push_back(&asm_ctx->symmap.constants, s);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Notes the symbols of the expression @param exp of @param      *
+*   field of the instruction at @param addr, a bare symbol is a   *
+*   reference to the field, the others are uses (field 0).        *
+*                                                                 *
+\*****************************************************************/
+void symmap_reference(const expression_t* exp, u16 addr, u8 field)
+{
+    if(!exp)
+        return;
+
+    if(!exp->next && (exp->type & EXP_LABEL) && (exp->type & 0b00111111) == '+')
+    {
+        symref_t r = { strdup(exp->data.label), addr, field };
+        vecsymref_push_back(&asm_ctx->symmap.refs, r);
+        return;
+    }
+
+    for(; exp; exp = exp->next)
+    {
+        if(!(exp->type & EXP_LABEL))
+            continue;
+        symref_t r = { strdup(exp->data.label), addr, 0 };
+        vecsymref_push_back(&asm_ctx->symmap.refs, r);
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Copies the symbol table and the symbols of the mapped         *
+*   snapshots before parse() frees them.                          *
+*                                                                 *
+\*****************************************************************/
+void symmap_collect()
+{
+    symmap_t* m = &asm_ctx->symmap;
+    const veclable* symtable = &asm_ctx->symtable;
+    u8* constant = calloc(symtable->size + 1, 1);
+    if(!constant)
+        fatal("out of memory");
+    for(size_t j = 0; j < m->constants.size; j++)
+        constant[symtable_find(m->constants.element[j].name)] = 1;
+
+    for(size_t i = 0; i < symtable->size; i++)
+    {
+        symbol_t s = { strdup(symtable->element[i].string), symtable->element[i].value, constant[i] };
+        vecsymbol_push_back(&m->symbols, s);
+    }
+    free(constant);
+
+    for(size_t i = 0, n = snapshot_count(); i < n; i++)
+    {
+        const char* name;
+        const snapshot_entry_t* e = snapshot_symbol(i, &name);
+        symbol_t s = { strdup(name), e->value, e->constant != 0 };
+        vecsymbol_push_back(&m->symbols, s);
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Writes the symbol map of the last assembled program into      *
+*   @param file.                                                  *
+*                                                                 *
+\*****************************************************************/
+void symmap_write(FILE* file)
+{
+    const symmap_t* m = &asm_ctx->symmap;
+    fprintf(file, "' ppasm symbol map\n");
+    fprintf(file, "image %u %d %u\n", opt_raw ? 0 : PREAMBLE_SIZE, opt_raw ? -1 : 5, asm_ctx->num_ops);
+
+    for(size_t i = 0; i < m->symbols.size; i++)
+        fprintf(file, "%s %s %lu\n", m->symbols.element[i].constant ? "const" : "label",
+                m->symbols.element[i].name, m->symbols.element[i].value);
+
+    for(size_t i = 0; i < m->refs.size; i++)
+    {
+        if(m->refs.element[i].field)
+            fprintf(file, "ref %s %u %s\n", m->refs.element[i].name, m->refs.element[i].addr,
+                    field_names[m->refs.element[i].field]);
+        else
+            fprintf(file, "use %s %u\n", m->refs.element[i].name, m->refs.element[i].addr);
+    }
+
+    for(size_t i = 0; i < asm_ctx->num_ops;)
+    {
+        size_t start = i;
+        while(i < asm_ctx->num_ops && asm_ctx->flags[i].data)
+            i++;
+        if(i > start)
+            fprintf(file, "data %lu %lu\n", (ulong)start, (ulong)(i - start));
+        else
+            i++;
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Reads the symbol map @param file into @param syms and @param  *
+*   fieldrefs. @return error message or 0 if everything is ok.    *
+*                                                                 *
+\*****************************************************************/
+static const char* read_map(FILE* file, vecsymbol* syms, vecsymref* fieldrefs,
+                            ulong* offset, long* checksum, ulong* longs)
+{
+    char line[MAX_LABEL_SIZE + 64], kind[16], name[MAX_LABEL_SIZE], field[16];
+    ulong value, count;
+    int have_image = 0;
+
+    while(fgets(line, sizeof(line), file))
+    {
+        if(*line == '\'' || sscanf(line, "data %lu %lu", &value, &count) == 2)
+            continue;
+
+        if(sscanf(line, "image %lu %ld %lu", offset, checksum, longs) == 3)
+            have_image = 1;
+        else if(sscanf(line, "ref %255s %lu %15s", name, &value, field) == 3)
+        {
+            symref_t r = { strdup(name), value, 0 };
+            for(u8 i = 1; i < sizeof(field_names) / sizeof(field_names[0]); i++)
+            {
+                if(!strcmp(field_names[i], field))
+                    r.field = i;
+            }
+            if(!r.field)
+                return "unknown field in the symbol map";
+            vecsymref_push_back(fieldrefs, r);
+        }
+        else if(sscanf(line, "use %255s %lu", name, &value) == 2)
+        {
+            symref_t r = { strdup(name), value, 0 };
+            vecsymref_push_back(fieldrefs, r);
+        }
+        else if(sscanf(line, "%15s %255s %lu", kind, name, &value) == 3 &&
+                (!strcmp(kind, "label") || !strcmp(kind, "const")))
+        {
+            symbol_t s = { strdup(name), value, !strcmp(kind, "const") };
+            vecsymbol_push_back(syms, s);
+        }
+        else
+            return "corrupt symbol map";
+    }
+
+    return have_image ? 0 : "symbol map without an image line";
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Marks the longs of the data lines of the symbol map           *
+*   @param map as data in asm_ctx->flags, for -d.                 *
+*   @return 0 if there is no map                                  *
+*                                                                 *
+\*****************************************************************/
+int symmap_read_data(const char* map)
+{
+    FILE* file = fopen(map, "r");
+    if(!file)
+        return 0;
+
+    char line[MAX_LABEL_SIZE + 64];
+    ulong start, count;
+    while(fgets(line, sizeof(line), file))
+    {
+        if(sscanf(line, "data %lu %lu", &start, &count) != 2)
+            continue;
+        for(ulong i = start; i < start + count && i < MAX_INSTRUCTIONS; i++)
+            asm_ctx->flags[i].data = 1;
+    }
+    fclose(file);
+    return 1;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Sets @param field of the long at @param p to @param value.    *
+*   @return the change of the byte sum of the long                *
+*                                                                 *
+\*****************************************************************/
+static u8 patch_field(u8* p, u8 field, ulong value)
+{
+    u8 before = p[0] + p[1] + p[2] + p[3];
+    u32 l = p[0] | p[1] << 8 | p[2] << 16 | (u32)p[3] << 24;
+
+    switch(field)
+    {
+        case 1: case 2: case 3: case 4:
+            p[field - 1] = value & 0xFF;
+            break;
+
+        case 5: case 6:
+            p[(field - 5) * 2] = value & 0xFF;
+            p[(field - 5) * 2 + 1] = (value >> 8) & 0xFF;
+            break;
+
+        case 7:
+            l = value;
+            break;
+
+        case FIELD_DEST:
+            l = (l & ~(0x1FFUL << 9)) | (value & 0x1FF) << 9;
+            break;
+
+        case FIELD_SRC:
+            l = (l & ~0x1FFUL) | (value & 0x1FF);
+            break;
+    }
+
+    if(field >= 7)
+    {
+        p[0] = l & 0xFF;
+        p[1] = (l >> 8) & 0xFF;
+        p[2] = (l >> 16) & 0xFF;
+        p[3] = (l >> 24) & 0xFF;
+    }
+
+    return (u8)(p[0] + p[1] + p[2] + p[3] - before);
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Finds the symbol of the "name=value" @param assignment in @param syms and   *
+*   checks that the value fits into the @param refs to it in the first @param   *
+*   longs of the image, the symbol goes to @param sym and the value to          *
+*   @param value. @return error message in asm_ctx->error or 0 if it can be     *
+*   patched                                                                     *
+*                                                                               *
+\*******************************************************************************/
+static const char* check_assignment(const char* assignment, vecsymbol* syms, vecsymref* refs, ulong longs,
+                                    symbol_t** sym, ulong* value)
+{
+    char* errmsg = asm_ctx->error;
+
+    const char* eq = strchr(assignment, '=');
+    if(!eq || string_to_number(eq + 1, value))
+    {
+        snprintf(errmsg, sizeof(asm_ctx->error), "expected symbol=value instead of \"%s\"", assignment);
+        return errmsg;
+    }
+
+    size_t namesz = eq - assignment, s = 0;
+    for(; s < syms->size; s++)
+    {
+        if(strlen(syms->element[s].name) == namesz && !strncmp(syms->element[s].name, assignment, namesz))
+            break;
+    }
+    if(s == syms->size)
+    {
+        snprintf(errmsg, sizeof(asm_ctx->error), "unknown symbol %.*s", (int)namesz, assignment);
+        return errmsg;
+    }
+    *sym = &syms->element[s];
+
+    int used = !(*sym)->constant && (*sym)->value < longs;
+    for(size_t r = 0; r < refs->size && (*sym)->constant; r++)
+    {
+        symref_t* ref = &refs->element[r];
+        if(strcmp(ref->name, (*sym)->name))
+            continue;
+        if(!ref->field)
+        {
+            snprintf(errmsg, sizeof(asm_ctx->error), "%s is used in an expression at %u, it can't be patched",
+                     (*sym)->name, ref->addr);
+            return errmsg;
+        }
+        if((ref->field == FIELD_SRC || ref->field == FIELD_DEST) && *value > 0x1FF)
+        {
+            snprintf(errmsg, sizeof(asm_ctx->error), "%s=%lu doesn't fit into 9 bits", (*sym)->name, *value);
+            return errmsg;
+        }
+        used |= ref->addr < longs;
+    }
+
+    if(!used)
+    {
+        snprintf(errmsg, sizeof(asm_ctx->error), "%s isn't used in the image", (*sym)->name);
+        return errmsg;
+    }
+    return 0;
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Patches the built @param image in place with the @param num "name=value"    *
+*   @param assignments, using the symbol map @param map. All of them are        *
+*   checked before the first byte is written, a failed patch leaves the image   *
+*   alone. @return error message, kept till the next error of asm_ctx, or 0    *
+*   if everything is ok.                                                        *
+*                                                                               *
+\*******************************************************************************/
+const char* symmap_patch(const char* image, const char* map, char* const* assignments, size_t num)
+{
+    const char* result = 0;
+
+    FILE* file = fopen(map, "r");
+    if(!file)
+        return "failed to open the symbol map";
+
+    vecsymbol syms;
+    vecsymref fieldrefs;
+    vecsymbol_init(&syms, 16);
+    vecsymref_init(&fieldrefs, 16);
+
+    ulong offset = 0, longs = 0;
+    long checksum = -1;
+    result = read_map(file, &syms, &fieldrefs, &offset, &checksum, &longs);
+    fclose(file);
+
+    symbol_t** sym = calloc(num ? num : 1, sizeof(symbol_t*));
+    ulong* value = calloc(num ? num : 1, sizeof(ulong));
+    if(!result && (!sym || !value))
+        result = "out of memory";
+    for(size_t i = 0; i < num && !result; i++)
+        result = check_assignment(assignments[i], &syms, &fieldrefs, longs, &sym[i], &value[i]);
+
+    int fd = -1;
+    u8* data = MAP_FAILED;
+    struct stat st;
+    if(!result)
+    {
+        fd = open(image, O_RDWR);
+        if(fd < 0 || fstat(fd, &st))
+            result = "failed to open the image";
+        else if((ulong)st.st_size < offset + longs * 4)
+            result = "the image is smaller than the symbol map says";
+        else if((data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+            result = "failed to map the image";
+    }
+
+    u8 delta = 0; /* change of the byte sum, the checksum has to make up for it */
+    for(size_t i = 0; i < num && !result; i++)
+    {
+        if(!sym[i]->constant)
+        {
+            delta += patch_field(data + offset + sym[i]->value * 4, 7, value[i]);
+            continue;
+        }
+
+        for(size_t r = 0; r < fieldrefs.size; r++)
+        {
+            symref_t* ref = &fieldrefs.element[r];
+            if(strcmp(ref->name, sym[i]->name) || ref->addr >= longs)
+                continue;
+            delta += patch_field(data + offset + ref->addr * 4, ref->field, value[i]);
+        }
+    }
+
+    if(data != MAP_FAILED)
+    {
+        if(checksum >= 0 && (ulong)checksum < offset)
+            data[checksum] -= delta;
+        munmap(data, st.st_size);
+    }
+    if(fd >= 0)
+        close(fd);
+
+    for(size_t i = 0; i < syms.size; i++)
+        free(syms.element[i].name);
+    for(size_t i = 0; i < fieldrefs.size; i++)
+        free(fieldrefs.element[i].name);
+    vecsymbol_fini(&syms);
+    vecsymref_fini(&fieldrefs);
+    free(sym);
+    free(value);
+
+    return result;
+}
@@ -0,0 +1,41 @@
+#ifndef SYMMAP_H_INCLUDED
+#define SYMMAP_H_INCLUDED
+#include "types.h"
+#include "expression.h"
+#include "containers.h"
+#include <stdio.h>
+
+typedef struct
+{
+    char*   name;
+    ulong   value;
+    u8      constant;
+} symbol_t;
+
+typedef struct
+{
+    char*   name;
+    u16     addr;
+    u8      field;
+} symref_t;
+
+VECTOR_DECLARE(vecsymbol, symbol_t);
+VECTOR_DECLARE(vecsymref, symref_t);
+
+/* the symbols of the source being assembled, for -m */
+typedef struct
+{
+    vecsymbol   symbols;
+    vecsymref   refs;
+    vecsymbol   constants; /* names the equ directive defined, values unused */
+    u8          initialized;
+} symmap_t;
+
+void symmap_reset();
+void symmap_constant(const char* name);
+void symmap_reference(const expression_t* exp, u16 addr, u8 field);
+void symmap_collect();
+void symmap_write(FILE* file);
+int symmap_read_data(const char* map);
+const char* symmap_patch(const char* image, const char* map, char* const* assignments, size_t num);
+#endif // SYMMAP_H_INCLUDED
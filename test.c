@@ -4,12 +4,37 @@
 #include "containers.h"
 #include "stringext.h"
 #include "loader.h"
+#include "compress.h"
+#include "fingerprint.h"
+#include "assemble.h"
+#include "lowlatency.h"
+#include "hotload.h"
+#include "monitor.h"
+#include "ring.h"
+#include "symmap.h"
+#include "parse.h"
+#include "variants.h"
+#include "context.h"
+#include "batch.h"
+#include "libppasm.h"
+#include "cache.h"
+#include "server.h"
+#include "incremental.h"
+#include "lsp.h"
+#include "preprocess.h"
+#include "snapshot.h"
+#include "ir.h"
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <pthread.h>
 #ifdef DO_TESTS
-VECTOR_DECLARE(veclable, pair_t);
-extern veclable symtable;
 
 /*
     Tests the correct structure types
@@ -204,6 +229,7 @@ void test_expressions()
     ex1->next = ex2;
     ex2->next = ex3;
     ex3->next = ex4;
+    ex4->next = NULL;
 
 
     /* trying successful evaluation first */
@@ -235,6 +261,7 @@ void test_expressions()
     ex1->next = ex2;
     ex2->next = ex3;
     ex3->next = ex4;
+    ex4->next = NULL;
 
     ex1->type = EXP_NUMBER | '+';
     ex1->data.number = 14;
@@ -279,6 +306,1292 @@ void test_loader()
 
 }
 
+/*
+    Tests the precomputed handshake against the LFSR
+*/
+void test_lfsr()
+{
+    u8 lfsr = 'P';
+    assert(handshake_tx[0] == 0xF9);
+    for(unsigned i = 1; i < 251; i++)
+        assert(handshake_tx[i] == (lfsr_step(&lfsr) | 0xFE));
+    for(unsigned i = 251; i < HANDSHAKE_TX_SIZE; i++)
+        assert(handshake_tx[i] == 0xF9);
+    for(unsigned i = 0; i < HANDSHAKE_RX_SIZE; i++)
+        assert(handshake_rx[i] == (lfsr_step(&lfsr) | 0xFE));
+
+    fprintf(stdout, "%s:\t\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Producer of test_ring(), pushes a known sequence in odd sized chunks
+*/
+static void* ring_producer(void* arg)
+{
+    ring_t* ring = arg;
+    u8 chunk[37];
+    for(u32 i = 0; i < 100000; )
+    {
+        unsigned n = 0;
+        while(n < sizeof(chunk) && i < 100000)
+            chunk[n++] = (u8)(i++ * 31);
+        ring_push_all(ring, chunk, n);
+    }
+    ring_close(ring);
+    return NULL;
+}
+
+/*
+    Tests the single producer single consumer queue between two threads
+*/
+void test_ring()
+{
+    ring_t ring;
+    pthread_t producer;
+    assert(ring_init(&ring, 256));
+    assert(!pthread_create(&producer, NULL, ring_producer, &ring));
+
+    u8 buff[100];
+    u32 received = 0;
+    while(!ring_done(&ring))
+    {
+        size_t n = ring_pop(&ring, buff, sizeof(buff));
+        for(size_t i = 0; i < n; i++, received++)
+            assert(buff[i] == (u8)(received * 31));
+    }
+    assert(received == 100000 && !ring_used(&ring));
+
+    pthread_join(producer, NULL);
+    ring_free(&ring);
+
+    fprintf(stdout, "%s:\t\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests the RLE compression round trip
+*/
+void test_compress()
+{
+    u8 src[1000], packed[RLE_BOUND(1000)], unpacked[1000];
+
+    /* zero padding, a short repeat, a long literal run and a repeat longer than RLE_MAX_RUN */
+    memset(src, 0, sizeof(src));
+    src[10] = src[11] = 7;
+    for(unsigned i = 100; i < 400; i++)
+        src[i] = i * 13;
+    memset(&src[500], 0xAA, 300);
+
+    size_t packedsz = rle_compress(src, sizeof(src), packed);
+    assert(packedsz < sizeof(src));
+    assert(rle_decompress(packed, packedsz, unpacked, sizeof(unpacked)) == sizeof(src));
+    assert(!memcmp(src, unpacked, sizeof(src)));
+
+    /* the stub has to be back in rx before the byte after a repeat run starts */
+    for(size_t i = 0; i < packedsz; i += packed[i] & 0x80 ? 2 : packed[i] + 2)
+        assert(!(packed[i] & 0x80) || packed[i] - 0x80 + 3 <= RLE_MAX_RUN);
+
+    /* incompressible data must stay within RLE_BOUND */
+    for(unsigned i = 0; i < sizeof(src); i++)
+        src[i] = i & 1 ? i : ~i;
+    packedsz = rle_compress(src, sizeof(src), packed);
+    assert(packedsz <= RLE_BOUND(sizeof(src)));
+    assert(rle_decompress(packed, packedsz, unpacked, sizeof(unpacked)) == sizeof(src));
+    assert(!memcmp(src, unpacked, sizeof(src)));
+
+    /* a truncated stream is rejected */
+    assert(!rle_decompress(packed, packedsz - 1, unpacked, sizeof(unpacked)));
+
+    fprintf(stdout, "%s:\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests the eeprom image, it has to sum up to 0 with the stack frame
+*/
+void test_eeprom()
+{
+    memset(asm_ctx->program, 0, sizeof(asm_ctx->program));
+    asm_ctx->program[0].raw = 0xA0BFEC3B;
+    asm_ctx->program[1].raw = 0x5C7C0001;
+    asm_ctx->program[2].raw = 0x000002B6;
+    asm_ctx->num_ops = 3;
+
+    u8 image[PREAMBLE_SIZE + 3 * 4];
+    size_t imgsz = create_image(image);
+    assert(imgsz == sizeof(image));
+
+    u8* eeprom = malloc(EEPROM_SIZE);
+    create_eeprom(eeprom, image, imgsz);
+
+    u8 sum = 0;
+    for(unsigned i = 0; i < EEPROM_SIZE; i++)
+        sum += eeprom[i];
+    assert(sum == 0);
+
+    assert(!memcmp(eeprom, image, imgsz));
+    assert(!memcmp(eeprom + imgsz, "\xFF\xFF\xF9\xFF\xFF\xFF\xF9\xFF", 8));
+    assert(eeprom[imgsz + 8] == 0 && eeprom[EEPROM_SIZE - 1] == 0);
+
+    free(eeprom);
+    asm_ctx->num_ops = 0;
+    fprintf(stdout, "%s:\t\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests patching a built image through its symbol map
+*/
+void test_patch()
+{
+    static const char source[] =
+        "NETID = 5\n"
+        "BAUD = 20\n"
+        "entry   mov     outa, #NETID\n"
+        "        mov     dira, serial\n"
+        "        long    NETID\n"
+        "serial  long    0\n"
+        "        mov     outb, #BAUD+1\n";
+
+    FILE* file = fmemopen((void*)source, sizeof(source) - 1, "r");
+    parse(file);
+    fclose(file);
+    asm_ctx->num_ops = count_instructions();
+    assert(asm_ctx->num_ops == 5);
+
+    char path[] = "/tmp/ppasm_patchXXXXXX", map[sizeof(path) + 4];
+    int fd = mkstemp(path);
+    u8 image[PREAMBLE_SIZE + 5 * 4];
+    size_t imgsz = create_image(image);
+    assert(write(fd, image, imgsz) == (ssize_t)imgsz);
+    close(fd);
+
+    snprintf(map, sizeof(map), "%s.map", path);
+    file = fopen(map, "w");
+    symmap_write(file);
+    fclose(file);
+
+    char* assignments[] = { "NETID=$1FF", "serial=$12345678" };
+    assert(!symmap_patch(path, map, assignments, 2));
+    char* toobig[] = { "NETID=512" };
+    assert(symmap_patch(path, map, toobig, 1));
+    char* unknown[] = { "nothing=1" };
+    assert(symmap_patch(path, map, unknown, 1));
+    /* the good assignment before a bad one isn't written either */
+    char* partly[] = { "serial=7", "nothing=1" };
+    assert(symmap_patch(path, map, partly, 2));
+    char* partly_big[] = { "serial=7", "NETID=512" };
+    assert(symmap_patch(path, map, partly_big, 2));
+    /* #BAUD+1 can't be rewritten, so BAUD can't be patched at all */
+    char* in_expression[] = { "BAUD=21" };
+    assert(symmap_patch(path, map, in_expression, 1));
+
+    fd = open(path, O_RDONLY);
+    assert(read(fd, image, imgsz) == (ssize_t)imgsz);
+    close(fd);
+
+    u32 l[4];
+    u8 sum = 0;
+    for(unsigned i = 0; i < 4; i++)
+        l[i] = image[PREAMBLE_SIZE + i * 4] | image[PREAMBLE_SIZE + i * 4 + 1] << 8 |
+               image[PREAMBLE_SIZE + i * 4 + 2] << 16 | (u32)image[PREAMBLE_SIZE + i * 4 + 3] << 24;
+    for(unsigned i = 0; i < imgsz; i++)
+        sum += image[i];
+
+    assert((l[0] & 0x1FF) == 0x1FF && l[2] == 0x1FF && l[3] == 0x12345678);
+    assert((l[1] & 0x1FF) == 3);
+    assert(sum == 0x14); /* what create_preamble() makes it */
+
+    unlink(path);
+    unlink(map);
+    asm_ctx->num_ops = 0;
+    fprintf(stdout, "%s:\t\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests building variants of a program out of one parse
+*/
+void test_variants()
+{
+    static const char source[] =
+        "SPEED = 10\n"
+        "entry   mov     outa, #SPEED+1\n"
+        "        long    SPEED*2\n"
+        "        mov     dira, buf\n"
+        "buf     long    0\n";
+
+    char dir[] = "/tmp/ppasm_variantsXXXXXX";
+    assert(mkdtemp(dir));
+    char list[sizeof(dir) + 16], fast[sizeof(dir) + 16], same[sizeof(dir) + 16];
+    snprintf(list, sizeof(list), "%s/variants", dir);
+    snprintf(fast, sizeof(fast), "%s/fast.bin", dir);
+    snprintf(same, sizeof(same), "%s/same.bin", dir);
+
+    FILE* file = fopen(list, "w");
+    fprintf(file, "%s SPEED=20\n' no overrides\n\n%s\n", fast, same);
+    fclose(file);
+
+    opt_variants = list;
+    opt_raw = 1;
+    file = fmemopen((void*)source, sizeof(source) - 1, "r");
+    parse(file);
+    fclose(file);
+    asm_ctx->num_ops = count_instructions();
+    assert(asm_ctx->num_ops == 4);
+    variants_build(list);
+
+    const char* outfiles[] = { fast, same };
+    const u32 expected[][2] = { { 21, 40 }, { 11, 20 } };
+    for(unsigned v = 0; v < 2; v++)
+    {
+        u8 image[4 * 4];
+        int fd = open(outfiles[v], O_RDONLY);
+        assert(read(fd, image, sizeof(image)) == sizeof(image));
+        close(fd);
+
+        u32 l[4];
+        for(unsigned i = 0; i < 4; i++)
+            l[i] = image[i * 4] | image[i * 4 + 1] << 8 | image[i * 4 + 2] << 16 | (u32)image[i * 4 + 3] << 24;
+        assert((l[0] & 0x1FF) == expected[v][0] && l[1] == expected[v][1]);
+        assert((l[2] & 0x1FF) == 3);
+        unlink(outfiles[v]);
+    }
+
+    /* the error of a worker comes back to the caller of variants_build() */
+    file = fopen(list, "w");
+    fprintf(file, "%s SPEED=20\n%s NOPE=1\n", fast, same);
+    fclose(file);
+    jmp_buf error_jmp;
+    asm_ctx->error_jmp = &error_jmp;
+    if(!setjmp(error_jmp))
+    {
+        variants_build(list);
+        assert(!"variants_build() didn't fail");
+    }
+    asm_ctx->error_jmp = NULL;
+    assert(strstr(asm_ctx->error, "unknown symbol NOPE"));
+    unlink(fast);
+    unlink(same);
+
+    unlink(list);
+    rmdir(dir);
+    opt_variants = NULL;
+    opt_raw = 0;
+    asm_ctx->num_ops = 0;
+    fprintf(stdout, "%s:\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests assembling many sources at once, each in a context of its own
+*/
+#define BATCH_JOBS 64
+static u32 batch_results[BATCH_JOBS][2];
+
+static void batch_test_job(size_t job, void* arg)
+{
+    char source[128];
+    int sz = snprintf(source, sizeof(source), "VAL = %lu\nentry   mov     outa, #VAL\n        long    VAL*3\n", (ulong)job);
+
+    asm_context_t* caller = asm_ctx;
+    asm_ctx = asm_context_new();
+    FILE* file = fmemopen(source, sz, "r");
+    parse(file);
+    fclose(file);
+    asm_ctx->num_ops = count_instructions();
+
+    batch_results[job][0] = asm_ctx->program[0].raw & 0x1FF;
+    batch_results[job][1] = asm_ctx->program[1].raw;
+    __atomic_fetch_add((unsigned*)arg, 1, __ATOMIC_RELAXED);
+    asm_context_free(asm_ctx);
+    asm_ctx = caller;
+}
+
+void test_batch()
+{
+    unsigned done = 0;
+    batch_run(BATCH_JOBS, 4, batch_test_job, &done);
+
+    assert(done == BATCH_JOBS);
+    for(unsigned i = 0; i < BATCH_JOBS; i++)
+        assert(batch_results[i][0] == i && batch_results[i][1] == i * 3);
+
+    fprintf(stdout, "%s:\t\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests the library interface, in memory and without exiting on errors
+*/
+void test_libppasm()
+{
+    static const char good[] =
+        "entry   mov     outa, #5\n"
+        "        long    7\n";
+    static const char bad[] =
+        "entry   mov     outa, #5\n"
+        "loop    bogus   outa\n";
+
+    ppasm_t* ctx = ppasm_new();
+    u8 image[PPASM_MAX_IMAGE];
+    size_t imgsz;
+
+    /* an empty source is a program of one empty long, first thing in a new context */
+    assert(!ppasm_assemble(ctx, "", 0, NULL, image, sizeof(image), &imgsz));
+    assert(imgsz == PREAMBLE_SIZE + 4);
+    assert(!ppasm_assemble(ctx, "\n\n", 2, NULL, image, sizeof(image), &imgsz));
+    assert(imgsz == PREAMBLE_SIZE + 4);
+
+    assert(ppasm_assemble(ctx, bad, sizeof(bad) - 1, NULL, image, sizeof(image), &imgsz) == -1);
+    assert(ppasm_error(ctx).line == 2 && strstr(ppasm_error(ctx).message, "bogus"));
+
+    /* the context is fine after an error */
+    assert(!ppasm_assemble(ctx, good, sizeof(good) - 1, NULL, image, sizeof(image), &imgsz));
+    assert(imgsz == PREAMBLE_SIZE + 8);
+    u8 sum = 0;
+    for(size_t i = 0; i < imgsz; i++)
+        sum += image[i];
+    assert(sum == 0x14);
+
+    ppasm_options_t raw = { 1, 0 };
+    assert(!ppasm_assemble(ctx, good, sizeof(good) - 1, &raw, image, sizeof(image), &imgsz));
+    assert(imgsz == 8 && image[4] == 7);
+    assert(ppasm_assemble(ctx, good, sizeof(good) - 1, NULL, image, 8, &imgsz) == -1);
+
+    ppasm_options_t eeprom = { 0, 1 };
+    assert(!ppasm_assemble(ctx, good, sizeof(good) - 1, &eeprom, image, sizeof(image), &imgsz));
+    assert(imgsz == EEPROM_SIZE);
+
+    ppasm_free(ctx);
+    fprintf(stdout, "%s:\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests the preprocessor
+*/
+void test_preprocess()
+{
+    char dir[] = "/tmp/ppasm_ppXXXXXX";
+    assert(mkdtemp(dir));
+    char inc[sizeof(dir) + 16], main_file[sizeof(dir) + 16], dep[sizeof(dir) + 16];
+    snprintf(inc, sizeof(inc), "%s/inc.spin", dir);
+    snprintf(main_file, sizeof(main_file), "%s/main.spin", dir);
+    snprintf(dep, sizeof(dep), "%s/main.d", dir);
+
+    FILE* file = fopen(inc, "w");
+    fputs("#ifndef INC_SPIN\n#define INC_SPIN\n#define TWICE(x) x*2\nshared  long TWICE(PIN)\n#endif\n", file);
+    fclose(file);
+
+    static const char src[] =
+        "#define PIN 3\n"
+        "#include \"inc.spin\"\n"
+        "#include \"inc.spin\"\n"
+        "#if defined(PIN) && PIN > 2 ' comment\n"
+        "        mov outa, #PIN ' PIN\n"
+        "#elif 1\n"
+        "        not taken\n"
+        "#else\n"
+        "#error not taken either\n"
+        "#endif\n"
+        "#ifdef FAST\n"
+        "        mov outa, #FAST\n"
+        "#endif\n";
+    preprocess_define("FAST=$1F");
+    preprocessed_t pre;
+    preprocess(main_file, src, sizeof(src) - 1, &pre);
+
+    char expected[512];
+    snprintf(expected, sizeof(expected),
+             "\n#line 1 \"%s\"\n\n\n\nshared  long 3*2\n\n#line 3 \"%s\"\n\n\n"
+             "        mov outa, #3 ' PIN\n\n\n\n\n\n\n        mov outa, #$1F\n\n",
+             inc, main_file);
+    assert(!strcmp(pre.text, expected) && pre.len == strlen(expected));
+    assert(pre.num_files == 2 && !strcmp(pre.files[0], main_file) && !strcmp(pre.files[1], inc));
+
+    /* the errors of an included line name the file and its line */
+    ppasm_t* ctx = ppasm_new();
+    u8 image[PPASM_MAX_IMAGE];
+    size_t imgsz;
+    assert(!ppasm_assemble(ctx, pre.text, pre.len, NULL, image, sizeof(image), &imgsz));
+    assert(imgsz == PREAMBLE_SIZE + 12 && image[PREAMBLE_SIZE] == 6);
+
+    write_depfile(dep, "main.binary", &pre);
+    preprocessed_free(&pre);
+    char buf[256] = { 0 };
+    snprintf(expected, sizeof(expected), "main.binary: %s \\\n  %s\n\n%s:\n", main_file, inc, inc);
+    file = fopen(dep, "r");
+    assert(fread(buf, 1, sizeof(buf), file) == strlen(expected) && !strcmp(buf, expected));
+    fclose(file);
+
+    file = fopen(inc, "w");
+    fputs("\n        bogus outa\n", file);
+    fclose(file);
+    static const char broken[] = "        nop\n#include \"inc.spin\"\n        nop\n";
+    preprocess(main_file, broken, sizeof(broken) - 1, &pre);
+    assert(ppasm_assemble(ctx, pre.text, pre.len, NULL, image, sizeof(image), &imgsz) == -1);
+    assert(ppasm_error(ctx).line == 2 && strstr(ppasm_error(ctx).message, inc));
+    preprocessed_free(&pre);
+    ppasm_free(ctx);
+
+    /* arguments are expanded before they go in, except the operands of ## */
+    static const char nested[] =
+        "#define F(x) x+1\n"
+        "#define GLUE(a, b) a##b\n"
+        "#define A 9\n"
+        "#define AB 5\n"
+        "        mov outa, #F(F(1))\n"
+        "        long GLUE(A, B), F(A)\n";
+    preprocess(main_file, nested, sizeof(nested) - 1, &pre);
+    assert(!strcmp(pre.text, "\n\n\n\n        mov outa, #1+1+1\n        long 5, 9+1\n"));
+    preprocessed_free(&pre);
+
+    /* & before ^ before |, == and != after < and > */
+    static const char precedence[] =
+        "#if 1 | 2 & 0\n"
+        "        long 1\n"
+        "#endif\n"
+        "#if 1 | 1 ^ 1\n"
+        "        long 2\n"
+        "#endif\n"
+        "#if 2 == 1 < 2\n"
+        "        long 3\n"
+        "#endif\n";
+    preprocess(main_file, precedence, sizeof(precedence) - 1, &pre);
+    assert(!strcmp(pre.text, "\n        long 1\n\n\n        long 2\n\n\n\n\n"));
+    preprocessed_free(&pre);
+
+    char cmd[sizeof(dir) + 16];
+    snprintf(cmd, sizeof(cmd), "rm -r %s", dir);
+    assert(!system(cmd));
+    fprintf(stdout, "%s:\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests the symbol snapshots of headers
+*/
+void test_snapshot()
+{
+    char dir[] = "/tmp/ppasm_symsXXXXXX";
+    assert(mkdtemp(dir));
+    char header[sizeof(dir) + 16], syms[sizeof(dir) + 24], main_file[sizeof(dir) + 16];
+    snprintf(header, sizeof(header), "%s/pins.spin", dir);
+    snprintf(syms, sizeof(syms), "%s" SNAPSHOT_EXTENSION, header);
+    snprintf(main_file, sizeof(main_file), "%s/main.spin", dir);
+
+    static const char pins[] =
+        "#pragma once\n"
+        "#define LED PIN_2\n"
+        "PIN_1   = 1 ' first\n"
+        "PIN_2   equ $10\n";
+    FILE* file = fopen(header, "w");
+    fputs(pins, file);
+    fclose(file);
+    snapshot_build(header, pins, sizeof(pins) - 1, syms);
+
+    int fd = open(syms, O_RDONLY);
+    snapshot_header_t h;
+    assert(read(fd, &h, sizeof(h)) == sizeof(h));
+    char image[h.size];
+    assert(pread(fd, image, h.size, 0) == h.size);
+    close(fd);
+    const snapshot_entry_t* e = snapshot_find((const snapshot_header_t*)image, "PIN_2");
+    assert(h.num_symbols == 2 && e && e->value == 0x10 && e->constant);
+    assert(!snapshot_find((const snapshot_header_t*)image, "PIN_3"));
+
+    /* the snapshot replaces the lines of the header, its macros are still there */
+    static const char src[] =
+        "#include \"pins.spin\"\n"
+        "        mov outa, #LED\n"
+        "        long PIN_1\n";
+    preprocessed_t pre;
+    preprocess(main_file, src, sizeof(src) - 1, &pre);
+    assert(strstr(pre.text, "#symbols") && !strstr(pre.text, "PIN_1   ="));
+
+    ppasm_t* ctx = ppasm_new();
+    u8 image1[PPASM_MAX_IMAGE], image2[PPASM_MAX_IMAGE];
+    size_t imgsz1, imgsz2;
+    assert(!ppasm_assemble(ctx, pre.text, pre.len, NULL, image1, sizeof(image1), &imgsz1));
+    assert(!ctx->snapshots && image1[PREAMBLE_SIZE] == 0x10 && image1[PREAMBLE_SIZE + 4] == 1);
+    preprocessed_free(&pre);
+
+    /* the symbols stay in the mapping, the map of -m still lists them */
+    int listed = 0;
+    for(size_t i = 0; i < ctx->symmap.symbols.size; i++)
+        listed |= !strcmp(ctx->symmap.symbols.element[i].name, "PIN_2") && ctx->symmap.symbols.element[i].constant &&
+                  ctx->symmap.symbols.element[i].value == 0x10;
+    assert(listed);
+    static const char twice[] =
+        "#include \"pins.spin\"\n"
+        "PIN_1   long 0\n";
+    preprocess(main_file, twice, sizeof(twice) - 1, &pre);
+    assert(ppasm_assemble(ctx, pre.text, pre.len, NULL, image2, sizeof(image2), &imgsz2) == -1);
+    assert(strstr(ppasm_error(ctx).message, "PIN_1 was already defined") && !ctx->snapshots);
+    preprocessed_free(&pre);
+
+    /* a changed header is parsed again */
+    file = fopen(header, "a");
+    fputs("PIN_3   = 3\n", file);
+    fclose(file);
+    preprocess(main_file, src, sizeof(src) - 1, &pre);
+    assert(!strstr(pre.text, "#symbols"));
+    assert(!ppasm_assemble(ctx, pre.text, pre.len, NULL, image2, sizeof(image2), &imgsz2));
+    assert(imgsz1 == imgsz2 && !memcmp(image1, image2, imgsz1));
+    preprocessed_free(&pre);
+    ppasm_free(ctx);
+
+    char cmd[sizeof(dir) + 16];
+    snprintf(cmd, sizeof(cmd), "rm -r %s", dir);
+    assert(!system(cmd));
+    fprintf(stdout, "%s:\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests the FILE directive
+*/
+void test_file()
+{
+    char dir[] = "/tmp/ppasm_fileXXXXXX";
+    assert(mkdtemp(dir));
+    char blob[sizeof(dir) + 16], main_file[sizeof(dir) + 16];
+    snprintf(blob, sizeof(blob), "%s/wave.bin", dir);
+    snprintf(main_file, sizeof(main_file), "%s/main.spin", dir);
+
+    static const u8 wave[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+    FILE* file = fopen(blob, "wb");
+    fwrite(wave, 1, sizeof(wave), file);
+    fclose(file);
+
+    /* the path is found next to the source and replaced with the real one */
+    static const char src[] =
+        "start   mov outa, #table\n"
+        "table   FILE \"wave.bin\"\n"
+        "bytes   file \"wave.bin\" 1, 3 BYTE ' comment\n"
+        "words   FILE \"wave.bin\" 6 WORD\n"
+        "        long 5\n";
+    preprocessed_t pre;
+    preprocess(main_file, src, sizeof(src) - 1, &pre);
+    assert(pre.num_blobs == 1 && strstr(pre.text, pre.blobs[0]) && strstr(pre.blobs[0], "/wave.bin"));
+
+    ppasm_t* ctx = ppasm_new();
+    u8 image[PPASM_MAX_IMAGE];
+    size_t imgsz;
+    assert(!ppasm_assemble(ctx, pre.text, pre.len, NULL, image, sizeof(image), &imgsz));
+    preprocessed_free(&pre);
+
+    static const u32 expected[] = { 0, 0x04030201, 0x08070605, 9, 2, 3, 4, 0x0807, 9, 5 };
+    assert(imgsz == PREAMBLE_SIZE + sizeof(expected));
+    for(size_t i = 1; i < sizeof(expected) / sizeof(expected[0]); i++)
+    {
+        assert(ctx->program[i].raw == expected[i]);
+        assert(ctx->flags[i].data == (i < 9));
+    }
+
+    asm_context_t* caller = asm_ctx;
+    asm_ctx = ctx;
+    char* listing;
+    size_t listingsz;
+    file = open_memstream(&listing, &listingsz);
+    generate_listing(file, 0);
+    symmap_write(file);
+    fclose(file);
+    asm_ctx = caller;
+    assert(strstr(listing, "0001 04030201 data\n") && strstr(listing, "\ndata 1 8\n"));
+    free(listing);
+
+    static const char bad[] = "        FILE \"/nonexistent/wave.bin\"\n";
+    assert(ppasm_assemble(ctx, bad, sizeof(bad) - 1, NULL, image, sizeof(image), &imgsz) == -1);
+    assert(strstr(ppasm_error(ctx).message, "can't open FILE"));
+
+    /* a FILE that fails after it was opened doesn't keep it open */
+    char past[sizeof(blob) + 32];
+    snprintf(past, sizeof(past), "        FILE \"%s\" 100\n", blob);
+    int next_fd = dup(0);
+    close(next_fd);
+    assert(ppasm_assemble(ctx, past, strlen(past), NULL, image, sizeof(image), &imgsz) == -1);
+    assert(strstr(ppasm_error(ctx).message, "has only 9 bytes"));
+    int fd = dup(0);
+    close(fd);
+    assert(fd == next_fd);
+    ppasm_free(ctx);
+
+    char cmd[sizeof(dir) + 16];
+    snprintf(cmd, sizeof(cmd), "rm -r %s", dir);
+    assert(!system(cmd));
+    fprintf(stdout, "%s:\t\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests the binary IR
+*/
+void test_ir()
+{
+    static const char src[] =
+        "        org     0\n"
+        "entry   mov     dira, #pins\n"
+        ":loop   if_nz   add count, #1 wc\n"
+        "        djnz    count, #:loop\n"
+        "        jmp     #entry+1\n"
+        "        res     2\n"
+        "count   long    table*2-1\n"
+        "table   long    0\n"
+        "pins    =       $F0\n";
+    ppasm_t* ctx = ppasm_new();
+    u8 image1[PPASM_MAX_IMAGE], image2[PPASM_MAX_IMAGE];
+    size_t imgsz1, imgsz2;
+    assert(!ppasm_assemble(ctx, src, sizeof(src) - 1, NULL, image1, sizeof(image1), &imgsz1));
+
+    asm_context_t* caller = asm_ctx;
+    asm_ctx = ctx;
+    char* ir;
+    size_t irsz;
+    FILE* file = open_memstream(&ir, &irsz);
+    ir_write(src, sizeof(src) - 1, file);
+    fclose(file);
+    asm_ctx = caller;
+    assert(ir_detect(ir, irsz) && !ir_detect(src, sizeof(src) - 1));
+
+    /* the IR gives the image and the symbols of the source */
+    assert(!ppasm_assemble(ctx, ir, irsz, NULL, image2, sizeof(image2), &imgsz2));
+    assert(imgsz1 == imgsz2 && !memcmp(image1, image2, imgsz1));
+    asm_ctx = ctx;
+    char* map;
+    size_t mapsz;
+    file = open_memstream(&map, &mapsz);
+    symmap_write(file);
+    fclose(file);
+    asm_ctx = caller;
+    assert(strstr(map, "count") && strstr(map, "entry:loop"));
+    free(map);
+
+    assert(ppasm_assemble(ctx, ir, irsz - 1, NULL, image2, sizeof(image2), &imgsz2) == -1);
+    assert(strstr(ppasm_error(ctx).message, "truncated"));
+    free(ir);
+
+    /* a code generator's IR: a symbol it only references and a data run */
+    static const char generated[] =
+        IR_MAGIC "\x01\x00\x80\x04\x01"
+        "\x00\x00\x04" "none"
+        "\x04\x00\x02\x78\x56\x34\x12\xEF\xBE\xAD\xDE"
+        "\x00";
+    assert(!ppasm_assemble(ctx, generated, sizeof(generated) - 1, NULL, image2, sizeof(image2), &imgsz2));
+    assert(imgsz2 == PREAMBLE_SIZE + 8 && ctx->program[1].raw == 0xDEADBEEF && !ctx->flags[1].data);
+    static const char undefined[] =
+        IR_MAGIC "\x01\x00\x80\x04\x01"
+        "\x00\x00\x04" "none"
+        "\x03\x07\x00\x01\x00"
+        "\x00";
+    assert(ppasm_assemble(ctx, undefined, sizeof(undefined) - 1, NULL, image2, sizeof(image2), &imgsz2) == -1);
+    assert(strstr(ppasm_error(ctx).message, "resolve"));
+    ppasm_free(ctx);
+    fprintf(stdout, "%s:\t\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests the parse of a source in memory against parse()
+*/
+/* @return the size of the @param image that parse() makes of the @param len bytes of @param src */
+static size_t parse_image(const char* src, size_t len, u8* image)
+{
+    asm_context_t* caller = asm_ctx;
+    asm_ctx = ppasm_new();
+    FILE* file = fmemopen((void*)src, len, "r");
+    parse(file);
+    fclose(file);
+    asm_ctx->num_ops = count_instructions();
+    size_t imgsz = create_image(image);
+    ppasm_free(asm_ctx);
+    asm_ctx = caller;
+    return imgsz;
+}
+
+void test_parse_memory()
+{
+    static const char tricky[] =
+        "\n\n        org 0\r\n"
+        "entry   mov outa, #5 { a comment\n"
+        "        over } add outa, #1\n"
+        "  , ' only a comment\n"
+        "        jmp #entry\n"
+        "        long entry+2";
+    static const char bad[] =
+        "entry   mov outa, #5\n"
+        "\n' comment\n"
+        "loop    bogus outa\n";
+    ppasm_t* ctx = ppasm_new();
+    u8 expected[PPASM_MAX_IMAGE], image[PPASM_MAX_IMAGE];
+    size_t expsz, imgsz;
+
+    expsz = parse_image(tricky, sizeof(tricky) - 1, expected);
+    assert(expsz == PREAMBLE_SIZE + 16);
+    assert(!ppasm_assemble(ctx, tricky, sizeof(tricky) - 1, NULL, image, sizeof(image), &imgsz));
+    assert(imgsz == expsz && !memcmp(image, expected, expsz));
+
+    /* the skipped lines still count */
+    assert(ppasm_assemble(ctx, bad, sizeof(bad) - 1, NULL, image, sizeof(image), &imgsz) == -1);
+    assert(ppasm_error(ctx).line == 4 && strstr(ppasm_error(ctx).message, "bogus"));
+    ppasm_free(ctx);
+    fprintf(stdout, "%s:\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Stress tests the parser with pathological sources, the time per byte mustn't grow with their size
+*/
+#define STRESS_FACTOR 3 /* a 4 times bigger source may take this much longer per byte */
+
+/* one comment line of @param n bytes */
+static void stress_line(FILE* file, size_t n)
+{
+    fputc('\'', file);
+    for(size_t i = 1; i < n; i++)
+        fputc('a' + i % 26, file);
+    fputc('\n', file);
+}
+
+/* a constant every 11 bytes, 100k of them in 1 MB */
+static void stress_labels(FILE* file, size_t n)
+{
+    for(size_t i = 0; i < n / 11; i++)
+        fprintf(file, "c%05lu = %lu\n", (ulong)i % 100000, (ulong)i / 100000 + i);
+}
+
+/* one long of @param n / 2 terms */
+static void stress_expression(FILE* file, size_t n)
+{
+    fprintf(file, "x = 1\n        long x");
+    for(size_t i = 0; i < n / 2; i++)
+        fputs(i % 2 ? "+x" : "-1", file);
+    fputc('\n', file);
+}
+
+/* local labels, a thousand under every global one */
+static void stress_local_labels(FILE* file, size_t n)
+{
+    for(size_t i = 0; i < n / 16; i++)
+    {
+        if(!(i % 1000))
+            fprintf(file, "global_%lu\n", (ulong)i);
+        fprintf(file, ":l%lu = %lu\n", (ulong)i, (ulong)i);
+    }
+}
+
+/* a { } comment of @param n bytes */
+static void stress_comment(FILE* file, size_t n)
+{
+    fputs("{\n", file);
+    for(size_t i = 0; i < n / 64; i++)
+        fprintf(file, "  %08lX the generator wrote this line, nothing in here is parsed\n", (ulong)i);
+    fputs("}\n        mov outa, #1\n", file);
+}
+
+/* @return the best of three assemblies of @param generate(@param n) in ns per byte */
+static double stress_time(ppasm_t* ctx, void (*generate)(FILE*, size_t), size_t n)
+{
+    char* src;
+    size_t len;
+    FILE* file = open_memstream(&src, &len);
+    generate(file, n);
+    fclose(file);
+
+    u8 image[PPASM_MAX_IMAGE];
+    size_t imgsz;
+    u64 best = (u64)-1;
+    for(int i = 0; i < 3; i++)
+    {
+        u64 t = get_time_ns();
+        assert(!ppasm_assemble(ctx, src, len, NULL, image, sizeof(image), &imgsz));
+        t = get_time_ns() - t;
+        if(t < best)
+            best = t;
+    }
+    free(src);
+    return (double)best / len;
+}
+
+void test_stress()
+{
+    static const struct
+    {
+        const char* name;
+        void        (*generate)(FILE*, size_t);
+    } sources[] =
+    {
+        { "line", stress_line },
+        { "labels", stress_labels },
+        { "expression", stress_expression },
+        { "local", stress_local_labels },
+        { "comment", stress_comment },
+    };
+    ppasm_t* ctx = ppasm_new();
+    fprintf(stdout, "%s:\tpassed, MB/s of 1 MB", __FUNCTION__);
+    for(size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++)
+    {
+        double small = stress_time(ctx, sources[i].generate, 0x40000);
+        double big = stress_time(ctx, sources[i].generate, 0x100000);
+        if(big > small * STRESS_FACTOR)
+            fprintf(stdout, "\n%s: %.1f ns per byte at 256 KB, %.1f at 1 MB\n", sources[i].name, small, big);
+        assert(big <= small * STRESS_FACTOR);
+        fprintf(stdout, " %s %.0f", sources[i].name, 1000 / big);
+    }
+    fprintf(stdout, "\n");
+    ppasm_free(ctx);
+}
+
+/*
+    Tests the incremental rebuild against full builds of the same sources
+*/
+/* @return 1 if the incremental build and a full one of @param src give the same image */
+static int same_as_full(ppasm_t* full, const char* src)
+{
+    u8 expected[PPASM_MAX_IMAGE];
+    size_t expsz;
+    assert(!ppasm_assemble(full, src, strlen(src), NULL, expected, sizeof(expected), &expsz));
+
+    u8 image[PREAMBLE_SIZE + MAX_INSTRUCTIONS * 4];
+    size_t imgsz = create_image(image);
+    return imgsz == expsz && !memcmp(image, expected, imgsz);
+}
+
+void test_incremental()
+{
+    static const char v1[] =
+        "        org     0\n"
+        "entry   mov     dira, #1\n"
+        ":loop   xor     outa, #1\n"
+        "        djnz    count, #:loop\n"
+        "        jmp     #entry\n"
+        "count   long    100\n"
+        "delay   long    entry + 3\n"
+        "size    =       4\n"
+        "other   mov     outa, #size\n"
+        ":loop   jmp     #:loop\n";
+    /* one instruction more in the first scope, everything after it moves */
+    static const char v2[] =
+        "        org     0\n"
+        "entry   mov     dira, #1\n"
+        ":loop   xor     outa, #1\n"
+        "        nop\n"
+        "        djnz    count, #:loop\n"
+        "        jmp     #entry\n"
+        "count   long    100\n"
+        "delay   long    entry + 3\n"
+        "size    =       4\n"
+        "other   mov     outa, #size\n"
+        ":loop   jmp     #:loop\n";
+    /* a constant changes, only its user is resolved again */
+    static const char v3[] =
+        "        org     0\n"
+        "entry   mov     dira, #1\n"
+        ":loop   xor     outa, #1\n"
+        "        nop\n"
+        "        djnz    count, #:loop\n"
+        "        jmp     #entry\n"
+        "count   long    100\n"
+        "delay   long    entry + 3\n"
+        "size    =       5\n"
+        "other   mov     outa, #size\n"
+        ":loop   jmp     #:loop\n";
+    static const char bad[] =
+        "entry   mov     dira, #1\n"
+        "        jmp     #nowhere\n";
+
+    asm_context_t* caller = asm_ctx;
+    ppasm_t* full = ppasm_new();
+    asm_ctx = asm_context_new();
+    incremental_t* inc = incremental_new();
+
+    assert(!incremental_build(inc, v1, sizeof(v1) - 1));
+    assert(inc->lines == 11 && inc->parsed == 11 && inc->evaluated == inc->fixups);
+    assert(same_as_full(full, v1));
+
+    assert(!incremental_build(inc, v1, sizeof(v1) - 1));
+    assert(inc->parsed == 1 && inc->evaluated == 0); /* only the ORG line */
+    assert(same_as_full(full, v1));
+
+    assert(!incremental_build(inc, v2, sizeof(v2) - 1));
+    assert(inc->parsed == 2 && inc->evaluated > 0 && inc->evaluated < inc->fixups);
+    assert(same_as_full(full, v2));
+
+    assert(!incremental_build(inc, v3, sizeof(v3) - 1));
+    assert(inc->parsed == 2 && inc->evaluated == 1);
+    assert(same_as_full(full, v3));
+
+    const char* errmsg = incremental_build(inc, bad, sizeof(bad) - 1);
+    assert(errmsg && strstr(errmsg, "line 2"));
+
+    /* the kept lines are still right after an error */
+    assert(!incremental_build(inc, v1, sizeof(v1) - 1));
+    assert(same_as_full(full, v1));
+
+    incremental_free(inc);
+    asm_context_free(asm_ctx);
+    asm_ctx = caller;
+    ppasm_free(full);
+    fprintf(stdout, "%s:\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests the language server on a scripted editor session
+*/
+/* appends the language server message @param json to @param b */
+static void lsp_message(char* b, const char* json)
+{
+    sprintf(b + strlen(b), "Content-Length: %lu\r\n\r\n%s", (ulong)strlen(json), json);
+}
+
+void test_lsp()
+{
+    static char in[4096];
+    *in = 0;
+    lsp_message(in, "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"initialize\",\"params\":{}}");
+    /* a new file is empty when it is opened */
+    lsp_message(in, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\",\"params\":{\"textDocument\":"
+                    "{\"uri\":\"file:///empty.spin\",\"text\":\"\"}}}");
+    lsp_message(in, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\",\"params\":{\"textDocument\":"
+                    "{\"uri\":\"file:///a.spin\",\"text\":\"entry   mov     dira, #1\\n\\n"
+                    ":loop   xor     outa, #1\\n        djnz    count, #:loop\\n        jmp     #nowhere\\n"
+                    "        wrlong  count\\ncount   long    100\\n\"}}}");
+    /* the errors are fixed in place */
+    lsp_message(in, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\",\"params\":{\"textDocument\":"
+                    "{\"uri\":\"file:///a.spin\"},\"contentChanges\":[{\"range\":{\"start\":{\"line\":4,\"character\":17},"
+                    "\"end\":{\"line\":4,\"character\":24}},\"text\":\"entry\"},{\"range\":{\"start\":{\"line\":5,"
+                    "\"character\":8},\"end\":{\"line\":5,\"character\":22}},\"text\":\"nop\"}]}}");
+    lsp_message(in, "{\"jsonrpc\":\"2.0\",\"id\":2,\"method\":\"textDocument/definition\",\"params\":{\"textDocument\":"
+                    "{\"uri\":\"file:///a.spin\"},\"position\":{\"line\":3,\"character\":27}}}");
+    lsp_message(in, "{\"jsonrpc\":\"2.0\",\"id\":3,\"method\":\"textDocument/references\",\"params\":{\"textDocument\":"
+                    "{\"uri\":\"file:///a.spin\"},\"position\":{\"line\":6,\"character\":2},"
+                    "\"context\":{\"includeDeclaration\":false}}}");
+    lsp_message(in, "{\"jsonrpc\":\"2.0\",\"id\":4,\"method\":\"textDocument/hover\",\"params\":{\"textDocument\":"
+                    "{\"uri\":\"file:///a.spin\"},\"position\":{\"line\":3,\"character\":18}}}");
+    lsp_message(in, "{\"jsonrpc\":\"2.0\",\"id\":5,\"method\":\"shutdown\"}");
+    lsp_message(in, "{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}");
+
+    char* out;
+    size_t outsz;
+    FILE* input = fmemopen(in, strlen(in), "r");
+    FILE* output = open_memstream(&out, &outsz);
+    assert(lsp_run(input, output) == 0);
+    fclose(input);
+    fclose(output);
+
+    char* diag = strstr(out, "publishDiagnostics");
+    assert(diag && strstr(diag, "file:///empty.spin") && strstr(diag, "\"diagnostics\":[]"));
+
+    /* both errors at once, with their lines */
+    diag = strstr(diag + 1, "publishDiagnostics");
+    assert(diag && strstr(diag, "\"line\":4,\"character\":8") && strstr(diag, "unknown label nowhere"));
+    assert(strstr(diag, "\"line\":5,\"character\":8"));
+    diag = strstr(diag + 1, "publishDiagnostics");
+    assert(diag && strstr(diag, "\"diagnostics\":[]"));
+
+    assert(strstr(out, "\"id\":2,\"result\":{\"uri\":\"file:///a.spin\",\"range\":{\"start\":{\"line\":2,\"character\":0}"));
+    assert(strstr(out, "\"id\":3,\"result\":[{\"uri\":\"file:///a.spin\",\"range\":{\"start\":{\"line\":3,\"character\":16}"));
+    assert(strstr(out, "`count` = 5 ($5), line 7\\n\\n$002: $E4FC0A01, cycles: 4 if it jumps, 8 if not"));
+    assert(strstr(out, "\"id\":5,\"result\":null"));
+
+    free(out);
+    fprintf(stdout, "%s:\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests the build cache
+*/
+void test_cache()
+{
+    char dir[] = "/tmp/ppasm_cacheXXXXXX";
+    assert(mkdtemp(dir));
+    char cache[sizeof(dir) + 8], out[sizeof(dir) + 8], copy[sizeof(dir) + 8];
+    snprintf(cache, sizeof(cache), "%s/cache", dir);
+    snprintf(out, sizeof(out), "%s/out", dir);
+    snprintf(copy, sizeof(copy), "%s/copy", dir);
+
+    u64 key = cache_key("a\r\nb", 4);
+    assert(key == cache_key("a\nb", 3));
+    opt_raw = 1;
+    assert(key != cache_key("a\nb", 3));
+    opt_raw = 0;
+
+    assert(!cache_fetch(cache, key, copy));
+    FILE* file = fopen(out, "w");
+    fputs("image", file);
+    fclose(file);
+    cache_store(cache, key, out);
+    assert(cache_fetch(cache, key, copy));
+
+    char buf[16] = { 0 };
+    file = fopen(copy, "r");
+    assert(fread(buf, 1, sizeof(buf), file) == 5 && !strcmp(buf, "image"));
+    fclose(file);
+
+    char* stats;
+    size_t statssz;
+    file = open_memstream(&stats, &statssz);
+    cache_stats(cache, file);
+    fclose(file);
+    assert(strstr(stats, "1 hits, 1 misses, 50.0% hit rate, 1 entries"));
+    free(stats);
+
+    char cmd[sizeof(dir) + 16];
+    snprintf(cmd, sizeof(cmd), "rm -r %s", dir);
+    assert(!system(cmd));
+    fprintf(stdout, "%s:\t\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests assembling on a --serve socket
+*/
+static void* server_test_loop(void* arg)
+{
+    server_loop(*(int*)arg);
+    return NULL;
+}
+
+/* sends a path request for @param file to the server @param sock_path, @return the status of the answer */
+static u32 server_path_request(const char* sock_path, const char* file, u8* data, size_t* size)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, sock_path);
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(s >= 0 && !connect(s, (struct sockaddr*)&addr, sizeof(addr)));
+
+    server_request_t r = { SERVER_MAGIC, SERVER_PATH, SERVER_RAW, strlen(file) };
+    assert(write(s, &r, sizeof(r)) == sizeof(r) && write(s, file, r.length) == r.length);
+    server_answer_t a;
+    assert(recv(s, &a, sizeof(a), MSG_WAITALL) == sizeof(a) && a.length <= *size);
+    assert(recv(s, data, a.length, MSG_WAITALL) == a.length);
+    *size = a.length;
+    close(s);
+    return a.status;
+}
+
+void test_server()
+{
+    static const char good[] =
+        "entry   mov     outa, #5\n"
+        "        long    7\n";
+    static const char bad[] =
+        "entry   mov     outa, #5\n"
+        "loop    bogus   outa\n";
+
+    char dir[] = "/tmp/ppasm_serverXXXXXX";
+    assert(mkdtemp(dir));
+    char path[sizeof(dir) + 8];
+    snprintf(path, sizeof(path), "%s/sock", dir);
+
+    int sock = server_open(path);
+    struct stat st;
+    assert(!stat(path, &st) && (st.st_mode & 0777) == 0600);
+    pthread_t thread;
+    assert(!pthread_create(&thread, NULL, server_test_loop, &sock));
+
+    u8 image[PPASM_MAX_IMAGE];
+    size_t imgsz;
+    char error[256];
+    ppasm_options_t raw = { 1, 0 };
+    for(unsigned i = 0; i < 100; i++)
+    {
+        assert(!server_assemble(path, good, sizeof(good) - 1, &raw, image, &imgsz, error, sizeof(error)));
+        assert(imgsz == 8 && image[4] == 7);
+    }
+    assert(server_assemble(path, bad, sizeof(bad) - 1, &raw, image, &imgsz, error, sizeof(error)) == 1);
+    assert(strstr(error, "bogus"));
+    assert(!server_assemble(path, good, sizeof(good) - 1, &raw, image, &imgsz, error, sizeof(error)));
+
+    /* an empty source mustn't take the server down for the next one */
+    assert(!server_assemble(path, "", 0, &raw, image, &imgsz, error, sizeof(error)));
+    assert(imgsz == 4);
+    assert(!server_assemble(path, good, sizeof(good) - 1, &raw, image, &imgsz, error, sizeof(error)));
+
+    /* the source of a path request goes through the preprocessor on the server */
+    char inc[sizeof(dir) + 16], main_file[sizeof(dir) + 16];
+    snprintf(inc, sizeof(inc), "%s/inc.spin", dir);
+    snprintf(main_file, sizeof(main_file), "%s/main.spin", dir);
+    FILE* file = fopen(inc, "w");
+    fputs("#define VALUE 9\n", file);
+    fclose(file);
+    file = fopen(main_file, "w");
+    fputs("#include \"inc.spin\"\nentry   mov     outa, #VALUE\n#ifdef VALUE\n        long    VALUE\n#endif\n", file);
+    fclose(file);
+    imgsz = sizeof(image);
+    assert(!server_path_request(path, main_file, image, &imgsz));
+    assert(imgsz == 8 && image[0] == 9 && image[4] == 9);
+    file = fopen(main_file, "w");
+    fputs("#error stop\n", file);
+    fclose(file);
+    imgsz = sizeof(image);
+    assert(server_path_request(path, main_file, image, &imgsz) == 1 && imgsz < sizeof(image));
+    image[imgsz] = 0;
+    assert(strstr((char*)image, "stop"));
+    unlink(inc);
+    unlink(main_file);
+
+    shutdown(sock, SHUT_RDWR);
+    pthread_join(thread, NULL);
+    close(sock);
+    unlink(path);
+    rmdir(dir);
+
+    assert(server_assemble("/nonexistent/sock", good, sizeof(good) - 1, &raw, image, &imgsz, error, sizeof(error)) == -1);
+    fprintf(stdout, "%s:\t\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests the cache of deployed image hashes
+*/
+void test_fingerprint()
+{
+    char dir[] = "/tmp/ppasm_testXXXXXX";
+    assert(mkdtemp(dir));
+    setenv("PPASM_HOME", dir, 1);
+
+    u64 hash;
+    assert(!fingerprint_lookup("/dev/serial/by-id/board1", &hash));
+
+    fingerprint_store("/dev/serial/by-id/board1", 0x1234);
+    fingerprint_store("/dev/serial/by-id/board10", 0x5678);
+    fingerprint_store("/dev/serial/by-id/board1", hash_fnv1a("ppasm", 5, FNV_OFFSET));
+
+    assert(fingerprint_lookup("/dev/serial/by-id/board1", &hash));
+    assert(hash == hash_fnv1a("ppasm", 5, FNV_OFFSET));
+    assert(fingerprint_lookup("/dev/serial/by-id/board10", &hash));
+    assert(hash == 0x5678);
+
+    ulong reset, settle;
+    assert(!timing_lookup("/dev/serial/by-id/board1", &reset, &settle));
+    timing_store("/dev/serial/by-id/board1", 3, 40);
+    timing_store("/dev/serial/by-id/board1", 6, 45);
+    assert(timing_lookup("/dev/serial/by-id/board1", &reset, &settle));
+    assert(reset == 6 && settle == 45);
+
+    char path[sizeof(dir) + 16];
+    snprintf(path, sizeof(path), "%s/%s", dir, FINGERPRINT_FILE);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/%s", dir, TIMING_FILE);
+    unlink(path);
+    rmdir(dir);
+    unsetenv("PPASM_HOME");
+
+    fprintf(stdout, "%s:\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests the hot reload protocol against the pty stub emulator
+*/
+void test_hotload()
+{
+    static hot_emulator_t emu;
+    assert(!hot_emulator_open(&emu));
+
+    u8 image[8 * 4];
+    for(unsigned i = 0; i < sizeof(image); i++)
+        image[i] = i * 7;
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if(!pid)
+    {
+        int fd = open(emu.name, O_RDWR | O_NOCTTY);
+        int ok = fd >= 0 && hot_ping(fd, 1000) && !hot_send(fd, 3, image, 8) &&
+                 hot_send(fd, 0, image, 8) && hot_send(fd, 3, image, COG_LONGS + 1);
+        _exit(ok ? 0 : 1);
+    }
+
+    assert(hot_emulate(&emu, 1000) == 3);
+    assert(emu.size[3] == 8);
+    assert(emu.cog[3][0] == 0x150E0700 && emu.cog[3][7] == 0xD9D2CBC4);
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && !WEXITSTATUS(status));
+    hot_emulator_close(&emu);
+
+    fprintf(stdout, "%s:\t\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests the capture of the program's output, plain and timestamped
+*/
+void test_monitor()
+{
+    static const char text[] = "hello\nworld\n";
+    char path[] = "/tmp/ppasm_monitorXXXXXX", buff[256];
+
+    for(int timestamps = 0; timestamps < 2; timestamps++)
+    {
+        int line[2];
+        assert(!pipe(line));
+        assert(write(line[1], text, sizeof(text) - 1) == sizeof(text) - 1);
+        close(line[1]);
+
+        int out = mkstemp(path);
+        assert(out >= 0);
+        assert(monitor(line[0], out, timestamps) == sizeof(text) - 1);
+        close(line[0]);
+
+        assert(lseek(out, 0, SEEK_SET) == 0);
+        ssize_t n = read(out, buff, sizeof(buff) - 1);
+        assert(n > 0);
+        buff[n] = 0;
+        if(!timestamps)
+            assert(!strcmp(buff, text));
+        else
+        {
+            assert(buff[0] == '[' && strstr(buff, "] hello\n["));
+            assert(!strcmp(buff + n - 7, " world\n"));
+        }
+
+        close(out);
+        unlink(path);
+        strcpy(path, "/tmp/ppasm_monitorXXXXXX");
+    }
+
+    assert(monitor_speed(115200) == B115200 && !monitor_speed(12345));
+
+    fprintf(stdout, "%s:\t\tpassed\n", __FUNCTION__);
+}
+
+/*
+    Tests the latency timer tuning against a fake sysfs tree
+*/
+void test_lowlatency()
+{
+    char root[] = "/tmp/ppasm_sysfsXXXXXX", path[PATH_MAX];
+    assert(mkdtemp(root));
+
+    const char* dirs[] = { "class", "class/tty", "class/tty/ttyUSB7", "class/tty/ttyUSB7/device" };
+    for(unsigned i = 0; i < 4; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", root, dirs[i]);
+        assert(!mkdir(path, 0755));
+    }
+
+    snprintf(path, sizeof(path), "%s/class/tty/ttyUSB7/device/latency_timer", root);
+    FILE* file = fopen(path, "w");
+    fprintf(file, "16\n");
+    fclose(file);
+
+    const char* sysfs = opt_sysfs;
+    opt_sysfs = root;
+
+    tty_tuning_t tuning;
+    tty_tune(&tuning, -1, "/dev/ttyUSB7");
+    assert(tuning.old_latency == 16);
+    assert(sysfs_latency_timer("ttyUSB7", path, sizeof(path)) == LATENCY_TIMER_MS);
+
+    tty_restore(&tuning);
+    assert(sysfs_latency_timer("ttyUSB7", path, sizeof(path)) == 16);
+
+    /* no adapter, nothing to restore */
+    tty_tune(&tuning, -1, "/dev/ttyS0");
+    assert(tuning.old_latency == -1);
+    tty_restore(&tuning);
+
+    opt_sysfs = sysfs;
+    unlink(path);
+    for(int i = 3; i >= 0; i--)
+    {
+        snprintf(path, sizeof(path), "%s/%s", root, dirs[i]);
+        rmdir(path);
+    }
+    rmdir(root);
+
+    fprintf(stdout, "%s:\tpassed\n", __FUNCTION__);
+}
+
 /***************************************************\
 *                                                   *
 *   Main tester entry.                              *
@@ -295,6 +1608,28 @@ int main(int argc, char* argv[])
     test_expressions();
     test_time();
     test_loader();
+    test_lfsr();
+    test_ring();
+    test_compress();
+    test_eeprom();
+    test_patch();
+    test_variants();
+    test_batch();
+    test_libppasm();
+    test_incremental();
+    test_lsp();
+    test_preprocess();
+    test_snapshot();
+    test_file();
+    test_ir();
+    test_parse_memory();
+    test_stress();
+    test_cache();
+    test_server();
+    test_fingerprint();
+    test_hotload();
+    test_monitor();
+    test_lowlatency();
     return 0;
 }
 #endif
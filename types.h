@@ -101,7 +101,8 @@ typedef struct
 {
     u8  valid   : 1; /* 1 if this is a valid operation */
     u8  raw_command  : 3; /* 0: not a raw command, 1-4 raw byte, 5,6 row high/low word, 7 raw long */
-    u8  reserved : 4;
+    u8  data : 1; /* copied in by FILE, not an instruction */
+    u8  reserved : 3;
 } flags_t;
 
 #define HIGH_BYTE_16(x) (u8)((x >> 8) & 0xff)
@@ -117,9 +118,22 @@ typedef struct
 extern u8 opt_verbose;  /* verbosity of the output for debugging */
 extern u8 opt_raw;      /* dont generate/take into account propeller tool header */
 extern u8 opt_listing;
-extern u16 num_ops;
+extern u8 opt_map; /* write a symbol map next to the binary */
+extern u8 opt_compress; /* compress the image for the download */
+extern u8 opt_eeprom; /* write an eeprom image instead of the binary */
+extern u8 opt_if_changed; /* skip the EEPROM download of an already deployed image */
+extern const char* opt_telemetry; /* file for the JSON records of the download timings */
+extern const char* opt_sysfs; /* where sysfs is mounted */
+extern u8 opt_low_latency; /* tune the usb serial adapter for the download */
+extern u8 opt_calibrate; /* search the shortest reset timing of the board */
+extern u8 opt_hot; /* cog to hot reload through the resident stub, 0 if off */
+extern const char* opt_monitor; /* capture the program's output after the download into this file */
+extern ulong opt_baud; /* baud rate of the program's output, 0 for the download rate */
+extern u8 opt_timestamps; /* timestamp the captured lines */
+extern const char* opt_variants; /* file of the define sets to build out of one parse */
+extern unsigned opt_jobs; /* threads of a batch, 0 for one per core */
+extern const char* opt_cache; /* directory of the build cache, NULL if off */
+extern const char* opt_server; /* socket of a --serve process to assemble on, NULL if off */
 extern FILE* vfile;
-extern instruction_t    program[MAX_INSTRUCTIONS]; /* current program */
-extern flags_t          flags[MAX_INSTRUCTIONS];
 extern const syntax_t*  syntax;
 #endif // TYPES_H_INCLUDED
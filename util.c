@@ -1,6 +1,7 @@
 #include "util.h"
 #include "opcodes.h"
 #include "containers.h"
+#include "context.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -10,6 +11,26 @@
 #include <assert.h>
 #include <sys/time.h>
 #include <time.h>
+#include <errno.h>
+
+/**********************************************\
+*                                              *
+*    Hands the error @param msg to the         *
+*    ppasm_assemble() that is running, if any. *
+*                                              *
+\**********************************************/
+static void library_error(const char* msg)
+{
+    if(!asm_ctx->error_jmp)
+        return;
+
+    if(asm_ctx->file)
+        snprintf(asm_ctx->error, sizeof(asm_ctx->error), "%s: %s", asm_ctx->file, msg);
+    else
+        snprintf(asm_ctx->error, sizeof(asm_ctx->error), "%s", msg);
+    asm_ctx->error_line = asm_ctx->line_num;
+    longjmp(*asm_ctx->error_jmp, 1);
+}
 
 /**********************************************\
 *                                              *
@@ -18,6 +39,16 @@
 \**********************************************/
 void sys_error(const char* msg)
 {
+    if(asm_ctx->error_jmp)
+    {
+        char errstr[MAX_ERROR_STRING_SIZE];
+        snprintf(errstr, sizeof(errstr), "%s: %s", msg, strerror(errno));
+        library_error(errstr);
+    }
+
+    const char* where = asm_ctx->file ? asm_ctx->file : asm_ctx->source;
+    if(where)
+        fprintf(stderr, "%s: ", where);
     perror(msg);
     exit(EXIT_FAILURE);
 }
@@ -37,7 +68,14 @@ void fatal(const char* fmt, ...)
 		va_start(marker, fmt);
 		vsnprintf(errstr, MAX_ERROR_STRING_SIZE, fmt, marker);
 		va_end(marker);
-        fprintf(stderr, "%s\n", errstr);
+        library_error(errstr);
+
+        /* an error in an included file names the file */
+        const char* where = asm_ctx->file ? asm_ctx->file : asm_ctx->source;
+        if(where)
+            fprintf(stderr, "%s: %s\n", where, errstr);
+        else
+            fprintf(stderr, "%s\n", errstr);
     }
     else
         fprintf(stderr, "error: %s: fmt is NULL!\n", __FILE__);
@@ -109,12 +147,39 @@ void sleep_msec(ulong msec)
 
 /*****************************************************************\
 *                                                                 *
-*   @return current time in milliseconds.                         *
+*   @return current monotonic time in nanoseconds.                *
+*                                                                 *
+\*****************************************************************/
+u64 get_time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return current monotonic time in milliseconds.               *
 *                                                                 *
 \*****************************************************************/
 ulong get_time_ms()
 {
-    struct timeval tv;
-	gettimeofday(&tv, NULL);
-	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    return get_time_ns() / 1000000;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   FNV-1a hash of @param size bytes of @param data, continuing   *
+*   from @param hash (FNV_OFFSET for a new one).                  *
+*                                                                 *
+\*****************************************************************/
+u64 hash_fnv1a(const void* data, size_t size, u64 hash)
+{
+    const u8* bytes = data;
+    for(size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
 }
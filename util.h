@@ -3,6 +3,7 @@
 #include "types.h"
 #define MIN(a, b) a < b ? a : b;
 #define MAX(a, b) a > b ? a : b;
+#define FNV_OFFSET 0xCBF29CE484222325ULL
 
 void sys_error(const char* msg);
 void fatal(const char* fmt, ...);
@@ -12,4 +13,6 @@ int is_local_label(const char* label);
 int is_valid_operator(const char op);
 void sleep_msec(ulong msec);
 ulong get_time_ms();
+u64 get_time_ns();
+u64 hash_fnv1a(const void* data, size_t size, u64 hash);
 #endif // UTIL_H_INCLUDED
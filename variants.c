@@ -0,0 +1,374 @@
+#include "variants.h"
+#include "assemble.h"
+#include "expression.h"
+#include "context.h"
+#include "snapshot.h"
+#include "stringext.h"
+#include "containers.h"
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <setjmp.h>
+
+/*
+--variants builds many binaries out of one source that only differ in the values of some
+symbols. The source is parsed once, every expression that uses a symbol is kept, and each
+variant only evaluates again the expressions that use a symbol it changes, on top of a copy
+of the assembled program. The variants file has one variant per line:
+
+    <outfile> <symbol>=<value> ...
+
+Empty lines and lines starting with ' are skipped.
+*/
+
+typedef struct
+{
+    expression_t*   exp; /* copy that outlives parse() */
+    u16             addr;
+    u8              field;
+} captured_t;
+
+typedef struct
+{
+    char*   outfile;
+    pair_t* overrides;
+    size_t  num_overrides;
+} variant_t;
+
+VECTOR_DECLARE(veccaptured, captured_t);
+VECTOR_DECLARE(vecvariant, variant_t);
+VECTOR_DECLARE(vecindex, size_t);
+
+static veccaptured captured;
+static pair_t* base = NULL; /* the symbols of the source sorted by name */
+static size_t num_base = 0;
+static vecindex* users = NULL; /* captured expressions that use each symbol of base */
+
+static vecvariant variants;
+static size_t next_variant; /* next one a worker takes */
+static size_t evaluated; /* expressions evaluated for all variants */
+static int failed; /* a worker failed, the others stop */
+static char worker_error[MAX_ERROR_STRING_SIZE]; /* of the worker that failed first, variants_build() reports it */
+
+/*****************************************************************\
+*                                                                 *
+*   Compares symbols @param a and @param b by name for qsort().   *
+*                                                                 *
+\*****************************************************************/
+static int compare_symbols(const void* a, const void* b)
+{
+    return strcmp(((const pair_t*)a)->string, ((const pair_t*)b)->string);
+}
+
+/*****************************************************************\
+*                                                                 *
+*   @return index of symbol @param name in base or num_base.      *
+*                                                                 *
+\*****************************************************************/
+static size_t find_base(const char* name)
+{
+    pair_t key = { name, 0 };
+    pair_t* found = bsearch(&key, base, num_base, sizeof(pair_t), compare_symbols);
+    return found ? (size_t)(found - base) : num_base;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Keeps a copy of @param exp going to @param field of the       *
+*   instruction at @param addr, if it uses any symbol.            *
+*                                                                 *
+\*****************************************************************/
+static void capture(const expression_t* exp, u16 addr, u8 field)
+{
+    const expression_t* e = exp;
+    while(e && !(e->type & EXP_LABEL))
+        e = e->next;
+    if(!e)
+        return;
+
+    captured_t c = { expression_copy(exp), addr, field };
+    veccaptured_push_back(&captured, c);
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Keeps the expressions and the symbol table of the source parse() is on      *
+*   before they are evaluated and freed, and notes which expressions use each   *
+*   symbol.                                                                     *
+*                                                                               *
+\*******************************************************************************/
+void variants_capture()
+{
+    veccaptured_init(&captured, 64);
+    for(unsigned i = 0; i < MAX_INSTRUCTIONS; i++)
+    {
+        if(!asm_ctx->flags[i].valid)
+            continue;
+
+        if(asm_ctx->flags[i].raw_command)
+            capture(asm_ctx->unresolved_src[i], i, asm_ctx->flags[i].raw_command);
+        else
+        {
+            capture(asm_ctx->unresolved_dest[i], i, FIELD_DEST);
+            capture(asm_ctx->unresolved_src[i], i, FIELD_SRC);
+        }
+    }
+
+    size_t num_mapped = snapshot_count();
+    num_base = asm_ctx->symtable.size + num_mapped;
+    base = malloc((num_base + 1) * sizeof(pair_t));
+    users = malloc((num_base + 1) * sizeof(vecindex));
+    if(!base || !users)
+        fatal("out of memory");
+
+    for(size_t i = 0; i < num_base; i++)
+    {
+        if(i < asm_ctx->symtable.size)
+        {
+            base[i].string = strdup(asm_ctx->symtable.element[i].string);
+            base[i].value = asm_ctx->symtable.element[i].value;
+        }
+        else
+        {
+            const char* name;
+            base[i].value = snapshot_symbol(i - asm_ctx->symtable.size, &name)->value;
+            base[i].string = strdup(name);
+        }
+        vecindex_init(&users[i], 4);
+    }
+    qsort(base, num_base, sizeof(pair_t), compare_symbols);
+
+    for(size_t c = 0; c < captured.size; c++)
+    {
+        for(const expression_t* e = captured.element[c].exp; e; e = e->next)
+        {
+            size_t s = (e->type & EXP_LABEL) ? find_base(e->data.label) : num_base;
+            if(s == num_base)
+                continue;
+
+            vecindex* u = &users[s];
+            if(!u->size || u->element[u->size - 1] != c)
+                vecindex_push_back(u, c);
+        }
+    }
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Looks up @param label for expression_value(), the overrides   *
+*   of the variant @param ctx first.                              *
+*                                                                 *
+\*****************************************************************/
+static int variant_lookup(void* ctx, const char* label, ulong* value)
+{
+    const variant_t* v = ctx;
+    for(size_t i = 0; i < v->num_overrides; i++)
+    {
+        if(!strcmp(v->overrides[i].string, label))
+        {
+            *value = v->overrides[i].value;
+            return 1;
+        }
+    }
+
+    size_t s = find_base(label);
+    if(s == num_base)
+        return 0;
+
+    *value = base[s].value;
+    return 1;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Builds variants of the program of the context @param arg      *
+*   until there are none left, runs on several threads at once,   *
+*   each with a context of its own.                               *
+*                                                                 *
+\*****************************************************************/
+static void* variants_worker(void* arg)
+{
+    const asm_context_t* parsed = arg;
+    asm_context_t* ctx = asm_context_new();
+    if(!ctx)
+    {
+        if(!__atomic_exchange_n(&failed, 1, __ATOMIC_RELAXED))
+            snprintf(worker_error, sizeof(worker_error), "out of memory");
+        return NULL;
+    }
+    ctx->num_ops = parsed->num_ops;
+    ctx->clkfreq = parsed->clkfreq;
+    ctx->clkreg = parsed->clkreg;
+    asm_ctx = ctx;
+
+    instruction_t prog[MAX_INSTRUCTIONS];
+    u8* volatile image = NULL;
+    u8* volatile eeprom = NULL;
+    size_t* volatile marks = NULL; /* variant + 1 that evaluated it last */
+    size_t count = 0;
+
+    jmp_buf error_jmp;
+    asm_ctx->error_jmp = &error_jmp;
+    if(setjmp(error_jmp))
+    {
+        if(!__atomic_exchange_n(&failed, 1, __ATOMIC_RELAXED))
+            snprintf(worker_error, sizeof(worker_error), "%s", asm_ctx->error);
+        free(marks);
+        free(eeprom);
+        free(image);
+        asm_context_free(ctx);
+        return NULL;
+    }
+
+    image = malloc(PREAMBLE_SIZE + asm_ctx->num_ops * 4);
+    eeprom = opt_eeprom ? malloc(EEPROM_SIZE) : NULL;
+    marks = calloc(captured.size + 1, sizeof(size_t));
+    if(!image || (opt_eeprom && !eeprom) || !marks)
+        fatal("out of memory");
+
+    while(!__atomic_load_n(&failed, __ATOMIC_RELAXED))
+    {
+        size_t v = __atomic_fetch_add(&next_variant, 1, __ATOMIC_RELAXED);
+        if(v >= variants.size)
+            break;
+
+        variant_t* variant = &variants.element[v];
+        memcpy(prog, parsed->program, asm_ctx->num_ops * sizeof(instruction_t));
+
+        for(size_t o = 0; o < variant->num_overrides; o++)
+        {
+            size_t s = find_base(variant->overrides[o].string);
+            if(s == num_base)
+                fatal("variant %s: unknown symbol %s", variant->outfile, variant->overrides[o].string);
+
+            for(size_t u = 0; u < users[s].size; u++)
+            {
+                size_t c = users[s].element[u];
+                if(marks[c] == v + 1)
+                    continue;
+                marks[c] = v + 1;
+
+                ulong result;
+                const char* errmsg = expression_value(captured.element[c].exp, variant_lookup, variant, &result);
+                if(errmsg)
+                    fatal("variant %s: %s", variant->outfile, errmsg);
+                expression_apply(&prog[captured.element[c].addr], captured.element[c].field, result);
+                count++;
+            }
+        }
+
+        size_t imgsz = create_image_of(image, prog, asm_ctx->num_ops);
+        const u8* data = image;
+        if(opt_raw)
+        {
+            data += PREAMBLE_SIZE;
+            imgsz -= PREAMBLE_SIZE;
+        }
+        else if(opt_eeprom)
+        {
+            create_eeprom(eeprom, image, imgsz);
+            data = eeprom;
+            imgsz = EEPROM_SIZE;
+        }
+
+        FILE* file = fopen(variant->outfile, "wb");
+        if(!file || fwrite(data, 1, imgsz, file) != imgsz || fclose(file))
+            sys_error("error writing a variant!");
+    }
+
+    __atomic_fetch_add(&evaluated, count, __ATOMIC_RELAXED);
+    free(marks);
+    free(eeprom);
+    free(image);
+    asm_context_free(ctx);
+    return NULL;
+}
+
+/*****************************************************************\
+*                                                                 *
+*   Reads the variants file @param filename.                      *
+*                                                                 *
+\*****************************************************************/
+static void read_variants(const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+    if(!file)
+        sys_error("error opening the variants file!");
+
+    vecvariant_init(&variants, 16);
+    char* line = NULL;
+    size_t linesz = 0;
+    size_t line_num = 0;
+    while(getline(&line, &linesz, file) > 0)
+    {
+        line_num++;
+        char* token = strtok(line, " \t\r\n");
+        if(!token || *token == '\'')
+            continue;
+
+        variant_t v = { strdup(token), malloc(linesz * sizeof(pair_t)), 0 };
+        while((token = strtok(NULL, " \t\r\n")))
+        {
+            char* eq = strchr(token, '=');
+            ulong value;
+            if(!eq || eq == token || string_to_number(eq + 1, &value))
+                fatal("%s line %lu: expected symbol=value instead of \"%s\"", filename, line_num, token);
+            *eq = 0;
+            if(!strcmp(token, "_CLKREG"))
+                fatal("%s line %lu: _CLKREG is in the preamble, it can't differ between variants", filename, line_num);
+
+            v.overrides[v.num_overrides].string = strdup(token);
+            v.overrides[v.num_overrides].value = value;
+            v.num_overrides++;
+        }
+        vecvariant_push_back(&variants, v);
+    }
+
+    free(line);
+    fclose(file);
+}
+
+/*******************************************************************************\
+*                                                                               *
+*   Writes every variant of the variants file @param filename out of the        *
+*   program parse() assembled after variants_capture().                         *
+*                                                                               *
+\*******************************************************************************/
+void variants_build(const char* filename)
+{
+    ulong t = get_time_ms();
+    read_variants(filename);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t num_threads = cpus > 0 ? (size_t)cpus : 1;
+    if(num_threads > variants.size)
+        num_threads = variants.size;
+
+    next_variant = 0;
+    evaluated = 0;
+    failed = 0;
+    pthread_t threads[num_threads + 1];
+    for(size_t i = 0; i < num_threads; i++)
+    {
+        if(pthread_create(&threads[i], NULL, variants_worker, asm_ctx))
+            fatal("failed to start a variants thread");
+    }
+    for(size_t i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    if(failed)
+        fatal("%s", worker_error);
+
+    if(opt_verbose)
+        printf("built %lu variants on %lu threads in %lu ms, %lu of %lu expressions evaluated again\n",
+               (ulong)variants.size, (ulong)num_threads, get_time_ms() - t,
+               (ulong)evaluated, (ulong)(captured.size * variants.size));
+
+    for(size_t i = 0; i < variants.size; i++)
+    {
+        for(size_t o = 0; o < variants.element[i].num_overrides; o++)
+            free((char*)variants.element[i].overrides[o].string);
+        free(variants.element[i].overrides);
+        free(variants.element[i].outfile);
+    }
+    vecvariant_fini(&variants);
+}
@@ -0,0 +1,8 @@
+#ifndef VARIANTS_H_INCLUDED
+#define VARIANTS_H_INCLUDED
+#include "types.h"
+#include <stdio.h>
+
+void variants_capture();
+void variants_build(const char* filename);
+#endif // VARIANTS_H_INCLUDED